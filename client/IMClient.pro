@@ -10,13 +10,17 @@ SOURCES += \
     ui/chatwindow.cpp \
     ui/loginwindow.cpp \
     network/tcpclient.cpp \
-    network/protocol.cpp
+    network/protocol.cpp \
+    network/filewriter.cpp \
+    network/filehasher.cpp
 
 HEADERS += \
     ui/chatwindow.h \
     ui/loginwindow.h \
     network/tcpclient.h \
-    network/protocol.h
+    network/protocol.h \
+    network/filewriter.h \
+    network/filehasher.h
 
 FORMS += \
     ui/chatwindow.ui \
@@ -0,0 +1,39 @@
+#include "filehasher.h"
+
+#include <QCryptographicHash>
+#include <QDebug>
+#include <QFile>
+
+FileHasher::FileHasher(QObject *parent)
+    : QObject(parent) {}
+
+void FileHasher::hashFile(const QString &fileId, const QString &path) {
+    QFile file(path);
+    QCryptographicHash hash(QCryptographicHash::Sha256);
+    if (!file.open(QIODevice::ReadOnly) || !hash.addData(&file)) {
+        qWarning() << "Cannot hash file" << path;
+        emit fileHashed(fileId, QByteArray());
+        return;
+    }
+    emit fileHashed(fileId, hash.result());
+}
+
+void FileHasher::hashRange(const QString &fileId, const QString &path, const QByteArray &nonce,
+                           quint64 offset, quint32 length) {
+    QFile file(path);
+    QCryptographicHash hash(QCryptographicHash::Sha256);
+    hash.addData(nonce);
+    if (!file.open(QIODevice::ReadOnly) || !file.seek(static_cast<qint64>(offset))) {
+        qWarning() << "Cannot read proof range of" << path;
+        emit rangeHashed(fileId, QByteArray());
+        return;
+    }
+    QByteArray range = file.read(length);
+    if (range.size() != static_cast<int>(length)) {
+        qWarning() << "Short proof range of" << path;
+        emit rangeHashed(fileId, QByteArray());
+        return;
+    }
+    hash.addData(range);
+    emit rangeHashed(fileId, hash.result());
+}
@@ -0,0 +1,28 @@
+#ifndef FILEHASHER_H
+#define FILEHASHER_H
+
+#include <QByteArray>
+#include <QObject>
+#include <QString>
+
+// Computes SHA-256 content hashes off the UI thread so the server can
+// deduplicate uploads it already holds.
+class FileHasher : public QObject {
+    Q_OBJECT
+
+public:
+    explicit FileHasher(QObject *parent = nullptr);
+
+public slots:
+    void hashFile(const QString &fileId, const QString &path);
+    // Answers a server proof request: SHA-256 of nonce followed by length
+    // bytes of the file from offset.
+    void hashRange(const QString &fileId, const QString &path, const QByteArray &nonce,
+                   quint64 offset, quint32 length);
+
+signals:
+    void fileHashed(const QString &fileId, const QByteArray &digest);
+    void rangeHashed(const QString &fileId, const QByteArray &digest);
+};
+
+#endif // FILEHASHER_H
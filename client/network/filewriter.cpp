@@ -0,0 +1,158 @@
+#include "filewriter.h"
+
+#include <QDebug>
+#include <QList>
+#include <QMetaObject>
+
+#if defined(__linux__)
+#include <fcntl.h>
+#endif
+
+namespace {
+constexpr int kCoalesceLimit = 1024 * 1024;
+
+void preallocate(QFile &file, quint64 fileSize) {
+    if (fileSize == 0) {
+        return;
+    }
+#if defined(__linux__)
+    int rc = posix_fallocate(file.handle(), 0, static_cast<off_t>(fileSize));
+    if (rc == 0) {
+        return;
+    }
+    qDebug() << "fallocate unsupported, resizing instead" << rc;
+#endif
+    file.resize(static_cast<qint64>(fileSize));
+}
+} // namespace
+
+FileWriter::FileWriter(QObject *parent)
+    : QObject(parent)
+    , flushQueued_(false) {}
+
+FileWriter::~FileWriter() {
+    abortAll();
+}
+
+void FileWriter::openFile(const QString &fileId, const QString &path, quint64 fileSize) {
+    WriteTarget target;
+    target.path = path;
+    target.fileSize = fileSize;
+    target.file = QSharedPointer<QFile>::create(path);
+    if (!target.file->open(QIODevice::WriteOnly)) {
+        emit fileOpened(fileId, false, "Cannot save file");
+        return;
+    }
+
+    preallocate(*target.file, fileSize);
+    targets_.insert(fileId, target);
+    emit fileOpened(fileId, true, path);
+}
+
+void FileWriter::writeChunk(const QString &fileId, quint64 offset, const QByteArray &data) {
+    auto it = targets_.find(fileId);
+    if (it == targets_.end()) {
+        return;
+    }
+
+    WriteTarget &target = it.value();
+    bool adjacent = target.pendingOffset + static_cast<quint64>(target.pending.size()) == offset;
+    if (!target.pending.isEmpty() && (!adjacent || target.pending.size() >= kCoalesceLimit)) {
+        if (!flushPending(target)) {
+            finishFile(fileId, false, "Write failed");
+            return;
+        }
+    }
+    if (target.pending.isEmpty()) {
+        target.pendingOffset = offset;
+    }
+    target.pending.append(data);
+    target.bytesReceived += static_cast<quint64>(data.size());
+
+    if (target.fileSize > 0 && target.bytesReceived >= target.fileSize) {
+        if (!flushPending(target)) {
+            finishFile(fileId, false, "Write failed");
+            return;
+        }
+        emit writeProgress(fileId, target.bytesReceived, target.fileSize);
+        finishFile(fileId, true, target.path);
+        return;
+    }
+
+    if (!flushQueued_) {
+        flushQueued_ = true;
+        QMetaObject::invokeMethod(this, [this]() { flushAll(); }, Qt::QueuedConnection);
+    }
+}
+
+void FileWriter::abortFile(const QString &fileId) {
+    auto it = targets_.find(fileId);
+    if (it == targets_.end()) {
+        return;
+    }
+    flushPending(it.value());
+    it.value().file->close();
+    targets_.erase(it);
+}
+
+void FileWriter::abortAll() {
+    for (auto it = targets_.begin(); it != targets_.end(); ++it) {
+        flushPending(it.value());
+        it.value().file->close();
+    }
+    targets_.clear();
+}
+
+bool FileWriter::flushPending(WriteTarget &target) {
+    if (target.pending.isEmpty()) {
+        return true;
+    }
+
+    if (target.file->pos() != static_cast<qint64>(target.pendingOffset)
+        && !target.file->seek(static_cast<qint64>(target.pendingOffset))) {
+        return false;
+    }
+
+    qint64 written = target.file->write(target.pending);
+    if (written != static_cast<qint64>(target.pending.size())) {
+        return false;
+    }
+
+    target.pending.clear();
+    return true;
+}
+
+void FileWriter::flushAll() {
+    flushQueued_ = false;
+
+    QList<QString> failed;
+    for (auto it = targets_.begin(); it != targets_.end(); ++it) {
+        WriteTarget &target = it.value();
+        if (target.pending.isEmpty()) {
+            continue;
+        }
+        if (!flushPending(target)) {
+            failed.append(it.key());
+            continue;
+        }
+        emit writeProgress(it.key(), target.bytesReceived, target.fileSize);
+    }
+
+    for (const QString &fileId : failed) {
+        finishFile(fileId, false, "Write failed");
+    }
+}
+
+void FileWriter::finishFile(const QString &fileId, bool success, const QString &message) {
+    auto it = targets_.find(fileId);
+    if (it == targets_.end()) {
+        return;
+    }
+
+    if (success) {
+        it.value().file->flush();
+    }
+    it.value().file->close();
+    targets_.erase(it);
+    emit fileFinished(fileId, success, message);
+}
@@ -0,0 +1,48 @@
+#ifndef FILEWRITER_H
+#define FILEWRITER_H
+
+#include <QByteArray>
+#include <QFile>
+#include <QHash>
+#include <QObject>
+#include <QSharedPointer>
+#include <QString>
+
+class FileWriter : public QObject {
+    Q_OBJECT
+
+public:
+    explicit FileWriter(QObject *parent = nullptr);
+    ~FileWriter();
+
+public slots:
+    void openFile(const QString &fileId, const QString &path, quint64 fileSize);
+    void writeChunk(const QString &fileId, quint64 offset, const QByteArray &data);
+    void abortFile(const QString &fileId);
+    void abortAll();
+
+signals:
+    void fileOpened(const QString &fileId, bool success, const QString &message);
+    void writeProgress(const QString &fileId, quint64 bytesWritten, quint64 totalBytes);
+    void fileFinished(const QString &fileId, bool success, const QString &message);
+
+private:
+    struct WriteTarget {
+        QString path;
+        quint64 fileSize = 0;
+        quint64 bytesReceived = 0;
+        quint64 pendingOffset = 0;
+        QByteArray pending;
+        QSharedPointer<QFile> file;
+    };
+
+    bool flushPending(WriteTarget &target);
+    void flushAll();
+    void finishFile(const QString &fileId, bool success, const QString &message);
+
+private:
+    QHash<QString, WriteTarget> targets_;
+    bool flushQueued_;
+};
+
+#endif // FILEWRITER_H
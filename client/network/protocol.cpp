@@ -1,5 +1,8 @@
 #include "protocol.h"
 
+#include <algorithm>
+#include <cstddef>
+
 namespace {
 uint64_t swap64(uint64_t value) {
     return (static_cast<uint64_t>(htonl(static_cast<uint32_t>(value & 0xFFFFFFFFULL))) << 32)
@@ -21,6 +24,20 @@ uint64_t networkToHost64(uint64_t value) {
     return swap64(value);
 #endif
 }
+
+// Longest prefix of at most maxBytes that does not end inside a UTF-8
+// multi-byte sequence.
+size_t utf8Prefix(const std::string &text, size_t maxBytes) {
+    if (text.size() <= maxBytes) {
+        return text.size();
+    }
+    size_t cut = maxBytes;
+    while (cut > 0 && maxBytes - cut < 3
+           && (static_cast<uint8_t>(text[cut]) & 0xC0) == 0x80) {
+        --cut;
+    }
+    return cut;
+}
 } // namespace
 
 bool ProtocolParser::validateHeader(const MessageHeader &header) {
@@ -52,14 +69,18 @@ std::vector<uint8_t> ProtocolParser::packHeartbeatRequest(uint32_t sequence) {
 
 std::vector<uint8_t> ProtocolParser::packLoginRequest(uint32_t sequence,
                                                       const std::string &clientId,
-                                                      const std::string &nickname) {
-    std::vector<uint8_t> buffer(sizeof(MessageHeader) + sizeof(LoginRequest));
+                                                      const std::string &nickname,
+                                                      const std::string &password,
+                                                      const std::string &resumeToken) {
+    bool withExt = !password.empty() || resumeToken.size() == kResumeTokenSize;
+    size_t bodyLen = sizeof(LoginRequest) + (withExt ? sizeof(LoginRequestExt) : 0);
+    std::vector<uint8_t> buffer(sizeof(MessageHeader) + bodyLen);
 
     MessageHeader header;
     header.magic = htonl(MAGIC_NUMBER);
     header.version = htons(PROTOCOL_VERSION);
     header.msgType = htons(MSG_LOGIN_REQ);
-    header.bodyLength = htonl(static_cast<uint32_t>(sizeof(LoginRequest)));
+    header.bodyLength = htonl(static_cast<uint32_t>(bodyLen));
     header.sequence = htonl(sequence);
 
     LoginRequest req;
@@ -69,6 +90,17 @@ std::vector<uint8_t> ProtocolParser::packLoginRequest(uint32_t sequence,
 
     std::memcpy(buffer.data(), &header, sizeof(MessageHeader));
     std::memcpy(buffer.data() + sizeof(MessageHeader), &req, sizeof(LoginRequest));
+    if (withExt) {
+        LoginRequestExt ext;
+        std::memset(&ext, 0, sizeof(ext));
+        std::strncpy(ext.password, password.c_str(), sizeof(ext.password) - 1);
+        if (resumeToken.size() == kResumeTokenSize) {
+            std::memcpy(ext.resumeToken, resumeToken.data(), sizeof(ext.resumeToken));
+        }
+        std::memcpy(buffer.data() + sizeof(MessageHeader) + sizeof(LoginRequest),
+                    &ext, sizeof(LoginRequestExt));
+        std::memset(&ext, 0, sizeof(ext));
+    }
 
     return buffer;
 }
@@ -107,10 +139,10 @@ std::vector<uint8_t> ProtocolParser::packChatMessage(uint32_t sequence,
     std::memset(&msg, 0, sizeof(msg));
     msg.chatType = static_cast<uint8_t>(scope);
     std::strncpy(msg.fromId, fromId.c_str(), sizeof(msg.fromId) - 1);
-    std::strncpy(msg.fromNick, fromNick.c_str(), sizeof(msg.fromNick) - 1);
+    std::memcpy(msg.fromNick, fromNick.data(), utf8Prefix(fromNick, sizeof(msg.fromNick) - 1));
     std::strncpy(msg.toId, toId.c_str(), sizeof(msg.toId) - 1);
     msg.timestamp = hostToNetwork64(timestamp);
-    std::strncpy(msg.message, message.c_str(), sizeof(msg.message) - 1);
+    std::memcpy(msg.message, message.data(), utf8Prefix(message, sizeof(msg.message) - 1));
 
     std::memcpy(buffer.data(), &header, sizeof(MessageHeader));
     std::memcpy(buffer.data() + sizeof(MessageHeader), &msg, sizeof(ChatMessage));
@@ -138,14 +170,15 @@ std::vector<uint8_t> ProtocolParser::packFileOffer(uint32_t sequence,
                                                    uint64_t fileSize,
                                                    const std::string &fromId,
                                                    const std::string &fromNick,
-                                                   const std::string &toId) {
-    std::vector<uint8_t> buffer(sizeof(MessageHeader) + sizeof(FileOffer));
+                                                   const std::string &toId,
+                                                   const FileOfferExt &ext) {
+    std::vector<uint8_t> buffer(sizeof(MessageHeader) + sizeof(FileOffer) + sizeof(FileOfferExt));
 
     MessageHeader header;
     header.magic = htonl(MAGIC_NUMBER);
     header.version = htons(PROTOCOL_VERSION);
     header.msgType = htons(MSG_FILE_OFFER);
-    header.bodyLength = htonl(static_cast<uint32_t>(sizeof(FileOffer)));
+    header.bodyLength = htonl(static_cast<uint32_t>(sizeof(FileOffer) + sizeof(FileOfferExt)));
     header.sequence = htonl(sequence);
 
     FileOffer offer;
@@ -157,8 +190,16 @@ std::vector<uint8_t> ProtocolParser::packFileOffer(uint32_t sequence,
     offer.fileSize = hostToNetwork64(fileSize);
     std::strncpy(offer.fileName, fileName.c_str(), sizeof(offer.fileName) - 1);
 
+    FileOfferExt extNet;
+    std::memset(&extNet, 0, sizeof(extNet));
+    extNet.streamCount = htonl(ext.streamCount);
+    std::memcpy(extNet.contentHash, ext.contentHash, sizeof(extNet.contentHash));
+    extNet.flags = ext.flags;
+    std::memcpy(extNet.attachToken, ext.attachToken, sizeof(extNet.attachToken));
+
     std::memcpy(buffer.data(), &header, sizeof(MessageHeader));
     std::memcpy(buffer.data() + sizeof(MessageHeader), &offer, sizeof(FileOffer));
+    std::memcpy(buffer.data() + sizeof(MessageHeader) + sizeof(FileOffer), &extNet, sizeof(FileOfferExt));
 
     return buffer;
 }
@@ -166,14 +207,17 @@ std::vector<uint8_t> ProtocolParser::packFileOffer(uint32_t sequence,
 std::vector<uint8_t> ProtocolParser::packFileOfferResponse(uint32_t sequence,
                                                            const std::string &fileId,
                                                            uint32_t result,
-                                                           const std::string &message) {
-    std::vector<uint8_t> buffer(sizeof(MessageHeader) + sizeof(FileOfferResponse));
+                                                           const std::string &message,
+                                                           const FileOfferResponseExt &ext) {
+    std::vector<uint8_t> buffer(sizeof(MessageHeader) + sizeof(FileOfferResponse)
+                                + sizeof(FileOfferResponseExt));
 
     MessageHeader header;
     header.magic = htonl(MAGIC_NUMBER);
     header.version = htons(PROTOCOL_VERSION);
     header.msgType = htons(MSG_FILE_OFFER_RSP);
-    header.bodyLength = htonl(static_cast<uint32_t>(sizeof(FileOfferResponse)));
+    header.bodyLength = htonl(static_cast<uint32_t>(sizeof(FileOfferResponse)
+                                                    + sizeof(FileOfferResponseExt)));
     header.sequence = htonl(sequence);
 
     FileOfferResponse rsp;
@@ -182,18 +226,208 @@ std::vector<uint8_t> ProtocolParser::packFileOfferResponse(uint32_t sequence,
     rsp.result = htonl(result);
     std::strncpy(rsp.message, message.c_str(), sizeof(rsp.message) - 1);
 
+    FileOfferResponseExt extNet;
+    std::memset(&extNet, 0, sizeof(extNet));
+    extNet.directAddress = ext.directAddress;
+    extNet.directPort = htons(ext.directPort);
+    std::memcpy(extNet.attachToken, ext.attachToken, sizeof(extNet.attachToken));
+
     std::memcpy(buffer.data(), &header, sizeof(MessageHeader));
     std::memcpy(buffer.data() + sizeof(MessageHeader), &rsp, sizeof(FileOfferResponse));
+    std::memcpy(buffer.data() + sizeof(MessageHeader) + sizeof(FileOfferResponse),
+                &extNet, sizeof(FileOfferResponseExt));
 
     return buffer;
 }
 
-std::vector<uint8_t> ProtocolParser::packFileData(uint32_t sequence,
-                                                  const std::string &fileId,
-                                                  uint64_t offset,
-                                                  const uint8_t *data,
-                                                  size_t dataLen) {
-    std::vector<uint8_t> buffer(sizeof(MessageHeader) + sizeof(FileDataHeader) + dataLen);
+std::vector<uint8_t> ProtocolParser::packFileCancel(uint32_t sequence,
+                                                    const std::string &fileId,
+                                                    uint32_t reason) {
+    std::vector<uint8_t> buffer(sizeof(MessageHeader) + sizeof(FileCancel));
+
+    MessageHeader header;
+    header.magic = htonl(MAGIC_NUMBER);
+    header.version = htons(PROTOCOL_VERSION);
+    header.msgType = htons(MSG_FILE_CANCEL);
+    header.bodyLength = htonl(static_cast<uint32_t>(sizeof(FileCancel)));
+    header.sequence = htonl(sequence);
+
+    FileCancel cancel;
+    std::memset(&cancel, 0, sizeof(cancel));
+    std::strncpy(cancel.fileId, fileId.c_str(), sizeof(cancel.fileId) - 1);
+    cancel.reason = htonl(reason);
+
+    std::memcpy(buffer.data(), &header, sizeof(MessageHeader));
+    std::memcpy(buffer.data() + sizeof(MessageHeader), &cancel, sizeof(FileCancel));
+
+    return buffer;
+}
+
+std::vector<uint8_t> ProtocolParser::packFileProofResponse(uint32_t sequence,
+                                                           const std::string &fileId,
+                                                           const std::string &digest) {
+    std::vector<uint8_t> buffer(sizeof(MessageHeader) + sizeof(FileProofResponse));
+
+    MessageHeader header;
+    header.magic = htonl(MAGIC_NUMBER);
+    header.version = htons(PROTOCOL_VERSION);
+    header.msgType = htons(MSG_FILE_PROOF_RSP);
+    header.bodyLength = htonl(static_cast<uint32_t>(sizeof(FileProofResponse)));
+    header.sequence = htonl(sequence);
+
+    FileProofResponse rsp;
+    std::memset(&rsp, 0, sizeof(rsp));
+    std::strncpy(rsp.fileId, fileId.c_str(), sizeof(rsp.fileId) - 1);
+    std::memcpy(rsp.digest, digest.data(), std::min(digest.size(), sizeof(rsp.digest)));
+
+    std::memcpy(buffer.data(), &header, sizeof(MessageHeader));
+    std::memcpy(buffer.data() + sizeof(MessageHeader), &rsp, sizeof(FileProofResponse));
+
+    return buffer;
+}
+
+std::vector<uint8_t> ProtocolParser::packFileStreamAttach(uint32_t sequence,
+                                                          const std::string &fileId,
+                                                          const std::string &clientId,
+                                                          uint8_t role,
+                                                          uint8_t streamIndex,
+                                                          const std::string &attachToken) {
+    std::vector<uint8_t> buffer(sizeof(MessageHeader) + sizeof(FileStreamAttach));
+
+    MessageHeader header;
+    header.magic = htonl(MAGIC_NUMBER);
+    header.version = htons(PROTOCOL_VERSION);
+    header.msgType = htons(MSG_FILE_STREAM_ATTACH);
+    header.bodyLength = htonl(static_cast<uint32_t>(sizeof(FileStreamAttach)));
+    header.sequence = htonl(sequence);
+
+    FileStreamAttach attach;
+    std::memset(&attach, 0, sizeof(attach));
+    std::strncpy(attach.fileId, fileId.c_str(), sizeof(attach.fileId) - 1);
+    std::strncpy(attach.clientId, clientId.c_str(), sizeof(attach.clientId) - 1);
+    attach.role = role;
+    attach.streamIndex = streamIndex;
+    std::memcpy(attach.attachToken, attachToken.data(),
+                std::min(attachToken.size(), sizeof(attach.attachToken)));
+
+    std::memcpy(buffer.data(), &header, sizeof(MessageHeader));
+    std::memcpy(buffer.data() + sizeof(MessageHeader), &attach, sizeof(FileStreamAttach));
+
+    return buffer;
+}
+
+std::vector<uint8_t> ProtocolParser::packFileStreamAttachResponse(uint32_t sequence,
+                                                                  const std::string &fileId,
+                                                                  uint32_t result,
+                                                                  uint8_t streamIndex) {
+    std::vector<uint8_t> buffer(sizeof(MessageHeader) + sizeof(FileStreamAttachResponse));
+
+    MessageHeader header;
+    header.magic = htonl(MAGIC_NUMBER);
+    header.version = htons(PROTOCOL_VERSION);
+    header.msgType = htons(MSG_FILE_STREAM_ATTACH_RSP);
+    header.bodyLength = htonl(static_cast<uint32_t>(sizeof(FileStreamAttachResponse)));
+    header.sequence = htonl(sequence);
+
+    FileStreamAttachResponse rsp;
+    std::memset(&rsp, 0, sizeof(rsp));
+    std::strncpy(rsp.fileId, fileId.c_str(), sizeof(rsp.fileId) - 1);
+    rsp.result = htonl(result);
+    rsp.streamIndex = streamIndex;
+
+    std::memcpy(buffer.data(), &header, sizeof(MessageHeader));
+    std::memcpy(buffer.data() + sizeof(MessageHeader), &rsp, sizeof(FileStreamAttachResponse));
+
+    return buffer;
+}
+
+std::vector<uint8_t> ProtocolParser::packHistoryRequest(uint32_t sequence,
+                                                        ChatScope scope,
+                                                        const std::string &peerId,
+                                                        uint64_t beforeSeq,
+                                                        uint64_t fromTime,
+                                                        uint64_t toTime,
+                                                        uint32_t limit) {
+    std::vector<uint8_t> buffer(sizeof(MessageHeader) + sizeof(HistoryRequest));
+
+    MessageHeader header;
+    header.magic = htonl(MAGIC_NUMBER);
+    header.version = htons(PROTOCOL_VERSION);
+    header.msgType = htons(MSG_HISTORY_REQ);
+    header.bodyLength = htonl(static_cast<uint32_t>(sizeof(HistoryRequest)));
+    header.sequence = htonl(sequence);
+
+    HistoryRequest req;
+    std::memset(&req, 0, sizeof(req));
+    req.chatType = static_cast<uint8_t>(scope);
+    std::strncpy(req.peerId, peerId.c_str(), sizeof(req.peerId) - 1);
+    req.beforeSeq = hostToNetwork64(beforeSeq);
+    req.fromTime = hostToNetwork64(fromTime);
+    req.toTime = hostToNetwork64(toTime);
+    req.limit = htonl(limit);
+
+    std::memcpy(buffer.data(), &header, sizeof(MessageHeader));
+    std::memcpy(buffer.data() + sizeof(MessageHeader), &req, sizeof(HistoryRequest));
+
+    return buffer;
+}
+
+std::vector<uint8_t> ProtocolParser::packSearchRequest(uint32_t sequence,
+                                                       const std::string &query,
+                                                       SearchScope scope,
+                                                       const std::string &peerId,
+                                                       uint64_t beforeSeq,
+                                                       uint32_t limit) {
+    std::vector<uint8_t> buffer(sizeof(MessageHeader) + sizeof(SearchRequest));
+
+    MessageHeader header;
+    header.magic = htonl(MAGIC_NUMBER);
+    header.version = htons(PROTOCOL_VERSION);
+    header.msgType = htons(MSG_SEARCH_REQ);
+    header.bodyLength = htonl(static_cast<uint32_t>(sizeof(SearchRequest)));
+    header.sequence = htonl(sequence);
+
+    SearchRequest req;
+    std::memset(&req, 0, sizeof(req));
+    std::strncpy(req.query, query.c_str(), sizeof(req.query) - 1);
+    req.scope = static_cast<uint8_t>(scope);
+    std::strncpy(req.peerId, peerId.c_str(), sizeof(req.peerId) - 1);
+    req.beforeSeq = hostToNetwork64(beforeSeq);
+    req.limit = htonl(limit);
+
+    std::memcpy(buffer.data(), &header, sizeof(MessageHeader));
+    std::memcpy(buffer.data() + sizeof(MessageHeader), &req, sizeof(SearchRequest));
+
+    return buffer;
+}
+
+std::vector<uint8_t> ProtocolParser::packCatchUpRequest(uint32_t sequence,
+                                                        uint32_t runId,
+                                                        uint32_t lastSeq) {
+    std::vector<uint8_t> buffer(sizeof(MessageHeader) + sizeof(CatchUpRequest));
+
+    MessageHeader header;
+    header.magic = htonl(MAGIC_NUMBER);
+    header.version = htons(PROTOCOL_VERSION);
+    header.msgType = htons(MSG_CATCHUP_REQ);
+    header.bodyLength = htonl(static_cast<uint32_t>(sizeof(CatchUpRequest)));
+    header.sequence = htonl(sequence);
+
+    CatchUpRequest req;
+    req.runId = htonl(runId);
+    req.lastSeq = htonl(lastSeq);
+
+    std::memcpy(buffer.data(), &header, sizeof(MessageHeader));
+    std::memcpy(buffer.data() + sizeof(MessageHeader), &req, sizeof(CatchUpRequest));
+
+    return buffer;
+}
+
+std::vector<uint8_t> ProtocolParser::packFileDataHeader(uint32_t sequence,
+                                                        const std::string &fileId,
+                                                        uint64_t offset,
+                                                        size_t dataLen) {
+    std::vector<uint8_t> buffer(sizeof(MessageHeader) + sizeof(FileDataHeader));
 
     MessageHeader header;
     header.magic = htonl(MAGIC_NUMBER);
@@ -210,8 +444,18 @@ std::vector<uint8_t> ProtocolParser::packFileData(uint32_t sequence,
 
     std::memcpy(buffer.data(), &header, sizeof(MessageHeader));
     std::memcpy(buffer.data() + sizeof(MessageHeader), &fileHeader, sizeof(FileDataHeader));
+
+    return buffer;
+}
+
+std::vector<uint8_t> ProtocolParser::packFileData(uint32_t sequence,
+                                                  const std::string &fileId,
+                                                  uint64_t offset,
+                                                  const uint8_t *data,
+                                                  size_t dataLen) {
+    std::vector<uint8_t> buffer = packFileDataHeader(sequence, fileId, offset, dataLen);
     if (dataLen > 0) {
-        std::memcpy(buffer.data() + sizeof(MessageHeader) + sizeof(FileDataHeader), data, dataLen);
+        buffer.insert(buffer.end(), data, data + dataLen);
     }
 
     return buffer;
@@ -229,6 +473,23 @@ bool ProtocolParser::parseLoginResponse(const uint8_t *data, size_t len, LoginRe
     return true;
 }
 
+bool ProtocolParser::parseLoginResponse(const uint8_t *data, size_t len, LoginResponse &rsp,
+                                        LoginResponseExt &ext) {
+    if (!parseLoginResponse(data, len, rsp)) {
+        return false;
+    }
+
+    // Servers without retry-after send the extension without its last field.
+    std::memset(&ext, 0, sizeof(ext));
+    if (len > sizeof(LoginResponse)) {
+        size_t extLen = std::min(len - sizeof(LoginResponse), sizeof(LoginResponseExt));
+        std::memcpy(&ext, data + sizeof(LoginResponse), extLen);
+        ext.resumeGraceSec = ntohl(ext.resumeGraceSec);
+        ext.retryAfterMs = ntohl(ext.retryAfterMs);
+    }
+    return true;
+}
+
 bool ProtocolParser::parseChatMessage(const uint8_t *data, size_t len, ChatMessage &msg) {
     if (len < sizeof(ChatMessage)) {
         return false;
@@ -275,11 +536,21 @@ bool ProtocolParser::parseUserListResponse(const uint8_t *data,
     return true;
 }
 
-bool ProtocolParser::parseFileOffer(const uint8_t *data, size_t len, FileOffer &offer) {
+bool ProtocolParser::parseFileOffer(const uint8_t *data,
+                                    size_t len,
+                                    FileOffer &offer,
+                                    FileOfferExt &ext) {
     if (len < sizeof(FileOffer)) {
         return false;
     }
 
+    std::memset(&ext, 0, sizeof(ext));
+    if (len >= sizeof(FileOffer) + sizeof(ext.streamCount)) {
+        size_t extLen = std::min(len - sizeof(FileOffer), sizeof(FileOfferExt));
+        std::memcpy(&ext, data + sizeof(FileOffer), extLen);
+        ext.streamCount = ntohl(ext.streamCount);
+    }
+
     std::memcpy(&offer, data, sizeof(FileOffer));
     offer.fileId[sizeof(offer.fileId) - 1] = '\0';
     offer.fromId[sizeof(offer.fromId) - 1] = '\0';
@@ -306,6 +577,136 @@ bool ProtocolParser::parseFileOfferResponse(const uint8_t *data,
     return true;
 }
 
+bool ProtocolParser::parseFileOfferResponse(const uint8_t *data,
+                                            size_t len,
+                                            FileOfferResponse &rsp,
+                                            FileOfferResponseExt &ext) {
+    if (!parseFileOfferResponse(data, len, rsp)) {
+        return false;
+    }
+
+    std::memset(&ext, 0, sizeof(ext));
+    if (len >= sizeof(FileOfferResponse) + offsetof(FileOfferResponseExt, attachToken)) {
+        size_t extLen = std::min(len - sizeof(FileOfferResponse), sizeof(FileOfferResponseExt));
+        std::memcpy(&ext, data + sizeof(FileOfferResponse), extLen);
+        ext.directPort = ntohs(ext.directPort);
+    }
+    return true;
+}
+
+bool ProtocolParser::parseFileStreamAttach(const uint8_t *data,
+                                           size_t len,
+                                           FileStreamAttach &attach) {
+    if (len < offsetof(FileStreamAttach, attachToken)) {
+        return false;
+    }
+
+    // Without a token the attach is parsed and then refused.
+    std::memset(&attach, 0, sizeof(attach));
+    std::memcpy(&attach, data, std::min(len, sizeof(FileStreamAttach)));
+    attach.fileId[sizeof(attach.fileId) - 1] = '\0';
+    attach.clientId[sizeof(attach.clientId) - 1] = '\0';
+
+    return true;
+}
+
+bool ProtocolParser::parseFileStreamAttachResponse(const uint8_t *data,
+                                                   size_t len,
+                                                   FileStreamAttachResponse &rsp) {
+    if (len < sizeof(FileStreamAttachResponse)) {
+        return false;
+    }
+
+    std::memcpy(&rsp, data, sizeof(FileStreamAttachResponse));
+    rsp.fileId[sizeof(rsp.fileId) - 1] = '\0';
+    rsp.result = ntohl(rsp.result);
+
+    return true;
+}
+
+bool ProtocolParser::parseRateLimitNotice(const uint8_t *data,
+                                          size_t len,
+                                          RateLimitNotice &notice) {
+    if (len < sizeof(RateLimitNotice)) {
+        return false;
+    }
+
+    std::memcpy(&notice, data, sizeof(RateLimitNotice));
+    notice.msgType = ntohs(notice.msgType);
+    notice.sequence = ntohl(notice.sequence);
+    notice.reason = ntohl(notice.reason);
+    notice.retryAfterMs = ntohl(notice.retryAfterMs);
+
+    return true;
+}
+
+bool ProtocolParser::parseFileProofRequest(const uint8_t *data,
+                                           size_t len,
+                                           FileProofRequest &req) {
+    if (len < sizeof(FileProofRequest)) {
+        return false;
+    }
+
+    std::memcpy(&req, data, sizeof(FileProofRequest));
+    req.fileId[sizeof(req.fileId) - 1] = '\0';
+    req.offset = networkToHost64(req.offset);
+    req.length = ntohl(req.length);
+
+    return true;
+}
+
+bool ProtocolParser::parseCatchUpResponse(const uint8_t *data,
+                                          size_t len,
+                                          CatchUpResponse &rsp) {
+    if (len < sizeof(CatchUpResponse)) {
+        return false;
+    }
+
+    std::memcpy(&rsp, data, sizeof(CatchUpResponse));
+    rsp.runId = ntohl(rsp.runId);
+    rsp.newestSeq = ntohl(rsp.newestSeq);
+    rsp.count = ntohl(rsp.count);
+
+    return true;
+}
+
+bool ProtocolParser::parseHistoryResponse(const uint8_t *data,
+                                          size_t len,
+                                          HistoryResponse &rsp,
+                                          std::vector<HistoryEntry> &entries) {
+    entries.clear();
+    if (len < sizeof(HistoryResponse)) {
+        return false;
+    }
+
+    std::memcpy(&rsp, data, sizeof(HistoryResponse));
+    rsp.result = ntohl(rsp.result);
+    rsp.count = ntohl(rsp.count);
+
+    size_t expected = sizeof(HistoryResponse) + static_cast<size_t>(rsp.count) * sizeof(HistoryEntry);
+    if (len < expected) {
+        return false;
+    }
+
+    size_t offset = sizeof(HistoryResponse);
+    entries.reserve(rsp.count);
+    for (uint32_t i = 0; i < rsp.count; ++i) {
+        HistoryEntry entry;
+        std::memcpy(&entry, data + offset, sizeof(HistoryEntry));
+        entry.seq = networkToHost64(entry.seq);
+        ChatMessage &msg = entry.message;
+        msg.fromId[sizeof(msg.fromId) - 1] = '\0';
+        msg.fromNick[sizeof(msg.fromNick) - 1] = '\0';
+        msg.toId[sizeof(msg.toId) - 1] = '\0';
+        msg.message[sizeof(msg.message) - 1] = '\0';
+        msg.timestamp = networkToHost64(msg.timestamp);
+        entries.push_back(entry);
+        offset += sizeof(HistoryEntry);
+    }
+
+    return true;
+}
+
 bool ProtocolParser::parseFileData(const uint8_t *data,
                                    size_t len,
                                    FileDataHeader &header,
@@ -27,11 +27,29 @@ struct LoginRequest {
     char nickname[64];
 };
 
+// Trailing login fields; clients without a password or a resume token
+// send none, and a shorter extension reads the missing fields as zero.
+struct LoginRequestExt {
+    char password[64];
+    uint8_t resumeToken[16];     // from an earlier LoginResponseExt
+};
+
 struct LoginResponse {
     uint32_t result;
     char message[128];
 };
 
+// Follows a successful LoginResponse, or one with LOGIN_RETRY_LATER.
+// Presenting the token within resumeGraceSec of losing the connection
+// restores the session without the other clients seeing it leave and
+// come back.
+struct LoginResponseExt {
+    uint8_t resumeToken[16];     // all zero when resuming is disabled
+    uint32_t resumeGraceSec;
+    uint8_t resumed;             // 1 when this login resumed a session
+    uint32_t retryAfterMs;       // with LOGIN_RETRY_LATER: when to try again
+};
+
 struct ChatMessage {
     uint8_t chatType;
     char fromId[32];
@@ -55,32 +73,158 @@ struct FileOffer {
     char fileName[256];
 };
 
+// Trailing offer fields; older peers send a shorter (or no) extension and
+// the missing fields read as zero.
+struct FileOfferExt {
+    uint32_t streamCount;
+    uint8_t contentHash[32];
+    uint8_t flags;
+    uint8_t attachToken[16];  // set by the server for the receiver's streams
+};
+
 struct FileOfferResponse {
     char fileId[37];
     uint32_t result;
     char message[64];
 };
 
+// Trailing response fields. A receiver accepting a FILE_OFFER_FLAG_DIRECT
+// offer may advertise where it listens; an address of 0 is replaced by the
+// server with the address it sees for that receiver.
+struct FileOfferResponseExt {
+    uint32_t directAddress;   // IPv4, network byte order
+    uint16_t directPort;
+    uint8_t attachToken[16];  // set by the server on accepts it forwards
+};
+
+struct FileCancel {
+    char fileId[37];
+    uint32_t reason;
+};
+
+// Sent to the sender of an offer the content store could serve. The
+// upload is only skipped once the sender answers with the SHA-256 of the
+// nonce followed by the requested range of the file.
+struct FileProofRequest {
+    char fileId[37];
+    uint8_t nonce[16];
+    uint64_t offset;
+    uint32_t length;
+};
+
+struct FileProofResponse {
+    char fileId[37];
+    uint8_t digest[32];
+};
+
 struct FileDataHeader {
     char fileId[37];
     uint64_t offset;
     uint32_t chunkSize;
 };
+
+// A data stream proves it belongs to the session with the attach token
+// the server handed out in the offer (receiver) or the accept (sender).
+struct FileStreamAttach {
+    char fileId[37];
+    char clientId[32];
+    uint8_t role;
+    uint8_t streamIndex;
+    uint8_t attachToken[16];
+};
+
+struct FileStreamAttachResponse {
+    char fileId[37];
+    uint32_t result;
+    uint8_t streamIndex;
+};
+
+// Sent for the first frame dropped by the sender's rate limit; further
+// frames are dropped silently until one gets through again.
+struct RateLimitNotice {
+    uint16_t msgType;        // type of the rejected frame
+    uint32_t sequence;       // its sequence number
+    uint32_t reason;
+    uint32_t retryAfterMs;
+};
+
+// Asks for one page of a conversation, newest first from beforeSeq.
+struct HistoryRequest {
+    uint8_t chatType;        // ChatScope
+    char peerId[32];         // other participant, for private history
+    uint64_t beforeSeq;      // 0 for the newest messages
+    uint64_t fromTime;       // epoch seconds; 0 for no lower bound
+    uint64_t toTime;         // epoch seconds; 0 for no upper bound
+    uint32_t limit;
+};
+
+// Followed by count HistoryEntry records, oldest first.
+struct HistoryResponse {
+    uint32_t result;
+    uint32_t count;
+    uint8_t more;            // older messages in range remain; page with
+                             // beforeSeq set to the first entry's seq
+};
+
+struct HistoryEntry {
+    uint64_t seq;
+    ChatMessage message;
+};
+
+// Finds messages containing every word of query. Answered with
+// MSG_SEARCH_RSP, laid out like HistoryResponse but newest first; page
+// with beforeSeq set to the last entry's seq.
+struct SearchRequest {
+    char query[128];
+    uint8_t scope;           // SearchScope
+    char peerId[32];         // with SEARCH_PRIVATE, only this conversation
+    uint64_t beforeSeq;      // 0 for the newest matches
+    uint32_t limit;
+};
+
+// Sent after login. Group chat frames from the server carry the group
+// sequence number in header.sequence; the server replies with the group
+// messages after lastSeq, then MSG_CATCHUP_RSP. A first request with
+// runId 0 only learns the current position.
+struct CatchUpRequest {
+    uint32_t runId;          // from the last MSG_CATCHUP_RSP; 0 if none
+    uint32_t lastSeq;        // header.sequence of the last group message
+};
+
+struct CatchUpResponse {
+    uint32_t runId;
+    uint32_t newestSeq;
+    uint32_t count;          // messages replayed ahead of this response
+    uint8_t complete;        // 0 when older missed messages are gone or the
+                             // server restarted; fetch them as history
+};
 #pragma pack(pop)
 
 enum MessageType : uint16_t {
     MSG_HEARTBEAT_REQ = 0x0001,
     MSG_HEARTBEAT_RSP = 0x0002,
+    MSG_RATE_LIMITED = 0x0003,
     MSG_LOGIN_REQ = 0x0101,
     MSG_LOGIN_RSP = 0x0102,
     MSG_LOGOUT_REQ = 0x0103,
     MSG_CHAT_MSG = 0x0201,
     MSG_USER_LIST_REQ = 0x0202,
     MSG_USER_LIST_RSP = 0x0203,
+    MSG_HISTORY_REQ = 0x0204,
+    MSG_HISTORY_RSP = 0x0205,
+    MSG_SEARCH_REQ = 0x0206,
+    MSG_SEARCH_RSP = 0x0207,
+    MSG_CATCHUP_REQ = 0x0208,
+    MSG_CATCHUP_RSP = 0x0209,
     MSG_FILE_OFFER = 0x0301,
     MSG_FILE_OFFER_RSP = 0x0302,
     MSG_FILE_DATA = 0x0303,
-    MSG_FILE_DATA_ACK = 0x0304
+    MSG_FILE_DATA_ACK = 0x0304,
+    MSG_FILE_STREAM_ATTACH = 0x0305,
+    MSG_FILE_STREAM_ATTACH_RSP = 0x0306,
+    MSG_FILE_CANCEL = 0x0307,
+    MSG_FILE_PROOF_REQ = 0x0308,
+    MSG_FILE_PROOF_RSP = 0x0309
 };
 
 enum LoginResult : uint32_t {
@@ -88,7 +232,11 @@ enum LoginResult : uint32_t {
     LOGIN_INVALID_PARAM = 1,
     LOGIN_SERVER_FULL = 2,
     LOGIN_ALREADY_ONLINE = 3,
-    LOGIN_NICKNAME_TAKEN = 4
+    LOGIN_NICKNAME_TAKEN = 4,
+    LOGIN_UNKNOWN_USER = 5,
+    LOGIN_DISABLED = 6,
+    LOGIN_BAD_CREDENTIALS = 7,
+    LOGIN_RETRY_LATER = 8
 };
 
 enum ChatScope : uint8_t {
@@ -99,16 +247,58 @@ enum ChatScope : uint8_t {
 enum FileOfferResult : uint32_t {
     FILE_OFFER_ACCEPT = 0,
     FILE_OFFER_DECLINE = 1,
-    FILE_OFFER_BUSY = 2
+    FILE_OFFER_BUSY = 2,
+    FILE_OFFER_STORED = 3
+};
+
+enum FileOfferFlag : uint8_t {
+    FILE_OFFER_FLAG_TUNNEL = 0x01,
+    FILE_OFFER_FLAG_DIRECT = 0x02
+};
+
+enum FileStreamRole : uint8_t {
+    FILE_STREAM_SENDER = 0,
+    FILE_STREAM_RECEIVER = 1
+};
+
+enum FileStreamAttachResult : uint32_t {
+    FILE_STREAM_ATTACH_OK = 0,
+    FILE_STREAM_ATTACH_REJECTED = 1
+};
+
+enum FileCancelReason : uint32_t {
+    FILE_CANCEL_DIRECT = 0
+};
+
+enum RateLimitReason : uint32_t {
+    RATE_LIMIT_MESSAGES = 1
+};
+
+enum HistoryResult : uint32_t {
+    HISTORY_OK = 0,
+    HISTORY_UNAVAILABLE = 1,
+    HISTORY_INVALID = 2
 };
 
+enum SearchScope : uint8_t {
+    SEARCH_ALL = 0,
+    SEARCH_GROUP = 1,
+    SEARCH_PRIVATE = 2
+};
+
+constexpr size_t kResumeTokenSize = sizeof(LoginResponseExt::resumeToken);
+
 class ProtocolParser {
 public:
     static bool validateHeader(const MessageHeader &header);
     static std::vector<uint8_t> packHeartbeatRequest(uint32_t sequence);
+    // The password and resumeToken (kResumeTokenSize raw bytes) travel in a
+    // LoginRequestExt, sent only when one of them is given.
     static std::vector<uint8_t> packLoginRequest(uint32_t sequence,
                                                   const std::string &clientId,
-                                                  const std::string &nickname);
+                                                  const std::string &nickname,
+                                                  const std::string &password = std::string(),
+                                                  const std::string &resumeToken = std::string());
     static std::vector<uint8_t> packLogoutRequest(uint32_t sequence);
     static std::vector<uint8_t> packChatMessage(uint32_t sequence,
                                                 ChatScope scope,
@@ -124,11 +314,49 @@ public:
                                               uint64_t fileSize,
                                               const std::string &fromId,
                                               const std::string &fromNick,
-                                              const std::string &toId);
+                                              const std::string &toId,
+                                              const FileOfferExt &ext);
     static std::vector<uint8_t> packFileOfferResponse(uint32_t sequence,
                                                       const std::string &fileId,
                                                       uint32_t result,
-                                                      const std::string &message);
+                                                      const std::string &message,
+                                                      const FileOfferResponseExt &ext = FileOfferResponseExt());
+    static std::vector<uint8_t> packFileCancel(uint32_t sequence,
+                                               const std::string &fileId,
+                                               uint32_t reason);
+    static std::vector<uint8_t> packFileProofResponse(uint32_t sequence,
+                                                      const std::string &fileId,
+                                                      const std::string &digest);
+    static std::vector<uint8_t> packFileStreamAttach(uint32_t sequence,
+                                                     const std::string &fileId,
+                                                     const std::string &clientId,
+                                                     uint8_t role,
+                                                     uint8_t streamIndex,
+                                                     const std::string &attachToken);
+    static std::vector<uint8_t> packFileStreamAttachResponse(uint32_t sequence,
+                                                             const std::string &fileId,
+                                                             uint32_t result,
+                                                             uint8_t streamIndex);
+    static std::vector<uint8_t> packHistoryRequest(uint32_t sequence,
+                                                   ChatScope scope,
+                                                   const std::string &peerId,
+                                                   uint64_t beforeSeq,
+                                                   uint64_t fromTime,
+                                                   uint64_t toTime,
+                                                   uint32_t limit);
+    static std::vector<uint8_t> packSearchRequest(uint32_t sequence,
+                                                  const std::string &query,
+                                                  SearchScope scope,
+                                                  const std::string &peerId,
+                                                  uint64_t beforeSeq,
+                                                  uint32_t limit);
+    static std::vector<uint8_t> packCatchUpRequest(uint32_t sequence,
+                                                   uint32_t runId,
+                                                   uint32_t lastSeq);
+    static std::vector<uint8_t> packFileDataHeader(uint32_t sequence,
+                                                   const std::string &fileId,
+                                                   uint64_t offset,
+                                                   size_t dataLen);
     static std::vector<uint8_t> packFileData(uint32_t sequence,
                                              const std::string &fileId,
                                              uint64_t offset,
@@ -136,14 +364,43 @@ public:
                                              size_t dataLen);
 
     static bool parseLoginResponse(const uint8_t *data, size_t len, LoginResponse &rsp);
+    // ext reads as zero when the server sent none.
+    static bool parseLoginResponse(const uint8_t *data, size_t len, LoginResponse &rsp,
+                                   LoginResponseExt &ext);
     static bool parseChatMessage(const uint8_t *data, size_t len, ChatMessage &msg);
     static bool parseUserListResponse(const uint8_t *data,
                                       size_t len,
                                       std::vector<UserInfo> &users);
-    static bool parseFileOffer(const uint8_t *data, size_t len, FileOffer &offer);
+    static bool parseFileOffer(const uint8_t *data,
+                               size_t len,
+                               FileOffer &offer,
+                               FileOfferExt &ext);
     static bool parseFileOfferResponse(const uint8_t *data,
                                        size_t len,
                                        FileOfferResponse &rsp);
+    static bool parseFileOfferResponse(const uint8_t *data,
+                                       size_t len,
+                                       FileOfferResponse &rsp,
+                                       FileOfferResponseExt &ext);
+    static bool parseFileStreamAttach(const uint8_t *data,
+                                      size_t len,
+                                      FileStreamAttach &attach);
+    static bool parseFileStreamAttachResponse(const uint8_t *data,
+                                              size_t len,
+                                              FileStreamAttachResponse &rsp);
+    static bool parseFileProofRequest(const uint8_t *data,
+                                      size_t len,
+                                      FileProofRequest &req);
+    static bool parseRateLimitNotice(const uint8_t *data,
+                                     size_t len,
+                                     RateLimitNotice &notice);
+    static bool parseHistoryResponse(const uint8_t *data,
+                                     size_t len,
+                                     HistoryResponse &rsp,
+                                     std::vector<HistoryEntry> &entries);
+    static bool parseCatchUpResponse(const uint8_t *data,
+                                     size_t len,
+                                     CatchUpResponse &rsp);
     static bool parseFileData(const uint8_t *data,
                               size_t len,
                               FileDataHeader &header,
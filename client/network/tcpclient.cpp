@@ -1,16 +1,46 @@
 #include "tcpclient.h"
 
+#include "filehasher.h"
+#include "filewriter.h"
+
 #include <QDateTime>
 #include <QDebug>
 #include <QDir>
 #include <QFileInfo>
+#include <QRandomGenerator>
 #include <QStandardPaths>
 #include <QtGlobal>
 
 #include <cstring>
 
+#ifdef Q_OS_LINUX
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#endif
+
 namespace {
 constexpr int kFileChunkSize = 16 * 1024;
+constexpr int kMinFileChunkSize = 4 * 1024;
+constexpr int kMaxFileChunkSize = 256 * 1024;
+constexpr qint64 kSendQueueLimit = 512 * 1024;
+constexpr qint64 kSendRateWindowMs = 200;
+constexpr qint64 kChunkTargetMs = 20;
+constexpr quint64 kMapWindowSize = 64ULL * 1024 * 1024;
+constexpr int kMaxParallelStreams = 8;
+constexpr quint64 kParallelMinFileSize = 8ULL * 1024 * 1024;
+constexpr int kStreamAttachTimeoutMs = 5000;
+constexpr int kDirectConnectTimeoutMs = 3000;
+// A heartbeat goes out only after this long without sending anything;
+// the server counts every frame it receives as a sign of life.
+constexpr int kHeartbeatIdleMs = 5000;
+// Keepalive probes for the setTcpKeepAlive() mode, roughly matching the
+// application heartbeat: idle, then probes every interval, dead after count.
+constexpr int kKeepAliveIdleSec = 10;
+constexpr int kKeepAliveIntervalSec = 5;
+constexpr int kKeepAliveCount = 3;
+constexpr int kReconnectBaseMs = 500;
+constexpr int kReconnectMaxMs = 30000;
 
 uint64_t currentEpochSeconds() {
 #if QT_VERSION >= QT_VERSION_CHECK(5, 8, 0)
@@ -19,21 +49,68 @@ uint64_t currentEpochSeconds() {
     return static_cast<uint64_t>(QDateTime::currentDateTime().toTime_t());
 #endif
 }
+bool takeFrame(QByteArray &buffer, MessageHeader &header, QByteArray &body) {
+    if (buffer.size() < static_cast<int>(sizeof(MessageHeader))) {
+        return false;
+    }
+
+    std::memcpy(&header, buffer.data(), sizeof(MessageHeader));
+    header.magic = ntohl(header.magic);
+    header.version = ntohs(header.version);
+    header.msgType = ntohs(header.msgType);
+    header.bodyLength = ntohl(header.bodyLength);
+    header.sequence = ntohl(header.sequence);
+
+    if (!ProtocolParser::validateHeader(header)) {
+        qWarning() << "Invalid header, clearing buffer";
+        buffer.clear();
+        return false;
+    }
+
+    int totalLen = static_cast<int>(sizeof(MessageHeader) + header.bodyLength);
+    if (buffer.size() < totalLen) {
+        return false;
+    }
+
+    body = buffer.mid(sizeof(MessageHeader), header.bodyLength);
+    buffer.remove(0, totalLen);
+    return true;
+}
 } // namespace
 
 TcpClient::TcpClient(QObject *parent)
     : QObject(parent)
     , socket_(nullptr)
+    , serverPort_(0)
+    , parallelStreams_(0)
+    , tunnelTransfers_(false)
+    , directTransfers_(false)
+    , tcpKeepAlive_(false)
     , heartbeatTimer_(nullptr)
-    , sequence_(0) {
+    , reconnectTimer_(nullptr)
+    , ioThread_(nullptr)
+    , fileWriter_(nullptr)
+    , hashThread_(nullptr)
+    , fileHasher_(nullptr)
+    , sequence_(0)
+    , groupRunId_(0)
+    , lastGroupSeq_(0)
+    , autoReconnect_(false)
+    , reconnectAttempt_(0)
+    , sendChunkSize_(kFileChunkSize)
+    , pumpingFileSends_(false)
+    , sendRateBytes_(0) {
     socket_ = new QTcpSocket(this);
 
     heartbeatTimer_ = new QTimer(this);
-    heartbeatTimer_->setInterval(5000);
+    heartbeatTimer_->setInterval(kHeartbeatIdleMs);
+    reconnectTimer_ = new QTimer(this);
+    reconnectTimer_->setSingleShot(true);
 
     connect(socket_, &QTcpSocket::connected, this, &TcpClient::onConnected);
     connect(socket_, &QTcpSocket::disconnected, this, &TcpClient::onDisconnected);
     connect(socket_, &QTcpSocket::readyRead, this, &TcpClient::onReadyRead);
+    connect(socket_, &QTcpSocket::bytesWritten, this, &TcpClient::onBytesWritten);
 #if QT_VERSION >= QT_VERSION_CHECK(5, 15, 0)
     connect(socket_, &QTcpSocket::errorOccurred, this, &TcpClient::onError);
 #else
@@ -41,20 +118,50 @@ TcpClient::TcpClient(QObject *parent)
             this, &TcpClient::onError);
 #endif
     connect(heartbeatTimer_, &QTimer::timeout, this, &TcpClient::onHeartbeatTimeout);
+    connect(reconnectTimer_, &QTimer::timeout, this, &TcpClient::onReconnectTimer);
+
+    ioThread_ = new QThread(this);
+    fileWriter_ = new FileWriter();
+    fileWriter_->moveToThread(ioThread_);
+    connect(ioThread_, &QThread::finished, fileWriter_, &QObject::deleteLater);
+    connect(fileWriter_, &FileWriter::fileOpened, this, &TcpClient::onWriterFileOpened);
+    connect(fileWriter_, &FileWriter::writeProgress, this, &TcpClient::onWriterProgress);
+    connect(fileWriter_, &FileWriter::fileFinished, this, &TcpClient::onWriterFinished);
+    ioThread_->start();
+
+    // Hashing a large outgoing file must not hold up writes of incoming ones.
+    hashThread_ = new QThread(this);
+    fileHasher_ = new FileHasher();
+    fileHasher_->moveToThread(hashThread_);
+    connect(hashThread_, &QThread::finished, fileHasher_, &QObject::deleteLater);
+    connect(fileHasher_, &FileHasher::fileHashed, this, &TcpClient::onFileHashed);
+    connect(fileHasher_, &FileHasher::rangeHashed, this, &TcpClient::onRangeHashed);
+    hashThread_->start();
 }
 
 TcpClient::~TcpClient() {
     disconnectFromServer();
+    ioThread_->quit();
+    ioThread_->wait();
+    hashThread_->quit();
+    hashThread_->wait();
 }
 
 void TcpClient::connectToServer(const QString &ip, int port) {
     qDebug() << "Connecting to" << ip << ":" << port;
+    stopReconnecting();
+    serverHost_ = ip;
+    serverPort_ = static_cast<quint16>(port);
     socket_->connectToHost(ip, port);
 }
 
 void TcpClient::disconnectFromServer() {
+    stopReconnecting();
+    password_.clear();
     heartbeatTimer_->stop();
     clearFileSessions();
+    // Logging out ends the session on the server; its token is void.
+    resumeToken_.clear();
     if (isConnected()) {
         sendLogoutRequest();
     }
@@ -68,6 +175,26 @@ void TcpClient::setIdentity(const QString &clientId, const QString &nickname) {
     nickname_ = nickname.trimmed();
 }
 
+void TcpClient::setPassword(const QString &password) {
+    password_ = password;
+}
+
+void TcpClient::setParallelStreams(int count) {
+    parallelStreams_ = qBound(0, count, kMaxParallelStreams);
+}
+
+void TcpClient::setTunnelTransfers(bool enabled) {
+    tunnelTransfers_ = enabled;
+}
+
+void TcpClient::setDirectTransfers(bool enabled) {
+    directTransfers_ = enabled;
+}
+
+void TcpClient::setTcpKeepAlive(bool enabled) {
+    tcpKeepAlive_ = enabled;
+}
+
 QString TcpClient::clientId() const {
     return clientId_;
 }
@@ -76,13 +203,22 @@ QString TcpClient::nickname() const {
     return nickname_;
 }
 
-void TcpClient::sendLoginRequest(const QString &clientId, const QString &nickname) {
-    qDebug() << "Sending login request" << clientId << nickname;
+void TcpClient::sendLoginRequest(const QString &clientId, const QString &nickname,
+                                 const QString &password) {
+    if (clientId != resumeClientId_) {
+        resumeClientId_ = clientId;
+        resumeToken_.clear();
+    }
+    qDebug() << "Sending login request" << clientId << nickname
+             << (password.isEmpty() ? "without password" : "with password")
+             << (resumeToken_.isEmpty() ? "" : "and resume token");
 
     auto data = ProtocolParser::packLoginRequest(
         ++sequence_,
         clientId.toStdString(),
-        nickname.toStdString());
+        nickname.toStdString(),
+        password.toStdString(),
+        std::string(resumeToken_.constData(), static_cast<size_t>(resumeToken_.size())));
 
     sendData(QByteArray(reinterpret_cast<const char *>(data.data()),
                         static_cast<int>(data.size())));
@@ -140,21 +276,79 @@ void TcpClient::sendFileOffer(const QString &fileId,
     session.fileName = fileName;
     session.fileSize = fileSize;
     session.toId = toId;
+    // Group offers are fanned out by the server over each receiver's main connection.
+    if (!toId.isEmpty() && parallelStreams_ > 1 && fileSize >= kParallelMinFileSize) {
+        session.streamCount = parallelStreams_;
+    } else if (!toId.isEmpty() && tunnelTransfers_) {
+        // The server splices a raw data channel from us to the receiver.
+        session.tunnel = true;
+    } else if (!toId.isEmpty() && directTransfers_) {
+        // Ask the receiver for an endpoint; the relay remains the fallback.
+        session.direct = true;
+    }
     sendSessions_.insert(fileId, session);
 
+    if (session.streamCount > 0 || session.tunnel) {
+        sendOfferPacket(session);
+        return;
+    }
+
+    // Single-stream offers carry a content hash so the server can skip
+    // uploads it already holds; the offer goes out once hashing finishes.
+    FileHasher *hasher = fileHasher_;
+    QMetaObject::invokeMethod(hasher, [hasher, fileId, filePath]() {
+        hasher->hashFile(fileId, filePath);
+    }, Qt::QueuedConnection);
+}
+
+void TcpClient::sendOfferPacket(const FileSendSession &session) {
+    FileOfferExt ext;
+    std::memset(&ext, 0, sizeof(ext));
+    ext.streamCount = static_cast<uint32_t>(session.streamCount);
+    ext.flags = session.tunnel ? FILE_OFFER_FLAG_TUNNEL : 0;
+    if (session.direct) {
+        ext.flags |= FILE_OFFER_FLAG_DIRECT;
+    }
+    if (session.contentHash.size() == static_cast<int>(sizeof(ext.contentHash))) {
+        std::memcpy(ext.contentHash, session.contentHash.constData(), sizeof(ext.contentHash));
+    }
+
     auto data = ProtocolParser::packFileOffer(
         ++sequence_,
-        fileId.toStdString(),
-        fileName.toStdString(),
-        static_cast<uint64_t>(fileSize),
+        session.fileId.toStdString(),
+        session.fileName.toStdString(),
+        static_cast<uint64_t>(session.fileSize),
         clientId_.toStdString(),
         nickname_.toStdString(),
-        toId.toStdString());
+        session.toId.toStdString(),
+        ext);
 
     sendData(QByteArray(reinterpret_cast<const char *>(data.data()),
                         static_cast<int>(data.size())));
 }
 
+void TcpClient::onFileHashed(const QString &fileId, const QByteArray &digest) {
+    auto it = sendSessions_.find(fileId);
+    if (it == sendSessions_.end() || !isConnected()) {
+        return;
+    }
+    it->contentHash = digest;
+    sendOfferPacket(it.value());
+}
+
+void TcpClient::onRangeHashed(const QString &fileId, const QByteArray &digest) {
+    if (!sendSessions_.contains(fileId) || !isConnected()) {
+        return;
+    }
+    // An empty digest still gets sent, so the server declines the offer
+    // instead of waiting for it to expire.
+    auto data = ProtocolParser::packFileProofResponse(
+        ++sequence_, fileId.toStdString(),
+        std::string(digest.constData(), static_cast<size_t>(digest.size())));
+    sendData(QByteArray(reinterpret_cast<const char *>(data.data()),
+                        static_cast<int>(data.size())));
+}
+
 void TcpClient::sendFileOfferResponse(const QString &fileId,
                                       uint32_t result,
                                       const QString &message) {
@@ -173,16 +367,21 @@ void TcpClient::sendFileOfferResponse(const QString &fileId,
             session.fileName = offer.fileName;
             session.fileSize = offer.fileSize;
             session.savePath = buildDownloadPath(session.fileName);
-
-            auto file = QSharedPointer<QFile>::create(session.savePath);
-            if (!file->open(QIODevice::WriteOnly)) {
-                result = FILE_OFFER_DECLINE;
-                responseMessage = "Cannot save file";
-                emit fileTransferCompleted(fileId, true, false, responseMessage);
-            } else {
-                session.file = file;
-                recvSessions_.insert(fileId, session);
-            }
+            session.streamCount = offer.streamCount;
+            session.tunnel = offer.tunnel;
+            session.fromId = offer.fromId;
+            session.direct = offer.direct && directTransfers_;
+            session.attachToken = offer.attachToken;
+            recvSessions_.insert(fileId, session);
+            pendingOffers_.erase(pendingIt);
+
+            QString savePath = session.savePath;
+            quint64 size = session.fileSize;
+            FileWriter *writer = fileWriter_;
+            QMetaObject::invokeMethod(writer, [writer, fileId, savePath, size]() {
+                writer->openFile(fileId, savePath, size);
+            }, Qt::QueuedConnection);
+            return;
         }
     }
 
@@ -208,10 +407,42 @@ void TcpClient::requestUserList() {
                         static_cast<int>(data.size())));
 }
 
+void TcpClient::requestHistory(ChatScope scope, const QString &peerId, quint64 beforeSeq, int limit) {
+    qDebug() << "Requesting history" << (scope == CHAT_PRIVATE ? peerId : QString("group"))
+             << "before" << beforeSeq;
+
+    auto data = ProtocolParser::packHistoryRequest(
+        ++sequence_, scope, peerId.toStdString(), beforeSeq, 0, 0,
+        static_cast<uint32_t>(qMax(limit, 0)));
+    sendData(QByteArray(reinterpret_cast<const char *>(data.data()),
+                        static_cast<int>(data.size())));
+}
+
+void TcpClient::requestSearch(const QString &query, SearchScope scope, const QString &peerId,
+                              quint64 beforeSeq, int limit) {
+    qDebug() << "Searching history for" << query << "before" << beforeSeq;
+
+    auto data = ProtocolParser::packSearchRequest(
+        ++sequence_, query.toStdString(), scope, peerId.toStdString(), beforeSeq,
+        static_cast<uint32_t>(qMax(limit, 0)));
+    sendData(QByteArray(reinterpret_cast<const char *>(data.data()),
+                        static_cast<int>(data.size())));
+}
+
+void TcpClient::requestGroupCatchUp() {
+    auto data = ProtocolParser::packCatchUpRequest(++sequence_, groupRunId_, lastGroupSeq_);
+    sendData(QByteArray(reinterpret_cast<const char *>(data.data()),
+                        static_cast<int>(data.size())));
+}
+
 bool TcpClient::isConnected() const {
     return socket_->state() == QAbstractSocket::ConnectedState;
 }
 
+bool TcpClient::isReconnecting() const {
+    return autoReconnect_;
+}
+
 const QVector<UserInfo> &TcpClient::userList() const {
     return userList_;
 }
@@ -221,8 +452,20 @@ void TcpClient::onConnected() {
 
     recvBuffer_.clear();
     sequence_ = 0;
-    heartbeatTimer_->start();
+    sendChunkSize_ = kFileChunkSize;
+    sendRateBytes_ = 0;
+    sendRateTimer_.invalidate();
+    if (tcpKeepAlive_) {
+        enableKeepAlive();
+    } else {
+        heartbeatTimer_->start();
+    }
 
+    // The login goes out in the same turn as the connect, without waiting
+    // for the UI; a resume token from the last session rides along.
+    if (!clientId_.isEmpty()) {
+        sendLoginRequest(clientId_, nickname_, password_);
+    }
     emit connected();
 }
 
@@ -230,9 +473,14 @@ void TcpClient::onDisconnected() {
     qDebug() << "TCP disconnected";
 
     heartbeatTimer_->stop();
-    clearFileSessions();
+    if (pumpingFileSends_) {
+        QTimer::singleShot(0, this, [this]() { clearFileSessions(); });
+    } else {
+        clearFileSessions();
+    }
 
     emit disconnected();
+    scheduleReconnect();
 }
 
 // 如何处理粘包和半包？
@@ -242,30 +490,10 @@ void TcpClient::onReadyRead() {
 
     qDebug() << "Received" << newData.size() << "bytes";
 
-    while (recvBuffer_.size() >= static_cast<int>(sizeof(MessageHeader))) {
-        MessageHeader header;
-        std::memcpy(&header, recvBuffer_.data(), sizeof(MessageHeader));
-
-        header.magic = ntohl(header.magic);
-        header.version = ntohs(header.version);
-        header.msgType = ntohs(header.msgType);
-        header.bodyLength = ntohl(header.bodyLength);
-        header.sequence = ntohl(header.sequence);
-
-        if (!ProtocolParser::validateHeader(header)) {
-            qWarning() << "Invalid header, clearing buffer";
-            recvBuffer_.clear();
-            break;
-        }
-
-        int totalLen = static_cast<int>(sizeof(MessageHeader) + header.bodyLength);
-        if (recvBuffer_.size() < totalLen) {
-            break;
-        }
-
-        QByteArray body = recvBuffer_.mid(sizeof(MessageHeader), header.bodyLength);
+    MessageHeader header;
+    QByteArray body;
+    while (takeFrame(recvBuffer_, header, body)) {
         processMessage(header, body);
-        recvBuffer_.remove(0, totalLen);
     }
 }
 
@@ -295,23 +523,104 @@ void TcpClient::onError(QAbstractSocket::SocketError error) {
 
     qWarning() << "Socket error:" << errorStr;
 
+    if (autoReconnect_) {
+        // A failed connect attempt ends without disconnected().
+        QTimer::singleShot(0, this, [this]() {
+            if (socket_->state() == QAbstractSocket::UnconnectedState) {
+                scheduleReconnect();
+            }
+        });
+        return;
+    }
     emit connectError(errorStr);
 }
 
 void TcpClient::onHeartbeatTimeout() {
+    // Sending restarts the idle timer, so this fires only when nothing
+    // else went out for kHeartbeatIdleMs.
     sendHeartbeat();
 }
 
+void TcpClient::enableKeepAlive() {
+    socket_->setSocketOption(QAbstractSocket::KeepAliveOption, 1);
+#ifdef Q_OS_LINUX
+    // The system default waits two hours before the first probe.
+    int fd = static_cast<int>(socket_->socketDescriptor());
+    int idle = kKeepAliveIdleSec;
+    int interval = kKeepAliveIntervalSec;
+    int count = kKeepAliveCount;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle)) < 0 ||
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval)) < 0 ||
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count)) < 0) {
+        qWarning() << "Failed to tune TCP keepalive, using system defaults";
+    }
+#endif
+    qDebug() << "Using TCP keepalive instead of heartbeats";
+}
+
+// Exponential backoff with full jitter: the wait is uniform in
+// [0, min(cap, base * 2^attempt)], so clients dropped together do not
+// come back together.
+void TcpClient::scheduleReconnect() {
+    if (!autoReconnect_ || reconnectTimer_->isActive()) {
+        return;
+    }
+    int ceiling = qMin(kReconnectMaxMs, kReconnectBaseMs << qMin(reconnectAttempt_, 6));
+    int delayMs = QRandomGenerator::global()->bounded(ceiling + 1);
+    ++reconnectAttempt_;
+    qDebug() << "Reconnecting in" << delayMs << "ms, attempt" << reconnectAttempt_;
+    reconnectTimer_->start(delayMs);
+    emit reconnecting(reconnectAttempt_, delayMs);
+}
+
+// The server already spreads the clients it defers; a little jitter on
+// top keeps those given the same slot apart.
+void TcpClient::scheduleLoginRetry(quint32 retryAfterMs) {
+    int delayMs = static_cast<int>(qMin<quint32>(retryAfterMs, kReconnectMaxMs));
+    delayMs += QRandomGenerator::global()->bounded(qMax(delayMs / 4, 100) + 1);
+    ++reconnectAttempt_;
+    qDebug() << "Login deferred by server, retrying in" << delayMs << "ms";
+    reconnectTimer_->start(delayMs);
+    emit reconnecting(reconnectAttempt_, delayMs);
+}
+
+void TcpClient::stopReconnecting() {
+    autoReconnect_ = false;
+    reconnectAttempt_ = 0;
+    reconnectTimer_->stop();
+}
+
+void TcpClient::onReconnectTimer() {
+    if (socket_->state() == QAbstractSocket::ConnectedState) {
+        sendLoginRequest(clientId_, nickname_, password_);
+    } else if (socket_->state() == QAbstractSocket::UnconnectedState) {
+        qDebug() << "Reconnecting to" << serverHost_ << ":" << serverPort_;
+        socket_->connectToHost(serverHost_, serverPort_);
+    }
+}
+
+void TcpClient::onBytesWritten(qint64 bytes) {
+    updateSendChunkSize(bytes);
+    pumpFileSends();
+}
+
 void TcpClient::sendData(const QByteArray &data) {
-    if (!isConnected()) {
+    writeSocket(socket_, data.constData(), static_cast<qint64>(data.size()));
+}
+
+void TcpClient::writeSocket(QTcpSocket *socket, const char *data, qint64 len) {
+    if (socket->state() != QAbstractSocket::ConnectedState) {
         qWarning() << "Not connected, skip send";
         return;
     }
 
-    qint64 written = socket_->write(data);
-    socket_->flush();
+    qint64 written = socket->write(data, len);
+    socket->flush();
+    if (socket == socket_ && heartbeatTimer_->isActive()) {
+        heartbeatTimer_->start();
+    }
 
-    qDebug() << "Sent" << written << "/" << data.size() << "bytes";
+    qDebug() << "Sent" << written << "/" << len << "bytes";
 }
 
 void TcpClient::processMessage(const MessageHeader &header, const QByteArray &body) {
@@ -323,16 +632,61 @@ void TcpClient::processMessage(const MessageHeader &header, const QByteArray &bo
         case MSG_HEARTBEAT_RSP:
             qDebug() << "Heartbeat response";
             break;
+        case MSG_RATE_LIMITED: {
+            RateLimitNotice notice;
+            if (ProtocolParser::parseRateLimitNotice(
+                    reinterpret_cast<const uint8_t *>(body.data()),
+                    static_cast<size_t>(body.size()), notice)) {
+                qWarning() << "Rate limited: msg type" << notice.msgType
+                           << "seq" << notice.sequence
+                           << "reason" << notice.reason
+                           << "retry after" << notice.retryAfterMs << "ms";
+            } else {
+                qWarning() << "Failed to parse rate limit notice";
+            }
+            break;
+        }
         case MSG_LOGIN_RSP: {
             LoginResponse rsp;
+            LoginResponseExt ext;
             if (ProtocolParser::parseLoginResponse(
                     reinterpret_cast<const uint8_t *>(body.data()),
-                    static_cast<size_t>(body.size()), rsp)) {
+                    static_cast<size_t>(body.size()), rsp, ext)) {
                 bool success = (rsp.result == LOGIN_SUCCESS);
                 QString message = QString::fromUtf8(rsp.message);
 
-                qDebug() << "Login response" << rsp.result << message;
-                emit loginResponse(success, message);
+                // Kept for the next login as this clientId, so a reconnect
+                // within ext.resumeGraceSec skips the full login.
+                resumeToken_.clear();
+                if (success && ext.resumeGraceSec > 0) {
+                    resumeToken_ = QByteArray(reinterpret_cast<const char *>(ext.resumeToken),
+                                              static_cast<int>(sizeof(ext.resumeToken)));
+                }
+                qDebug() << "Login response" << rsp.result << message
+                         << (ext.resumed ? "(session resumed)" : "");
+                bool relogin = autoReconnect_;
+                if (rsp.result == LOGIN_RETRY_LATER) {
+                    scheduleLoginRetry(ext.retryAfterMs);
+                } else if (success) {
+                    autoReconnect_ = true;
+                    reconnectAttempt_ = 0;
+                    if (relogin) {
+                        emit reconnected(ext.resumed != 0);
+                    } else {
+                        emit loginResponse(true, message);
+                    }
+                    requestGroupCatchUp();
+                } else if (relogin && (rsp.result == LOGIN_SERVER_FULL ||
+                                       rsp.result == LOGIN_ALREADY_ONLINE)) {
+                    // The server may not have noticed the old connection
+                    // dying yet; back off and try again.
+                    socket_->disconnectFromHost();
+                } else if (relogin) {
+                    stopReconnecting();
+                    emit reconnectFailed(message);
+                } else {
+                    emit loginResponse(false, message);
+                }
             } else {
                 qWarning() << "Failed to parse login response";
                 emit loginResponse(false, "Failed to parse response");
@@ -345,6 +699,9 @@ void TcpClient::processMessage(const MessageHeader &header, const QByteArray &bo
                     reinterpret_cast<const uint8_t *>(body.data()),
                     static_cast<size_t>(body.size()), msg)) {
                 bool isPrivate = (msg.chatType == CHAT_PRIVATE);
+                if (!isPrivate && header.sequence != 0) {
+                    lastGroupSeq_ = header.sequence;
+                }
                 QString fromId = QString::fromUtf8(msg.fromId);
                 QString fromNick = QString::fromUtf8(msg.fromNick);
                 QString toId = QString::fromUtf8(msg.toId);
@@ -355,6 +712,74 @@ void TcpClient::processMessage(const MessageHeader &header, const QByteArray &bo
             }
             break;
         }
+        case MSG_HISTORY_RSP: {
+            HistoryResponse rsp;
+            std::vector<HistoryEntry> entries;
+            if (!ProtocolParser::parseHistoryResponse(
+                    reinterpret_cast<const uint8_t *>(body.data()),
+                    static_cast<size_t>(body.size()), rsp, entries)) {
+                qWarning() << "Failed to parse history response";
+                break;
+            }
+            if (rsp.result != HISTORY_OK) {
+                qWarning() << "History request failed, result" << rsp.result;
+                break;
+            }
+            for (const auto &entry : entries) {
+                const ChatMessage &msg = entry.message;
+                emit historyMessageReceived(entry.seq,
+                                            QString::fromUtf8(msg.fromId),
+                                            QString::fromUtf8(msg.fromNick),
+                                            QString::fromUtf8(msg.message),
+                                            msg.chatType == CHAT_PRIVATE,
+                                            QString::fromUtf8(msg.toId),
+                                            msg.timestamp);
+            }
+            emit historyPageReceived(static_cast<int>(entries.size()), rsp.more != 0);
+            break;
+        }
+        case MSG_CATCHUP_RSP: {
+            CatchUpResponse rsp;
+            if (!ProtocolParser::parseCatchUpResponse(
+                    reinterpret_cast<const uint8_t *>(body.data()),
+                    static_cast<size_t>(body.size()), rsp)) {
+                qWarning() << "Failed to parse catch-up response";
+                break;
+            }
+            bool complete = rsp.complete != 0;
+            qDebug() << "Group catch-up replayed" << rsp.count
+                     << "up to seq" << rsp.newestSeq << (complete ? "" : "(incomplete)");
+            groupRunId_ = rsp.runId;
+            lastGroupSeq_ = rsp.newestSeq;
+            emit groupCatchUpFinished(static_cast<int>(rsp.count), complete);
+            break;
+        }
+        case MSG_SEARCH_RSP: {
+            HistoryResponse rsp;
+            std::vector<HistoryEntry> entries;
+            if (!ProtocolParser::parseHistoryResponse(
+                    reinterpret_cast<const uint8_t *>(body.data()),
+                    static_cast<size_t>(body.size()), rsp, entries)) {
+                qWarning() << "Failed to parse search response";
+                break;
+            }
+            if (rsp.result != HISTORY_OK) {
+                qWarning() << "Search request failed, result" << rsp.result;
+                break;
+            }
+            for (const auto &entry : entries) {
+                const ChatMessage &msg = entry.message;
+                emit searchResultReceived(entry.seq,
+                                          QString::fromUtf8(msg.fromId),
+                                          QString::fromUtf8(msg.fromNick),
+                                          QString::fromUtf8(msg.message),
+                                          msg.chatType == CHAT_PRIVATE,
+                                          QString::fromUtf8(msg.toId),
+                                          msg.timestamp);
+            }
+            emit searchPageReceived(static_cast<int>(entries.size()), rsp.more != 0);
+            break;
+        }
         case MSG_USER_LIST_RSP: {
             std::vector<UserInfo> users;
             if (ProtocolParser::parseUserListResponse(
@@ -373,9 +798,10 @@ void TcpClient::processMessage(const MessageHeader &header, const QByteArray &bo
         }
         case MSG_FILE_OFFER: {
             FileOffer offer;
+            FileOfferExt ext;
             if (ProtocolParser::parseFileOffer(
                     reinterpret_cast<const uint8_t *>(body.data()),
-                    static_cast<size_t>(body.size()), offer)) {
+                    static_cast<size_t>(body.size()), offer, ext)) {
                 QString fileId = QString::fromUtf8(offer.fileId);
                 QString fileName = QString::fromUtf8(offer.fileName);
                 QString fromId = QString::fromUtf8(offer.fromId);
@@ -387,6 +813,11 @@ void TcpClient::processMessage(const MessageHeader &header, const QByteArray &bo
                 pending.fileSize = offer.fileSize;
                 pending.fromId = fromId;
                 pending.fromNick = fromNick;
+                pending.streamCount = qMin(static_cast<int>(ext.streamCount), kMaxParallelStreams);
+                pending.tunnel = (ext.flags & FILE_OFFER_FLAG_TUNNEL) != 0;
+                pending.direct = (ext.flags & FILE_OFFER_FLAG_DIRECT) != 0;
+                pending.attachToken = QByteArray(reinterpret_cast<const char *>(ext.attachToken),
+                                                 sizeof(ext.attachToken));
                 pendingOffers_.insert(fileId, pending);
 
                 emit fileOfferReceived(fileId, fileName, offer.fileSize, fromId, fromNick);
@@ -397,15 +828,29 @@ void TcpClient::processMessage(const MessageHeader &header, const QByteArray &bo
         }
         case MSG_FILE_OFFER_RSP: {
             FileOfferResponse rsp;
+            FileOfferResponseExt ext;
             if (ProtocolParser::parseFileOfferResponse(
                     reinterpret_cast<const uint8_t *>(body.data()),
-                    static_cast<size_t>(body.size()), rsp)) {
+                    static_cast<size_t>(body.size()), rsp, ext)) {
                 QString fileId = QString::fromUtf8(rsp.fileId);
                 QString message = QString::fromUtf8(rsp.message);
                 emit fileOfferResponseReceived(fileId, rsp.result, message);
 
-                if (rsp.result == FILE_OFFER_ACCEPT) {
+                auto sessionIt = sendSessions_.find(fileId);
+                if (rsp.result == FILE_OFFER_ACCEPT && sessionIt != sendSessions_.end()) {
+                    sessionIt->attachToken = QByteArray(
+                        reinterpret_cast<const char *>(ext.attachToken), sizeof(ext.attachToken));
+                }
+                if (rsp.result == FILE_OFFER_ACCEPT && sessionIt != sendSessions_.end()
+                    && sessionIt->direct && ext.directPort != 0) {
+                    openDirectStream(fileId, ext.directAddress, ext.directPort);
+                } else if (rsp.result == FILE_OFFER_ACCEPT) {
                     startFileSend(fileId);
+                } else if (rsp.result == FILE_OFFER_STORED) {
+                    if (sendSessions_.contains(fileId)) {
+                        emit fileTransferCompleted(fileId, false, true, message);
+                        sendSessions_.remove(fileId);
+                    }
                 } else {
                     if (sendSessions_.contains(fileId)) {
                         emit fileTransferCompleted(fileId, false, false, message);
@@ -417,6 +862,31 @@ void TcpClient::processMessage(const MessageHeader &header, const QByteArray &bo
             }
             break;
         }
+        case MSG_FILE_PROOF_REQ: {
+            FileProofRequest req;
+            if (ProtocolParser::parseFileProofRequest(
+                    reinterpret_cast<const uint8_t *>(body.data()),
+                    static_cast<size_t>(body.size()), req)) {
+                QString fileId = QString::fromUtf8(req.fileId);
+                auto sessionIt = sendSessions_.find(fileId);
+                if (sessionIt == sendSessions_.end()) {
+                    break;
+                }
+                // The server holds this content already and wants proof we
+                // do too before it skips the upload.
+                QString filePath = sessionIt->filePath;
+                QByteArray nonce(reinterpret_cast<const char *>(req.nonce), sizeof(req.nonce));
+                quint64 offset = req.offset;
+                quint32 length = req.length;
+                FileHasher *hasher = fileHasher_;
+                QMetaObject::invokeMethod(hasher, [hasher, fileId, filePath, nonce, offset, length]() {
+                    hasher->hashRange(fileId, filePath, nonce, offset, length);
+                }, Qt::QueuedConnection);
+            } else {
+                qWarning() << "Failed to parse file proof request";
+            }
+            break;
+        }
         case MSG_FILE_DATA: {
             FileDataHeader headerData;
             const uint8_t *payload = nullptr;
@@ -464,78 +934,634 @@ void TcpClient::startFileSend(const QString &fileId) {
 
     session.started = true;
     session.bytesSent = 0;
+    session.ranges.clear();
+
+    quint64 fileLength = static_cast<quint64>(session.file->size());
+    int rangeCount = qMax(1, session.streamCount);
+    quint64 rangeSize = fileLength / static_cast<quint64>(rangeCount);
+    for (int i = 0; i < rangeCount; ++i) {
+        SendRange range;
+        range.startOffset = rangeSize * static_cast<quint64>(i);
+        range.nextOffset = range.startOffset;
+        range.endOffset = (i == rangeCount - 1) ? fileLength : range.startOffset + rangeSize;
+        if (rangeCount > 1 || session.tunnel) {
+            range.socket = openDataStream(fileId, FILE_STREAM_SENDER, i, session.tunnel);
+            range.ready = false;
+        } else if (session.directSocket) {
+            range.socket = session.directSocket;
+        }
+        session.ranges.append(range);
+    }
 
-    while (!session.file->atEnd()) {
-        QByteArray chunk = session.file->read(kFileChunkSize);
-        if (chunk.isEmpty() && !session.file->atEnd()) {
-            emit fileTransferCompleted(fileId, false, false, "Read error");
-            session.file->close();
-            sendSessions_.remove(fileId);
-            return;
+    if (!sendRateTimer_.isValid()) {
+        sendRateTimer_.start();
+        sendRateBytes_ = 0;
+    }
+    pumpFileSends();
+}
+
+void TcpClient::pumpFileSends() {
+    if (pumpingFileSends_ || sendSessions_.isEmpty()) {
+        return;
+    }
+    pumpingFileSends_ = true;
+
+    const qint64 queueLimit = qMax(kSendQueueLimit, static_cast<qint64>(sendChunkSize_) * 4);
+    QList<QString> finished;
+    bool progressed = true;
+    while (progressed && isConnected()) {
+        progressed = false;
+        for (auto it = sendSessions_.begin(); it != sendSessions_.end(); ++it) {
+            FileSendSession &session = it.value();
+            if (!session.started || finished.contains(session.fileId)) {
+                continue;
+            }
+
+            bool failed = false;
+            for (SendRange &range : session.ranges) {
+                QTcpSocket *socket = range.socket ? range.socket : socket_;
+                if (!range.ready || range.nextOffset >= range.endOffset
+                    || socket->bytesToWrite() >= queueLimit) {
+                    continue;
+                }
+                if (!sendNextFileChunk(session, range)) {
+                    failed = true;
+                    break;
+                }
+                progressed = true;
+            }
+
+            if (failed) {
+                closeSendFile(session);
+                closeDataStreams(session.fileId);
+                finished.append(session.fileId);
+            } else if (isSendComplete(session)) {
+                closeSendFile(session);
+                closeDataStreams(session.fileId);
+                finished.append(session.fileId);
+                emit fileTransferCompleted(session.fileId, false, true, "Sent");
+            }
+        }
+    }
+
+    for (const QString &fileId : finished) {
+        sendSessions_.remove(fileId);
+    }
+    pumpingFileSends_ = false;
+}
+
+bool TcpClient::sendNextFileChunk(FileSendSession &session, SendRange &range) {
+    if (!session.file || !session.file->isOpen()) {
+        emit fileTransferCompleted(session.fileId, false, false, "File not open");
+        return false;
+    }
+
+    qint64 chunkLen = static_cast<qint64>(
+        qMin(static_cast<quint64>(sendChunkSize_), range.endOffset - range.nextOffset));
+    bool ok = false;
+    if (!session.mapFailed) {
+        ok = sendMappedFileChunk(session, range, chunkLen);
+    }
+    if (!ok && session.mapFailed) {
+        ok = sendBufferedFileChunk(session, range, chunkLen);
+    }
+    if (!ok) {
+        emit fileTransferCompleted(session.fileId, false, false, "Read error");
+        return false;
+    }
+
+    emit fileTransferProgress(session.fileId, session.bytesSent, session.fileSize, false);
+    return true;
+}
+
+bool TcpClient::sendMappedFileChunk(FileSendSession &session, SendRange &range, qint64 chunkLen) {
+    quint64 windowEnd = range.mapOffset + range.mapLength;
+    if (!range.mapBase || range.nextOffset < range.mapOffset
+        || range.nextOffset + static_cast<quint64>(chunkLen) > windowEnd) {
+        if (range.mapBase) {
+            session.file->unmap(range.mapBase);
+            range.mapBase = nullptr;
         }
+        quint64 length = qMin(kMapWindowSize, range.endOffset - range.nextOffset);
+        range.mapBase = session.file->map(static_cast<qint64>(range.nextOffset),
+                                          static_cast<qint64>(length));
+        if (!range.mapBase) {
+            qWarning() << "File map failed, falling back to buffered reads" << session.fileId;
+            session.mapFailed = true;
+            return false;
+        }
+        range.mapOffset = range.nextOffset;
+        range.mapLength = length;
+    }
+
+    QTcpSocket *socket = range.socket ? range.socket : socket_;
+    const uchar *payload = range.mapBase + (range.nextOffset - range.mapOffset);
+    if (!session.tunnel) {
+        auto header = ProtocolParser::packFileDataHeader(
+            ++sequence_,
+            session.fileId.toStdString(),
+            range.nextOffset,
+            static_cast<size_t>(chunkLen));
+        writeSocket(socket, reinterpret_cast<const char *>(header.data()), static_cast<qint64>(header.size()));
+    }
+    writeSocket(socket, reinterpret_cast<const char *>(payload), chunkLen);
+
+    range.nextOffset += static_cast<quint64>(chunkLen);
+    session.bytesSent += static_cast<quint64>(chunkLen);
+    return true;
+}
+
+bool TcpClient::sendBufferedFileChunk(FileSendSession &session, SendRange &range, qint64 chunkLen) {
+    if (session.file->pos() != static_cast<qint64>(range.nextOffset)
+        && !session.file->seek(static_cast<qint64>(range.nextOffset))) {
+        return false;
+    }
+
+    QByteArray chunk = session.file->read(chunkLen);
+    if (chunk.isEmpty()) {
+        return false;
+    }
 
+    QTcpSocket *socket = range.socket ? range.socket : socket_;
+    if (session.tunnel) {
+        writeSocket(socket, chunk.constData(), chunk.size());
+    } else {
         auto packet = ProtocolParser::packFileData(
             ++sequence_,
-            fileId.toStdString(),
-            session.bytesSent,
+            session.fileId.toStdString(),
+            range.nextOffset,
             reinterpret_cast<const uint8_t *>(chunk.data()),
             static_cast<size_t>(chunk.size()));
+        writeSocket(socket, reinterpret_cast<const char *>(packet.data()), static_cast<qint64>(packet.size()));
+    }
+
+    range.nextOffset += static_cast<quint64>(chunk.size());
+    session.bytesSent += static_cast<quint64>(chunk.size());
+    return true;
+}
 
-        sendData(QByteArray(reinterpret_cast<const char *>(packet.data()),
-                            static_cast<int>(packet.size())));
+bool TcpClient::isSendComplete(const FileSendSession &session) const {
+    for (const SendRange &range : session.ranges) {
+        if (range.nextOffset < range.endOffset) {
+            return false;
+        }
+    }
+    return true;
+}
 
-        session.bytesSent += static_cast<quint64>(chunk.size());
-        emit fileTransferProgress(fileId, session.bytesSent, session.fileSize, false);
+void TcpClient::closeSendFile(FileSendSession &session) {
+    if (!session.file) {
+        return;
+    }
+    for (SendRange &range : session.ranges) {
+        if (range.mapBase) {
+            session.file->unmap(range.mapBase);
+            range.mapBase = nullptr;
+        }
+    }
+    if (session.file->isOpen()) {
+        session.file->close();
     }
+}
+
+QTcpSocket *TcpClient::openDataStream(const QString &fileId, uint8_t role, int index, bool tunnel) {
+    auto *stream = new QTcpSocket(this);
 
-    session.file->close();
-    emit fileTransferCompleted(fileId, false, true, "Sent");
-    sendSessions_.remove(fileId);
+    DataStream info;
+    info.fileId = fileId;
+    info.role = role;
+    info.index = static_cast<uint8_t>(index);
+    info.tunnel = tunnel;
+    watchDataStream(stream, info, kStreamAttachTimeoutMs);
+
+    stream->connectToHost(serverHost_, serverPort_);
+    return stream;
 }
 
-void TcpClient::handleFileData(const QString &fileId, quint64 offset, const QByteArray &payload) {
-    if (!recvSessions_.contains(fileId)) {
+void TcpClient::watchDataStream(QTcpSocket *stream, const DataStream &info, int attachTimeoutMs) {
+    dataStreams_.insert(stream, info);
+
+    connect(stream, &QTcpSocket::connected, this, [this, stream]() { onDataStreamConnected(stream); });
+    connect(stream, &QTcpSocket::readyRead, this, [this, stream]() { onDataStreamReadyRead(stream); });
+    connect(stream, &QTcpSocket::bytesWritten, this, &TcpClient::onBytesWritten);
+    connect(stream, &QTcpSocket::disconnected, this, [this, stream]() { onDataStreamClosed(stream); });
+#if QT_VERSION >= QT_VERSION_CHECK(5, 15, 0)
+    connect(stream, &QTcpSocket::errorOccurred, this, [this, stream](QAbstractSocket::SocketError) {
+        onDataStreamClosed(stream);
+    });
+#else
+    connect(stream, QOverload<QAbstractSocket::SocketError>::of(&QTcpSocket::error),
+            this, [this, stream](QAbstractSocket::SocketError) { onDataStreamClosed(stream); });
+#endif
+    QTimer::singleShot(attachTimeoutMs, stream, [this, stream]() {
+        auto it = dataStreams_.constFind(stream);
+        if (it != dataStreams_.constEnd() && !it->attached) {
+            qWarning() << "Data stream attach timed out" << it->fileId;
+            onDataStreamClosed(stream);
+        }
+    });
+}
+
+void TcpClient::openDirectStream(const QString &fileId, quint32 address, quint16 port) {
+    auto *stream = new QTcpSocket(this);
+
+    DataStream info;
+    info.fileId = fileId;
+    info.role = FILE_STREAM_SENDER;
+    info.direct = true;
+    watchDataStream(stream, info, kDirectConnectTimeoutMs);
+
+    qDebug() << "Trying direct connection" << fileId << port;
+    stream->connectToHost(QHostAddress(ntohl(address)), port);
+}
+
+void TcpClient::onDirectConnection(const QString &fileId) {
+    auto it = recvSessions_.find(fileId);
+    if (it == recvSessions_.end() || !it->directServer) {
         return;
     }
 
-    FileReceiveSession &session = recvSessions_[fileId];
-    if (!session.file || !session.file->isOpen()) {
-        emit fileTransferCompleted(fileId, true, false, "File not open");
-        recvSessions_.remove(fileId);
+    while (it->directServer->hasPendingConnections()) {
+        QTcpSocket *stream = it->directServer->nextPendingConnection();
+        stream->setParent(this);
+
+        DataStream info;
+        info.fileId = fileId;
+        info.role = FILE_STREAM_RECEIVER;
+        info.direct = true;
+        watchDataStream(stream, info, kDirectConnectTimeoutMs);
+        onDataStreamReadyRead(stream);
+    }
+}
+
+void TcpClient::onDirectAttach(QTcpSocket *stream, const QByteArray &body) {
+    auto it = dataStreams_.find(stream);
+    if (it == dataStreams_.end()) {
         return;
     }
 
-    if (offset != session.bytesReceived) {
-        if (!session.file->seek(static_cast<qint64>(offset))) {
-            emit fileTransferCompleted(fileId, true, false, "Seek failed");
-            session.file->close();
-            recvSessions_.remove(fileId);
-            return;
+    // The sender identifies itself the same way it would to the server.
+    FileStreamAttach attach;
+    bool ok = ProtocolParser::parseFileStreamAttach(
+        reinterpret_cast<const uint8_t *>(body.data()),
+        static_cast<size_t>(body.size()), attach);
+    auto sessionIt = recvSessions_.find(it->fileId);
+    ok = ok && sessionIt != recvSessions_.end()
+        && attach.role == FILE_STREAM_SENDER
+        && QString::fromUtf8(attach.fileId) == it->fileId
+        && QString::fromUtf8(attach.clientId) == sessionIt->fromId
+        && sessionIt->attachToken.size() == static_cast<int>(sizeof(attach.attachToken))
+        && std::memcmp(attach.attachToken, sessionIt->attachToken.constData(),
+                       sizeof(attach.attachToken)) == 0;
+
+    auto data = ProtocolParser::packFileStreamAttachResponse(
+        ++sequence_,
+        it->fileId.toStdString(),
+        ok ? FILE_STREAM_ATTACH_OK : FILE_STREAM_ATTACH_REJECTED,
+        attach.streamIndex);
+    writeSocket(stream, reinterpret_cast<const char *>(data.data()), static_cast<qint64>(data.size()));
+
+    if (!ok) {
+        qWarning() << "Direct attach rejected" << it->fileId;
+        onDataStreamClosed(stream);
+        return;
+    }
+    it->attached = true;
+    closeDirectServer(sessionIt.value());
+}
+
+void TcpClient::fallBackToRelay(const QString &fileId) {
+    auto it = sendSessions_.find(fileId);
+    if (it == sendSessions_.end() || it->started) {
+        return;
+    }
+    qWarning() << "Direct connection failed, using server relay" << fileId;
+    it->direct = false;
+    it->directSocket = nullptr;
+    startFileSend(fileId);
+}
+
+void TcpClient::closeDirectServer(FileReceiveSession &session) {
+    if (!session.directServer) {
+        return;
+    }
+    session.directServer->close();
+    session.directServer->deleteLater();
+    session.directServer = nullptr;
+}
+
+void TcpClient::onDataStreamConnected(QTcpSocket *stream) {
+    auto it = dataStreams_.constFind(stream);
+    if (it == dataStreams_.constEnd()) {
+        return;
+    }
+
+    QByteArray token;
+    if (it->role == FILE_STREAM_SENDER) {
+        auto sessionIt = sendSessions_.constFind(it->fileId);
+        if (sessionIt != sendSessions_.constEnd()) {
+            token = sessionIt->attachToken;
+        }
+    } else {
+        auto sessionIt = recvSessions_.constFind(it->fileId);
+        if (sessionIt != recvSessions_.constEnd()) {
+            token = sessionIt->attachToken;
+        }
+    }
+    auto data = ProtocolParser::packFileStreamAttach(
+        ++sequence_,
+        it->fileId.toStdString(),
+        clientId_.toStdString(),
+        it->role,
+        it->index,
+        std::string(token.constData(), static_cast<size_t>(token.size())));
+    writeSocket(stream, reinterpret_cast<const char *>(data.data()), static_cast<qint64>(data.size()));
+}
+
+void TcpClient::onDataStreamReadyRead(QTcpSocket *stream) {
+    auto it = dataStreams_.find(stream);
+    if (it == dataStreams_.end()) {
+        stream->readAll();
+        return;
+    }
+
+    it->recvBuffer.append(stream->readAll());
+
+    MessageHeader header;
+    QByteArray body;
+    while (dataStreams_.contains(stream)) {
+        DataStream &info = dataStreams_[stream];
+        if (info.tunnel && info.attached) {
+            // Everything after the attach response is file payload, in order.
+            if (!info.recvBuffer.isEmpty()) {
+                QByteArray payload;
+                payload.swap(info.recvBuffer);
+                quint64 offset = info.rawOffset;
+                info.rawOffset += static_cast<quint64>(payload.size());
+                handleFileData(info.fileId, offset, payload);
+            }
+            break;
+        }
+        if (!takeFrame(info.recvBuffer, header, body)) {
+            break;
+        }
+        if (info.direct && info.role == FILE_STREAM_RECEIVER) {
+            // Anyone can reach the direct listener: before the attach only
+            // an attach is accepted, after it only data for this file.
+            if (!info.attached) {
+                if (header.msgType != MSG_FILE_STREAM_ATTACH) {
+                    qWarning() << "Unexpected frame before direct attach" << header.msgType;
+                    onDataStreamClosed(stream);
+                    break;
+                }
+                onDirectAttach(stream, body);
+                continue;
+            }
+            FileDataHeader dataHeader;
+            const uint8_t *payload = nullptr;
+            size_t payloadLen = 0;
+            if (header.msgType != MSG_FILE_DATA ||
+                !ProtocolParser::parseFileData(
+                    reinterpret_cast<const uint8_t *>(body.data()),
+                    static_cast<size_t>(body.size()), dataHeader, payload, payloadLen) ||
+                QString::fromUtf8(dataHeader.fileId) != info.fileId) {
+                qWarning() << "Unexpected frame on direct stream" << info.fileId
+                           << header.msgType;
+                onDataStreamClosed(stream);
+                break;
+            }
+            handleFileData(info.fileId, dataHeader.offset,
+                           QByteArray(reinterpret_cast<const char *>(payload),
+                                      static_cast<int>(payloadLen)));
+            continue;
+        }
+        if (header.msgType != MSG_FILE_STREAM_ATTACH_RSP) {
+            if (info.direct) {
+                // The peer only ever answers the attach.
+                qWarning() << "Unexpected frame on direct stream" << info.fileId
+                           << header.msgType;
+                onDataStreamClosed(stream);
+                break;
+            }
+            processMessage(header, body);
+            continue;
         }
-        session.bytesReceived = offset;
+
+        FileStreamAttachResponse rsp;
+        bool ok = ProtocolParser::parseFileStreamAttachResponse(
+            reinterpret_cast<const uint8_t *>(body.data()),
+            static_cast<size_t>(body.size()), rsp);
+        onDataStreamAttached(stream, ok && rsp.result == FILE_STREAM_ATTACH_OK);
+    }
+}
+
+void TcpClient::onDataStreamAttached(QTcpSocket *stream, bool success) {
+    auto it = dataStreams_.find(stream);
+    if (it == dataStreams_.end()) {
+        return;
+    }
+    if (!success) {
+        qWarning() << "Data stream attach rejected" << it->fileId << it->index;
+        onDataStreamClosed(stream);
+        return;
+    }
+
+    it->attached = true;
+    if (it->role != FILE_STREAM_SENDER) {
+        return;
+    }
+
+    auto sessionIt = sendSessions_.find(it->fileId);
+    if (sessionIt == sendSessions_.end()) {
+        return;
+    }
+    if (it->direct) {
+        // The receiver is reachable; release the relay session on the server.
+        QString fileId = it->fileId;
+        qDebug() << "Direct connection established" << fileId;
+        sessionIt->directSocket = stream;
+        auto data = ProtocolParser::packFileCancel(++sequence_, fileId.toStdString(), FILE_CANCEL_DIRECT);
+        sendData(QByteArray(reinterpret_cast<const char *>(data.data()),
+                            static_cast<int>(data.size())));
+        startFileSend(fileId);
+        return;
+    }
+    for (SendRange &range : sessionIt->ranges) {
+        if (range.socket == stream) {
+            range.ready = true;
+        }
+    }
+    pumpFileSends();
+}
+
+void TcpClient::onDataStreamClosed(QTcpSocket *stream) {
+    auto it = dataStreams_.find(stream);
+    if (it == dataStreams_.end()) {
+        return;
+    }
+    if (pumpingFileSends_) {
+        QTimer::singleShot(0, this, [this, stream]() { onDataStreamClosed(stream); });
+        return;
+    }
+
+    DataStream info = it.value();
+    dataStreams_.erase(it);
+    stream->abort();
+    stream->deleteLater();
+
+    if (info.role != FILE_STREAM_SENDER) {
+        return;
+    }
+    if (info.direct && !info.attached) {
+        fallBackToRelay(info.fileId);
+        return;
+    }
+
+    auto sessionIt = sendSessions_.find(info.fileId);
+    if (sessionIt == sendSessions_.end()) {
+        return;
     }
 
-    if (!payload.isEmpty()) {
-        qint64 written = session.file->write(payload);
-        if (written < 0) {
-            emit fileTransferCompleted(fileId, true, false, "Write failed");
-            session.file->close();
-            recvSessions_.remove(fileId);
+    FileSendSession &session = sessionIt.value();
+    for (SendRange &range : session.ranges) {
+        if (range.socket != stream) {
+            continue;
+        }
+        range.socket = nullptr;
+        // The relay session is released once a direct stream is up, so
+        // there is nothing to fall back to.
+        if ((info.direct || range.nextOffset != range.startOffset)
+            && range.nextOffset < range.endOffset) {
+            emit fileTransferCompleted(session.fileId, false, false, "Stream lost");
+            closeSendFile(session);
+            closeDataStreams(session.fileId);
+            sendSessions_.erase(sessionIt);
             return;
         }
-        session.bytesReceived += static_cast<quint64>(written);
+        range.ready = true;
+    }
+    pumpFileSends();
+}
+
+void TcpClient::closeDataStreams(const QString &fileId) {
+    for (auto it = dataStreams_.begin(); it != dataStreams_.end();) {
+        if (it->fileId != fileId) {
+            ++it;
+            continue;
+        }
+        QTcpSocket *stream = it.key();
+        it = dataStreams_.erase(it);
+        stream->disconnectFromHost();
+        stream->deleteLater();
     }
+}
 
-    emit fileTransferProgress(fileId, session.bytesReceived, session.fileSize, true);
+void TcpClient::updateSendChunkSize(qint64 bytes) {
+    if (!sendRateTimer_.isValid()) {
+        return;
+    }
 
-    if (session.fileSize > 0 && session.bytesReceived >= session.fileSize) {
-        session.file->flush();
-        session.file->close();
-        emit fileTransferCompleted(fileId, true, true, session.savePath);
-        recvSessions_.remove(fileId);
+    sendRateBytes_ += bytes;
+    qint64 elapsedMs = sendRateTimer_.elapsed();
+    if (elapsedMs < kSendRateWindowMs) {
+        return;
+    }
+
+    qint64 bytesPerSec = sendRateBytes_ * 1000 / elapsedMs;
+    qint64 target = bytesPerSec * kChunkTargetMs / 1000;
+    target = qBound(static_cast<qint64>(kMinFileChunkSize),
+                    target,
+                    static_cast<qint64>(kMaxFileChunkSize));
+    sendChunkSize_ = static_cast<int>(target / kMinFileChunkSize * kMinFileChunkSize);
+
+    sendRateBytes_ = 0;
+    if (sendSessions_.isEmpty()) {
+        sendRateTimer_.invalidate();
+    } else {
+        sendRateTimer_.restart();
     }
 }
 
+void TcpClient::handleFileData(const QString &fileId, quint64 offset, const QByteArray &payload) {
+    auto it = recvSessions_.constFind(fileId);
+    if (it == recvSessions_.constEnd() || !it->opened || payload.isEmpty()) {
+        return;
+    }
+
+    FileWriter *writer = fileWriter_;
+    QMetaObject::invokeMethod(writer, [writer, fileId, offset, payload]() {
+        writer->writeChunk(fileId, offset, payload);
+    }, Qt::QueuedConnection);
+}
+
+void TcpClient::onWriterFileOpened(const QString &fileId, bool success, const QString &message) {
+    auto it = recvSessions_.find(fileId);
+    if (it == recvSessions_.end()) {
+        return;
+    }
+
+    uint32_t result = FILE_OFFER_ACCEPT;
+    QString responseMessage = "Accepted";
+    FileOfferResponseExt ext;
+    std::memset(&ext, 0, sizeof(ext));
+    if (success) {
+        it->opened = true;
+        for (int i = 0; i < it->streamCount; ++i) {
+            openDataStream(fileId, FILE_STREAM_RECEIVER, i);
+        }
+        if (it->tunnel) {
+            openDataStream(fileId, FILE_STREAM_RECEIVER, 0, true);
+        }
+        if (it->direct) {
+            // Listen for the sender; the server fills in the address it
+            // sees us on.
+            auto *server = new QTcpServer(this);
+            if (server->listen(QHostAddress::Any, 0)) {
+                connect(server, &QTcpServer::newConnection, this, [this, fileId]() {
+                    onDirectConnection(fileId);
+                });
+                it->directServer = server;
+                ext.directPort = server->serverPort();
+            } else {
+                qWarning() << "Direct listener failed, using server relay" << fileId;
+                server->deleteLater();
+            }
+        }
+    } else {
+        result = FILE_OFFER_DECLINE;
+        responseMessage = message;
+        recvSessions_.erase(it);
+        emit fileTransferCompleted(fileId, true, false, responseMessage);
+    }
+
+    auto data = ProtocolParser::packFileOfferResponse(
+        ++sequence_,
+        fileId.toStdString(),
+        result,
+        responseMessage.toStdString(),
+        ext);
+
+    sendData(QByteArray(reinterpret_cast<const char *>(data.data()),
+                        static_cast<int>(data.size())));
+}
+
+void TcpClient::onWriterProgress(const QString &fileId, quint64 bytesWritten, quint64 totalBytes) {
+    if (!recvSessions_.contains(fileId)) {
+        return;
+    }
+    emit fileTransferProgress(fileId, bytesWritten, totalBytes, true);
+}
+
+void TcpClient::onWriterFinished(const QString &fileId, bool success, const QString &message) {
+    if (!recvSessions_.contains(fileId)) {
+        return;
+    }
+    closeDirectServer(recvSessions_[fileId]);
+    recvSessions_.remove(fileId);
+    closeDataStreams(fileId);
+    emit fileTransferCompleted(fileId, true, success, message);
+}
+
 QString TcpClient::buildDownloadPath(const QString &fileName) const {
     QString baseDir = QStandardPaths::writableLocation(QStandardPaths::DownloadLocation);
     if (baseDir.isEmpty()) {
@@ -570,15 +1596,20 @@ QString TcpClient::buildDownloadPath(const QString &fileName) const {
 }
 
 void TcpClient::clearFileSessions() {
+    for (auto it = dataStreams_.begin(); it != dataStreams_.end(); ++it) {
+        it.key()->abort();
+        it.key()->deleteLater();
+    }
+    dataStreams_.clear();
     for (auto it = sendSessions_.begin(); it != sendSessions_.end(); ++it) {
-        if (it->file && it->file->isOpen()) {
-            it->file->close();
-        }
+        closeSendFile(it.value());
     }
     for (auto it = recvSessions_.begin(); it != recvSessions_.end(); ++it) {
-        if (it->file && it->file->isOpen()) {
-            it->file->close();
-        }
+        closeDirectServer(it.value());
+    }
+    if (!recvSessions_.isEmpty()) {
+        FileWriter *writer = fileWriter_;
+        QMetaObject::invokeMethod(writer, [writer]() { writer->abortAll(); }, Qt::QueuedConnection);
     }
     sendSessions_.clear();
     recvSessions_.clear();
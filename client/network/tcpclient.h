@@ -3,16 +3,22 @@
 
 #include <QObject>
 #include <QByteArray>
+#include <QElapsedTimer>
 #include <QFile>
 #include <QHash>
 #include <QSharedPointer>
 #include <QString>
+#include <QTcpServer>
 #include <QTcpSocket>
+#include <QThread>
 #include <QTimer>
 #include <QVector>
 
 #include "protocol.h"
 
+class FileHasher;
+class FileWriter;
+
 class TcpClient : public QObject {
     Q_OBJECT
 
@@ -23,9 +29,20 @@ public:
     void connectToServer(const QString &ip, int port);
     void disconnectFromServer();
     void setIdentity(const QString &clientId, const QString &nickname);
+    // Sent with the login that goes out as soon as the socket connects,
+    // and again with every automatic re-login.
+    void setPassword(const QString &password);
+    void setParallelStreams(int count);
+    void setTunnelTransfers(bool enabled);
+    void setDirectTransfers(bool enabled);
+    // Lets the kernel probe an idle connection instead of sending
+    // heartbeats. Only for servers running with tcp_keepalive_sec, which
+    // otherwise drop connections that stay silent.
+    void setTcpKeepAlive(bool enabled);
     QString clientId() const;
     QString nickname() const;
-    void sendLoginRequest(const QString &clientId, const QString &nickname);
+    void sendLoginRequest(const QString &clientId, const QString &nickname,
+                          const QString &password = QString());
     void sendLogoutRequest();
     void sendHeartbeat();
     void sendChatMessage(ChatScope scope, const QString &toId, const QString &message);
@@ -36,7 +53,17 @@ public:
                        const QString &toId);
     void sendFileOfferResponse(const QString &fileId, uint32_t result, const QString &message);
     void requestUserList();
+    // Pages backwards through a conversation; pass the oldest seq already
+    // shown as beforeSeq, or 0 for the newest messages.
+    void requestHistory(ChatScope scope, const QString &peerId, quint64 beforeSeq, int limit);
+    // Matches come newest first; pass the last seq shown as beforeSeq for
+    // the next page.
+    void requestSearch(const QString &query, SearchScope scope, const QString &peerId,
+                       quint64 beforeSeq, int limit);
     bool isConnected() const;
+    // True after the first successful login until disconnectFromServer()
+    // or a login failure that retrying cannot fix.
+    bool isReconnecting() const;
     const QVector<UserInfo> &userList() const;
 
 signals:
@@ -44,6 +71,11 @@ signals:
     void connectError(const QString &error);
     void disconnected();
     void loginResponse(bool success, const QString &message);
+    // The connection or login will be retried after delayMs.
+    void reconnecting(int attempt, int delayMs);
+    // Automatic re-logins report here instead of through loginResponse.
+    void reconnected(bool resumed);
+    void reconnectFailed(const QString &message);
     void chatMessageReceived(const QString &fromId,
                              const QString &fromNick,
                              const QString &message,
@@ -51,6 +83,25 @@ signals:
                              const QString &toId,
                              quint64 timestamp);
     void userListUpdated();
+    void historyMessageReceived(quint64 seq,
+                                const QString &fromId,
+                                const QString &fromNick,
+                                const QString &message,
+                                bool isPrivate,
+                                const QString &toId,
+                                quint64 timestamp);
+    void historyPageReceived(int count, bool more);
+    void searchResultReceived(quint64 seq,
+                              const QString &fromId,
+                              const QString &fromNick,
+                              const QString &message,
+                              bool isPrivate,
+                              const QString &toId,
+                              quint64 timestamp);
+    void searchPageReceived(int count, bool more);
+    // Missed group messages arrive through chatMessageReceived first;
+    // complete is false when some were lost and history should be used.
+    void groupCatchUpFinished(int count, bool complete);
     void fileOfferReceived(const QString &fileId,
                            const QString &fileName,
                            quint64 fileSize,
@@ -72,6 +123,13 @@ private slots:
     void onReadyRead();
     void onError(QAbstractSocket::SocketError error);
     void onHeartbeatTimeout();
+    void onReconnectTimer();
+    void onBytesWritten(qint64 bytes);
+    void onWriterFileOpened(const QString &fileId, bool success, const QString &message);
+    void onWriterProgress(const QString &fileId, quint64 bytesWritten, quint64 totalBytes);
+    void onWriterFinished(const QString &fileId, bool success, const QString &message);
+    void onFileHashed(const QString &fileId, const QByteArray &digest);
+    void onRangeHashed(const QString &fileId, const QByteArray &digest);
 
 private:
     struct PendingOffer {
@@ -80,6 +138,21 @@ private:
         quint64 fileSize = 0;
         QString fromId;
         QString fromNick;
+        int streamCount = 0;
+        bool tunnel = false;
+        bool direct = false;
+        QByteArray attachToken;
+    };
+
+    struct SendRange {
+        QTcpSocket *socket = nullptr;
+        quint64 startOffset = 0;
+        quint64 nextOffset = 0;
+        quint64 endOffset = 0;
+        bool ready = true;
+        uchar *mapBase = nullptr;
+        quint64 mapOffset = 0;
+        quint64 mapLength = 0;
     };
 
     struct FileSendSession {
@@ -90,36 +163,111 @@ private:
         QString toId;
         quint64 bytesSent = 0;
         bool started = false;
+        int streamCount = 0;
+        bool tunnel = false;
+        bool direct = false;
+        QTcpSocket *directSocket = nullptr;
+        QByteArray contentHash;
         QSharedPointer<QFile> file;
+        QVector<SendRange> ranges;
+        bool mapFailed = false;
+        QByteArray attachToken;
     };
 
     struct FileReceiveSession {
         QString fileId;
         QString fileName;
         quint64 fileSize = 0;
-        quint64 bytesReceived = 0;
         QString savePath;
-        QSharedPointer<QFile> file;
+        QString fromId;
+        bool opened = false;
+        int streamCount = 0;
+        bool tunnel = false;
+        bool direct = false;
+        QTcpServer *directServer = nullptr;
+        QByteArray attachToken;
+    };
+
+    struct DataStream {
+        QString fileId;
+        uint8_t role = FILE_STREAM_SENDER;
+        uint8_t index = 0;
+        bool attached = false;
+        // Tunnel streams carry raw payload once attached.
+        bool tunnel = false;
+        quint64 rawOffset = 0;
+        // Direct streams connect the two peers without the server.
+        bool direct = false;
+        QByteArray recvBuffer;
     };
 
     void sendData(const QByteArray &data);
+    void sendOfferPacket(const FileSendSession &session);
+    void writeSocket(QTcpSocket *socket, const char *data, qint64 len);
     void processMessage(const MessageHeader &header, const QByteArray &body);
     void startFileSend(const QString &fileId);
+    void pumpFileSends();
+    bool sendNextFileChunk(FileSendSession &session, SendRange &range);
+    bool sendMappedFileChunk(FileSendSession &session, SendRange &range, qint64 chunkLen);
+    bool sendBufferedFileChunk(FileSendSession &session, SendRange &range, qint64 chunkLen);
+    bool isSendComplete(const FileSendSession &session) const;
+    void closeSendFile(FileSendSession &session);
+    QTcpSocket *openDataStream(const QString &fileId, uint8_t role, int index, bool tunnel = false);
+    void watchDataStream(QTcpSocket *stream, const DataStream &info, int attachTimeoutMs);
+    void openDirectStream(const QString &fileId, quint32 address, quint16 port);
+    void onDirectConnection(const QString &fileId);
+    void onDirectAttach(QTcpSocket *stream, const QByteArray &body);
+    void fallBackToRelay(const QString &fileId);
+    void closeDirectServer(FileReceiveSession &session);
+    void onDataStreamConnected(QTcpSocket *stream);
+    void onDataStreamReadyRead(QTcpSocket *stream);
+    void onDataStreamAttached(QTcpSocket *stream, bool success);
+    void onDataStreamClosed(QTcpSocket *stream);
+    void closeDataStreams(const QString &fileId);
+    void updateSendChunkSize(qint64 bytes);
     void handleFileData(const QString &fileId, quint64 offset, const QByteArray &payload);
     QString buildDownloadPath(const QString &fileName) const;
+    void requestGroupCatchUp();
+    void scheduleReconnect();
+    void scheduleLoginRetry(quint32 retryAfterMs);
+    void stopReconnecting();
+    void enableKeepAlive();
     void clearFileSessions();
 
 private:
     QTcpSocket *socket_;
+    QString serverHost_;
+    quint16 serverPort_;
+    int parallelStreams_;
+    bool tunnelTransfers_;
+    bool directTransfers_;
+    bool tcpKeepAlive_;
     QTimer *heartbeatTimer_;
+    QTimer *reconnectTimer_;
+    QThread *ioThread_;
+    FileWriter *fileWriter_;
+    QThread *hashThread_;
+    FileHasher *fileHasher_;
     QByteArray recvBuffer_;
     uint32_t sequence_;
+    uint32_t groupRunId_;
+    uint32_t lastGroupSeq_;
     QString clientId_;
     QString nickname_;
+    QString password_;
+    QString resumeClientId_;
+    QByteArray resumeToken_;
+    bool autoReconnect_;
+    int reconnectAttempt_;
     QVector<UserInfo> userList_;
     QHash<QString, PendingOffer> pendingOffers_;
     QHash<QString, FileSendSession> sendSessions_;
     QHash<QString, FileReceiveSession> recvSessions_;
+    QHash<QTcpSocket *, DataStream> dataStreams_;
+    int sendChunkSize_;
+    bool pumpingFileSends_;
+    QElapsedTimer sendRateTimer_;
+    qint64 sendRateBytes_;
 };
 
 #endif // TCPCLIENT_H
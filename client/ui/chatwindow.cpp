@@ -47,6 +47,9 @@ ChatWindow::ChatWindow(TcpClient *client, QWidget *parent)
                 this, &ChatWindow::onFileTransferCompleted);
         connect(tcpClient_, &TcpClient::connected, this, &ChatWindow::onConnected);
         connect(tcpClient_, &TcpClient::disconnected, this, &ChatWindow::onDisconnected);
+        connect(tcpClient_, &TcpClient::reconnecting, this, &ChatWindow::onReconnecting);
+        connect(tcpClient_, &TcpClient::reconnected, this, &ChatWindow::onReconnected);
+        connect(tcpClient_, &TcpClient::reconnectFailed, this, &ChatWindow::onReconnectFailed);
     }
 
     ui->plainTextEdit_input->installEventFilter(this);
@@ -113,14 +116,37 @@ void ChatWindow::setStatus(const QString &text, const QColor &color) {
 }
 
 void ChatWindow::onConnected() {
-    setStatus("Connected", QColor(0, 160, 0));
-    if (tcpClient_) {
-        tcpClient_->requestUserList();
+    // The roster is pushed once the login (or session resume) succeeds.
+    if (tcpClient_->isReconnecting()) {
+        setStatus("Connected, logging in...", QColor(0, 128, 255));
+        return;
     }
+    setStatus("Connected", QColor(0, 160, 0));
 }
 
 void ChatWindow::onDisconnected() {
+    if (tcpClient_->isReconnecting()) {
+        return;
+    }
+    setStatus("Disconnected", Qt::red);
+}
+
+void ChatWindow::onReconnecting(int attempt, int delayMs) {
+    setStatus(QString("Reconnecting in %1 s (attempt %2)")
+                  .arg((delayMs + 999) / 1000)
+                  .arg(attempt),
+              QColor(255, 165, 0));
+}
+
+void ChatWindow::onReconnected(bool resumed) {
+    // Conversation, user selection and transfer rows are left as they were.
+    setStatus(resumed ? "Connected (resumed)" : "Connected", QColor(0, 160, 0));
+}
+
+void ChatWindow::onReconnectFailed(const QString &message) {
     setStatus("Disconnected", Qt::red);
+    QMessageBox::warning(this, "Reconnect Failed",
+                         QString("Could not log in again:\n%1").arg(message));
 }
 
 void ChatWindow::onSendClicked() {
@@ -164,7 +190,7 @@ void ChatWindow::onSelectFile() {
     if (!isGroup && toId.isEmpty()) {
         toId = targetText;
     }
-    if (isGroup || toId.isEmpty()) {
+    if (!isGroup && toId.isEmpty()) {
         QMessageBox::warning(this, "Warning", "Please select a user for file transfer.");
         return;
     }
@@ -249,6 +275,9 @@ void ChatWindow::onFileOfferResponseReceived(const QString &fileId,
         case FILE_OFFER_BUSY:
             status = "Busy";
             break;
+        case FILE_OFFER_STORED:
+            status = "Delivered";
+            break;
         default:
             status = "Unknown";
             break;
@@ -330,6 +359,13 @@ void ChatWindow::addTransferRow(const QString &fileId,
                                 bool incoming) {
     if (transferRows_.contains(fileId)) {
         updateTransferStatus(fileId, status);
+        // The server re-offers interrupted downloads after a reconnect.
+        QWidget *actionWidget = ui->table_transfers->cellWidget(transferRows_.value(fileId), 3);
+        if (incoming && actionWidget) {
+            for (QPushButton *button : actionWidget->findChildren<QPushButton *>()) {
+                button->setEnabled(true);
+            }
+        }
         return;
     }
 
@@ -57,6 +57,9 @@ private slots:
                                  const QString &message);
     void onConnected();
     void onDisconnected();
+    void onReconnecting(int attempt, int delayMs);
+    void onReconnected(bool resumed);
+    void onReconnectFailed(const QString &message);
 
 private:
     void setupUI();
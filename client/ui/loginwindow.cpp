@@ -38,6 +38,8 @@ void LoginWindow::setupUI() {
     ui->lineEdit_port->setText("8888");
     ui->lineEdit_clientId->setText(generateClientId());
     ui->lineEdit_nickname->setPlaceholderText("Enter nickname");
+    ui->lineEdit_password->setEchoMode(QLineEdit::Password);
+    ui->lineEdit_password->setPlaceholderText("Only for registered users");
 
     QFont font = ui->label_status->font();
     font.setPointSize(10);
@@ -89,13 +91,13 @@ void LoginWindow::onConnectClicked() {
     saveConfig();
 
     tcpClient_->setIdentity(clientId, nickname);
+    tcpClient_->setPassword(ui->lineEdit_password->text());
     tcpClient_->connectToServer(ip, port);
 }
 
 void LoginWindow::onConnected() {
+    // TcpClient sends the login itself as soon as the socket is up.
     updateStatus("Connected, logging in...", QColor(0, 128, 255));
-
-    tcpClient_->sendLoginRequest(tcpClient_->clientId(), tcpClient_->nickname());
 }
 
 void LoginWindow::onConnectError(const QString &error) {
@@ -108,6 +110,10 @@ void LoginWindow::onConnectError(const QString &error) {
 }
 
 void LoginWindow::onDisconnected() {
+    if (tcpClient_->isReconnecting()) {
+        updateStatus("Reconnecting...", QColor(255, 165, 0));
+        return;
+    }
     updateStatus("Disconnected", Qt::red);
 
     if (isVisible()) {
@@ -162,6 +168,10 @@ void LoginWindow::loadConfig() {
     if (settings_->contains("user/nickname")) {
         ui->lineEdit_nickname->setText(settings_->value("user/nickname").toString());
     }
+    tcpClient_->setParallelStreams(settings_->value("transfer/parallelStreams", 0).toInt());
+    tcpClient_->setTunnelTransfers(settings_->value("transfer/tunnel", false).toBool());
+    tcpClient_->setDirectTransfers(settings_->value("transfer/direct", false).toBool());
+    tcpClient_->setTcpKeepAlive(settings_->value("connection/tcpKeepAlive", false).toBool());
 }
 
 QString LoginWindow::generateClientId() {
@@ -0,0 +1,99 @@
+#include "auth_pool.h"
+
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstring>
+
+namespace {
+
+constexpr int kWorkerNice = 10;
+
+}  // namespace
+
+AuthPool::AuthPool(size_t threads, size_t maxQueued, int notifyFd)
+    : maxQueued_(maxQueued),
+      notifyFd_(notifyFd) {
+    for (size_t i = 0; i < threads; ++i) {
+        workers_.emplace_back(&AuthPool::workerLoop, this);
+    }
+}
+
+AuthPool::~AuthPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    wake_.notify_all();
+    for (auto& worker : workers_) {
+        worker.join();
+    }
+}
+
+bool AuthPool::submit(AuthJob& job) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (jobs_.size() >= maxQueued_) {
+            ++stats_.rejected;
+            return false;
+        }
+        jobs_.push_back(std::move(job));
+        ++stats_.submitted;
+    }
+    wake_.notify_one();
+    return true;
+}
+
+void AuthPool::takeResults(std::vector<AuthResult>& results) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    results.swap(results_);
+    results_.clear();
+}
+
+AuthPoolStats AuthPool::stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    AuthPoolStats stats = stats_;
+    stats.queued = jobs_.size();
+    return stats;
+}
+
+void AuthPool::workerLoop() {
+    // Per-thread on Linux: only this worker is deprioritized.
+    setpriority(PRIO_PROCESS, static_cast<id_t>(syscall(SYS_gettid)), kWorkerNice);
+
+    while (true) {
+        AuthJob job;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            wake_.wait(lock, [this]() { return stopping_ || !jobs_.empty(); });
+            if (stopping_) {
+                return;
+            }
+            job = std::move(jobs_.front());
+            jobs_.pop_front();
+        }
+
+        auto started = std::chrono::steady_clock::now();
+        uint8_t derived[kCredentialHashSize];
+        deriveCredential(job.password, job.salt, sizeof(job.salt), job.iterations, derived);
+        bool accepted = constantTimeEqual(derived, job.credential, sizeof(derived));
+        std::fill(job.password.begin(), job.password.end(), '\0');
+        auto busyUs = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - started).count();
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            results_.push_back(AuthResult{job.id, accepted});
+            ++stats_.completed;
+            if (!accepted) {
+                ++stats_.failed;
+            }
+            stats_.busyUs += static_cast<uint64_t>(busyUs);
+        }
+        uint64_t one = 1;
+        ssize_t written = write(notifyFd_, &one, sizeof(one));
+        (void)written;
+    }
+}
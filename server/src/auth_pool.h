@@ -0,0 +1,69 @@
+#ifndef AUTH_POOL_H
+#define AUTH_POOL_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "credential.h"
+
+struct AuthJob {
+    uint64_t id = 0;
+    std::string password;
+    uint8_t salt[kCredentialSaltSize];
+    uint8_t credential[kCredentialHashSize];
+    uint32_t iterations = 0;
+};
+
+struct AuthResult {
+    uint64_t id;
+    bool accepted;
+};
+
+struct AuthPoolStats {
+    uint64_t queued = 0;
+    uint64_t submitted = 0;
+    uint64_t rejected = 0;
+    uint64_t completed = 0;
+    uint64_t failed = 0;
+    uint64_t busyUs = 0;
+};
+
+// Checks passwords on a few worker threads so the deliberately slow hash
+// never runs on the reactor. At most maxQueued jobs wait; each finished
+// check is queued as a result and signalled by writing to notifyFd, an
+// eventfd the reactor watches. Workers run at a lower priority so that,
+// on a busy machine, a login storm yields the CPU to chat traffic.
+class AuthPool {
+public:
+    AuthPool(size_t threads, size_t maxQueued, int notifyFd);
+    ~AuthPool();
+
+    AuthPool(const AuthPool&) = delete;
+    AuthPool& operator=(const AuthPool&) = delete;
+
+    // Returns false, leaving job untouched, when the queue is full.
+    bool submit(AuthJob& job);
+    void takeResults(std::vector<AuthResult>& results);
+    AuthPoolStats stats() const;
+
+private:
+    void workerLoop();
+
+    size_t maxQueued_;
+    int notifyFd_;
+    std::vector<std::thread> workers_;
+    std::deque<AuthJob> jobs_;
+    std::vector<AuthResult> results_;
+    bool stopping_ = false;
+    AuthPoolStats stats_;
+    mutable std::mutex mutex_;
+    std::condition_variable wake_;
+};
+
+#endif
@@ -13,6 +13,7 @@ bool ClientManager::addClient(int fd, const std::string& ip, int port) {
     info.ip = ip;
     info.port = port;
     info.lastHeartbeat = std::chrono::steady_clock::now();
+    info.connectedAt = info.lastHeartbeat;
     info.isOnline = false;
 
     clients_[fd] = info;
@@ -40,6 +41,9 @@ std::vector<int> ClientManager::checkTimeout(int timeoutSeconds) {
     auto now = std::chrono::steady_clock::now();
 
     for (const auto& pair : clients_) {
+        if (pair.second.isDataChannel) {
+            continue;
+        }
         auto elapsed = std::chrono::duration_cast<std::chrono::seconds>(
             now - pair.second.lastHeartbeat).count();
 
@@ -51,6 +55,27 @@ std::vector<int> ClientManager::checkTimeout(int timeoutSeconds) {
     return timeoutFds;
 }
 
+std::vector<int> ClientManager::checkLoginTimeout(int timeoutSeconds) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    std::vector<int> timeoutFds;
+    auto now = std::chrono::steady_clock::now();
+
+    for (const auto& pair : clients_) {
+        if (pair.second.isOnline || pair.second.isDataChannel) {
+            continue;
+        }
+        auto elapsed = std::chrono::duration_cast<std::chrono::seconds>(
+            now - pair.second.connectedAt).count();
+
+        if (elapsed > timeoutSeconds) {
+            timeoutFds.push_back(pair.first);
+        }
+    }
+
+    return timeoutFds;
+}
+
 ClientInfo* ClientManager::getClient(int fd) {
     std::lock_guard<std::mutex> lock(mutex_);
 
@@ -86,6 +111,29 @@ bool ClientManager::setClientIdentity(int fd, const std::string& clientId,
     return true;
 }
 
+void ClientManager::clearClientIdentity(int fd) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    auto it = clients_.find(fd);
+    if (it == clients_.end()) {
+        return;
+    }
+    it->second.clientId.clear();
+    it->second.nickname.clear();
+    it->second.isOnline = false;
+}
+
+bool ClientManager::markDataChannel(int fd) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    auto it = clients_.find(fd);
+    if (it == clients_.end() || it->second.isOnline) {
+        return false;
+    }
+    it->second.isDataChannel = true;
+    return true;
+}
+
 bool ClientManager::isClientIdOnline(const std::string& clientId, int excludeFd) const {
     if (clientId.empty()) {
         return false;
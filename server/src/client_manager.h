@@ -14,9 +14,11 @@ struct ClientInfo {
     std::string ip;
     int port;
     std::chrono::steady_clock::time_point lastHeartbeat;
+    std::chrono::steady_clock::time_point connectedAt;
     bool isOnline;
+    bool isDataChannel;
 
-    ClientInfo() : fd(-1), port(0), isOnline(false) {}
+    ClientInfo() : fd(-1), port(0), isOnline(false), isDataChannel(false) {}
 };
 
 class ClientManager {
@@ -28,9 +30,14 @@ public:
     void removeClient(int fd);
     void updateHeartbeat(int fd);
     std::vector<int> checkTimeout(int timeoutSeconds);
+    // Connections that have neither logged in nor become data channels.
+    std::vector<int> checkLoginTimeout(int timeoutSeconds);
     ClientInfo* getClient(int fd);
     bool getClientInfo(int fd, ClientInfo& out) const;
     bool setClientIdentity(int fd, const std::string& clientId, const std::string& nickname);
+    // Takes the identity off a connection that is about to be closed.
+    void clearClientIdentity(int fd);
+    bool markDataChannel(int fd);
     bool isClientIdOnline(const std::string& clientId, int excludeFd) const;
     bool isNicknameOnline(const std::string& nickname, int excludeFd) const;
     int getFdByClientId(const std::string& clientId) const;
@@ -0,0 +1,229 @@
+#include "content_filter.h"
+
+#include <algorithm>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <sys/stat.h>
+
+#include "utf8.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+constexpr size_t kMaxTermLength = 255;
+// With more distinct first bytes than this, comparing against each of
+// them costs more than just stepping the DFA.
+constexpr size_t kMaxPrefilterBytes = 8;
+
+uint8_t foldAscii(uint8_t c) {
+    return (c >= 'A' && c <= 'Z') ? static_cast<uint8_t>(c + ('a' - 'A')) : c;
+}
+
+std::string trim(const std::string& s) {
+    size_t begin = s.find_first_not_of(" \t\r");
+    if (begin == std::string::npos) {
+        return {};
+    }
+    size_t end = s.find_last_not_of(" \t\r");
+    return s.substr(begin, end - begin + 1);
+}
+
+bool modificationTime(const std::string& path, int64_t& mtimeNs) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        return false;
+    }
+    mtimeNs = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+    return true;
+}
+
+}  // namespace
+
+ContentFilter::ContentFilter(const std::string& path)
+    : path_(path), mtimeNs_(0) {}
+
+bool ContentFilter::load() {
+    int64_t mtimeNs = 0;
+    std::ifstream in(path_);
+    if (!in || !modificationTime(path_, mtimeNs)) {
+        std::cerr << "[filter] cannot open " << path_ << std::endl;
+        return false;
+    }
+
+    std::vector<std::string> terms;
+    size_t skipped = 0;
+    std::string line;
+    while (std::getline(in, line)) {
+        size_t comment = line.find('#');
+        if (comment != std::string::npos) {
+            line.erase(comment);
+        }
+        line = trim(line);
+        if (line.empty()) {
+            continue;
+        }
+        if (line.size() > kMaxTermLength || utf8ValidPrefix(line.data(), line.size()) != line.size()) {
+            ++skipped;
+            continue;
+        }
+        for (auto& c : line) {
+            c = static_cast<char>(foldAscii(static_cast<uint8_t>(c)));
+        }
+        terms.push_back(line);
+    }
+    std::sort(terms.begin(), terms.end());
+    terms.erase(std::unique(terms.begin(), terms.end()), terms.end());
+
+    automaton_ = compile(terms);
+    mtimeNs_ = mtimeNs;
+    termCount_ = terms.size();
+    std::cout << "[filter] loaded path=" << path_
+              << " terms=" << terms.size()
+              << " states=" << automaton_->matchLength.size()
+              << " skipped=" << skipped << std::endl;
+    return true;
+}
+
+void ContentFilter::reloadIfChanged() {
+    int64_t mtimeNs = 0;
+    if (!modificationTime(path_, mtimeNs) || mtimeNs == mtimeNs_) {
+        return;
+    }
+    // A failed reload keeps the previous list in force.
+    load();
+}
+
+std::shared_ptr<const ContentFilter::Automaton> ContentFilter::compile(
+    const std::vector<std::string>& terms) {
+    auto automaton = std::make_shared<Automaton>();
+    Automaton& a = *automaton;
+
+    // Bytes that never occur in a term share class 0.
+    for (const auto& term : terms) {
+        for (char ch : term) {
+            uint8_t c = static_cast<uint8_t>(ch);
+            if (a.byteClass[c] == 0) {
+                a.byteClass[c] = static_cast<uint8_t>(a.classCount++);
+            }
+        }
+    }
+    for (int c = 'A'; c <= 'Z'; ++c) {
+        a.byteClass[c] = a.byteClass[foldAscii(static_cast<uint8_t>(c))];
+    }
+
+    // Trie; a zero transition means "no edge" until the DFA is completed.
+    const size_t classes = a.classCount;
+    a.next.assign(classes, 0);
+    a.matchLength.assign(1, 0);
+    for (const auto& term : terms) {
+        uint32_t state = 0;
+        for (char ch : term) {
+            uint32_t& edge = a.next[state * classes + a.byteClass[static_cast<uint8_t>(ch)]];
+            if (edge == 0) {
+                edge = static_cast<uint32_t>(a.matchLength.size());
+                a.next.resize(a.next.size() + classes, 0);
+                a.matchLength.push_back(0);
+            }
+            state = a.next[state * classes + a.byteClass[static_cast<uint8_t>(ch)]];
+        }
+        a.matchLength[state] = static_cast<uint16_t>(term.size());
+    }
+
+    // Breadth-first: resolve failure links into direct transitions and
+    // inherit the longest match from each state's failure state.
+    std::vector<uint32_t> fail(a.matchLength.size(), 0);
+    std::deque<uint32_t> queue;
+    for (size_t c = 0; c < classes; ++c) {
+        if (a.next[c] != 0) {
+            queue.push_back(a.next[c]);
+        }
+    }
+    while (!queue.empty()) {
+        uint32_t state = queue.front();
+        queue.pop_front();
+        a.matchLength[state] = std::max(a.matchLength[state], a.matchLength[fail[state]]);
+        for (size_t c = 0; c < classes; ++c) {
+            uint32_t& edge = a.next[state * classes + c];
+            uint32_t fallback = a.next[fail[state] * classes + c];
+            if (edge != 0) {
+                fail[edge] = fallback;
+                queue.push_back(edge);
+            } else {
+                edge = fallback;
+            }
+        }
+    }
+
+    for (int c = 0; c < 256; ++c) {
+        if (a.next[a.byteClass[c]] != 0) {
+            a.firstBytes.push_back(static_cast<uint8_t>(c));
+        }
+    }
+    if (a.firstBytes.size() > kMaxPrefilterBytes) {
+        a.firstBytes.clear();
+    }
+    return automaton;
+}
+
+size_t ContentFilter::skipToCandidate(const Automaton& a, const uint8_t* data,
+                                      size_t pos, size_t len) {
+#if defined(__SSE2__)
+    if (!a.firstBytes.empty()) {
+        __m128i needles[kMaxPrefilterBytes];
+        size_t count = a.firstBytes.size();
+        for (size_t i = 0; i < count; ++i) {
+            needles[i] = _mm_set1_epi8(static_cast<char>(a.firstBytes[i]));
+        }
+        while (len - pos >= 16) {
+            __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + pos));
+            __m128i hits = _mm_cmpeq_epi8(block, needles[0]);
+            for (size_t i = 1; i < count; ++i) {
+                hits = _mm_or_si128(hits, _mm_cmpeq_epi8(block, needles[i]));
+            }
+            int mask = _mm_movemask_epi8(hits);
+            if (mask != 0) {
+                return pos + static_cast<size_t>(__builtin_ctz(static_cast<unsigned>(mask)));
+            }
+            pos += 16;
+        }
+    }
+#endif
+    while (pos < len && a.next[a.byteClass[data[pos]]] == 0) {
+        ++pos;
+    }
+    return pos;
+}
+
+size_t ContentFilter::apply(std::string& text) {
+    std::shared_ptr<const Automaton> automaton = automaton_;
+    if (!automaton || text.empty()) {
+        return 0;
+    }
+    const Automaton& a = *automaton;
+    uint8_t* data = reinterpret_cast<uint8_t*>(&text[0]);
+    size_t len = text.size();
+    size_t found = 0;
+    uint32_t state = 0;
+    for (size_t i = 0; i < len; ++i) {
+        if (state == 0) {
+            i = skipToCandidate(a, data, i, len);
+            if (i == len) {
+                break;
+            }
+        }
+        state = a.next[state * a.classCount + a.byteClass[data[i]]];
+        uint16_t match = a.matchLength[state];
+        if (match != 0) {
+            // Already consumed, so masking does not disturb the scan.
+            std::fill(data + i + 1 - match, data + i + 1, static_cast<uint8_t>('*'));
+            ++found;
+        }
+    }
+    bytesScanned_ += len;
+    matches_ += found;
+    return found;
+}
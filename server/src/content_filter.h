@@ -0,0 +1,61 @@
+#ifndef CONTENT_FILTER_H
+#define CONTENT_FILTER_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Masks banned terms in chat text. The word list (one term per line, '#'
+// starts a comment, ASCII letters match case-insensitively) is compiled
+// into an Aho-Corasick DFA over byte classes, so a message is scanned in
+// one pass regardless of how many terms there are.
+class ContentFilter {
+public:
+    explicit ContentFilter(const std::string& path);
+
+    bool load();
+    // Recompiles the list if the file changed since the last load.
+    void reloadIfChanged();
+    // Overwrites every matched term with '*' and returns the match count.
+    size_t apply(std::string& text);
+
+    size_t termCount() const {
+        return termCount_.load();
+    }
+
+    uint64_t bytesScanned() const {
+        return bytesScanned_.load();
+    }
+
+    uint64_t matches() const {
+        return matches_.load();
+    }
+
+private:
+    struct Automaton {
+        size_t classCount = 1;
+        uint8_t byteClass[256] = {0};
+        // classCount transitions per state; state 0 is the root.
+        std::vector<uint32_t> next;
+        // Length of the longest term ending in each state, 0 if none.
+        std::vector<uint16_t> matchLength;
+        // Bytes that leave the root; scanned for with SIMD while idle.
+        std::vector<uint8_t> firstBytes;
+    };
+
+    static std::shared_ptr<const Automaton> compile(const std::vector<std::string>& terms);
+    static size_t skipToCandidate(const Automaton& automaton, const uint8_t* data,
+                                  size_t pos, size_t len);
+
+    std::string path_;
+    int64_t mtimeNs_;
+    std::shared_ptr<const Automaton> automaton_;
+    std::atomic<size_t> termCount_{0};
+    std::atomic<uint64_t> bytesScanned_{0};
+    std::atomic<uint64_t> matches_{0};
+};
+
+#endif
@@ -0,0 +1,251 @@
+#include "content_store.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+namespace {
+
+bool isObjectName(const char* name) {
+    size_t len = std::strlen(name);
+    if (len != Sha256::kDigestSize * 2) {
+        return false;
+    }
+    for (size_t i = 0; i < len; ++i) {
+        char c = name[i];
+        if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f'))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+}  // namespace
+
+ContentObject::~ContentObject() {
+    if (fd_ >= 0) {
+        close(fd_);
+    }
+}
+
+bool ContentObject::rangeDigest(const uint8_t* prefix, size_t prefixLen, uint64_t offset,
+                                uint32_t length, uint8_t digest[Sha256::kDigestSize]) const {
+    if (offset > size_ || length > size_ - offset) {
+        return false;
+    }
+
+    Sha256 hash;
+    hash.update(prefix, prefixLen);
+    uint8_t buffer[16 * 1024];
+    while (length > 0) {
+        size_t want = std::min<size_t>(length, sizeof(buffer));
+        ssize_t n = pread(fd_, buffer, want, static_cast<off_t>(offset));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        hash.update(buffer, static_cast<size_t>(n));
+        offset += static_cast<uint64_t>(n);
+        length -= static_cast<uint32_t>(n);
+    }
+    hash.finish(digest);
+    return true;
+}
+
+ContentWriter::ContentWriter(const std::string& key, int fd, const std::string& tmpPath)
+    : key_(key), fd_(fd), tmpPath_(tmpPath), size_(0) {}
+
+ContentWriter::~ContentWriter() {
+    if (fd_ >= 0) {
+        close(fd_);
+    }
+    if (!tmpPath_.empty()) {
+        unlink(tmpPath_.c_str());
+    }
+}
+
+bool ContentWriter::append(uint64_t offset, const uint8_t* data, size_t len) {
+    // Only in-order uploads can be hashed incrementally.
+    if (fd_ < 0 || offset != size_) {
+        return false;
+    }
+
+    size_t written = 0;
+    while (written < len) {
+        ssize_t n = pwrite(fd_, data + written, len - written,
+                           static_cast<off_t>(size_ + written));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        written += static_cast<size_t>(n);
+    }
+
+    hash_.update(data, len);
+    size_ += len;
+    return true;
+}
+
+ContentStore::ContentStore(const std::string& dir, uint64_t maxBytes)
+    : dir_(dir), maxBytes_(maxBytes) {}
+
+bool ContentStore::init() {
+    if (mkdir(dir_.c_str(), 0700) < 0 && errno != EEXIST) {
+        std::cerr << "[store] cannot create " << dir_ << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+
+    DIR* dir = opendir(dir_.c_str());
+    if (!dir) {
+        std::cerr << "[store] cannot open " << dir_ << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+
+    struct Found {
+        std::string key;
+        uint64_t size;
+        time_t atime;
+    };
+    std::vector<Found> found;
+    while (dirent* entry = readdir(dir)) {
+        std::string path = dir_ + "/" + entry->d_name;
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        if (!isObjectName(entry->d_name)) {
+            // Leftover partial upload from an earlier run.
+            unlink(path.c_str());
+            continue;
+        }
+        struct stat st;
+        if (stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+            found.push_back(Found{entry->d_name, static_cast<uint64_t>(st.st_size), st.st_atime});
+        }
+    }
+    closedir(dir);
+
+    std::sort(found.begin(), found.end(), [](const Found& a, const Found& b) {
+        return a.atime > b.atime;
+    });
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto& object : found) {
+        lru_.push_back(object.key);
+        entries_[object.key] = Entry{object.size, std::prev(lru_.end())};
+        stats_.bytes += object.size;
+    }
+    stats_.objects = entries_.size();
+    evictLocked();
+
+    std::cout << "[store] dir=" << dir_ << " objects=" << stats_.objects
+              << " bytes=" << stats_.bytes << std::endl;
+    return true;
+}
+
+std::shared_ptr<const ContentObject> ContentStore::lookup(const std::string& key, uint64_t size) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++stats_.lookups;
+
+    auto it = entries_.find(key);
+    if (it == entries_.end() || it->second.size != size) {
+        return nullptr;
+    }
+
+    int fd = open(pathFor(key).c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        lru_.erase(it->second.lru);
+        stats_.bytes -= it->second.size;
+        entries_.erase(it);
+        stats_.objects = entries_.size();
+        return nullptr;
+    }
+
+    lru_.splice(lru_.begin(), lru_, it->second.lru);
+    return std::make_shared<ContentObject>(fd, size);
+}
+
+std::unique_ptr<ContentWriter> ContentStore::beginWrite(const std::string& key) {
+    std::string pattern = dir_ + "/.upload_XXXXXX";
+    std::vector<char> name(pattern.begin(), pattern.end());
+    name.push_back('\0');
+
+    int fd = mkstemp(name.data());
+    if (fd < 0) {
+        std::cerr << "[store] cannot create upload file: " << std::strerror(errno) << std::endl;
+        return nullptr;
+    }
+    return std::unique_ptr<ContentWriter>(new ContentWriter(key, fd, name.data()));
+}
+
+bool ContentStore::commit(ContentWriter& writer) {
+    uint8_t digest[Sha256::kDigestSize];
+    writer.hash_.finish(digest);
+    if (Sha256::toHex(digest) != writer.key_) {
+        std::cerr << "[store] hash mismatch key=" << writer.key_ << std::endl;
+        return false;
+    }
+    if (writer.size_ > maxBytes_) {
+        return false;
+    }
+
+    std::string path = pathFor(writer.key_);
+    if (rename(writer.tmpPath_.c_str(), path.c_str()) < 0) {
+        std::cerr << "[store] rename failed: " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    writer.tmpPath_.clear();
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(writer.key_);
+    if (it != entries_.end()) {
+        stats_.bytes -= it->second.size;
+        lru_.erase(it->second.lru);
+        entries_.erase(it);
+    }
+    lru_.push_front(writer.key_);
+    entries_[writer.key_] = Entry{writer.size_, lru_.begin()};
+    stats_.bytes += writer.size_;
+    stats_.objects = entries_.size();
+    ++stats_.inserts;
+    evictLocked();
+    return true;
+}
+
+void ContentStore::recordHit(uint64_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++stats_.hits;
+    stats_.bytesSaved += bytes;
+}
+
+ContentStoreStats ContentStore::stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
+}
+
+std::string ContentStore::pathFor(const std::string& key) const {
+    return dir_ + "/" + key;
+}
+
+void ContentStore::evictLocked() {
+    while (stats_.bytes > maxBytes_ && !lru_.empty()) {
+        const std::string& key = lru_.back();
+        auto it = entries_.find(key);
+        unlink(pathFor(key).c_str());
+        stats_.bytes -= it->second.size;
+        entries_.erase(it);
+        lru_.pop_back();
+        ++stats_.evictions;
+    }
+    stats_.objects = entries_.size();
+}
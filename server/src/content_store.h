@@ -0,0 +1,110 @@
+#ifndef CONTENT_STORE_H
+#define CONTENT_STORE_H
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "sha256.h"
+
+// Read-only handle on a stored object; the fd stays valid even if the
+// object is evicted while it is being served.
+class ContentObject {
+public:
+    ContentObject(int fd, uint64_t size) : fd_(fd), size_(size) {}
+    ~ContentObject();
+
+    ContentObject(const ContentObject&) = delete;
+    ContentObject& operator=(const ContentObject&) = delete;
+
+    int fd() const {
+        return fd_;
+    }
+
+    uint64_t size() const {
+        return size_;
+    }
+
+    // SHA-256 of prefix followed by length bytes from offset, as a sender
+    // answers a FileProofRequest.
+    bool rangeDigest(const uint8_t* prefix, size_t prefixLen, uint64_t offset,
+                     uint32_t length, uint8_t digest[Sha256::kDigestSize]) const;
+
+private:
+    int fd_;
+    uint64_t size_;
+};
+
+// Receives one upload in order and hashes it on the way in. The object is
+// only published if the digest matches the key the sender announced.
+class ContentWriter {
+public:
+    ContentWriter(const std::string& key, int fd, const std::string& tmpPath);
+    ~ContentWriter();
+
+    ContentWriter(const ContentWriter&) = delete;
+    ContentWriter& operator=(const ContentWriter&) = delete;
+
+    bool append(uint64_t offset, const uint8_t* data, size_t len);
+
+    const std::string& key() const {
+        return key_;
+    }
+
+    uint64_t size() const {
+        return size_;
+    }
+
+private:
+    friend class ContentStore;
+
+    std::string key_;
+    int fd_;
+    std::string tmpPath_;
+    uint64_t size_;
+    Sha256 hash_;
+};
+
+struct ContentStoreStats {
+    uint64_t objects = 0;
+    uint64_t bytes = 0;
+    uint64_t lookups = 0;
+    uint64_t hits = 0;
+    uint64_t bytesSaved = 0;
+    uint64_t inserts = 0;
+    uint64_t evictions = 0;
+};
+
+class ContentStore {
+public:
+    ContentStore(const std::string& dir, uint64_t maxBytes);
+
+    bool init();
+    std::shared_ptr<const ContentObject> lookup(const std::string& key, uint64_t size);
+    std::unique_ptr<ContentWriter> beginWrite(const std::string& key);
+    bool commit(ContentWriter& writer);
+    // Counts an upload skipped because a receiver was served from the store.
+    void recordHit(uint64_t bytes);
+    ContentStoreStats stats() const;
+
+private:
+    struct Entry {
+        uint64_t size;
+        std::list<std::string>::iterator lru;
+    };
+
+    std::string pathFor(const std::string& key) const;
+    void evictLocked();
+
+    std::string dir_;
+    uint64_t maxBytes_;
+    std::unordered_map<std::string, Entry> entries_;
+    std::list<std::string> lru_;
+    ContentStoreStats stats_;
+    mutable std::mutex mutex_;
+};
+
+#endif
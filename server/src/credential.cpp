@@ -0,0 +1,93 @@
+#include "credential.h"
+
+#include <sys/random.h>
+
+#include <cerrno>
+#include <cstring>
+
+#include "sha256.h"
+
+namespace {
+
+// Hash states after absorbing the padded key, so each HMAC costs two
+// compressions of the message instead of four.
+struct HmacKey {
+    Sha256 inner;
+    Sha256 outer;
+};
+
+void prepareKey(const std::string& password, HmacKey& key) {
+    uint8_t block[64];
+    std::memset(block, 0, sizeof(block));
+    if (password.size() > sizeof(block)) {
+        Sha256 hash;
+        hash.update(reinterpret_cast<const uint8_t*>(password.data()), password.size());
+        hash.finish(block);
+    } else {
+        std::memcpy(block, password.data(), password.size());
+    }
+
+    uint8_t pad[64];
+    for (size_t i = 0; i < sizeof(pad); ++i) {
+        pad[i] = block[i] ^ 0x36;
+    }
+    key.inner.update(pad, sizeof(pad));
+    for (size_t i = 0; i < sizeof(pad); ++i) {
+        pad[i] = block[i] ^ 0x5c;
+    }
+    key.outer.update(pad, sizeof(pad));
+}
+
+void hmac(const HmacKey& key, const uint8_t* data, size_t len, uint8_t out[Sha256::kDigestSize]) {
+    Sha256 inner = key.inner;
+    inner.update(data, len);
+    uint8_t digest[Sha256::kDigestSize];
+    inner.finish(digest);
+
+    Sha256 outer = key.outer;
+    outer.update(digest, sizeof(digest));
+    outer.finish(out);
+}
+
+}  // namespace
+
+void deriveCredential(const std::string& password, const uint8_t* salt, size_t saltLen,
+                      uint32_t iterations, uint8_t out[kCredentialHashSize]) {
+    HmacKey key;
+    prepareKey(password, key);
+
+    std::string saltBlock(reinterpret_cast<const char*>(salt), saltLen);
+    saltBlock.append("\0\0\0\1", 4);
+    uint8_t u[Sha256::kDigestSize];
+    hmac(key, reinterpret_cast<const uint8_t*>(saltBlock.data()), saltBlock.size(), u);
+    std::memcpy(out, u, kCredentialHashSize);
+    for (uint32_t i = 1; i < iterations; ++i) {
+        hmac(key, u, sizeof(u), u);
+        for (size_t j = 0; j < kCredentialHashSize; ++j) {
+            out[j] ^= u[j];
+        }
+    }
+}
+
+bool randomBytes(uint8_t* out, size_t len) {
+    while (len > 0) {
+        ssize_t n = getrandom(out, len, 0);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        out += n;
+        len -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+bool constantTimeEqual(const uint8_t* a, const uint8_t* b, size_t len) {
+    uint8_t diff = 0;
+    for (size_t i = 0; i < len; ++i) {
+        diff |= a[i] ^ b[i];
+    }
+    return diff == 0;
+}
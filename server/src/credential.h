@@ -0,0 +1,21 @@
+#ifndef CREDENTIAL_H
+#define CREDENTIAL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+constexpr size_t kCredentialSaltSize = 16;
+constexpr size_t kCredentialHashSize = 32;
+
+// PBKDF2-HMAC-SHA256 with a single output block: the form in which user
+// passwords are stored. Deliberately slow; cost grows with iterations.
+void deriveCredential(const std::string& password, const uint8_t* salt, size_t saltLen,
+                      uint32_t iterations, uint8_t out[kCredentialHashSize]);
+
+bool randomBytes(uint8_t* out, size_t len);
+
+// Compares without an early exit, so timing does not reveal the prefix.
+bool constantTimeEqual(const uint8_t* a, const uint8_t* b, size_t len);
+
+#endif
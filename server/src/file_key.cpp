@@ -0,0 +1,48 @@
+#include "file_key.h"
+
+namespace {
+
+constexpr size_t kUuidTextLength = 36;
+
+int hexValue(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+}  // namespace
+
+bool parseFileKey(const char* text, size_t len, FileKey& key) {
+    if (!text || len < kUuidTextLength || (len > kUuidTextLength && text[kUuidTextLength] != '\0')) {
+        return false;
+    }
+
+    uint64_t words[2] = {0, 0};
+    size_t digits = 0;
+    for (size_t i = 0; i < kUuidTextLength; ++i) {
+        if (i == 8 || i == 13 || i == 18 || i == 23) {
+            if (text[i] != '-') {
+                return false;
+            }
+            continue;
+        }
+        int value = hexValue(text[i]);
+        if (value < 0) {
+            return false;
+        }
+        uint64_t& word = words[digits / 16];
+        word = (word << 4) | static_cast<uint64_t>(value);
+        ++digits;
+    }
+
+    key.hi = words[0];
+    key.lo = words[1];
+    return true;
+}
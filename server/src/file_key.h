@@ -0,0 +1,33 @@
+#ifndef FILE_KEY_H
+#define FILE_KEY_H
+
+#include <cstddef>
+#include <cstdint>
+
+// Binary form of the textual UUID that identifies a file transfer, used
+// to key the session table without allocating a string per lookup.
+struct FileKey {
+    uint64_t hi = 0;
+    uint64_t lo = 0;
+
+    bool operator==(const FileKey& other) const {
+        return hi == other.hi && lo == other.lo;
+    }
+
+    bool operator!=(const FileKey& other) const {
+        return !(*this == other);
+    }
+};
+
+struct FileKeyHash {
+    size_t operator()(const FileKey& key) const {
+        return static_cast<size_t>(key.hi ^ (key.lo * 0x9E3779B97F4A7C15ULL));
+    }
+};
+
+// Parses the canonical 36-character 8-4-4-4-12 form. A NUL-terminated
+// field may be passed whole; only the first 36 bytes and the terminator
+// are examined.
+bool parseFileKey(const char* text, size_t len, FileKey& key);
+
+#endif
@@ -0,0 +1,97 @@
+#include "file_spool.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+FileSpool::FileSpool()
+    : fd_(-1), size_(0) {}
+
+FileSpool::~FileSpool() {
+    if (fd_ >= 0) {
+        close(fd_);
+        unlink(path_.c_str());
+    }
+}
+
+bool FileSpool::create(const std::string& dir) {
+    std::string pattern = dir + "/" + kSpoolFilePrefix + "XXXXXX";
+    std::vector<char> name(pattern.begin(), pattern.end());
+    name.push_back('\0');
+
+    fd_ = mkstemp(name.data());
+    if (fd_ < 0) {
+        std::cerr << "[spool] create failed dir=" << dir
+                  << " error=" << std::strerror(errno) << std::endl;
+        return false;
+    }
+    path_ = name.data();
+    return true;
+}
+
+bool FileSpool::append(const uint8_t* data, size_t len, bool frameEnd) {
+    if (fd_ < 0) {
+        return false;
+    }
+
+    size_t written = 0;
+    while (written < len) {
+        ssize_t n = pwrite(fd_, data + written, len - written,
+                           static_cast<off_t>(size_ + written));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::cerr << "[spool] write failed path=" << path_
+                      << " error=" << std::strerror(errno) << std::endl;
+            return false;
+        }
+        written += static_cast<size_t>(n);
+    }
+
+    size_ += len;
+    if (frameEnd) {
+        frameEnds_.push_back(size_);
+    }
+    return true;
+}
+
+void FileSpool::discardPartial() {
+    size_ = committedSize();
+}
+
+size_t FileSpool::frameSpan(uint64_t offset, size_t maxBytes) const {
+    auto it = std::upper_bound(frameEnds_.begin(), frameEnds_.end(), offset);
+    if (it == frameEnds_.end()) {
+        return 0;
+    }
+
+    // Always hand out at least one whole frame, even if it exceeds maxBytes.
+    uint64_t end = *it;
+    for (++it; it != frameEnds_.end() && *it - offset <= maxBytes; ++it) {
+        end = *it;
+    }
+    return static_cast<size_t>(end - offset);
+}
+
+ssize_t FileSpool::readAt(uint64_t offset, uint8_t* buf, size_t len) const {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pread(fd_, buf + done, len - done, static_cast<off_t>(offset + done));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        done += static_cast<size_t>(n);
+    }
+    return static_cast<ssize_t>(done);
+}
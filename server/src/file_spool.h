@@ -0,0 +1,52 @@
+#ifndef FILE_SPOOL_H
+#define FILE_SPOOL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
+constexpr const char* kSpoolFilePrefix = "im_spool_";
+
+// Append-only spool of relayed file frames. A frame may be appended in
+// several pieces; only completed frames are visible to frameSpan(), so
+// readers always resume on a frame boundary.
+class FileSpool {
+public:
+    FileSpool();
+    ~FileSpool();
+
+    FileSpool(const FileSpool&) = delete;
+    FileSpool& operator=(const FileSpool&) = delete;
+
+    bool create(const std::string& dir);
+    bool append(const uint8_t* data, size_t len, bool frameEnd = true);
+    void discardPartial();
+    size_t frameSpan(uint64_t offset, size_t maxBytes) const;
+    ssize_t readAt(uint64_t offset, uint8_t* buf, size_t len) const;
+
+    uint64_t size() const {
+        return size_;
+    }
+
+    uint64_t committedSize() const {
+        return frameEnds_.empty() ? 0 : frameEnds_.back();
+    }
+
+    int fd() const {
+        return fd_;
+    }
+
+    const std::string& path() const {
+        return path_;
+    }
+
+private:
+    int fd_;
+    uint64_t size_;
+    std::string path_;
+    std::vector<uint64_t> frameEnds_;
+};
+
+#endif
@@ -0,0 +1,342 @@
+#include "history_store.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+namespace {
+
+constexpr uint32_t kRecordMagic = 0x48535431;  // "HST1"
+constexpr uint64_t kCheckpointStride = 64;
+
+// Host byte order; the log never leaves this host. prevSegment is zero for
+// the first record of a conversation.
+#pragma pack(push, 1)
+struct RecordHeader {
+    uint32_t magic;
+    uint32_t checksum;
+    uint32_t length;
+    uint8_t conversationLen;
+    uint8_t reserved[3];
+    uint64_t seq;
+    uint64_t time;
+    uint64_t prevSegment;
+    uint32_t prevOffset;
+    uint32_t reserved2;
+};
+#pragma pack(pop)
+
+uint32_t recordChecksum(const RecordHeader& header, const uint8_t* rest, size_t restLen) {
+    const uint8_t* fields = reinterpret_cast<const uint8_t*>(&header) + 8;
+    uint32_t hash = logChecksum(2166136261u, fields, sizeof(RecordHeader) - 8);
+    return logChecksum(hash, rest, restLen);
+}
+
+}  // namespace
+
+HistoryStore::HistoryStore(const std::string& dir, uint64_t segmentBytes, uint64_t maxBytes)
+    : dir_(dir),
+      segmentBytes_(static_cast<size_t>(segmentBytes)),
+      maxBytes_(maxBytes) {}
+
+HistoryStore::~HistoryStore() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& entry : segments_) {
+        closeLogSegment(entry.second);
+    }
+}
+
+bool HistoryStore::init() {
+    std::vector<uint64_t> ids;
+    if (!listLogSegments(dir_, ids, "[history]")) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (uint64_t id : ids) {
+        Segment segment;
+        if (!openLogSegment(dir_, id, 0, segment, "[history]")) {
+            continue;
+        }
+        segments_[segment.id] = segment;
+        recover(segments_[segment.id]);
+    }
+
+    uint64_t records = 0;
+    for (const auto& entry : conversations_) {
+        records += entry.second.count;
+    }
+    std::cout << "[history] loaded dir=" << dir_
+              << " segments=" << segments_.size()
+              << " conversations=" << conversations_.size()
+              << " records=" << records << std::endl;
+    return true;
+}
+
+void HistoryStore::recover(Segment& segment) {
+    size_t pos = 0;
+    bool torn = false;
+    while (pos + sizeof(RecordHeader) <= segment.size) {
+        RecordHeader header;
+        std::memcpy(&header, segment.base + pos, sizeof(header));
+        if (header.magic != kRecordMagic) {
+            torn = header.magic != 0;
+            break;
+        }
+        size_t restLen = static_cast<size_t>(header.conversationLen) + header.length;
+        if (restLen > segment.size - pos - sizeof(header)
+            || header.checksum != recordChecksum(header, segment.base + pos + sizeof(header), restLen)) {
+            torn = true;
+            break;
+        }
+
+        std::string conversation(reinterpret_cast<const char*>(segment.base + pos + sizeof(header)),
+                                 header.conversationLen);
+        Location location;
+        location.segment = segment.id;
+        location.offset = static_cast<uint32_t>(pos);
+        indexRecord(conversation, header.seq, header.time, location);
+        nextSeq_ = std::max(nextSeq_, header.seq + 1);
+        lastTime_ = std::max(lastTime_, header.time);
+        segment.newest = std::max(segment.newest, header.time);
+        pos += sizeof(header) + restLen;
+    }
+
+    if (torn) {
+        // New records may be appended here; stale bytes behind them must
+        // not parse as records on the next start.
+        std::cerr << "[history] truncated segment " << logSegmentPath(dir_, segment.id)
+                  << " at offset=" << pos << std::endl;
+        std::memset(segment.base + pos, 0, segment.size - pos);
+    }
+    segment.used = pos;
+}
+
+void HistoryStore::indexRecord(const std::string& conversation, uint64_t seq, uint64_t time,
+                               const Location& location) {
+    Conversation& entry = conversations_[conversation];
+    if (entry.count % kCheckpointStride == 0) {
+        entry.checkpoints.push_back(Checkpoint{seq, time, location});
+    }
+    entry.tail = location;
+    ++entry.count;
+}
+
+bool HistoryStore::readRecord(const Location& location, RecordView& record) const {
+    auto it = segments_.find(location.segment);
+    if (it == segments_.end() || location.offset + sizeof(RecordHeader) > it->second.used) {
+        return false;
+    }
+    const uint8_t* at = it->second.base + location.offset;
+    RecordHeader header;
+    std::memcpy(&header, at, sizeof(header));
+    record.seq = header.seq;
+    record.time = header.time;
+    record.prev.segment = header.prevSegment;
+    record.prev.offset = header.prevOffset;
+    record.payload = at + sizeof(header) + header.conversationLen;
+    record.length = header.length;
+    return true;
+}
+
+bool HistoryStore::rollSegment() {
+    // History is a ring: when the budget is used up the oldest segment
+    // makes room for the new one.
+    while (!segments_.empty()
+           && (segments_.size() + 1) * static_cast<uint64_t>(segmentBytes_) > maxBytes_) {
+        dropFrontSegment();
+    }
+    uint64_t id = segments_.empty() ? 1 : segments_.rbegin()->first + 1;
+    Segment segment;
+    if (!openLogSegment(dir_, id, segmentBytes_, segment, "[history]")) {
+        return false;
+    }
+    segments_[id] = segment;
+    return true;
+}
+
+uint64_t HistoryStore::append(const std::string& conversation, const uint8_t* payload, size_t len,
+                              uint64_t time) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t total = sizeof(RecordHeader) + conversation.size() + len;
+    if (conversation.size() > UINT8_MAX || total > segmentBytes_) {
+        return 0;
+    }
+    if (segments_.empty() || segments_.rbegin()->second.used + total > segments_.rbegin()->second.size) {
+        if (!rollSegment()) {
+            return 0;
+        }
+    }
+
+    // The index is searched by time, so time never goes backwards even if
+    // the wall clock does.
+    time = std::max(time, lastTime_);
+    lastTime_ = time;
+
+    Segment& segment = segments_.rbegin()->second;
+    RecordHeader header;
+    std::memset(&header, 0, sizeof(header));
+    header.magic = kRecordMagic;
+    header.length = static_cast<uint32_t>(len);
+    header.conversationLen = static_cast<uint8_t>(conversation.size());
+    header.seq = nextSeq_++;
+    header.time = time;
+    auto it = conversations_.find(conversation);
+    if (it != conversations_.end()) {
+        header.prevSegment = it->second.tail.segment;
+        header.prevOffset = it->second.tail.offset;
+    }
+
+    uint8_t* out = segment.base + segment.used;
+    std::memcpy(out + sizeof(header), conversation.data(), conversation.size());
+    std::memcpy(out + sizeof(header) + conversation.size(), payload, len);
+    header.checksum = recordChecksum(header, out + sizeof(header), conversation.size() + len);
+    std::memcpy(out, &header, sizeof(header));
+
+    Location location;
+    location.segment = segment.id;
+    location.offset = static_cast<uint32_t>(segment.used);
+    segment.used += total;
+    segment.newest = time;
+    indexRecord(conversation, header.seq, time, location);
+    ++stats_.appended;
+    return header.seq;
+}
+
+void HistoryStore::query(const std::string& conversation, const HistoryQuery& query,
+                         std::vector<HistoryItem>& items, bool& more) {
+    items.clear();
+    more = false;
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++stats_.queries;
+    auto it = conversations_.find(conversation);
+    if (it == conversations_.end() || query.limit == 0) {
+        return;
+    }
+
+    uint64_t beforeSeq = query.beforeSeq > 0 ? query.beforeSeq : UINT64_MAX;
+    uint64_t toTime = query.toTime > 0 ? query.toTime : UINT64_MAX;
+    auto tooNew = [beforeSeq, toTime](uint64_t seq, uint64_t time) {
+        return seq >= beforeSeq || time > toTime;
+    };
+
+    // Sequence and time both grow along a conversation, so the first
+    // checkpoint past the requested bounds is found by binary search. The
+    // walk starts there and skips at most one stride of newer records.
+    const auto& checkpoints = it->second.checkpoints;
+    auto first = std::partition_point(checkpoints.begin(), checkpoints.end(),
+                                      [&tooNew](const Checkpoint& checkpoint) {
+                                          return !tooNew(checkpoint.seq, checkpoint.time);
+                                      });
+    Location location = first == checkpoints.end() ? it->second.tail : first->location;
+
+    RecordView record;
+    while (location.segment != 0 && readRecord(location, record)) {
+        ++stats_.recordsRead;
+        if (record.time < query.fromTime) {
+            break;
+        }
+        if (!tooNew(record.seq, record.time)) {
+            if (items.size() == query.limit) {
+                more = true;
+                break;
+            }
+            HistoryItem item;
+            item.seq = record.seq;
+            item.time = record.time;
+            item.payload.assign(record.payload, record.payload + record.length);
+            items.push_back(std::move(item));
+        }
+        location = record.prev;
+    }
+    std::reverse(items.begin(), items.end());
+}
+
+bool HistoryStore::fetch(const std::string& conversation, uint64_t seq, HistoryItem& item) {
+    HistoryQuery query;
+    query.beforeSeq = seq + 1;
+    query.limit = 1;
+    std::vector<HistoryItem> items;
+    bool more = false;
+    this->query(conversation, query, items, more);
+    if (items.empty() || items[0].seq != seq) {
+        return false;
+    }
+    item = std::move(items[0]);
+    return true;
+}
+
+void HistoryStore::scan(const RecordFn& visit) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto& entry : segments_) {
+        const Segment& segment = entry.second;
+        size_t pos = 0;
+        while (pos + sizeof(RecordHeader) <= segment.used) {
+            RecordHeader header;
+            std::memcpy(&header, segment.base + pos, sizeof(header));
+            const uint8_t* name = segment.base + pos + sizeof(header);
+            visit(std::string(reinterpret_cast<const char*>(name), header.conversationLen),
+                  header.seq, name + header.conversationLen, header.length);
+            pos += sizeof(header) + header.conversationLen + header.length;
+        }
+    }
+}
+
+uint64_t HistoryStore::oldestSeq() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto& entry : segments_) {
+        if (entry.second.used >= sizeof(RecordHeader)) {
+            RecordHeader header;
+            std::memcpy(&header, entry.second.base, sizeof(header));
+            return header.seq;
+        }
+    }
+    return nextSeq_;
+}
+
+void HistoryStore::dropFrontSegment() {
+    auto front = segments_.begin();
+    uint64_t id = front->first;
+    closeLogSegment(front->second);
+    unlink(logSegmentPath(dir_, id).c_str());
+    segments_.erase(front);
+    ++stats_.droppedSegments;
+
+    // Chains simply end where the dropped segment was; only the index
+    // entries pointing into it have to go.
+    for (auto it = conversations_.begin(); it != conversations_.end();) {
+        Conversation& conversation = it->second;
+        if (conversation.tail.segment <= id) {
+            it = conversations_.erase(it);
+            continue;
+        }
+        auto stale = std::find_if(conversation.checkpoints.begin(), conversation.checkpoints.end(),
+                                  [id](const Checkpoint& checkpoint) {
+                                      return checkpoint.location.segment > id;
+                                  });
+        conversation.checkpoints.erase(conversation.checkpoints.begin(), stale);
+        ++it;
+    }
+}
+
+void HistoryStore::compact(uint64_t now, uint64_t retentionSec) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (retentionSec == 0) {
+        return;
+    }
+    // The segment being appended to is kept; it is the newest anyway.
+    while (segments_.size() > 1 && segments_.begin()->second.newest + retentionSec <= now) {
+        std::cout << "[history] retention drop segment=" << segments_.begin()->first << std::endl;
+        dropFrontSegment();
+    }
+}
+
+HistoryStoreStats HistoryStore::stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    HistoryStoreStats stats = stats_;
+    stats.conversations = conversations_.size();
+    stats.segments = segments_.size();
+    return stats;
+}
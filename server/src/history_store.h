@@ -0,0 +1,120 @@
+#ifndef HISTORY_STORE_H
+#define HISTORY_STORE_H
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "log_segment.h"
+
+struct HistoryItem {
+    uint64_t seq = 0;
+    uint64_t time = 0;
+    std::vector<uint8_t> payload;
+};
+
+// One page of a conversation, walking back from the newest message below
+// beforeSeq and no later than toTime. Zero leaves a bound open.
+struct HistoryQuery {
+    uint64_t beforeSeq = 0;
+    uint64_t fromTime = 0;
+    uint64_t toTime = 0;
+    size_t limit = 50;
+};
+
+struct HistoryStoreStats {
+    uint64_t conversations = 0;
+    uint64_t segments = 0;
+    uint64_t appended = 0;
+    uint64_t queries = 0;
+    uint64_t recordsRead = 0;
+    uint64_t droppedSegments = 0;
+};
+
+// Every routed chat message, appended to mmap'd log segments shared by all
+// conversations. Each record points back at the previous record of its
+// conversation, and every kCheckpointStride-th record of a conversation
+// is kept in a sparse in-memory index, so a page lookup is a binary search
+// plus a short walk along the chain. Retention drops whole segments from
+// the front; the index is rebuilt from the log on startup.
+class HistoryStore {
+public:
+    HistoryStore(const std::string& dir, uint64_t segmentBytes, uint64_t maxBytes);
+    ~HistoryStore();
+
+    HistoryStore(const HistoryStore&) = delete;
+    HistoryStore& operator=(const HistoryStore&) = delete;
+
+    using RecordFn = std::function<void(const std::string& conversation, uint64_t seq,
+                                        const uint8_t* payload, size_t len)>;
+
+    bool init();
+    // Returns the record's sequence number, or 0 if it was not stored.
+    uint64_t append(const std::string& conversation, const uint8_t* payload, size_t len,
+                    uint64_t time);
+    // Items come back oldest first; more is set when older matching
+    // messages remain.
+    void query(const std::string& conversation, const HistoryQuery& query,
+               std::vector<HistoryItem>& items, bool& more);
+    bool fetch(const std::string& conversation, uint64_t seq, HistoryItem& item);
+    // Visits every stored record, oldest first.
+    void scan(const RecordFn& visit) const;
+    // Sequence number of the oldest stored record.
+    uint64_t oldestSeq() const;
+    void compact(uint64_t now, uint64_t retentionSec);
+    HistoryStoreStats stats() const;
+
+private:
+    struct Segment : LogSegment {
+        size_t used = 0;
+        uint64_t newest = 0;
+    };
+
+    struct Location {
+        uint64_t segment = 0;
+        uint32_t offset = 0;
+    };
+
+    struct Checkpoint {
+        uint64_t seq;
+        uint64_t time;
+        Location location;
+    };
+
+    struct Conversation {
+        Location tail;
+        uint64_t count = 0;
+        std::vector<Checkpoint> checkpoints;
+    };
+
+    struct RecordView {
+        uint64_t seq;
+        uint64_t time;
+        Location prev;
+        const uint8_t* payload;
+        size_t length;
+    };
+
+    void recover(Segment& segment);
+    void indexRecord(const std::string& conversation, uint64_t seq, uint64_t time,
+                     const Location& location);
+    bool readRecord(const Location& location, RecordView& record) const;
+    bool rollSegment();
+    void dropFrontSegment();
+
+    std::string dir_;
+    size_t segmentBytes_;
+    uint64_t maxBytes_;
+    std::map<uint64_t, Segment> segments_;
+    std::unordered_map<std::string, Conversation> conversations_;
+    uint64_t nextSeq_ = 1;
+    uint64_t lastTime_ = 0;
+    HistoryStoreStats stats_;
+    mutable std::mutex mutex_;
+};
+
+#endif
@@ -0,0 +1,124 @@
+#include "log_segment.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+namespace {
+
+bool parseSegmentName(const char* name, uint64_t& id) {
+    size_t len = std::strlen(name);
+    if (len != 20 || std::strcmp(name + 16, ".log") != 0) {
+        return false;
+    }
+    char* end = nullptr;
+    id = std::strtoull(name, &end, 16);
+    return end == name + 16;
+}
+
+}  // namespace
+
+std::string logSegmentPath(const std::string& dir, uint64_t id) {
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016" PRIx64 ".log", id);
+    return dir + "/" + name;
+}
+
+bool listLogSegments(const std::string& dir, std::vector<uint64_t>& ids, const char* tag) {
+    if (mkdir(dir.c_str(), 0700) < 0 && errno != EEXIST) {
+        std::cerr << tag << " cannot create " << dir << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    DIR* handle = opendir(dir.c_str());
+    if (!handle) {
+        std::cerr << tag << " cannot open " << dir << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    while (dirent* entry = readdir(handle)) {
+        uint64_t id = 0;
+        if (parseSegmentName(entry->d_name, id)) {
+            ids.push_back(id);
+        }
+    }
+    closedir(handle);
+    std::sort(ids.begin(), ids.end());
+    return true;
+}
+
+bool openLogSegment(const std::string& dir, uint64_t id, size_t createSize,
+                    LogSegment& segment, const char* tag) {
+    std::string path = logSegmentPath(dir, id);
+    bool create = createSize > 0;
+    int flags = O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_EXCL : 0);
+    int fd = open(path.c_str(), flags, 0600);
+    if (fd < 0) {
+        std::cerr << tag << " cannot open " << path << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+
+    size_t size = createSize;
+    if (create) {
+        int rc = posix_fallocate(fd, 0, static_cast<off_t>(size));
+        if (rc != 0) {
+            std::cerr << tag << " cannot allocate " << path << ": " << std::strerror(rc) << std::endl;
+            close(fd);
+            unlink(path.c_str());
+            return false;
+        }
+    } else {
+        struct stat st;
+        if (fstat(fd, &st) < 0 || st.st_size <= 0) {
+            std::cerr << tag << " ignoring empty segment " << path << std::endl;
+            close(fd);
+            return false;
+        }
+        size = static_cast<size_t>(st.st_size);
+    }
+
+    void* base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        std::cerr << tag << " mmap failed " << path << ": " << std::strerror(errno) << std::endl;
+        close(fd);
+        if (create) {
+            unlink(path.c_str());
+        }
+        return false;
+    }
+
+    segment.id = id;
+    segment.fd = fd;
+    segment.base = static_cast<uint8_t*>(base);
+    segment.size = size;
+    return true;
+}
+
+void closeLogSegment(LogSegment& segment) {
+    if (segment.base) {
+        munmap(segment.base, segment.size);
+        segment.base = nullptr;
+    }
+    if (segment.fd >= 0) {
+        close(segment.fd);
+        segment.fd = -1;
+    }
+}
+
+// FNV-1a; only meant to catch torn or stale records.
+uint32_t logChecksum(uint32_t seed, const uint8_t* data, size_t len) {
+    uint32_t hash = seed;
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
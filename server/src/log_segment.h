@@ -0,0 +1,32 @@
+#ifndef LOG_SEGMENT_H
+#define LOG_SEGMENT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// A fixed-size, append-only log file mapped read/write. Segments are named
+// by a hex id so that a directory listing sorts them in write order.
+struct LogSegment {
+    uint64_t id = 0;
+    int fd = -1;
+    uint8_t* base = nullptr;
+    size_t size = 0;
+};
+
+std::string logSegmentPath(const std::string& dir, uint64_t id);
+
+// Creates dir if needed and returns the ids of its segments, ascending.
+bool listLogSegments(const std::string& dir, std::vector<uint64_t>& ids, const char* tag);
+
+// Maps an existing segment, or creates one of createSize bytes with its
+// blocks reserved: running out of space while writing through the mapping
+// would raise SIGBUS instead of an error. Failures are logged under tag.
+bool openLogSegment(const std::string& dir, uint64_t id, size_t createSize,
+                    LogSegment& segment, const char* tag);
+void closeLogSegment(LogSegment& segment);
+
+uint32_t logChecksum(uint32_t seed, const uint8_t* data, size_t len);
+
+#endif
@@ -16,6 +16,7 @@ void signalHandler(int signum) {
 int main(int argc, char* argv[]) {
     std::string ip = "0.0.0.0";
     int port = 8888;
+    ServerConfig config;
 
     if (argc >= 2) {
         port = std::atoi(argv[1]);
@@ -23,6 +24,9 @@ int main(int argc, char* argv[]) {
     if (argc >= 3) {
         ip = argv[2];
     }
+    if (argc >= 4 && !config.loadFromFile(argv[3])) {
+        return 1;
+    }
 
     std::cout << "========================================" << std::endl;
     std::cout << "  IM Server v1.0" << std::endl;
@@ -34,7 +38,7 @@ int main(int argc, char* argv[]) {
     signal(SIGTERM, signalHandler);
     signal(SIGPIPE, SIG_IGN);
 
-    Server server(ip, port);
+    Server server(ip, port, config);
     g_server = &server;
 
     if (!server.start()) {
@@ -0,0 +1,390 @@
+#include "offline_store.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+namespace {
+
+constexpr uint32_t kRecordMagic = 0x4f464c31;  // "OFL1"
+constexpr uint8_t kRecordMessage = 1;
+// Every message for the recipient up to the sequence in the payload has
+// been delivered; without a payload, every one below the marker's own.
+constexpr uint8_t kRecordDelivered = 2;
+
+// Records are written in host byte order; the log never leaves this host.
+#pragma pack(push, 1)
+struct RecordHeader {
+    uint32_t magic;
+    uint32_t checksum;
+    uint32_t length;
+    uint8_t type;
+    uint8_t recipientLen;
+    uint16_t reserved;
+    uint64_t seq;
+    uint64_t time;
+};
+#pragma pack(pop)
+
+// Covers everything after the checksum field, so a torn record fails it.
+uint32_t recordChecksum(const RecordHeader& header, const uint8_t* rest, size_t restLen) {
+    const uint8_t* fields = reinterpret_cast<const uint8_t*>(&header) + 8;
+    uint32_t hash = logChecksum(2166136261u, fields, sizeof(RecordHeader) - 8);
+    return logChecksum(hash, rest, restLen);
+}
+
+}  // namespace
+
+OfflineStore::OfflineStore(const std::string& dir, uint64_t segmentBytes, uint64_t maxBytes,
+                           OfflineSync sync, size_t maxPerRecipient)
+    : dir_(dir),
+      segmentBytes_(static_cast<size_t>(segmentBytes)),
+      maxBytes_(maxBytes),
+      syncMode_(sync),
+      maxPerRecipient_(maxPerRecipient) {}
+
+OfflineStore::~OfflineStore() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& entry : segments_) {
+        if (syncMode_ != OfflineSync::Os) {
+            syncSegment(entry.second);
+        }
+        closeLogSegment(entry.second);
+    }
+}
+
+bool OfflineStore::init() {
+    std::vector<uint64_t> ids;
+    if (!listLogSegments(dir_, ids, "[offline]")) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (size_t i = 0; i < ids.size(); ++i) {
+        Segment segment;
+        if (!openLogSegment(dir_, ids[i], 0, segment, "[offline]")) {
+            continue;
+        }
+        recover(segment, i + 1 == ids.size());
+        segments_[segment.id] = segment;
+    }
+    dropFrontSegments(0, 0);
+
+    uint64_t pending = 0;
+    for (const auto& entry : index_) {
+        pending += entry.second.size();
+    }
+    std::cout << "[offline] loaded dir=" << dir_
+              << " segments=" << segments_.size()
+              << " recipients=" << index_.size()
+              << " pending=" << pending << std::endl;
+    return true;
+}
+
+void OfflineStore::recover(Segment& segment, bool active) {
+    size_t pos = 0;
+    bool torn = false;
+    while (pos + sizeof(RecordHeader) <= segment.size) {
+        RecordHeader header;
+        std::memcpy(&header, segment.base + pos, sizeof(header));
+        if (header.magic != kRecordMagic) {
+            torn = header.magic != 0;
+            break;
+        }
+        size_t restLen = static_cast<size_t>(header.recipientLen) + header.length;
+        if (restLen > segment.size - pos - sizeof(header)
+            || header.checksum != recordChecksum(header, segment.base + pos + sizeof(header), restLen)) {
+            torn = true;
+            break;
+        }
+
+        std::string recipient(reinterpret_cast<const char*>(segment.base + pos + sizeof(header)),
+                              header.recipientLen);
+        nextSeq_ = std::max(nextSeq_, header.seq + 1);
+        if (header.type == kRecordMessage) {
+            RecordRef ref;
+            ref.segment = segment.id;
+            ref.seq = header.seq;
+            ref.offset = static_cast<uint32_t>(pos + sizeof(header) + header.recipientLen);
+            ref.length = header.length;
+            index_[recipient].push_back(ref);
+            ++segment.live;
+            segment.newest = std::max(segment.newest, header.time);
+        } else if (header.type == kRecordDelivered) {
+            // The marker names the last record it covers; markers without
+            // one cover everything written before them.
+            uint64_t throughSeq = header.seq - 1;
+            if (header.length == sizeof(throughSeq)) {
+                std::memcpy(&throughSeq, segment.base + pos + sizeof(header) + header.recipientLen,
+                            sizeof(throughSeq));
+            }
+            auto it = index_.find(recipient);
+            if (it != index_.end()) {
+                auto& refs = it->second;
+                while (!refs.empty() && refs.front().seq <= throughSeq) {
+                    if (refs.front().segment == segment.id) {
+                        --segment.live;
+                    } else {
+                        auto segmentIt = segments_.find(refs.front().segment);
+                        if (segmentIt != segments_.end()) {
+                            --segmentIt->second.live;
+                        }
+                    }
+                    refs.pop_front();
+                }
+                if (refs.empty()) {
+                    index_.erase(it);
+                }
+            }
+        }
+        pos += sizeof(header) + restLen;
+    }
+
+    segment.used = pos;
+    segment.synced = pos;
+    if (torn) {
+        std::cerr << "[offline] truncated segment " << logSegmentPath(dir_, segment.id)
+                  << " at offset=" << pos << std::endl;
+        if (active) {
+            // New records go here; stale bytes behind them must not parse
+            // as records on the next start.
+            std::memset(segment.base + pos, 0, segment.size - pos);
+        }
+    }
+    if (!active) {
+        // Sealed segments are never appended to again.
+        segment.used = segment.size;
+    }
+}
+
+bool OfflineStore::rollSegment(bool force) {
+    if (!force && (segments_.size() + 1) * static_cast<uint64_t>(segmentBytes_) > maxBytes_) {
+        return false;
+    }
+    uint64_t id = 1;
+    if (!segments_.empty()) {
+        Segment& last = segments_.rbegin()->second;
+        if (syncMode_ != OfflineSync::Os) {
+            syncSegment(last);
+        }
+        id = last.id + 1;
+    }
+
+    Segment segment;
+    if (!openLogSegment(dir_, id, segmentBytes_, segment, "[offline]")) {
+        return false;
+    }
+    if (syncMode_ != OfflineSync::Os) {
+        int dirFd = open(dir_.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dirFd >= 0) {
+            fsync(dirFd);
+            close(dirFd);
+        }
+    }
+    segments_[id] = segment;
+    return true;
+}
+
+bool OfflineStore::appendRecord(uint8_t type, const std::string& recipient,
+                                const uint8_t* payload, size_t len, uint64_t now, uint64_t& seq) {
+    size_t total = sizeof(RecordHeader) + recipient.size() + len;
+    if (recipient.size() > UINT8_MAX || total > segmentBytes_) {
+        return false;
+    }
+    if (segments_.empty() || segments_.rbegin()->second.used + total > segments_.rbegin()->second.size) {
+        // Delivery markers may go over the budget; losing one would bring
+        // delivered messages back after a restart.
+        if (!rollSegment(type == kRecordDelivered)) {
+            return false;
+        }
+    }
+
+    Segment& segment = segments_.rbegin()->second;
+    RecordHeader header;
+    std::memset(&header, 0, sizeof(header));
+    header.magic = kRecordMagic;
+    header.length = static_cast<uint32_t>(len);
+    header.type = type;
+    header.recipientLen = static_cast<uint8_t>(recipient.size());
+    header.seq = nextSeq_++;
+    header.time = now;
+
+    uint8_t* out = segment.base + segment.used;
+    std::memcpy(out + sizeof(header), recipient.data(), recipient.size());
+    if (len > 0) {
+        std::memcpy(out + sizeof(header) + recipient.size(), payload, len);
+    }
+    header.checksum = recordChecksum(header, out + sizeof(header), recipient.size() + len);
+    std::memcpy(out, &header, sizeof(header));
+
+    seq = header.seq;
+    segment.used += total;
+    if (syncMode_ == OfflineSync::Always) {
+        syncSegment(segment);
+    }
+    return true;
+}
+
+bool OfflineStore::append(const std::string& recipient, const uint8_t* frame, size_t len,
+                          uint64_t now) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& refs = index_[recipient];
+    uint64_t seq = 0;
+    if (refs.size() >= maxPerRecipient_
+        || !appendRecord(kRecordMessage, recipient, frame, len, now, seq)) {
+        if (refs.empty()) {
+            index_.erase(recipient);
+        }
+        ++stats_.rejected;
+        return false;
+    }
+
+    Segment& segment = segments_.rbegin()->second;
+    RecordRef ref;
+    ref.segment = segment.id;
+    ref.seq = seq;
+    ref.offset = static_cast<uint32_t>(segment.used - len);
+    ref.length = static_cast<uint32_t>(len);
+    refs.push_back(ref);
+    ++segment.live;
+    segment.newest = std::max(segment.newest, now);
+    ++stats_.appended;
+    return true;
+}
+
+size_t OfflineStore::collect(const std::string& recipient, size_t maxBatch,
+                             const BatchCallback& send, uint64_t& throughSeq) {
+    std::vector<std::vector<uint8_t>> batches;
+    size_t count = 0;
+    throughSeq = 0;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = index_.find(recipient);
+        if (it == index_.end()) {
+            return 0;
+        }
+
+        std::vector<uint8_t> batch;
+        for (const RecordRef& ref : it->second) {
+            const Segment& segment = segments_.at(ref.segment);
+            if (!batch.empty() && batch.size() + ref.length > maxBatch) {
+                batches.push_back(std::move(batch));
+                batch.clear();
+            }
+            batch.insert(batch.end(), segment.base + ref.offset,
+                         segment.base + ref.offset + ref.length);
+        }
+        if (!batch.empty()) {
+            batches.push_back(std::move(batch));
+        }
+        count = it->second.size();
+        throughSeq = it->second.back().seq;
+    }
+
+    for (const auto& batch : batches) {
+        send(batch);
+    }
+    return count;
+}
+
+void OfflineStore::markDelivered(const std::string& recipient, uint64_t throughSeq) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = index_.find(recipient);
+    if (it == index_.end()) {
+        return;
+    }
+    auto& refs = it->second;
+    size_t count = 0;
+    while (!refs.empty() && refs.front().seq <= throughSeq) {
+        auto segmentIt = segments_.find(refs.front().segment);
+        if (segmentIt != segments_.end()) {
+            --segmentIt->second.live;
+        }
+        refs.pop_front();
+        ++count;
+    }
+    if (refs.empty()) {
+        index_.erase(it);
+    }
+    if (count == 0) {
+        return;
+    }
+
+    uint64_t seq = 0;
+    if (!appendRecord(kRecordDelivered, recipient, reinterpret_cast<const uint8_t*>(&throughSeq),
+                      sizeof(throughSeq), 0, seq)) {
+        std::cerr << "[offline] cannot record delivery recipient=" << recipient << std::endl;
+    }
+    stats_.delivered += count;
+    dropFrontSegments(0, 0);
+}
+
+void OfflineStore::syncSegment(Segment& segment) {
+    if (segment.used <= segment.synced) {
+        return;
+    }
+    size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    size_t start = segment.synced & ~(page - 1);
+    if (msync(segment.base + start, segment.used - start, MS_SYNC) < 0) {
+        std::cerr << "[offline] msync failed: " << std::strerror(errno) << std::endl;
+        return;
+    }
+    segment.synced = segment.used;
+    ++stats_.syncs;
+}
+
+void OfflineStore::sync() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!segments_.empty()) {
+        syncSegment(segments_.rbegin()->second);
+    }
+}
+
+void OfflineStore::expire(uint64_t now, uint64_t retentionSec) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    dropFrontSegments(now, retentionSec);
+}
+
+void OfflineStore::dropFrontSegments(uint64_t now, uint64_t retentionSec) {
+    // Only the oldest segments go: a delivery marker only covers records
+    // written before it, so dropping from the front never revives anything.
+    // The segment being appended to is always kept.
+    while (segments_.size() > 1) {
+        Segment& segment = segments_.begin()->second;
+        bool aged = retentionSec > 0 && segment.newest + retentionSec <= now;
+        if (segment.live > 0 && !aged) {
+            break;
+        }
+        if (segment.live > 0) {
+            for (auto it = index_.begin(); it != index_.end();) {
+                auto& refs = it->second;
+                while (!refs.empty() && refs.front().segment == segment.id) {
+                    refs.pop_front();
+                    ++stats_.expired;
+                }
+                it = refs.empty() ? index_.erase(it) : std::next(it);
+            }
+            std::cout << "[offline] expired segment id=" << segment.id
+                      << " messages=" << segment.live << std::endl;
+        }
+        closeLogSegment(segment);
+        unlink(logSegmentPath(dir_, segment.id).c_str());
+        segments_.erase(segments_.begin());
+    }
+}
+
+OfflineStoreStats OfflineStore::stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    OfflineStoreStats stats = stats_;
+    for (const auto& entry : index_) {
+        stats.pending += entry.second.size();
+    }
+    stats.recipients = index_.size();
+    stats.segments = segments_.size();
+    return stats;
+}
@@ -0,0 +1,93 @@
+#ifndef OFFLINE_STORE_H
+#define OFFLINE_STORE_H
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "log_segment.h"
+
+// When appended records reach the disk: msync after every record, on the
+// periodic sync() call, or whenever the kernel writes the pages back.
+enum class OfflineSync { Always, Interval, Os };
+
+struct OfflineStoreStats {
+    uint64_t pending = 0;
+    uint64_t recipients = 0;
+    uint64_t segments = 0;
+    uint64_t appended = 0;
+    uint64_t delivered = 0;
+    uint64_t rejected = 0;
+    uint64_t expired = 0;
+    uint64_t syncs = 0;
+};
+
+// Frames for recipients that are offline, kept in an append-only log of
+// fixed-size mmap'd segments. Delivery appends a marker record instead of
+// rewriting anything, and whole segments are deleted from the front once
+// nothing in them is pending or they have aged out. The per-recipient index
+// lives in memory and is rebuilt from the log on startup.
+class OfflineStore {
+public:
+    using BatchCallback = std::function<void(const std::vector<uint8_t>& batch)>;
+
+    OfflineStore(const std::string& dir, uint64_t segmentBytes, uint64_t maxBytes,
+                 OfflineSync sync, size_t maxPerRecipient);
+    ~OfflineStore();
+
+    OfflineStore(const OfflineStore&) = delete;
+    OfflineStore& operator=(const OfflineStore&) = delete;
+
+    bool init();
+    bool append(const std::string& recipient, const uint8_t* frame, size_t len, uint64_t now);
+    // Passes the recipient's frames, oldest first, to send in batches of at
+    // most maxBatch bytes. They stay stored until markDelivered() is called
+    // with the returned throughSeq. Returns the frame count.
+    size_t collect(const std::string& recipient, size_t maxBatch, const BatchCallback& send,
+                   uint64_t& throughSeq);
+    // Drops the recipient's frames up to and including throughSeq.
+    void markDelivered(const std::string& recipient, uint64_t throughSeq);
+    void sync();
+    void expire(uint64_t now, uint64_t retentionSec);
+    OfflineStoreStats stats() const;
+
+private:
+    struct Segment : LogSegment {
+        size_t used = 0;
+        size_t synced = 0;
+        uint64_t live = 0;
+        uint64_t newest = 0;
+    };
+
+    struct RecordRef {
+        uint64_t segment;
+        uint64_t seq;
+        uint32_t offset;
+        uint32_t length;
+    };
+
+    void recover(Segment& segment, bool active);
+    bool appendRecord(uint8_t type, const std::string& recipient,
+                      const uint8_t* payload, size_t len, uint64_t now, uint64_t& seq);
+    bool rollSegment(bool force);
+    void syncSegment(Segment& segment);
+    void dropFrontSegments(uint64_t now, uint64_t retentionSec);
+
+    std::string dir_;
+    size_t segmentBytes_;
+    uint64_t maxBytes_;
+    OfflineSync syncMode_;
+    size_t maxPerRecipient_;
+    std::map<uint64_t, Segment> segments_;
+    std::unordered_map<std::string, std::deque<RecordRef>> index_;
+    uint64_t nextSeq_ = 1;
+    OfflineStoreStats stats_;
+    mutable std::mutex mutex_;
+};
+
+#endif
@@ -1,8 +1,78 @@
 #include "protocol.h"
+#include "utf8.h"
 
+#include <algorithm>
+#include <cstddef>
 #include <vector>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 namespace {
+constexpr uint32_t kMaxBodyLength = 1024 * 1024;
+
+// Returns the first position in [begin, end) where all four magic bytes
+// match, or end. Scans 16 candidate positions per step where SSE2 is
+// available by matching the first two magic bytes at once.
+const uint8_t* findMagic(const uint8_t* begin, const uint8_t* end, const uint8_t* magic) {
+    if (end - begin < 4) {
+        return end;
+    }
+    const uint8_t* last = end - 4;
+    const uint8_t* p = begin;
+#if defined(__SSE2__)
+    const __m128i first = _mm_set1_epi8(static_cast<char>(magic[0]));
+    const __m128i second = _mm_set1_epi8(static_cast<char>(magic[1]));
+    while (last - p >= 16) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 1));
+        unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, second))));
+        while (mask != 0) {
+            unsigned bit = static_cast<unsigned>(__builtin_ctz(mask));
+            if (std::memcmp(p + bit + 2, magic + 2, 2) == 0) {
+                return p + bit;
+            }
+            mask &= mask - 1;
+        }
+        p += 16;
+    }
+#endif
+    while (p <= last) {
+        p = static_cast<const uint8_t*>(std::memchr(p, magic[0],
+                                                    static_cast<size_t>(last - p) + 1));
+        if (!p) {
+            return end;
+        }
+        if (std::memcmp(p, magic, 4) == 0) {
+            return p;
+        }
+        ++p;
+    }
+    return end;
+}
+
+// Checks whatever part of a header is available at p against the fixed
+// fields; a truncated candidate is plausible until proven otherwise.
+bool plausibleHeader(const uint8_t* p, size_t avail, uint16_t expectedVersion) {
+    if (avail >= offsetof(MessageHeader, msgType)) {
+        uint16_t version;
+        std::memcpy(&version, p + offsetof(MessageHeader, version), sizeof(version));
+        if (ntohs(version) != expectedVersion) {
+            return false;
+        }
+    }
+    if (avail >= offsetof(MessageHeader, sequence)) {
+        uint32_t bodyLength;
+        std::memcpy(&bodyLength, p + offsetof(MessageHeader, bodyLength), sizeof(bodyLength));
+        if (ntohl(bodyLength) > kMaxBodyLength) {
+            return false;
+        }
+    }
+    return true;
+}
+
 uint64_t swap64(uint64_t value) {
     return (static_cast<uint64_t>(htonl(static_cast<uint32_t>(value & 0xFFFFFFFFULL))) << 32)
         | htonl(static_cast<uint32_t>(value >> 32));
@@ -29,12 +99,27 @@ ProtocolParser::ProtocolParser() = default;
 ProtocolParser::~ProtocolParser() = default;
 
 void ProtocolParser::parseData(int fd, const uint8_t* data, size_t len, MessageCallback callback) {
+    parseData(fd, data, len, std::move(callback), FragmentCallback());
+}
+
+void ProtocolParser::parseData(int fd, const uint8_t* data, size_t len, MessageCallback callback,
+                               FragmentCallback fragments) {
+    // The body of a frame already being streamed goes straight to the
+    // handler without passing through the receive buffer.
+    size_t streamed = continueStream(fd, data, len, fragments);
+    data += streamed;
+    len -= streamed;
+    if (len == 0) {
+        return;
+    }
+
     auto& buffer = recvBuffers_[fd];
     buffer.insert(buffer.end(), data, data + len);
 
-    while (buffer.size() >= sizeof(MessageHeader)) {
+    size_t pos = 0;
+    while (buffer.size() - pos >= sizeof(MessageHeader)) {
         MessageHeader header;
-        std::memcpy(&header, buffer.data(), sizeof(MessageHeader));
+        std::memcpy(&header, buffer.data() + pos, sizeof(MessageHeader));
 
         header.magic = ntohl(header.magic);
         header.version = ntohs(header.version);
@@ -43,21 +128,93 @@ void ProtocolParser::parseData(int fd, const uint8_t* data, size_t len, MessageC
         header.sequence = ntohl(header.sequence);
 
         if (!validateHeader(header)) {
-            buffer.clear();
-            break;
+            size_t skip = resyncOffset(buffer.data() + pos, buffer.size() - pos);
+            ++resyncCount_;
+            resyncSkipped_ += skip;
+            pos += skip;
+            continue;
+        }
+
+        auto ruleIt = streamRules_.find(header.msgType);
+        if (fragments && ruleIt != streamRules_.end()
+            && header.bodyLength > ruleIt->second.minBodyLength
+            && header.bodyLength > ruleIt->second.prefixLen) {
+            size_t prefixLen = ruleIt->second.prefixLen;
+            if (buffer.size() - pos < sizeof(MessageHeader) + prefixLen) {
+                break;
+            }
+            const uint8_t* prefix = buffer.data() + pos + sizeof(MessageHeader);
+            StreamState& state = streams_[fd];
+            state.header = header;
+            state.prefix.assign(prefix, prefix + prefixLen);
+            state.bodyOffset = prefixLen;
+            pos += sizeof(MessageHeader) + prefixLen;
+            pos += continueStream(fd, buffer.data() + pos, buffer.size() - pos, fragments);
+            if (streams_.count(fd) > 0) {
+                break;
+            }
+            continue;
         }
 
         size_t totalLen = sizeof(MessageHeader) + static_cast<size_t>(header.bodyLength);
-        if (buffer.size() < totalLen) {
+        if (buffer.size() - pos < totalLen) {
             break;
         }
 
-        const uint8_t* body = buffer.data() + sizeof(MessageHeader);
+        const uint8_t* body = buffer.data() + pos + sizeof(MessageHeader);
         callback(fd, header, body, static_cast<size_t>(header.bodyLength));
+        pos += totalLen;
+    }
 
-        buffer.erase(buffer.begin(),
-                     buffer.begin() + static_cast<std::vector<uint8_t>::difference_type>(totalLen));
+    buffer.erase(buffer.begin(),
+                 buffer.begin() + static_cast<std::vector<uint8_t>::difference_type>(pos));
+}
+
+size_t ProtocolParser::resyncOffset(const uint8_t* data, size_t len) {
+    uint8_t magic[sizeof(MAGIC_NUMBER)];
+    uint32_t netMagic = htonl(MAGIC_NUMBER);
+    std::memcpy(magic, &netMagic, sizeof(magic));
+
+    const uint8_t* end = data + len;
+    for (const uint8_t* p = findMagic(data + 1, end, magic); p != end;
+         p = findMagic(p + 1, end, magic)) {
+        if (plausibleHeader(p, static_cast<size_t>(end - p), PROTOCOL_VERSION)) {
+            return static_cast<size_t>(p - data);
+        }
     }
+
+    // Keep a trailing partial magic so it can complete on the next read.
+    size_t keep = std::min<size_t>(sizeof(magic) - 1, len - 1);
+    for (; keep > 0; --keep) {
+        if (std::memcmp(end - keep, magic, keep) == 0) {
+            break;
+        }
+    }
+    return len - keep;
+}
+
+void ProtocolParser::setStreamed(uint16_t msgType, size_t prefixLen, size_t minBodyLength) {
+    streamRules_[msgType] = StreamRule{prefixLen, minBodyLength};
+}
+
+size_t ProtocolParser::continueStream(int fd, const uint8_t* data, size_t len,
+                                      const FragmentCallback& fragments) {
+    auto it = streams_.find(fd);
+    if (it == streams_.end() || len == 0) {
+        return 0;
+    }
+
+    StreamState& state = it->second;
+    size_t offset = state.bodyOffset;
+    size_t take = std::min(len, static_cast<size_t>(state.header.bodyLength) - offset);
+    state.bodyOffset += take;
+    if (fragments) {
+        fragments(fd, state.header, state.prefix.data(), state.prefix.size(), data, take, offset);
+    }
+    if (state.bodyOffset == state.header.bodyLength) {
+        streams_.erase(it);
+    }
+    return take;
 }
 
 bool ProtocolParser::validateHeader(const MessageHeader& header) {
@@ -67,7 +224,7 @@ bool ProtocolParser::validateHeader(const MessageHeader& header) {
     if (header.version != PROTOCOL_VERSION) {
         return false;
     }
-    if (header.bodyLength > 1024 * 1024) {
+    if (header.bodyLength > kMaxBodyLength) {
         return false;
     }
     return true;
@@ -110,6 +267,24 @@ std::vector<uint8_t> ProtocolParser::packLoginResponse(uint32_t sequence,
     return buffer;
 }
 
+std::vector<uint8_t> ProtocolParser::packLoginResponse(uint32_t sequence,
+                                                       uint32_t result,
+                                                       const std::string& message,
+                                                       const LoginResponseExt& ext) {
+    std::vector<uint8_t> buffer = packLoginResponse(sequence, result, message);
+    uint32_t bodyLen = static_cast<uint32_t>(sizeof(LoginResponse) + sizeof(LoginResponseExt));
+    uint32_t bodyLenNet = htonl(bodyLen);
+    std::memcpy(buffer.data() + offsetof(MessageHeader, bodyLength), &bodyLenNet,
+                sizeof(bodyLenNet));
+
+    LoginResponseExt extNet = ext;
+    extNet.resumeGraceSec = htonl(ext.resumeGraceSec);
+    extNet.retryAfterMs = htonl(ext.retryAfterMs);
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&extNet);
+    buffer.insert(buffer.end(), bytes, bytes + sizeof(extNet));
+    return buffer;
+}
+
 std::vector<uint8_t> ProtocolParser::packChatMessage(uint32_t sequence,
                                                      ChatScope scope,
                                                      const std::string& fromId,
@@ -130,10 +305,12 @@ std::vector<uint8_t> ProtocolParser::packChatMessage(uint32_t sequence,
     std::memset(&msg, 0, sizeof(msg));
     msg.chatType = static_cast<uint8_t>(scope);
     std::strncpy(msg.fromId, fromId.c_str(), sizeof(msg.fromId) - 1);
-    std::strncpy(msg.fromNick, fromNick.c_str(), sizeof(msg.fromNick) - 1);
+    std::memcpy(msg.fromNick, fromNick.data(),
+                utf8TruncatedLength(fromNick.data(), fromNick.size(), sizeof(msg.fromNick) - 1));
     std::strncpy(msg.toId, toId.c_str(), sizeof(msg.toId) - 1);
     msg.timestamp = hostToNetwork64(timestamp);
-    std::strncpy(msg.message, message.c_str(), sizeof(msg.message) - 1);
+    std::memcpy(msg.message, message.data(),
+                utf8TruncatedLength(message.data(), message.size(), sizeof(msg.message) - 1));
 
     std::memcpy(buffer.data(), &header, sizeof(MessageHeader));
     std::memcpy(buffer.data() + sizeof(MessageHeader), &msg, sizeof(ChatMessage));
@@ -174,14 +351,15 @@ std::vector<uint8_t> ProtocolParser::packFileOffer(uint32_t sequence,
                                                    uint64_t fileSize,
                                                    const std::string& fromId,
                                                    const std::string& fromNick,
-                                                   const std::string& toId) {
-    std::vector<uint8_t> buffer(sizeof(MessageHeader) + sizeof(FileOffer));
+                                                   const std::string& toId,
+                                                   const FileOfferExt& ext) {
+    std::vector<uint8_t> buffer(sizeof(MessageHeader) + sizeof(FileOffer) + sizeof(FileOfferExt));
 
     MessageHeader header;
     header.magic = htonl(MAGIC_NUMBER);
     header.version = htons(PROTOCOL_VERSION);
     header.msgType = htons(MSG_FILE_OFFER);
-    header.bodyLength = htonl(static_cast<uint32_t>(sizeof(FileOffer)));
+    header.bodyLength = htonl(static_cast<uint32_t>(sizeof(FileOffer) + sizeof(FileOfferExt)));
     header.sequence = htonl(sequence);
 
     FileOffer offer;
@@ -193,8 +371,16 @@ std::vector<uint8_t> ProtocolParser::packFileOffer(uint32_t sequence,
     offer.fileSize = hostToNetwork64(fileSize);
     std::strncpy(offer.fileName, fileName.c_str(), sizeof(offer.fileName) - 1);
 
+    FileOfferExt extNet;
+    std::memset(&extNet, 0, sizeof(extNet));
+    extNet.streamCount = htonl(ext.streamCount);
+    std::memcpy(extNet.contentHash, ext.contentHash, sizeof(extNet.contentHash));
+    extNet.flags = ext.flags;
+    std::memcpy(extNet.attachToken, ext.attachToken, sizeof(extNet.attachToken));
+
     std::memcpy(buffer.data(), &header, sizeof(MessageHeader));
     std::memcpy(buffer.data() + sizeof(MessageHeader), &offer, sizeof(FileOffer));
+    std::memcpy(buffer.data() + sizeof(MessageHeader) + sizeof(FileOffer), &extNet, sizeof(FileOfferExt));
 
     return buffer;
 }
@@ -202,14 +388,17 @@ std::vector<uint8_t> ProtocolParser::packFileOffer(uint32_t sequence,
 std::vector<uint8_t> ProtocolParser::packFileOfferResponse(uint32_t sequence,
                                                            const std::string& fileId,
                                                            uint32_t result,
-                                                           const std::string& message) {
-    std::vector<uint8_t> buffer(sizeof(MessageHeader) + sizeof(FileOfferResponse));
+                                                           const std::string& message,
+                                                           const FileOfferResponseExt& ext) {
+    std::vector<uint8_t> buffer(sizeof(MessageHeader) + sizeof(FileOfferResponse)
+                                + sizeof(FileOfferResponseExt));
 
     MessageHeader header;
     header.magic = htonl(MAGIC_NUMBER);
     header.version = htons(PROTOCOL_VERSION);
     header.msgType = htons(MSG_FILE_OFFER_RSP);
-    header.bodyLength = htonl(static_cast<uint32_t>(sizeof(FileOfferResponse)));
+    header.bodyLength = htonl(static_cast<uint32_t>(sizeof(FileOfferResponse)
+                                                    + sizeof(FileOfferResponseExt)));
     header.sequence = htonl(sequence);
 
     FileOfferResponse rsp;
@@ -218,8 +407,195 @@ std::vector<uint8_t> ProtocolParser::packFileOfferResponse(uint32_t sequence,
     rsp.result = htonl(result);
     std::strncpy(rsp.message, message.c_str(), sizeof(rsp.message) - 1);
 
+    FileOfferResponseExt extNet;
+    std::memset(&extNet, 0, sizeof(extNet));
+    extNet.directAddress = ext.directAddress;
+    extNet.directPort = htons(ext.directPort);
+    std::memcpy(extNet.attachToken, ext.attachToken, sizeof(extNet.attachToken));
+
     std::memcpy(buffer.data(), &header, sizeof(MessageHeader));
     std::memcpy(buffer.data() + sizeof(MessageHeader), &rsp, sizeof(FileOfferResponse));
+    std::memcpy(buffer.data() + sizeof(MessageHeader) + sizeof(FileOfferResponse),
+                &extNet, sizeof(FileOfferResponseExt));
+
+    return buffer;
+}
+
+std::vector<uint8_t> ProtocolParser::packFileStreamAttachResponse(uint32_t sequence,
+                                                                  const std::string& fileId,
+                                                                  uint32_t result,
+                                                                  uint8_t streamIndex) {
+    std::vector<uint8_t> buffer(sizeof(MessageHeader) + sizeof(FileStreamAttachResponse));
+
+    MessageHeader header;
+    header.magic = htonl(MAGIC_NUMBER);
+    header.version = htons(PROTOCOL_VERSION);
+    header.msgType = htons(MSG_FILE_STREAM_ATTACH_RSP);
+    header.bodyLength = htonl(static_cast<uint32_t>(sizeof(FileStreamAttachResponse)));
+    header.sequence = htonl(sequence);
+
+    FileStreamAttachResponse rsp;
+    std::memset(&rsp, 0, sizeof(rsp));
+    std::strncpy(rsp.fileId, fileId.c_str(), sizeof(rsp.fileId) - 1);
+    rsp.result = htonl(result);
+    rsp.streamIndex = streamIndex;
+
+    std::memcpy(buffer.data(), &header, sizeof(MessageHeader));
+    std::memcpy(buffer.data() + sizeof(MessageHeader), &rsp, sizeof(FileStreamAttachResponse));
+
+    return buffer;
+}
+
+std::vector<uint8_t> ProtocolParser::packFileProofRequest(uint32_t sequence,
+                                                          const std::string& fileId,
+                                                          const uint8_t* nonce,
+                                                          uint64_t offset,
+                                                          uint32_t length) {
+    std::vector<uint8_t> buffer(sizeof(MessageHeader) + sizeof(FileProofRequest));
+
+    MessageHeader header;
+    header.magic = htonl(MAGIC_NUMBER);
+    header.version = htons(PROTOCOL_VERSION);
+    header.msgType = htons(MSG_FILE_PROOF_REQ);
+    header.bodyLength = htonl(static_cast<uint32_t>(sizeof(FileProofRequest)));
+    header.sequence = htonl(sequence);
+
+    FileProofRequest req;
+    std::memset(&req, 0, sizeof(req));
+    std::strncpy(req.fileId, fileId.c_str(), sizeof(req.fileId) - 1);
+    std::memcpy(req.nonce, nonce, sizeof(req.nonce));
+    req.offset = hostToNetwork64(offset);
+    req.length = htonl(length);
+
+    std::memcpy(buffer.data(), &header, sizeof(MessageHeader));
+    std::memcpy(buffer.data() + sizeof(MessageHeader), &req, sizeof(FileProofRequest));
+
+    return buffer;
+}
+
+std::vector<uint8_t> ProtocolParser::packRateLimitNotice(uint16_t msgType,
+                                                         uint32_t sequence,
+                                                         uint32_t reason,
+                                                         uint32_t retryAfterMs) {
+    std::vector<uint8_t> buffer(sizeof(MessageHeader) + sizeof(RateLimitNotice));
+
+    MessageHeader header;
+    header.magic = htonl(MAGIC_NUMBER);
+    header.version = htons(PROTOCOL_VERSION);
+    header.msgType = htons(MSG_RATE_LIMITED);
+    header.bodyLength = htonl(static_cast<uint32_t>(sizeof(RateLimitNotice)));
+    header.sequence = htonl(0);
+
+    RateLimitNotice notice;
+    std::memset(&notice, 0, sizeof(notice));
+    notice.msgType = htons(msgType);
+    notice.sequence = htonl(sequence);
+    notice.reason = htonl(reason);
+    notice.retryAfterMs = htonl(retryAfterMs);
+
+    std::memcpy(buffer.data(), &header, sizeof(MessageHeader));
+    std::memcpy(buffer.data() + sizeof(MessageHeader), &notice, sizeof(RateLimitNotice));
+
+    return buffer;
+}
+
+std::vector<uint8_t> ProtocolParser::packHistoryResponse(uint32_t sequence,
+                                                         uint32_t result,
+                                                         const std::vector<HistoryEntry>& entries,
+                                                         bool more) {
+    return packEntryList(MSG_HISTORY_RSP, sequence, result, entries, more);
+}
+
+std::vector<uint8_t> ProtocolParser::packSearchResponse(uint32_t sequence,
+                                                        uint32_t result,
+                                                        const std::vector<HistoryEntry>& entries,
+                                                        bool more) {
+    return packEntryList(MSG_SEARCH_RSP, sequence, result, entries, more);
+}
+
+std::vector<uint8_t> ProtocolParser::packCatchUpResponse(uint32_t sequence,
+                                                         uint32_t runId,
+                                                         uint32_t newestSeq,
+                                                         uint32_t count,
+                                                         bool complete) {
+    std::vector<uint8_t> buffer(sizeof(MessageHeader) + sizeof(CatchUpResponse));
+
+    MessageHeader header;
+    header.magic = htonl(MAGIC_NUMBER);
+    header.version = htons(PROTOCOL_VERSION);
+    header.msgType = htons(MSG_CATCHUP_RSP);
+    header.bodyLength = htonl(static_cast<uint32_t>(sizeof(CatchUpResponse)));
+    header.sequence = htonl(sequence);
+
+    CatchUpResponse rsp;
+    std::memset(&rsp, 0, sizeof(rsp));
+    rsp.runId = htonl(runId);
+    rsp.newestSeq = htonl(newestSeq);
+    rsp.count = htonl(count);
+    rsp.complete = complete ? 1 : 0;
+
+    std::memcpy(buffer.data(), &header, sizeof(MessageHeader));
+    std::memcpy(buffer.data() + sizeof(MessageHeader), &rsp, sizeof(CatchUpResponse));
+
+    return buffer;
+}
+
+std::vector<uint8_t> ProtocolParser::packEntryList(uint16_t msgType,
+                                                   uint32_t sequence,
+                                                   uint32_t result,
+                                                   const std::vector<HistoryEntry>& entries,
+                                                   bool more) {
+    size_t bodyLen = sizeof(HistoryResponse) + entries.size() * sizeof(HistoryEntry);
+    std::vector<uint8_t> buffer(sizeof(MessageHeader) + bodyLen);
+
+    MessageHeader header;
+    header.magic = htonl(MAGIC_NUMBER);
+    header.version = htons(PROTOCOL_VERSION);
+    header.msgType = htons(msgType);
+    header.bodyLength = htonl(static_cast<uint32_t>(bodyLen));
+    header.sequence = htonl(sequence);
+
+    HistoryResponse rsp;
+    std::memset(&rsp, 0, sizeof(rsp));
+    rsp.result = htonl(result);
+    rsp.count = htonl(static_cast<uint32_t>(entries.size()));
+    rsp.more = more ? 1 : 0;
+
+    std::memcpy(buffer.data(), &header, sizeof(MessageHeader));
+    std::memcpy(buffer.data() + sizeof(MessageHeader), &rsp, sizeof(HistoryResponse));
+
+    size_t offset = sizeof(MessageHeader) + sizeof(HistoryResponse);
+    for (const auto& entry : entries) {
+        HistoryEntry out = entry;
+        out.seq = hostToNetwork64(entry.seq);
+        std::memcpy(buffer.data() + offset, &out, sizeof(HistoryEntry));
+        offset += sizeof(HistoryEntry);
+    }
+
+    return buffer;
+}
+
+std::vector<uint8_t> ProtocolParser::packFileDataHeader(uint32_t sequence,
+                                                        const std::string& fileId,
+                                                        uint64_t offset,
+                                                        size_t dataLen) {
+    std::vector<uint8_t> buffer(sizeof(MessageHeader) + sizeof(FileDataHeader));
+
+    MessageHeader header;
+    header.magic = htonl(MAGIC_NUMBER);
+    header.version = htons(PROTOCOL_VERSION);
+    header.msgType = htons(MSG_FILE_DATA);
+    header.bodyLength = htonl(static_cast<uint32_t>(sizeof(FileDataHeader) + dataLen));
+    header.sequence = htonl(sequence);
+
+    FileDataHeader fileHeader;
+    std::memset(&fileHeader, 0, sizeof(fileHeader));
+    std::strncpy(fileHeader.fileId, fileId.c_str(), sizeof(fileHeader.fileId) - 1);
+    fileHeader.offset = hostToNetwork64(offset);
+    fileHeader.chunkSize = htonl(static_cast<uint32_t>(dataLen));
+
+    std::memcpy(buffer.data(), &header, sizeof(MessageHeader));
+    std::memcpy(buffer.data() + sizeof(MessageHeader), &fileHeader, sizeof(FileDataHeader));
 
     return buffer;
 }
@@ -245,6 +621,17 @@ std::vector<uint8_t> ProtocolParser::packRawMessage(uint16_t msgType,
     return buffer;
 }
 
+std::vector<uint8_t> ProtocolParser::packFrameStart(uint16_t msgType,
+                                                    uint32_t sequence,
+                                                    uint32_t bodyLength,
+                                                    const uint8_t* prefix,
+                                                    size_t prefixLen) {
+    std::vector<uint8_t> buffer = packRawMessage(msgType, sequence, prefix, prefixLen);
+    uint32_t netLength = htonl(bodyLength);
+    std::memcpy(buffer.data() + offsetof(MessageHeader, bodyLength), &netLength, sizeof(netLength));
+    return buffer;
+}
+
 bool ProtocolParser::parseLoginRequest(const uint8_t* data, size_t len, LoginRequest& req) {
     if (len < sizeof(LoginRequest)) {
         return false;
@@ -256,6 +643,21 @@ bool ProtocolParser::parseLoginRequest(const uint8_t* data, size_t len, LoginReq
     return true;
 }
 
+bool ProtocolParser::parseLoginRequest(const uint8_t* data, size_t len, LoginRequest& req,
+                                       LoginRequestExt& ext) {
+    if (!parseLoginRequest(data, len, req)) {
+        return false;
+    }
+
+    std::memset(&ext, 0, sizeof(ext));
+    if (len >= sizeof(LoginRequest) + sizeof(ext.password)) {
+        size_t extLen = std::min(len - sizeof(LoginRequest), sizeof(LoginRequestExt));
+        std::memcpy(&ext, data + sizeof(LoginRequest), extLen);
+        ext.password[sizeof(ext.password) - 1] = '\0';
+    }
+    return true;
+}
+
 bool ProtocolParser::parseChatMessage(const uint8_t* data, size_t len, ChatMessage& msg) {
     if (len < sizeof(ChatMessage)) {
         return false;
@@ -271,11 +673,19 @@ bool ProtocolParser::parseChatMessage(const uint8_t* data, size_t len, ChatMessa
     return true;
 }
 
-bool ProtocolParser::parseFileOffer(const uint8_t* data, size_t len, FileOffer& offer) {
+bool ProtocolParser::parseFileOffer(const uint8_t* data, size_t len, FileOffer& offer,
+                                    FileOfferExt& ext) {
     if (len < sizeof(FileOffer)) {
         return false;
     }
 
+    std::memset(&ext, 0, sizeof(ext));
+    if (len >= sizeof(FileOffer) + sizeof(ext.streamCount)) {
+        size_t extLen = std::min(len - sizeof(FileOffer), sizeof(FileOfferExt));
+        std::memcpy(&ext, data + sizeof(FileOffer), extLen);
+        ext.streamCount = ntohl(ext.streamCount);
+    }
+
     std::memcpy(&offer, data, sizeof(FileOffer));
     offer.fileId[sizeof(offer.fileId) - 1] = '\0';
     offer.fromId[sizeof(offer.fromId) - 1] = '\0';
@@ -300,6 +710,113 @@ bool ProtocolParser::parseFileOfferResponse(const uint8_t* data, size_t len, Fil
     return true;
 }
 
+bool ProtocolParser::parseFileOfferResponse(const uint8_t* data, size_t len, FileOfferResponse& rsp,
+                                            FileOfferResponseExt& ext) {
+    if (!parseFileOfferResponse(data, len, rsp)) {
+        return false;
+    }
+
+    std::memset(&ext, 0, sizeof(ext));
+    if (len >= sizeof(FileOfferResponse) + offsetof(FileOfferResponseExt, attachToken)) {
+        size_t extLen = std::min(len - sizeof(FileOfferResponse), sizeof(FileOfferResponseExt));
+        std::memcpy(&ext, data + sizeof(FileOfferResponse), extLen);
+        ext.directPort = ntohs(ext.directPort);
+    }
+    return true;
+}
+
+bool ProtocolParser::parseFileCancel(const uint8_t* data, size_t len, FileCancel& cancel) {
+    if (len < sizeof(FileCancel)) {
+        return false;
+    }
+
+    std::memcpy(&cancel, data, sizeof(FileCancel));
+    cancel.fileId[sizeof(cancel.fileId) - 1] = '\0';
+    cancel.reason = ntohl(cancel.reason);
+
+    return true;
+}
+
+bool ProtocolParser::parseFileStreamAttach(const uint8_t* data, size_t len, FileStreamAttach& attach) {
+    if (len < offsetof(FileStreamAttach, attachToken)) {
+        return false;
+    }
+
+    // Without a token the attach is parsed and then refused.
+    std::memset(&attach, 0, sizeof(attach));
+    std::memcpy(&attach, data, std::min(len, sizeof(FileStreamAttach)));
+    attach.fileId[sizeof(attach.fileId) - 1] = '\0';
+    attach.clientId[sizeof(attach.clientId) - 1] = '\0';
+
+    return true;
+}
+
+bool ProtocolParser::parseFileProofResponse(const uint8_t* data, size_t len, FileProofResponse& rsp) {
+    if (len < sizeof(FileProofResponse)) {
+        return false;
+    }
+
+    std::memcpy(&rsp, data, sizeof(FileProofResponse));
+    rsp.fileId[sizeof(rsp.fileId) - 1] = '\0';
+
+    return true;
+}
+
+bool ProtocolParser::parseFileDataHeader(const uint8_t* data, size_t len, FileDataHeader& header) {
+    if (len < sizeof(FileDataHeader)) {
+        return false;
+    }
+
+    std::memcpy(&header, data, sizeof(FileDataHeader));
+    header.fileId[sizeof(header.fileId) - 1] = '\0';
+    header.offset = networkToHost64(header.offset);
+    header.chunkSize = ntohl(header.chunkSize);
+
+    return true;
+}
+
+bool ProtocolParser::parseHistoryRequest(const uint8_t* data, size_t len, HistoryRequest& req) {
+    if (len < sizeof(HistoryRequest)) {
+        return false;
+    }
+
+    std::memcpy(&req, data, sizeof(HistoryRequest));
+    req.peerId[sizeof(req.peerId) - 1] = '\0';
+    req.beforeSeq = networkToHost64(req.beforeSeq);
+    req.fromTime = networkToHost64(req.fromTime);
+    req.toTime = networkToHost64(req.toTime);
+    req.limit = ntohl(req.limit);
+
+    return true;
+}
+
+bool ProtocolParser::parseSearchRequest(const uint8_t* data, size_t len, SearchRequest& req) {
+    if (len < sizeof(SearchRequest)) {
+        return false;
+    }
+
+    std::memcpy(&req, data, sizeof(SearchRequest));
+    req.query[sizeof(req.query) - 1] = '\0';
+    req.peerId[sizeof(req.peerId) - 1] = '\0';
+    req.beforeSeq = networkToHost64(req.beforeSeq);
+    req.limit = ntohl(req.limit);
+
+    return true;
+}
+
+bool ProtocolParser::parseCatchUpRequest(const uint8_t* data, size_t len, CatchUpRequest& req) {
+    if (len < sizeof(CatchUpRequest)) {
+        return false;
+    }
+
+    std::memcpy(&req, data, sizeof(CatchUpRequest));
+    req.runId = ntohl(req.runId);
+    req.lastSeq = ntohl(req.lastSeq);
+
+    return true;
+}
+
 void ProtocolParser::removeClient(int fd) {
     recvBuffers_.erase(fd);
+    streams_.erase(fd);
 }
@@ -1,6 +1,7 @@
 #ifndef PROTOCOL_H
 #define PROTOCOL_H
 
+#include <atomic>
 #include <cstdint>
 #include <vector>
 #include <string>
@@ -14,18 +15,44 @@
 using MessageCallback = std::function<void(int fd, const MessageHeader& header,
                                            const uint8_t* body, size_t bodyLen)>;
 
+// Streamed frames arrive in pieces: each call carries the frame header, the
+// first prefixLen body bytes, and the next fragment of the rest of the body,
+// starting at bodyOffset. The fragment ending at header.bodyLength is the last.
+using FragmentCallback = std::function<void(int fd, const MessageHeader& header,
+                                            const uint8_t* prefix, size_t prefixLen,
+                                            const uint8_t* data, size_t len,
+                                            size_t bodyOffset)>;
+
 class ProtocolParser {
 public:
     ProtocolParser();
     ~ProtocolParser();
 
     void parseData(int fd, const uint8_t* data, size_t len, MessageCallback callback);
+    void parseData(int fd, const uint8_t* data, size_t len, MessageCallback callback,
+                   FragmentCallback fragments);
+    // Frames of msgType with a body longer than minBodyLength are streamed
+    // instead of being buffered whole.
+    void setStreamed(uint16_t msgType, size_t prefixLen, size_t minBodyLength);
+
+    // Invalid headers are skipped up to the next plausible frame start.
+    uint64_t resyncCount() const {
+        return resyncCount_.load();
+    }
+
+    uint64_t resyncSkippedBytes() const {
+        return resyncSkipped_.load();
+    }
 
     static bool validateHeader(const MessageHeader& header);
     static std::vector<uint8_t> packHeartbeatResponse(uint32_t sequence);
     static std::vector<uint8_t> packLoginResponse(uint32_t sequence,
                                                   uint32_t result,
                                                   const std::string& message);
+    static std::vector<uint8_t> packLoginResponse(uint32_t sequence,
+                                                  uint32_t result,
+                                                  const std::string& message,
+                                                  const LoginResponseExt& ext);
     static std::vector<uint8_t> packChatMessage(uint32_t sequence,
                                                 ChatScope scope,
                                                 const std::string& fromId,
@@ -41,19 +68,71 @@ public:
                                               uint64_t fileSize,
                                               const std::string& fromId,
                                               const std::string& fromNick,
-                                              const std::string& toId);
+                                              const std::string& toId,
+                                              const FileOfferExt& ext);
     static std::vector<uint8_t> packFileOfferResponse(uint32_t sequence,
                                                       const std::string& fileId,
                                                       uint32_t result,
-                                                      const std::string& message);
+                                                      const std::string& message,
+                                                      const FileOfferResponseExt& ext = FileOfferResponseExt());
+    static std::vector<uint8_t> packFileStreamAttachResponse(uint32_t sequence,
+                                                             const std::string& fileId,
+                                                             uint32_t result,
+                                                             uint8_t streamIndex);
+    static std::vector<uint8_t> packFileProofRequest(uint32_t sequence,
+                                                     const std::string& fileId,
+                                                     const uint8_t* nonce,
+                                                     uint64_t offset,
+                                                     uint32_t length);
+    static std::vector<uint8_t> packRateLimitNotice(uint16_t msgType,
+                                                    uint32_t sequence,
+                                                    uint32_t reason,
+                                                    uint32_t retryAfterMs);
+    // Entries carry the seq in host order and the message as it is sent.
+    static std::vector<uint8_t> packHistoryResponse(uint32_t sequence,
+                                                    uint32_t result,
+                                                    const std::vector<HistoryEntry>& entries,
+                                                    bool more);
+    static std::vector<uint8_t> packSearchResponse(uint32_t sequence,
+                                                   uint32_t result,
+                                                   const std::vector<HistoryEntry>& entries,
+                                                   bool more);
+    static std::vector<uint8_t> packCatchUpResponse(uint32_t sequence,
+                                                    uint32_t runId,
+                                                    uint32_t newestSeq,
+                                                    uint32_t count,
+                                                    bool complete);
+    static std::vector<uint8_t> packFileDataHeader(uint32_t sequence,
+                                                   const std::string& fileId,
+                                                   uint64_t offset,
+                                                   size_t dataLen);
     static std::vector<uint8_t> packRawMessage(uint16_t msgType,
                                                uint32_t sequence,
                                                const uint8_t* body,
                                                size_t bodyLen);
+    // Header plus the first prefixLen bytes of a frame whose body is
+    // bodyLength bytes long; the rest of the body follows separately.
+    static std::vector<uint8_t> packFrameStart(uint16_t msgType,
+                                               uint32_t sequence,
+                                               uint32_t bodyLength,
+                                               const uint8_t* prefix,
+                                               size_t prefixLen);
     static bool parseLoginRequest(const uint8_t* data, size_t len, LoginRequest& req);
+    static bool parseLoginRequest(const uint8_t* data, size_t len, LoginRequest& req,
+                                  LoginRequestExt& ext);
     static bool parseChatMessage(const uint8_t* data, size_t len, ChatMessage& msg);
-    static bool parseFileOffer(const uint8_t* data, size_t len, FileOffer& offer);
+    static bool parseFileOffer(const uint8_t* data, size_t len, FileOffer& offer,
+                               FileOfferExt& ext);
     static bool parseFileOfferResponse(const uint8_t* data, size_t len, FileOfferResponse& rsp);
+    static bool parseFileOfferResponse(const uint8_t* data, size_t len, FileOfferResponse& rsp,
+                                       FileOfferResponseExt& ext);
+    static bool parseFileCancel(const uint8_t* data, size_t len, FileCancel& cancel);
+    static bool parseFileStreamAttach(const uint8_t* data, size_t len, FileStreamAttach& attach);
+    static bool parseFileProofResponse(const uint8_t* data, size_t len, FileProofResponse& rsp);
+    static bool parseFileDataHeader(const uint8_t* data, size_t len, FileDataHeader& header);
+    static bool parseHistoryRequest(const uint8_t* data, size_t len, HistoryRequest& req);
+    static bool parseSearchRequest(const uint8_t* data, size_t len, SearchRequest& req);
+    static bool parseCatchUpRequest(const uint8_t* data, size_t len, CatchUpRequest& req);
 
     void removeClient(int fd);
 
@@ -61,7 +140,31 @@ private:
     static constexpr uint32_t MAGIC_NUMBER = 0x12345678;
     static constexpr uint16_t PROTOCOL_VERSION = 0x0001;
 
+    struct StreamRule {
+        size_t prefixLen;
+        size_t minBodyLength;
+    };
+
+    struct StreamState {
+        MessageHeader header;
+        std::vector<uint8_t> prefix;
+        size_t bodyOffset;
+    };
+
+    static std::vector<uint8_t> packEntryList(uint16_t msgType,
+                                              uint32_t sequence,
+                                              uint32_t result,
+                                              const std::vector<HistoryEntry>& entries,
+                                              bool more);
+    size_t continueStream(int fd, const uint8_t* data, size_t len,
+                          const FragmentCallback& fragments);
+    static size_t resyncOffset(const uint8_t* data, size_t len);
+
     std::map<int, std::vector<uint8_t>> recvBuffers_;
+    std::map<uint16_t, StreamRule> streamRules_;
+    std::map<int, StreamState> streams_;
+    std::atomic<uint64_t> resyncCount_{0};
+    std::atomic<uint64_t> resyncSkipped_{0};
 };
 
 #endif
@@ -0,0 +1,84 @@
+#include "recent_ring.h"
+
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+#include "utils.h"
+
+constexpr size_t RecentRing::kFrameSize;
+
+RecentRing::RecentRing(size_t capacity)
+    : capacity_(capacity),
+      slots_(capacity * kFrameSize) {
+    auto now = std::chrono::steady_clock::now().time_since_epoch().count();
+    runId_ = static_cast<uint32_t>(now) ^ static_cast<uint32_t>(getpid()) ^ 0x9e3779b9u;
+    if (runId_ == 0) {
+        runId_ = 1;
+    }
+}
+
+void RecentRing::push(std::vector<uint8_t>& frame) {
+    if (frame.size() != kFrameSize || capacity_ == 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    uint32_t seq = nextSeq_++;
+    uint32_t wireSeq = htonl(seq);
+    std::memcpy(frame.data() + offsetof(MessageHeader, sequence), &wireSeq, sizeof(wireSeq));
+    std::memcpy(slots_.data() + (seq % capacity_) * kFrameSize, frame.data(), kFrameSize);
+}
+
+bool RecentRing::collect(uint32_t afterSeq, uint32_t untilSeq, const std::string& skipFromId,
+                         std::vector<uint8_t>& out, uint32_t& count) {
+    count = 0;
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++stats_.catchUps;
+    uint32_t newest = nextSeq_ - 1;
+    if (afterSeq > newest) {
+        ++stats_.incomplete;
+        return false;
+    }
+    uint32_t oldest = newest >= capacity_ ? newest - static_cast<uint32_t>(capacity_) + 1 : 1;
+    bool complete = afterSeq + 1 >= oldest;
+    uint32_t first = std::max(afterSeq + 1, oldest);
+    uint32_t last = std::min(newest, untilSeq);
+
+    if (first <= last) {
+        out.reserve(out.size() + static_cast<size_t>(last - first + 1) * kFrameSize);
+    }
+    for (uint32_t seq = first; seq != 0 && seq <= last; ++seq) {
+        const uint8_t* frame = slots_.data() + (seq % capacity_) * kFrameSize;
+        const char* fromId = reinterpret_cast<const char*>(frame + sizeof(MessageHeader)
+                                                           + offsetof(ChatMessage, fromId));
+        size_t fromLen = boundedStrnlen(fromId, sizeof(ChatMessage::fromId));
+        if (fromLen == skipFromId.size() && std::memcmp(fromId, skipFromId.data(), fromLen) == 0) {
+            continue;
+        }
+        out.insert(out.end(), frame, frame + kFrameSize);
+        ++count;
+    }
+    stats_.replayed += count;
+    if (!complete) {
+        ++stats_.incomplete;
+    }
+    return complete;
+}
+
+uint32_t RecentRing::newestSeq() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return nextSeq_ - 1;
+}
+
+RecentRingStats RecentRing::stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    RecentRingStats stats = stats_;
+    stats.capacity = capacity_;
+    stats.newestSeq = nextSeq_ - 1;
+    stats.stored = std::min<uint64_t>(nextSeq_ - 1, capacity_);
+    stats.memoryBytes = slots_.size();
+    return stats;
+}
@@ -0,0 +1,52 @@
+#ifndef RECENT_RING_H
+#define RECENT_RING_H
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "common/message.h"
+
+struct RecentRingStats {
+    uint64_t capacity = 0;
+    uint64_t stored = 0;
+    uint64_t newestSeq = 0;
+    uint64_t memoryBytes = 0;
+    uint64_t catchUps = 0;
+    uint64_t replayed = 0;
+    uint64_t incomplete = 0;
+};
+
+// The last capacity group chat frames in a fixed buffer. Each frame is
+// stamped with the next group sequence number in header.sequence, so the
+// frame for seq lives in slot seq % capacity and a reconnecting client can
+// be sent exactly the frames after the last one it saw. Sequence numbers
+// restart with the server; runId tells runs apart.
+class RecentRing {
+public:
+    explicit RecentRing(size_t capacity);
+
+    // Stamps frame, a packed MSG_CHAT_MSG, and keeps a copy.
+    void push(std::vector<uint8_t>& frame);
+    // Appends the frames after afterSeq up to untilSeq, except those sent
+    // by skipFromId, to out. Returns false when some of them were already
+    // overwritten.
+    bool collect(uint32_t afterSeq, uint32_t untilSeq, const std::string& skipFromId,
+                 std::vector<uint8_t>& out, uint32_t& count);
+    uint32_t runId() const { return runId_; }
+    uint32_t newestSeq() const;
+    RecentRingStats stats() const;
+
+    static constexpr size_t kFrameSize = sizeof(MessageHeader) + sizeof(ChatMessage);
+
+private:
+    size_t capacity_;
+    std::vector<uint8_t> slots_;
+    uint32_t runId_;
+    uint32_t nextSeq_ = 1;
+    RecentRingStats stats_;
+    mutable std::mutex mutex_;
+};
+
+#endif
@@ -0,0 +1,325 @@
+#include "search_index.h"
+
+#include <algorithm>
+#include <iterator>
+
+namespace {
+
+constexpr uint32_t kBufferMaxDocs = 4096;
+constexpr size_t kMergeFactor = 4;
+constexpr size_t kMaxTermLength = 32;
+
+void putVarint(std::vector<uint8_t>& out, uint32_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<uint8_t>(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<uint8_t>(value));
+}
+
+void decodePostings(const uint8_t* p, const uint8_t* end, uint32_t base,
+                    std::vector<uint32_t>& docs) {
+    uint32_t doc = base;
+    while (p < end) {
+        uint32_t delta = 0;
+        int shift = 0;
+        while (p < end) {
+            uint8_t byte = *p++;
+            delta |= static_cast<uint32_t>(byte & 0x7f) << shift;
+            if (!(byte & 0x80)) {
+                break;
+            }
+            shift += 7;
+        }
+        doc += delta;
+        docs.push_back(doc);
+    }
+}
+
+size_t tier(uint32_t docCount) {
+    size_t level = 0;
+    uint32_t units = docCount / kBufferMaxDocs;
+    while (units >= kMergeFactor) {
+        units /= kMergeFactor;
+        ++level;
+    }
+    return level;
+}
+
+}  // namespace
+
+void tokenizeForSearch(const char* text, size_t len, std::vector<std::string>& terms) {
+    std::string term;
+    for (size_t i = 0; i <= len; ++i) {
+        unsigned char c = i < len ? static_cast<unsigned char>(text[i]) : 0;
+        bool word = (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c >= 0x80;
+        if (c >= 'A' && c <= 'Z') {
+            c = static_cast<unsigned char>(c - 'A' + 'a');
+            word = true;
+        }
+        if (word) {
+            term.push_back(static_cast<char>(c));
+            continue;
+        }
+        if (!term.empty() && term.size() <= kMaxTermLength) {
+            terms.push_back(term);
+        }
+        term.clear();
+    }
+}
+
+// Frozen run of documents [firstDoc, endDoc). Each term's posting list is
+// the delta from firstDoc, then from the previous document, as varints.
+struct SearchIndex::Segment {
+    uint32_t firstDoc = 0;
+    uint32_t endDoc = 0;
+    std::vector<std::string> terms;
+    std::vector<uint32_t> offsets;
+    std::vector<uint8_t> postings;
+
+    bool find(const std::string& term, std::vector<uint32_t>& docs) const {
+        auto it = std::lower_bound(terms.begin(), terms.end(), term);
+        if (it == terms.end() || *it != term) {
+            return false;
+        }
+        size_t index = static_cast<size_t>(it - terms.begin());
+        decodePostings(postings.data() + offsets[index], postings.data() + offsets[index + 1],
+                       firstDoc, docs);
+        return true;
+    }
+
+    void addTerm(const std::string& term, const std::vector<uint32_t>& docs) {
+        terms.push_back(term);
+        uint32_t prev = firstDoc;
+        for (uint32_t doc : docs) {
+            putVarint(postings, doc - prev);
+            prev = doc;
+        }
+        offsets.push_back(static_cast<uint32_t>(postings.size()));
+    }
+};
+
+SearchIndex::SearchIndex() = default;
+SearchIndex::~SearchIndex() = default;
+
+void SearchIndex::add(uint64_t seq, const std::string& conversation, const char* text, size_t len) {
+    std::vector<std::string> terms;
+    tokenizeForSearch(text, len, terms);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto inserted = conversationIds_.emplace(conversation,
+                                             static_cast<uint32_t>(conversationNames_.size()));
+    if (inserted.second) {
+        conversationNames_.push_back(conversation);
+    }
+    uint32_t doc = docBase_ + static_cast<uint32_t>(docs_.size());
+    docs_.push_back(Document{seq, inserted.first->second});
+    for (const auto& term : terms) {
+        auto& docs = buffer_[term];
+        if (docs.empty() || docs.back() != doc) {
+            docs.push_back(doc);
+        }
+    }
+    ++bufferDocs_;
+    if (bufferDocs_ >= kBufferMaxDocs) {
+        freezeBuffer();
+        mergeTail();
+    }
+}
+
+void SearchIndex::freezeBuffer() {
+    if (bufferDocs_ == 0) {
+        return;
+    }
+    std::unique_ptr<Segment> segment(new Segment());
+    segment->endDoc = docBase_ + static_cast<uint32_t>(docs_.size());
+    segment->firstDoc = segment->endDoc - bufferDocs_;
+    segment->offsets.push_back(0);
+
+    std::vector<const std::string*> terms;
+    terms.reserve(buffer_.size());
+    for (const auto& entry : buffer_) {
+        terms.push_back(&entry.first);
+    }
+    std::sort(terms.begin(), terms.end(), [](const std::string* a, const std::string* b) {
+        return *a < *b;
+    });
+    segment->terms.reserve(terms.size());
+    segment->offsets.reserve(terms.size() + 1);
+    for (const std::string* term : terms) {
+        segment->addTerm(*term, buffer_[*term]);
+    }
+    segment->postings.shrink_to_fit();
+
+    stats_.postingBytes += segment->postings.size();
+    segments_.push_back(std::move(segment));
+    buffer_.clear();
+    bufferDocs_ = 0;
+}
+
+void SearchIndex::mergeTail() {
+    // Merge the newest kMergeFactor segments while they are all the same
+    // size class; sizes then grow geometrically towards the oldest.
+    while (segments_.size() >= kMergeFactor) {
+        size_t first = segments_.size() - kMergeFactor;
+        size_t level = tier(segments_.back()->endDoc - segments_.back()->firstDoc);
+        bool sameTier = true;
+        for (size_t i = first; i < segments_.size(); ++i) {
+            if (tier(segments_[i]->endDoc - segments_[i]->firstDoc) != level) {
+                sameTier = false;
+                break;
+            }
+        }
+        if (!sameTier) {
+            break;
+        }
+        std::unique_ptr<Segment> merged = mergeSegments(first, kMergeFactor);
+        for (size_t i = first; i < segments_.size(); ++i) {
+            stats_.postingBytes -= segments_[i]->postings.size();
+        }
+        stats_.postingBytes += merged->postings.size();
+        segments_.resize(first);
+        segments_.push_back(std::move(merged));
+        ++stats_.merges;
+    }
+}
+
+std::unique_ptr<SearchIndex::Segment> SearchIndex::mergeSegments(size_t first, size_t count) {
+    std::unique_ptr<Segment> merged(new Segment());
+    merged->firstDoc = std::max(segments_[first]->firstDoc, docBase_);
+    merged->endDoc = std::max(segments_[first + count - 1]->endDoc, merged->firstDoc);
+    merged->offsets.push_back(0);
+
+    std::vector<std::string> terms;
+    for (size_t i = first; i < first + count; ++i) {
+        terms.insert(terms.end(), segments_[i]->terms.begin(), segments_[i]->terms.end());
+    }
+    std::sort(terms.begin(), terms.end());
+    terms.erase(std::unique(terms.begin(), terms.end()), terms.end());
+
+    // Inputs cover consecutive document ranges, so concatenating their
+    // lists keeps each one sorted. Trimmed documents are dropped here.
+    std::vector<uint32_t> docs;
+    for (const auto& term : terms) {
+        docs.clear();
+        for (size_t i = first; i < first + count; ++i) {
+            segments_[i]->find(term, docs);
+        }
+        auto live = std::lower_bound(docs.begin(), docs.end(), docBase_);
+        docs.erase(docs.begin(), live);
+        if (!docs.empty()) {
+            merged->addTerm(term, docs);
+        }
+    }
+    merged->postings.shrink_to_fit();
+    return merged;
+}
+
+bool SearchIndex::collectPostings(const Segment* segment, const std::vector<std::string>& terms,
+                                  std::vector<uint32_t>& docs) const {
+    std::vector<std::vector<uint32_t>> lists(terms.size());
+    for (size_t i = 0; i < terms.size(); ++i) {
+        if (segment) {
+            if (!segment->find(terms[i], lists[i])) {
+                return false;
+            }
+        } else {
+            auto it = buffer_.find(terms[i]);
+            if (it == buffer_.end()) {
+                return false;
+            }
+            lists[i] = it->second;
+        }
+    }
+
+    std::sort(lists.begin(), lists.end(),
+              [](const std::vector<uint32_t>& a, const std::vector<uint32_t>& b) {
+                  return a.size() < b.size();
+              });
+    docs.swap(lists[0]);
+    std::vector<uint32_t> next;
+    for (size_t i = 1; i < lists.size() && !docs.empty(); ++i) {
+        next.clear();
+        std::set_intersection(docs.begin(), docs.end(), lists[i].begin(), lists[i].end(),
+                              std::back_inserter(next));
+        docs.swap(next);
+    }
+    return !docs.empty();
+}
+
+void SearchIndex::search(const std::vector<std::string>& terms, uint64_t beforeSeq, size_t limit,
+                         const VisibleFn& visible, std::vector<SearchHit>& hits, bool& more) {
+    hits.clear();
+    more = false;
+    if (terms.empty() || limit == 0) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++stats_.queries;
+    uint32_t cutoff = docBase_ + static_cast<uint32_t>(docs_.size());
+    if (beforeSeq > 0) {
+        auto it = std::lower_bound(docs_.begin(), docs_.end(), beforeSeq,
+                                   [](const Document& doc, uint64_t seq) { return doc.seq < seq; });
+        cutoff = docBase_ + static_cast<uint32_t>(it - docs_.begin());
+    }
+
+    // Visibility is decided once per conversation, not once per match.
+    std::vector<int8_t> verdicts(conversationNames_.size(), -1);
+    std::vector<uint32_t> docs;
+    for (size_t i = segments_.size() + 1; i-- > 0;) {
+        const Segment* segment = i < segments_.size() ? segments_[i].get() : nullptr;
+        if (segment && segment->firstDoc >= cutoff) {
+            continue;
+        }
+        if (!collectPostings(segment, terms, docs)) {
+            continue;
+        }
+        for (auto it = docs.rbegin(); it != docs.rend(); ++it) {
+            uint32_t doc = *it;
+            if (doc >= cutoff) {
+                continue;
+            }
+            if (doc < docBase_) {
+                break;
+            }
+            const Document& document = docs_[doc - docBase_];
+            int8_t& verdict = verdicts[document.conversation];
+            if (verdict < 0) {
+                verdict = visible(conversationNames_[document.conversation]) ? 1 : 0;
+            }
+            if (!verdict) {
+                continue;
+            }
+            if (hits.size() == limit) {
+                more = true;
+                return;
+            }
+            hits.push_back(SearchHit{document.seq, conversationNames_[document.conversation]});
+        }
+    }
+}
+
+void SearchIndex::trim(uint64_t oldestSeq) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    while (!docs_.empty() && docs_.front().seq < oldestSeq && docs_.size() > bufferDocs_) {
+        docs_.pop_front();
+        ++docBase_;
+    }
+    while (!segments_.empty() && segments_.front()->endDoc <= docBase_) {
+        stats_.postingBytes -= segments_.front()->postings.size();
+        segments_.erase(segments_.begin());
+    }
+}
+
+SearchIndexStats SearchIndex::stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    SearchIndexStats stats = stats_;
+    stats.documents = docs_.size();
+    stats.segments = segments_.size();
+    stats.terms = buffer_.size();
+    for (const auto& segment : segments_) {
+        stats.terms += segment->terms.size();
+    }
+    return stats;
+}
@@ -0,0 +1,81 @@
+#ifndef SEARCH_INDEX_H
+#define SEARCH_INDEX_H
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct SearchIndexStats {
+    uint64_t documents = 0;
+    uint64_t terms = 0;
+    uint64_t segments = 0;
+    uint64_t postingBytes = 0;
+    uint64_t merges = 0;
+    uint64_t queries = 0;
+};
+
+struct SearchHit {
+    uint64_t seq;
+    std::string conversation;
+};
+
+// Splits text into lowercase terms: runs of ASCII letters and digits, or
+// of non-ASCII bytes so that UTF-8 words stay whole.
+void tokenizeForSearch(const char* text, size_t len, std::vector<std::string>& terms);
+
+// Inverted index over chat history records. New documents go into an
+// in-memory buffer; full buffers are frozen into immutable segments whose
+// posting lists are delta/varint coded, and runs of similar-sized segments
+// are merged so a query only visits a logarithmic number of them.
+class SearchIndex {
+public:
+    using VisibleFn = std::function<bool(const std::string& conversation)>;
+
+    SearchIndex();
+    ~SearchIndex();
+
+    SearchIndex(const SearchIndex&) = delete;
+    SearchIndex& operator=(const SearchIndex&) = delete;
+
+    // Documents must be added in increasing seq order.
+    void add(uint64_t seq, const std::string& conversation, const char* text, size_t len);
+    // Returns documents containing every term, newest first, below
+    // beforeSeq (0 for no bound) and in conversations visible passes.
+    // more is set when further matches remain.
+    void search(const std::vector<std::string>& terms, uint64_t beforeSeq, size_t limit,
+                const VisibleFn& visible, std::vector<SearchHit>& hits, bool& more);
+    // Forgets documents whose history records are gone.
+    void trim(uint64_t oldestSeq);
+    SearchIndexStats stats() const;
+
+private:
+    struct Segment;
+
+    struct Document {
+        uint64_t seq;
+        uint32_t conversation;
+    };
+
+    void freezeBuffer();
+    void mergeTail();
+    std::unique_ptr<Segment> mergeSegments(size_t first, size_t count);
+    bool collectPostings(const Segment* segment, const std::vector<std::string>& terms,
+                         std::vector<uint32_t>& docs) const;
+
+    std::deque<Document> docs_;
+    uint32_t docBase_ = 0;
+    std::vector<std::string> conversationNames_;
+    std::unordered_map<std::string, uint32_t> conversationIds_;
+    std::unordered_map<std::string, std::vector<uint32_t>> buffer_;
+    uint32_t bufferDocs_ = 0;
+    std::vector<std::unique_ptr<Segment>> segments_;
+    SearchIndexStats stats_;
+    mutable std::mutex mutex_;
+};
+
+#endif
@@ -1,25 +1,51 @@
 #include "server.h"
 #include "utils.h"
+#include "utf8.h"
+#include "credential.h"
 
 #include <arpa/inet.h>
 #include <fcntl.h>
+#include <linux/errqueue.h>
+#include <linux/sockios.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <dirent.h>
+#include <sys/sendfile.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include <algorithm>
 #include <cerrno>
 #include <chrono>
 #include <cstring>
+#include <deque>
+#include <functional>
 #include <iostream>
 
-constexpr int kBacklog = 128;
 constexpr int kEpollMaxEvents = 1024;
 constexpr int kHeartbeatIntervalSec = 5;
 constexpr int kHeartbeatTimeoutSec = 10;
 constexpr size_t kMaxOnlineClients = 1024;
-constexpr size_t kWriteTrimThreshold = 4096;
+constexpr int kMaxWriteSegments = 64;
 constexpr size_t kFileIdSize = 37;
+constexpr uint32_t kMaxFileStreams = 8;
+constexpr size_t kRelayWindowBytes = 1024 * 1024;
+constexpr size_t kSpoolSendSize = 256 * 1024;
+constexpr size_t kStreamedFrameMinBytes = 64 * 1024;
+constexpr uint32_t kStoreProofBytes = 64 * 1024;
+constexpr int kZeroCopyMaxCopied = 8;
+// Long pauses are taken in slices so the connection's liveness is kept
+// fresh while nothing is read from it.
+constexpr int kMaxReadPauseMs = 1000;
+constexpr size_t kOfflineBatchBytes = 64 * 1024;
+constexpr uint32_t kHistoryDefaultPage = 50;
+constexpr uint32_t kHistoryMaxPage = 100;
+constexpr uint32_t kSearchDefaultPage = 20;
+constexpr size_t kSearchMaxTerms = 8;
 
 static int sendFlags() {
 #ifdef MSG_NOSIGNAL
@@ -29,20 +55,44 @@ static int sendFlags() {
 #endif
 }
 
+static int zeroCopyFlag() {
+#ifdef MSG_ZEROCOPY
+    return MSG_ZEROCOPY;
+#else
+    return 0;
+#endif
+}
+
 uint64_t currentEpochSeconds() {
     using namespace std::chrono;
     return static_cast<uint64_t>(
         duration_cast<seconds>(system_clock::now().time_since_epoch()).count());
 }
 
-std::string extractFileId(const uint8_t* body, size_t bodyLen) {
-    if (!body || bodyLen < kFileIdSize) {
-        return {};
+// Group chat is one conversation; a private one is named after both
+// participants, so either side finds the same history.
+std::string historyConversation(ChatScope scope, const std::string& a, const std::string& b) {
+    if (scope == CHAT_GROUP) {
+        return "g";
+    }
+    return a < b ? "p" + a + "\n" + b : "p" + b + "\n" + a;
+}
+
+bool conversationIncludes(const std::string& conversation, const std::string& clientId) {
+    if (conversation.empty() || conversation[0] != 'p') {
+        return false;
+    }
+    size_t split = conversation.find('\n');
+    if (split == std::string::npos) {
+        return false;
     }
-    char fileId[kFileIdSize];
-    std::memcpy(fileId, body, kFileIdSize);
-    fileId[kFileIdSize - 1] = '\0';
-    return std::string(fileId, boundedStrnlen(fileId, kFileIdSize));
+    return conversation.compare(1, split - 1, clientId) == 0
+        || conversation.compare(split + 1, std::string::npos, clientId) == 0;
+}
+
+bool extractFileKey(const uint8_t* body, size_t bodyLen, FileKey& key) {
+    return body && bodyLen >= kFileIdSize
+        && parseFileKey(reinterpret_cast<const char*>(body), kFileIdSize, key);
 }
 
 class ListenHandler : public EventHandler {
@@ -104,6 +154,34 @@ public:
     ClientHandler(Server* server, int fd)
         : server_(server), fd_(fd) {}
 
+    ~ClientHandler() override {
+        // The kernel may still reference pages of unacknowledged zero-copy
+        // sends; keep them alive for another GC period.
+        for (auto& pending : zeroCopyInflight_) {
+            for (auto& buffer : pending.buffers) {
+                server_->zeroCopyRetired_.push_back(std::move(buffer));
+            }
+        }
+    }
+
+    bool enableZeroCopy(size_t minBytes) {
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+        int one = 1;
+        if (setsockopt(fd_, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0) {
+            std::cerr << "[zerocopy] unavailable fd=" << fd_
+                      << " error=" << std::strerror(errno) << std::endl;
+            return false;
+        }
+        zeroCopySocket_ = true;
+        zeroCopy_ = true;
+        zeroCopyMinBytes_ = minBytes;
+        return true;
+#else
+        (void)minBytes;
+        return false;
+#endif
+    }
+
     int getHandle() const override {
         return fd_;
     }
@@ -112,12 +190,28 @@ public:
         if (closing_) {
             return;
         }
+        if (tunnel_) {
+            handleTunnelRead();
+            return;
+        }
+        if (readsPaused_) {
+            return;
+        }
 
         uint8_t buffer[4096];
         while (true) {
             ssize_t n = recv(fd_, buffer, sizeof(buffer), 0);
             if (n > 0) {
                 server_->onClientData(fd_, buffer, static_cast<size_t>(n));
+                if (tunnel_) {
+                    // Everything after the attach frame is raw payload and
+                    // is left in the socket for the tunnel.
+                    return;
+                }
+                if (readsPaused_) {
+                    // Unread data stays in the socket until resumeReads().
+                    return;
+                }
                 continue;
             }
             if (n == 0) {
@@ -143,7 +237,12 @@ public:
         if (!flushOut()) {
             return;
         }
-        if (!closing_ && pending() == 0) {
+        if (tunnel_) {
+            server_->pumpTunnel(fd_);
+            return;
+        }
+        server_->onClientWritable(fd_);
+        if (!closing_ && pendingBytes_ == 0) {
             server_->reactor_->modifyHandler(this, EVENT_READ);
         }
     }
@@ -152,6 +251,28 @@ public:
         if (closing_) {
             return;
         }
+        if (tunnel_ && tunnelSource_ && !(events & EVENT_ERROR)) {
+            // The sender may half-close right after its last byte; keep the
+            // socket until the tunnel has drained it.
+            server_->pumpTunnel(fd_);
+            return;
+        }
+        if (zeroCopySocket_ && !(events & EVENT_HUP)) {
+            // Zero-copy completions are reported through the error queue and
+            // raise EPOLLERR without anything being wrong with the socket.
+            drainZeroCopyCompletions();
+            int soError = 0;
+            socklen_t len = sizeof(soError);
+            if (getsockopt(fd_, SOL_SOCKET, SO_ERROR, &soError, &len) == 0 && soError == 0) {
+                if (events & EVENT_READ) {
+                    handleRead();
+                }
+                if ((events & EVENT_WRITE) && !closing_) {
+                    handleWrite();
+                }
+                return;
+            }
+        }
         std::cerr << "socket error events=" << events << " fd=" << fd_ << std::endl;
         requestClose("socket error");
     }
@@ -164,77 +285,253 @@ public:
             return true;
         }
 
-        if (pending() == 0) {
-            size_t offset = 0;
-            while (offset < data.size()) {
-                ssize_t n = send(fd_,
-                                 data.data() + offset,
-                                 data.size() - offset,
-                                 sendFlags());
-                if (n > 0) {
-                    offset += static_cast<size_t>(n);
-                    continue;
-                }
-                if (n == 0) {
-                    requestClose("peer closed");
-                    return false;
-                }
-                if (errno == EINTR) {
-                    continue;
-                }
-                if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                    break;
-                }
-                std::cerr << "send failed: " << std::strerror(errno) << std::endl;
-                requestClose("send error");
-                return false;
-            }
+        size_t offset = 0;
+        if (pendingBytes_ == 0 && !sendDirect(data.data(), data.size(), offset)) {
+            return false;
+        }
+        if (offset == data.size()) {
+            return true;
+        }
 
-            if (offset == data.size()) {
-                return true;
+        auto rest = std::make_shared<std::vector<uint8_t>>(
+            data.begin() + static_cast<std::vector<uint8_t>::difference_type>(offset),
+            data.end());
+        appendOut(std::move(rest), 0);
+        return true;
+    }
+
+    bool queueShared(const SharedBuffer& data) {
+        if (closing_ || fd_ < 0) {
+            return false;
+        }
+        if (!data || data->empty()) {
+            return true;
+        }
+
+        if (zeroCopy_ && pendingBytes_ == 0 && data->size() >= zeroCopyMinBytes_) {
+            // Go through the queue so the buffer stays pinned until the
+            // kernel reports the zero-copy send complete.
+            appendOut(data, 0);
+            return flushOut();
+        }
+
+        size_t offset = 0;
+        if (pendingBytes_ == 0 && !sendDirect(data->data(), data->size(), offset)) {
+            return false;
+        }
+        if (offset < data->size()) {
+            appendOut(data, offset);
+        }
+        return true;
+    }
+
+    bool queueFile(const std::shared_ptr<const void>& owner, int fileFd,
+                   uint64_t offset, size_t len) {
+        if (closing_ || fd_ < 0) {
+            return false;
+        }
+        if (len == 0) {
+            return true;
+        }
+
+        OutSegment segment;
+        segment.fileOwner = owner;
+        segment.fileFd = fileFd;
+        segment.offset = static_cast<size_t>(offset);
+        segment.length = len;
+        if (pendingBytes_ == 0 && !sendFromFile(segment)) {
+            return false;
+        }
+        if (segment.length > 0) {
+            bool wasEmpty = pendingBytes_ == 0;
+            pendingBytes_ += segment.length;
+            outq_.push_back(std::move(segment));
+            if (wasEmpty) {
+                server_->reactor_->modifyHandler(this, EVENT_READ | EVENT_WRITE);
             }
-            appendOut(data.data() + offset, data.size() - offset);
-        } else {
-            appendOut(data.data(), data.size());
         }
+        return true;
+    }
+
+    size_t pendingBytes() const {
+        return pendingBytes_;
+    }
+
+    void pauseReads() {
+        readsPaused_ = true;
+    }
+
+    // Reading is edge-triggered, so whatever arrived during the pause has
+    // to be drained here rather than waiting for the next event.
+    void resumeReads() {
+        if (!readsPaused_) {
+            return;
+        }
+        readsPaused_ = false;
+        handleRead();
+    }
 
+    // Hands the socket over to a splice tunnel: no more frames are parsed
+    // and write readiness stays armed (edge-triggered) for the pump.
+    void enterTunnel(bool source) {
+        tunnel_ = true;
+        tunnelSource_ = source;
         server_->reactor_->modifyHandler(this, EVENT_READ | EVENT_WRITE);
-        return true;
     }
 
 private:
-    size_t pending() const {
-        return outbuf_.size() - outOffset_;
+    void handleTunnelRead() {
+        if (tunnelSource_) {
+            server_->pumpTunnel(fd_);
+            return;
+        }
+        // The receiving side never sends on its tunnel; only watch for close.
+        uint8_t buffer[512];
+        while (true) {
+            ssize_t n = recv(fd_, buffer, sizeof(buffer), 0);
+            if (n > 0) {
+                continue;
+            }
+            if (n == 0) {
+                requestClose("peer closed");
+                return;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                requestClose("recv error");
+            }
+            return;
+        }
     }
 
-    void appendOut(const uint8_t* data, size_t len) {
-        if (len == 0) {
-            return;
+    // Memory segments reference a shared buffer; file segments (spool or
+    // content store) are sent straight from the file with sendfile().
+    struct OutSegment {
+        SharedBuffer data;
+        size_t offset = 0;
+        std::shared_ptr<const void> fileOwner;
+        int fileFd = -1;
+        size_t length = 0;
+
+        bool isFile() const {
+            return fileFd >= 0;
+        }
+
+        size_t remaining() const {
+            return isFile() ? length : data->size() - offset;
+        }
+    };
+
+    bool sendFromFile(OutSegment& segment) {
+        while (segment.length > 0) {
+            off_t offset = static_cast<off_t>(segment.offset);
+            ssize_t n = sendfile(fd_, segment.fileFd, &offset, segment.length);
+            if (n > 0) {
+                segment.offset += static_cast<size_t>(n);
+                segment.length -= static_cast<size_t>(n);
+                continue;
+            }
+            if (n == 0) {
+                requestClose("spool truncated");
+                return false;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return true;
+            }
+            std::cerr << "sendfile failed: " << std::strerror(errno) << std::endl;
+            requestClose("send error");
+            return false;
+        }
+        return true;
+    }
+
+    bool sendDirect(const uint8_t* data, size_t len, size_t& offset) {
+        while (offset < len) {
+            ssize_t n = send(fd_, data + offset, len - offset, sendFlags());
+            if (n > 0) {
+                offset += static_cast<size_t>(n);
+                continue;
+            }
+            if (n == 0) {
+                requestClose("peer closed");
+                return false;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return true;
+            }
+            std::cerr << "send failed: " << std::strerror(errno) << std::endl;
+            requestClose("send error");
+            return false;
         }
-        if (pending() == 0) {
-            outbuf_.clear();
-            outOffset_ = 0;
+        return true;
+    }
+
+    void appendOut(SharedBuffer data, size_t offset) {
+        bool wasEmpty = pendingBytes_ == 0;
+        OutSegment segment;
+        segment.data = std::move(data);
+        segment.offset = offset;
+        pendingBytes_ += segment.remaining();
+        outq_.push_back(std::move(segment));
+        if (wasEmpty) {
+            server_->reactor_->modifyHandler(this, EVENT_READ | EVENT_WRITE);
         }
-        outbuf_.insert(outbuf_.end(), data, data + len);
     }
 
     bool flushOut() {
-        while (pending() > 0) {
-            ssize_t n = send(fd_,
-                             outbuf_.data() + outOffset_,
-                             pending(),
-                             sendFlags());
+        if (!zeroCopyInflight_.empty()) {
+            // EPOLLERR is edge-triggered and only reliably raised for the first
+            // completion, so reap the error queue before every flush as well.
+            drainZeroCopyCompletions();
+        }
+        bool zeroCopyAllowed = zeroCopy_;
+        while (!outq_.empty()) {
+            if (outq_.front().isFile()) {
+                OutSegment& front = outq_.front();
+                size_t before = front.length;
+                if (!sendFromFile(front)) {
+                    return false;
+                }
+                pendingBytes_ -= before - front.length;
+                if (front.length > 0) {
+                    return true;
+                }
+                outq_.pop_front();
+                continue;
+            }
+
+            iovec iov[kMaxWriteSegments];
+            int count = 0;
+            size_t batchBytes = 0;
+            for (auto it = outq_.begin();
+                 it != outq_.end() && !it->isFile() && count < kMaxWriteSegments; ++it) {
+                iov[count].iov_base = const_cast<uint8_t*>(it->data->data() + it->offset);
+                iov[count].iov_len = it->data->size() - it->offset;
+                batchBytes += iov[count].iov_len;
+                ++count;
+            }
+
+            msghdr msg;
+            std::memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = static_cast<size_t>(count);
+
+            bool zeroCopy = zeroCopyAllowed && zeroCopy_ && batchBytes >= zeroCopyMinBytes_;
+            int flags = sendFlags() | (zeroCopy ? zeroCopyFlag() : 0);
+            ssize_t n = sendmsg(fd_, &msg, flags);
             if (n > 0) {
-                outOffset_ += static_cast<size_t>(n);
-                if (pending() == 0) {
-                    outbuf_.clear();
-                    outOffset_ = 0;
-                } else if (outOffset_ >= kWriteTrimThreshold) {
-                    outbuf_.erase(outbuf_.begin(),
-                                  outbuf_.begin()
-                                      + static_cast<std::vector<uint8_t>::difference_type>(outOffset_));
-                    outOffset_ = 0;
+                if (zeroCopy) {
+                    pinZeroCopySend(static_cast<size_t>(n));
                 }
+                consumeOut(static_cast<size_t>(n));
                 continue;
             }
             if (n == 0) {
@@ -244,6 +541,11 @@ private:
             if (errno == EINTR) {
                 continue;
             }
+            if (zeroCopy && errno == ENOBUFS) {
+                // Out of optmem for page pinning; copy this round instead.
+                zeroCopyAllowed = false;
+                continue;
+            }
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
                 return true;
             }
@@ -254,6 +556,91 @@ private:
         return true;
     }
 
+    void consumeOut(size_t n) {
+        pendingBytes_ -= n;
+        while (n > 0) {
+            OutSegment& front = outq_.front();
+            size_t avail = front.remaining();
+            if (n < avail) {
+                front.offset += n;
+                return;
+            }
+            n -= avail;
+            outq_.pop_front();
+        }
+    }
+
+    // Each successful MSG_ZEROCOPY send gets the next id from a per-socket
+    // counter; the buffers it touched are held until that id completes.
+    void pinZeroCopySend(size_t sent) {
+        ZeroCopySend pending;
+        pending.id = zeroCopyNextId_++;
+        for (auto it = outq_.begin(); it != outq_.end() && sent > 0; ++it) {
+            pending.buffers.push_back(it->data);
+            sent -= std::min(sent, it->remaining());
+        }
+        zeroCopyInflight_.push_back(std::move(pending));
+        server_->zeroCopySends_++;
+    }
+
+    void drainZeroCopyCompletions() {
+#ifdef SO_EE_ORIGIN_ZEROCOPY
+        while (true) {
+            char control[128];
+            msghdr msg;
+            std::memset(&msg, 0, sizeof(msg));
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+
+            if (recvmsg(fd_, &msg, MSG_ERRQUEUE) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return;
+            }
+            for (cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+                bool recvErr = (cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                               (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR);
+                if (!recvErr) {
+                    continue;
+                }
+                sock_extended_err err;
+                std::memcpy(&err, CMSG_DATA(cm), sizeof(err));
+                if (err.ee_errno != 0 || err.ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                    continue;
+                }
+                completeZeroCopy(err.ee_info, err.ee_data,
+                                 (err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) != 0);
+            }
+        }
+#endif
+    }
+
+    // Completes the inclusive id range [lo, hi]; ids wrap at 2^32.
+    void completeZeroCopy(uint32_t lo, uint32_t hi, bool copied) {
+        uint32_t span = hi - lo;
+        size_t before = zeroCopyInflight_.size();
+        zeroCopyInflight_.erase(
+            std::remove_if(zeroCopyInflight_.begin(), zeroCopyInflight_.end(),
+                           [lo, span](const ZeroCopySend& pending) {
+                               return pending.id - lo <= span;
+                           }),
+            zeroCopyInflight_.end());
+        server_->zeroCopyCompletions_ += before - zeroCopyInflight_.size();
+
+        if (!copied) {
+            zeroCopyCopiedStreak_ = 0;
+            return;
+        }
+        server_->zeroCopyCopied_ += static_cast<uint64_t>(span) + 1;
+        // The kernel fell back to copying (e.g. loopback or a device without
+        // scatter-gather); pinning then only adds overhead.
+        if (zeroCopy_ && ++zeroCopyCopiedStreak_ >= kZeroCopyMaxCopied) {
+            zeroCopy_ = false;
+            std::cout << "[zerocopy] fallback fd=" << fd_ << " reason=copied" << std::endl;
+        }
+    }
+
     void requestClose(const char* reason) {
         if (closing_) {
             return;
@@ -266,13 +653,101 @@ private:
     Server* server_;
     int fd_;
     bool closing_ = false;
-    std::vector<uint8_t> outbuf_;
-    size_t outOffset_ = 0;
+    std::deque<OutSegment> outq_;
+    size_t pendingBytes_ = 0;
+
+    struct ZeroCopySend {
+        uint32_t id = 0;
+        std::vector<SharedBuffer> buffers;
+    };
+
+    bool tunnel_ = false;
+    bool tunnelSource_ = false;
+    bool readsPaused_ = false;
+    bool zeroCopySocket_ = false;
+    bool zeroCopy_ = false;
+    size_t zeroCopyMinBytes_ = 0;
+    uint32_t zeroCopyNextId_ = 0;
+    int zeroCopyCopiedStreak_ = 0;
+    std::deque<ZeroCopySend> zeroCopyInflight_;
+};
+
+// Owns a timerfd, or an eventfd, which drains the same way: the callback
+// runs once per wakeup however many expirations or posts were counted.
+class TimerHandler : public EventHandler {
+public:
+    TimerHandler(int fd, std::function<void()> callback)
+        : fd_(fd), callback_(std::move(callback)) {}
+
+    ~TimerHandler() override {
+        if (fd_ >= 0) {
+            close(fd_);
+        }
+    }
+
+    static int createTimerFd(int intervalMs) {
+        int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (fd < 0) {
+            std::cerr << "timerfd_create failed: " << std::strerror(errno) << std::endl;
+            return -1;
+        }
+        itimerspec spec;
+        std::memset(&spec, 0, sizeof(spec));
+        spec.it_interval.tv_sec = intervalMs / 1000;
+        spec.it_interval.tv_nsec = static_cast<long>(intervalMs % 1000) * 1000000L;
+        spec.it_value = spec.it_interval;
+        if (timerfd_settime(fd, 0, &spec, nullptr) < 0) {
+            std::cerr << "timerfd_settime failed: " << std::strerror(errno) << std::endl;
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    // Replaces the timer's schedule with a single expiry delayMs from now.
+    bool armOnce(int delayMs) {
+        itimerspec spec;
+        std::memset(&spec, 0, sizeof(spec));
+        delayMs = std::max(delayMs, 1);
+        spec.it_value.tv_sec = delayMs / 1000;
+        spec.it_value.tv_nsec = static_cast<long>(delayMs % 1000) * 1000000L;
+        if (timerfd_settime(fd_, 0, &spec, nullptr) < 0) {
+            std::cerr << "timerfd_settime failed: " << std::strerror(errno) << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    int getHandle() const override {
+        return fd_;
+    }
+
+    void handleRead() override {
+        uint64_t expirations = 0;
+        bool fired = false;
+        while (read(fd_, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+            fired = true;
+        }
+        if (fired) {
+            callback_();
+        }
+    }
+
+    void handleWrite() override {}
+
+    void handleError(uint32_t events) override {
+        std::cerr << "timer error events=" << events << " fd=" << fd_ << std::endl;
+    }
+
+private:
+    int fd_;
+    std::function<void()> callback_;
 };
 
-Server::Server(const std::string& ip, int port)
+Server::Server(const std::string& ip, int port, const ServerConfig& config)
     : ip_(ip),
       port_(port),
+      config_(config),
       listenFd_(-1),
       running_(false) {}
 
@@ -303,6 +778,7 @@ bool Server::start() {
 
     clientMgr_ = std::make_unique<ClientManager>();
     protocol_ = std::make_unique<ProtocolParser>();
+    protocol_->setStreamed(MSG_FILE_DATA, sizeof(FileDataHeader), kStreamedFrameMinBytes);
     listenHandler_ = std::make_unique<ListenHandler>(this, listenFd_);
     if (!reactor_->registerHandler(listenHandler_.get(), EVENT_READ)) {
         std::cerr << "epoll_ctl add listen failed: " << std::strerror(errno) << std::endl;
@@ -311,42 +787,218 @@ bool Server::start() {
         listenFd_ = -1;
         return false;
     }
-    return true;
-}
-
-void Server::stop() {
-    running_ = false;
-}
-
-void Server::run() {
-    if (!reactor_ || !clientMgr_ || !protocol_) {
-        std::cerr << "server not initialized" << std::endl;
-        return;
-    }
 
-    running_ = true;
-    heartbeatThread_ = std::thread(&Server::heartbeatLoop, this);
-
-    while (running_) {
-        processPendingDisconnects();
-        int nReady = reactor_->poll(1000);
-        if (nReady < 0) {
-            std::cerr << "epoll_wait error: " << std::strerror(errno) << std::endl;
-            break;
+    removeStaleSpoolFiles();
+    if (config_.storeMaxBytes > 0) {
+        contentStore_ = std::make_unique<ContentStore>(config_.storeDir, config_.storeMaxBytes);
+        if (!contentStore_->init()) {
+            std::cerr << "[store] disabled" << std::endl;
+            contentStore_.reset();
         }
-        processPendingDisconnects();
     }
-
-    running_ = false;
-    if (heartbeatThread_.joinable()) {
-        heartbeatThread_.join();
+    if (!config_.chatFilterFile.empty()) {
+        chatFilter_ = std::make_unique<ContentFilter>(config_.chatFilterFile);
+        if (!chatFilter_->load()) {
+            std::cerr << "[filter] disabled" << std::endl;
+            chatFilter_.reset();
+        }
     }
-    cleanupAllClients();
+    if (config_.offlineMaxBytes > 0) {
+        OfflineSync sync = OfflineSync::Interval;
+        if (config_.offlineSync == "always") {
+            sync = OfflineSync::Always;
+        } else if (config_.offlineSync == "os") {
+            sync = OfflineSync::Os;
+        }
+        offlineStore_ = std::make_unique<OfflineStore>(
+            config_.offlineDir, config_.offlineSegmentBytes, config_.offlineMaxBytes,
+            sync, config_.offlineMaxPerUser);
+        if (!offlineStore_->init()) {
+            std::cerr << "[offline] disabled" << std::endl;
+            offlineStore_.reset();
+        } else if (sync == OfflineSync::Interval) {
+            int syncFd = TimerHandler::createTimerFd(config_.offlineSyncMs);
+            if (syncFd >= 0) {
+                offlineSyncTimer_ = std::make_unique<TimerHandler>(syncFd, [this]() {
+                    offlineStore_->sync();
+                });
+                if (!reactor_->registerHandler(offlineSyncTimer_.get(), EVENT_READ)) {
+                    std::cerr << "epoll_ctl add timer failed: " << std::strerror(errno) << std::endl;
+                    offlineSyncTimer_.reset();
+                }
+            }
+        }
+    }
+    if (config_.historyMaxBytes > 0) {
+        historyStore_ = std::make_unique<HistoryStore>(
+            config_.historyDir, config_.historySegmentBytes, config_.historyMaxBytes);
+        if (!historyStore_->init()) {
+            std::cerr << "[history] disabled" << std::endl;
+            historyStore_.reset();
+        }
+    }
+    if (historyStore_ && config_.searchIndex) {
+        searchIndex_ = std::make_unique<SearchIndex>();
+        auto started = std::chrono::steady_clock::now();
+        uint64_t documents = 0;
+        uint64_t bytes = 0;
+        historyStore_->scan([this, &documents, &bytes](const std::string& conversation, uint64_t seq,
+                                                       const uint8_t* payload, size_t len) {
+            indexHistoryRecord(conversation, seq, payload, len);
+            ++documents;
+            bytes += len;
+        });
+        auto elapsedMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - started).count();
+        std::cout << "[search] indexed documents=" << documents
+                  << " bytes=" << bytes
+                  << " ms=" << elapsedMs << std::endl;
+    }
+    if (!config_.userDb.empty()) {
+        userDirectory_ = std::make_unique<UserDirectory>(config_.userDb);
+        if (!userDirectory_->load()) {
+            std::cerr << "[users] disabled" << std::endl;
+            userDirectory_.reset();
+        }
+    }
+    if (userDirectory_) {
+        int notifyFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (notifyFd < 0) {
+            std::cerr << "[auth] eventfd failed: " << std::strerror(errno) << std::endl;
+            return false;
+        }
+        authNotifier_ = std::make_unique<TimerHandler>(notifyFd, [this]() {
+            finishPendingLogins();
+        });
+        if (!reactor_->registerHandler(authNotifier_.get(), EVENT_READ)) {
+            std::cerr << "[auth] cannot watch eventfd" << std::endl;
+            return false;
+        }
+        authPool_ = std::make_unique<AuthPool>(static_cast<size_t>(config_.authThreads),
+                                               config_.authQueueMax, notifyFd);
+    }
+    if (config_.recentRingMessages > 0) {
+        recentRing_ = std::make_unique<RecentRing>(config_.recentRingMessages);
+    }
+    if (config_.loginRatePerSec > 0) {
+        loginBucket_ = TokenBucket(config_.loginRatePerSec, config_.loginBurst);
+    }
+    if (config_.rosterFlushMs > 0) {
+        int rosterFd = TimerHandler::createTimerFd(0);
+        if (rosterFd >= 0) {
+            rosterTimer_ = std::make_unique<TimerHandler>(rosterFd, [this]() {
+                flushUserList();
+            });
+            if (!reactor_->registerHandler(rosterTimer_.get(), EVENT_READ)) {
+                std::cerr << "epoll_ctl add timer failed: " << std::strerror(errno) << std::endl;
+                rosterTimer_.reset();
+            }
+        }
+    }
+    if (config_.resumeGraceSec > 0) {
+        int resumeFd = TimerHandler::createTimerFd(0);
+        if (resumeFd >= 0) {
+            resumeTimer_ = std::make_unique<TimerHandler>(resumeFd, [this]() {
+                expireDetachedSessions();
+            });
+            if (!reactor_->registerHandler(resumeTimer_.get(), EVENT_READ)) {
+                std::cerr << "epoll_ctl add timer failed: " << std::strerror(errno) << std::endl;
+                resumeTimer_.reset();
+            }
+        }
+        if (resumeTimer_) {
+            sessions_ = std::make_unique<SessionTable>(config_.resumeGraceSec);
+        } else {
+            std::cerr << "[session] resume tokens disabled" << std::endl;
+        }
+    }
+    int timerFd = TimerHandler::createTimerFd(config_.spoolGcIntervalSec * 1000);
+    if (timerFd >= 0) {
+        spoolGcTimer_ = std::make_unique<TimerHandler>(timerFd, [this]() {
+            collectSpoolGarbage();
+            expireIdleFileSessions();
+            releaseRetiredZeroCopyBuffers();
+            if (userDirectory_) {
+                userDirectory_->reloadIfChanged();
+            }
+            if (chatFilter_) {
+                chatFilter_->reloadIfChanged();
+            }
+            if (offlineStore_) {
+                offlineStore_->expire(currentEpochSeconds(),
+                                      static_cast<uint64_t>(config_.offlineRetentionSec));
+            }
+            if (historyStore_) {
+                historyStore_->compact(currentEpochSeconds(),
+                                       static_cast<uint64_t>(config_.historyRetentionSec));
+            }
+            if (searchIndex_) {
+                searchIndex_->trim(historyStore_->oldestSeq());
+            }
+        });
+        if (!reactor_->registerHandler(spoolGcTimer_.get(), EVENT_READ)) {
+            std::cerr << "epoll_ctl add timer failed: " << std::strerror(errno) << std::endl;
+            spoolGcTimer_.reset();
+        }
+    }
+    if (config_.fileRateBytes > 0) {
+        timerFd = TimerHandler::createTimerFd(0);
+        if (timerFd >= 0) {
+            throttleTimer_ = std::make_unique<TimerHandler>(timerFd, [this]() {
+                resumePausedReads();
+            });
+            if (!reactor_->registerHandler(throttleTimer_.get(), EVENT_READ)) {
+                std::cerr << "epoll_ctl add timer failed: " << std::strerror(errno) << std::endl;
+                throttleTimer_.reset();
+            }
+        }
+        if (!throttleTimer_) {
+            std::cerr << "[throttle] file rate limit disabled" << std::endl;
+        }
+    }
+    return true;
+}
+
+void Server::stop() {
+    running_ = false;
+}
+
+void Server::run() {
+    if (!reactor_ || !clientMgr_ || !protocol_) {
+        std::cerr << "server not initialized" << std::endl;
+        return;
+    }
+
+    running_ = true;
+    heartbeatThread_ = std::thread(&Server::heartbeatLoop, this);
+
+    while (running_) {
+        processPendingDisconnects();
+        int nReady = reactor_->poll(1000);
+        if (nReady < 0) {
+            std::cerr << "epoll_wait error: " << std::strerror(errno) << std::endl;
+            break;
+        }
+        processPendingDisconnects();
+    }
+
+    running_ = false;
+    if (heartbeatThread_.joinable()) {
+        heartbeatThread_.join();
+    }
+    cleanupAllClients();
     if (listenFd_ >= 0) {
         close(listenFd_);
         listenFd_ = -1;
     }
     listenHandler_.reset();
+    authPool_.reset();
+    authNotifier_.reset();
+    resumeTimer_.reset();
+    rosterTimer_.reset();
+    spoolGcTimer_.reset();
+    throttleTimer_.reset();
+    offlineSyncTimer_.reset();
     reactor_.reset();
 }
 
@@ -388,7 +1040,7 @@ bool Server::initListenSocket() {
         return false;
     }
 
-    if (listen(listenFd_, kBacklog) < 0) {
+    if (listen(listenFd_, config_.listenBacklog) < 0) {
         std::cerr << "listen failed: " << std::strerror(errno) << std::endl;
         close(listenFd_);
         listenFd_ = -1;
@@ -420,13 +1072,50 @@ bool Server::setNonBlocking(int fd) {
     return true;
 }
 
+// Probes start after idleSec of silence; a peer that misses three, or
+// leaves sent data unacknowledged for as long, gets the socket reset and
+// shows up as a read error.
+bool Server::setKeepAlive(int fd, int idleSec) {
+    int on = 1;
+    int interval = std::max(1, idleSec / 3);
+    int count = 3;
+    unsigned int userTimeoutMs = static_cast<unsigned int>(idleSec + interval * count) * 1000;
+    if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on)) < 0 ||
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idleSec, sizeof(idleSec)) < 0 ||
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval)) < 0 ||
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count)) < 0 ||
+        setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &userTimeoutMs,
+                   sizeof(userTimeoutMs)) < 0) {
+        std::cerr << "setsockopt keepalive failed: " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    return true;
+}
+
 bool Server::registerClient(int clientFd, const std::string& ip, int port) {
     if (!reactor_ || !clientMgr_) {
         close(clientFd);
         return false;
     }
 
-    if (!setNonBlocking(clientFd)) {
+    // Cheap refusals first: in a reconnect storm most connections are
+    // turned away here and retry after backing off.
+    if (config_.maxUnauthenticated > 0 && unauthenticated_.size() >= config_.maxUnauthenticated) {
+        ++refusedConnections_;
+        close(clientFd);
+        return false;
+    }
+    if (config_.maxConnsPerIp > 0) {
+        auto ipIt = connectionsPerIp_.find(ip);
+        if (ipIt != connectionsPerIp_.end() && ipIt->second >= config_.maxConnsPerIp) {
+            ++refusedPerIp_;
+            close(clientFd);
+            return false;
+        }
+    }
+
+    if (!setNonBlocking(clientFd) ||
+        (config_.tcpKeepaliveSec > 0 && !setKeepAlive(clientFd, config_.tcpKeepaliveSec))) {
         close(clientFd);
         return false;
     }
@@ -438,23 +1127,63 @@ bool Server::registerClient(int clientFd, const std::string& ip, int port) {
         return false;
     }
 
+    if (config_.zeroCopySend) {
+        handler->enableZeroCopy(config_.zeroCopyMinBytes);
+    }
+
+    if (config_.msgRatePerSec > 0 || throttleTimer_) {
+        ClientLimits& limits = clientLimits_[clientFd];
+        limits.messages = TokenBucket(config_.msgRatePerSec, config_.msgBurst);
+        if (throttleTimer_) {
+            limits.fileBytes = TokenBucket(static_cast<double>(config_.fileRateBytes),
+                                           static_cast<double>(config_.fileBurstBytes));
+        }
+    }
+
     clientMgr_->addClient(clientFd, ip, port);
     clientHandlers_.emplace(clientFd, std::move(handler));
+    unauthenticated_.insert(clientFd);
+    unauthenticatedCount_ = unauthenticated_.size();
+    if (config_.maxConnsPerIp > 0) {
+        ++connectionsPerIp_[ip];
+    }
     return true;
 }
 
+void Server::leaveUnauthenticated(int clientFd) {
+    unauthenticated_.erase(clientFd);
+    unauthenticatedCount_ = unauthenticated_.size();
+}
+
 void Server::onClientData(int clientFd, const uint8_t* data, size_t len) {
+    // Any traffic proves the peer is alive, so busy clients need not ping.
+    // Touched once per read rather than per frame.
+    clientMgr_->updateHeartbeat(clientFd);
+    if (!offlineDeliveries_.empty()) {
+        confirmOfflineDelivery(clientFd);
+    }
     protocol_->parseData(
         clientFd,
         data,
         len,
         [this](int fd, const MessageHeader& header, const uint8_t* body, size_t bodyLen) {
             this->handleMessage(fd, header, body, bodyLen);
+        },
+        [this](int fd, const MessageHeader& header, const uint8_t* prefix, size_t prefixLen,
+               const uint8_t* data, size_t len, size_t bodyOffset) {
+            this->handleFileDataFragment(fd, header, prefix, prefixLen, data, len, bodyOffset);
         });
 }
 
 void Server::handleMessage(int clientFd, const MessageHeader& header,
                            const uint8_t* body, size_t bodyLen) {
+    if (!admitMessage(clientFd, header)) {
+        return;
+    }
+    if (header.msgType == MSG_FILE_DATA) {
+        chargeFileBytes(clientFd, bodyLen);
+    }
+
     switch (header.msgType) {
         case MSG_HEARTBEAT_REQ: {
             if (bodyLen != 0) {
@@ -462,79 +1191,22 @@ void Server::handleMessage(int clientFd, const MessageHeader& header,
                           << " fd=" << clientFd << std::endl;
                 break;
             }
-            clientMgr_->updateHeartbeat(clientFd);
+            ++heartbeatRequests_;
             auto response = ProtocolParser::packHeartbeatResponse(header.sequence);
             if (!sendResponse(clientFd, response)) {
                 std::cerr << "send heartbeat response failed for fd=" << clientFd << std::endl;
             }
             break;
         }
-        case MSG_LOGIN_REQ: {
-            LoginRequest req;
-            if (!ProtocolParser::parseLoginRequest(body, bodyLen, req)) {
-                auto response = ProtocolParser::packLoginResponse(
-                    header.sequence, LOGIN_INVALID_PARAM, "Invalid parameters");
-                sendResponse(clientFd, response);
-                break;
-            }
-
-            std::string clientId(req.clientId,
-                                 boundedStrnlen(req.clientId, sizeof(req.clientId)));
-            std::string nickname(req.nickname,
-                                 boundedStrnlen(req.nickname, sizeof(req.nickname)));
-
-            if (clientId.empty() || nickname.empty()) {
-                auto response = ProtocolParser::packLoginResponse(
-                    header.sequence, LOGIN_INVALID_PARAM, "Invalid parameters");
-                sendResponse(clientFd, response);
-                break;
-            }
-
-            if (clientMgr_->isClientIdOnline(clientId, clientFd)) {
-                auto response = ProtocolParser::packLoginResponse(
-                    header.sequence, LOGIN_ALREADY_ONLINE, "Client already online");
-                sendResponse(clientFd, response);
-                break;
-            }
-
-            if (clientMgr_->isNicknameOnline(nickname, clientFd)) {
-                auto response = ProtocolParser::packLoginResponse(
-                    header.sequence, LOGIN_NICKNAME_TAKEN, "Nickname taken");
-                sendResponse(clientFd, response);
-                break;
-            }
-
-            if (clientMgr_->getOnlineCount() >= kMaxOnlineClients) {
-                auto response = ProtocolParser::packLoginResponse(
-                    header.sequence, LOGIN_SERVER_FULL, "Server full");
-                sendResponse(clientFd, response);
-                break;
-            }
-
-            if (!clientMgr_->setClientIdentity(clientFd, clientId, nickname)) {
-                auto response = ProtocolParser::packLoginResponse(
-                    header.sequence, LOGIN_INVALID_PARAM, "Invalid parameters");
-                sendResponse(clientFd, response);
-                break;
-            }
-
-            auto response = ProtocolParser::packLoginResponse(
-                header.sequence, LOGIN_SUCCESS, "OK");
-            if (!sendResponse(clientFd, response)) {
-                std::cerr << "send login response failed for fd=" << clientFd << std::endl;
-            }
-
-            std::cout << "[login] fd=" << clientFd
-                      << " clientId=" << clientId
-                      << " nickname=" << nickname << std::endl;
-            broadcastUserList();
+        case MSG_LOGIN_REQ:
+            handleLoginRequest(clientFd, header, body, bodyLen);
             break;
-        }
         case MSG_LOGOUT_REQ: {
             if (bodyLen != 0) {
                 std::cerr << "invalid logout body length=" << bodyLen
                           << " fd=" << clientFd << std::endl;
             }
+            sessionEnds_[clientFd] = SessionEnd::Logout;
             queueDisconnect(clientFd);
             break;
         }
@@ -544,6 +1216,15 @@ void Server::handleMessage(int clientFd, const MessageHeader& header,
         case MSG_USER_LIST_REQ:
             handleUserListRequest(clientFd, header);
             break;
+        case MSG_HISTORY_REQ:
+            handleHistoryRequest(clientFd, header, body, bodyLen);
+            break;
+        case MSG_SEARCH_REQ:
+            handleSearchRequest(clientFd, header, body, bodyLen);
+            break;
+        case MSG_CATCHUP_REQ:
+            handleCatchUpRequest(clientFd, header, body, bodyLen);
+            break;
         case MSG_FILE_OFFER:
             handleFileOffer(clientFd, header, body, bodyLen);
             break;
@@ -554,6 +1235,15 @@ void Server::handleMessage(int clientFd, const MessageHeader& header,
         case MSG_FILE_DATA_ACK:
             handleFileData(clientFd, header, body, bodyLen);
             break;
+        case MSG_FILE_STREAM_ATTACH:
+            handleFileStreamAttach(clientFd, header, body, bodyLen);
+            break;
+        case MSG_FILE_CANCEL:
+            handleFileCancel(clientFd, body, bodyLen);
+            break;
+        case MSG_FILE_PROOF_RSP:
+            handleFileProof(clientFd, header, body, bodyLen);
+            break;
         default:
             std::cout << "[unknown] msgType=" << header.msgType
                       << " fd=" << clientFd << std::endl;
@@ -561,109 +1251,710 @@ void Server::handleMessage(int clientFd, const MessageHeader& header,
     }
 }
 
-void Server::handleChatMessage(int clientFd, const MessageHeader& header,
-                               const uint8_t* body, size_t bodyLen) {
-    ChatMessage msg;
-    if (!ProtocolParser::parseChatMessage(body, bodyLen, msg)) {
-        std::cerr << "invalid chat message length=" << bodyLen
-                  << " fd=" << clientFd << std::endl;
-        return;
+bool Server::admitMessage(int clientFd, const MessageHeader& header) {
+    switch (header.msgType) {
+        case MSG_HEARTBEAT_REQ:
+        case MSG_LOGOUT_REQ:
+        case MSG_FILE_DATA:
+        case MSG_FILE_DATA_ACK:
+            return true;
+        default:
+            break;
     }
-
-    ClientInfo sender;
-    if (!clientMgr_ || !clientMgr_->getClientInfo(clientFd, sender) || !sender.isOnline) {
-        std::cerr << "chat from unknown client fd=" << clientFd << std::endl;
-        return;
+    auto it = clientLimits_.find(clientFd);
+    if (it == clientLimits_.end()) {
+        return true;
     }
 
-    std::string toId(msg.toId, boundedStrnlen(msg.toId, sizeof(msg.toId)));
-    std::string text(msg.message, boundedStrnlen(msg.message, sizeof(msg.message)));
-    uint64_t timestamp = msg.timestamp == 0 ? currentEpochSeconds() : msg.timestamp;
+    ClientLimits& limits = it->second;
+    auto now = std::chrono::steady_clock::now();
+    if (limits.messages.tryConsume(1, now)) {
+        limits.notified = false;
+        return true;
+    }
+    ++throttledMessages_;
+    if (!limits.notified) {
+        limits.notified = true;
+        auto retryAfter = limits.messages.delayFor(1, now);
+        std::cout << "[throttle] reject fd=" << clientFd
+                  << " msgType=" << header.msgType
+                  << " retryAfterMs=" << retryAfter.count() << std::endl;
+        sendResponse(clientFd, ProtocolParser::packRateLimitNotice(
+            header.msgType, header.sequence, RATE_LIMIT_MESSAGES,
+            static_cast<uint32_t>(retryAfter.count())));
+    }
+    return false;
+}
 
-    ChatScope scope = (msg.chatType == CHAT_PRIVATE) ? CHAT_PRIVATE : CHAT_GROUP;
+void Server::chargeFileBytes(int clientFd, size_t bytes) {
+    auto it = clientLimits_.find(clientFd);
+    if (it == clientLimits_.end() || !it->second.fileBytes.enabled()) {
+        return;
+    }
+    auto now = std::chrono::steady_clock::now();
+    it->second.fileBytes.consume(static_cast<double>(bytes), now);
+    auto delay = it->second.fileBytes.delayFor(0, now);
+    if (delay.count() == 0) {
+        return;
+    }
 
-    auto packet = ProtocolParser::packChatMessage(
-        header.sequence,
-        scope,
-        sender.clientId,
-        sender.nickname,
-        toId,
-        text,
-        timestamp);
+    auto handlerIt = clientHandlers_.find(clientFd);
+    if (handlerIt == clientHandlers_.end()) {
+        return;
+    }
+    handlerIt->second->pauseReads();
+    auto resumeAt = now + std::min(delay, std::chrono::milliseconds(kMaxReadPauseMs));
+    bool rearm = true;
+    for (const auto& entry : pausedReads_) {
+        if (entry.first != clientFd && entry.second.resumeAt <= resumeAt) {
+            rearm = false;
+            break;
+        }
+    }
+    auto inserted = pausedReads_.emplace(clientFd, PausedRead{now, resumeAt});
+    if (inserted.second) {
+        ++readPauses_;
+    } else {
+        inserted.first->second.resumeAt = resumeAt;
+    }
+    if (rearm) {
+        throttleTimer_->armOnce(static_cast<int>(
+            std::chrono::duration_cast<std::chrono::milliseconds>(resumeAt - now).count()));
+    }
+}
 
-    if (scope == CHAT_GROUP) {
-        auto targets = clientMgr_->getOnlineClients();
-        for (const auto& target : targets) {
-            if (target.fd == clientFd) {
-                continue;
-            }
-            sendResponse(target.fd, packet);
+void Server::resumePausedReads() {
+    using namespace std::chrono;
+    auto now = steady_clock::now();
+    std::vector<int> due;
+    for (auto& entry : pausedReads_) {
+        PausedRead& paused = entry.second;
+        if (paused.resumeAt > now) {
+            continue;
+        }
+        auto limitsIt = clientLimits_.find(entry.first);
+        milliseconds delay(0);
+        if (limitsIt != clientLimits_.end()) {
+            delay = limitsIt->second.fileBytes.delayFor(0, now);
+        }
+        if (delay.count() > 0) {
+            // Still in debt: nothing is read, but the peer is alive.
+            paused.resumeAt = now + std::min(delay, milliseconds(kMaxReadPauseMs));
+            clientMgr_->updateHeartbeat(entry.first);
+            continue;
+        }
+        readPausedMs_ += static_cast<uint64_t>(
+            duration_cast<milliseconds>(now - paused.since).count());
+        due.push_back(entry.first);
+    }
+    for (int fd : due) {
+        pausedReads_.erase(fd);
+    }
+    for (int fd : due) {
+        auto handlerIt = clientHandlers_.find(fd);
+        if (handlerIt != clientHandlers_.end()) {
+            handlerIt->second->resumeReads();
         }
-        return;
     }
 
-    if (toId.empty()) {
-        std::cerr << "private chat missing target fd=" << clientFd << std::endl;
+    // Resumed handlers may have paused again and re-armed the timer; make
+    // sure it fires for the earliest connection still waiting.
+    if (pausedReads_.empty()) {
         return;
     }
+    auto next = pausedReads_.begin()->second.resumeAt;
+    for (const auto& entry : pausedReads_) {
+        next = std::min(next, entry.second.resumeAt);
+    }
+    throttleTimer_->armOnce(static_cast<int>(
+        duration_cast<milliseconds>(next - steady_clock::now()).count()));
+}
 
-    int targetFd = clientMgr_->getFdByClientId(toId);
-    if (targetFd < 0) {
-        std::cerr << "private chat target offline id=" << toId
-                  << " fd=" << clientFd << std::endl;
+void Server::handleLoginRequest(int clientFd, const MessageHeader& header,
+                                const uint8_t* body, size_t bodyLen) {
+    LoginRequest req;
+    LoginRequestExt ext;
+    if (!ProtocolParser::parseLoginRequest(body, bodyLen, req, ext)) {
+        auto response = ProtocolParser::packLoginResponse(
+            header.sequence, LOGIN_INVALID_PARAM, "Invalid parameters");
+        sendResponse(clientFd, response);
         return;
     }
 
-    sendResponse(targetFd, packet);
-}
+    std::string clientId(req.clientId,
+                         boundedStrnlen(req.clientId, sizeof(req.clientId)));
+    std::string nickname(req.nickname,
+                         boundedStrnlen(req.nickname, sizeof(req.nickname)));
+    std::string password(ext.password, boundedStrnlen(ext.password, sizeof(ext.password)));
+    uint8_t resumeToken[kResumeTokenSize];
+    std::memcpy(resumeToken, ext.resumeToken, sizeof(resumeToken));
+    std::memset(&ext, 0, sizeof(ext));
 
-void Server::handleUserListRequest(int clientFd, const MessageHeader& header) {
-    if (!clientMgr_) {
+    if (clientId.empty() || nickname.empty() || pendingLoginFds_.count(clientFd)) {
+        auto response = ProtocolParser::packLoginResponse(
+            header.sequence, LOGIN_INVALID_PARAM, "Invalid parameters");
+        sendResponse(clientFd, response);
         return;
     }
 
-    ClientInfo info;
-    if (!clientMgr_->getClientInfo(clientFd, info) || !info.isOnline) {
+    UserRecord user;
+    bool registered = userDirectory_ && userDirectory_->lookup(clientId, user);
+    if (!registered && userDirectory_ && config_.userDbRequired) {
+        auto response = ProtocolParser::packLoginResponse(
+            header.sequence, LOGIN_UNKNOWN_USER, "Unknown user");
+        sendResponse(clientFd, response);
+        return;
+    }
+    if (registered && (user.flags & USER_DISABLED)) {
+        auto response = ProtocolParser::packLoginResponse(
+            header.sequence, LOGIN_DISABLED, "Account disabled");
+        sendResponse(clientFd, response);
+        return;
+    }
+    bool hasToken = std::any_of(resumeToken, resumeToken + sizeof(resumeToken),
+                                [](uint8_t b) { return b != 0; });
+    std::string resumedNick;
+    if (sessions_ && hasToken && sessions_->resume(clientId, resumeToken, resumedNick)) {
+        // The token stands in for the password it was issued after.
+        resumeLogin(clientFd, header.sequence, clientId, resumedNick, resumeToken);
+        return;
+    }
+    if (registered && user.nickname[0] != '\0') {
+        // Registered users always appear under their own nickname.
+        nickname.assign(user.nickname, boundedStrnlen(user.nickname, sizeof(user.nickname)));
+    }
+    if (!admitLogin(clientFd, header.sequence)) {
+        return;
+    }
+    if (rejectLogin(clientFd, header.sequence, clientId, nickname)) {
+        return;
+    }
+    if (!registered || user.iterations == 0) {
+        completeLogin(clientFd, header.sequence, clientId, nickname);
         return;
     }
 
-    sendUserList(clientFd, header.sequence);
+    // The hash is slow on purpose; the reactor moves on while a worker
+    // checks it and finishPendingLogins() picks up the verdict.
+    AuthJob job;
+    job.id = nextAuthId_++;
+    job.password.swap(password);
+    std::memcpy(job.salt, user.salt, sizeof(job.salt));
+    std::memcpy(job.credential, user.credential, sizeof(job.credential));
+    job.iterations = user.iterations;
+    uint64_t id = job.id;
+    if (!authPool_->submit(job)) {
+        std::fill(job.password.begin(), job.password.end(), '\0');
+        // The login was never attempted, so it keeps its admission token
+        // for the retry.
+        loginBucket_.refund(1);
+        // Long enough for the workers to get through the current queue.
+        AuthPoolStats stats = authPool_->stats();
+        uint64_t perJobMs = stats.completed > 0 ? stats.busyUs / stats.completed / 1000 : 100;
+        uint64_t retryMs = std::max<uint64_t>(perJobMs, 1) * stats.queued /
+                           static_cast<uint64_t>(std::max(config_.authThreads, 1));
+        ++deferredLogins_;
+        sendRetryLater(clientFd, header.sequence, static_cast<uint32_t>(retryMs));
+        return;
+    }
+    pendingLogins_[id] = PendingLogin{clientFd, header.sequence, clientId, nickname};
+    pendingLoginFds_[clientFd] = id;
 }
 
-void Server::handleFileOffer(int clientFd, const MessageHeader& header,
-                             const uint8_t* body, size_t bodyLen) {
-    FileOffer offer;
-    if (!ProtocolParser::parseFileOffer(body, bodyLen, offer)) {
-        std::cerr << "invalid file offer length=" << bodyLen
-                  << " fd=" << clientFd << std::endl;
+void Server::finishPendingLogins() {
+    if (!authPool_) {
         return;
     }
+    std::vector<AuthResult> results;
+    authPool_->takeResults(results);
+    for (const auto& result : results) {
+        auto it = pendingLogins_.find(result.id);
+        if (it == pendingLogins_.end()) {
+            continue;
+        }
+        PendingLogin login = std::move(it->second);
+        pendingLogins_.erase(it);
+        pendingLoginFds_.erase(login.fd);
 
-    ClientInfo sender;
-    if (!clientMgr_ || !clientMgr_->getClientInfo(clientFd, sender) || !sender.isOnline) {
-        std::cerr << "file offer from unknown client fd=" << clientFd << std::endl;
-        return;
+        if (!result.accepted) {
+            std::cout << "[auth] rejected clientId=" << login.clientId
+                      << " fd=" << login.fd << std::endl;
+            auto response = ProtocolParser::packLoginResponse(
+                login.sequence, LOGIN_BAD_CREDENTIALS, "Invalid credentials");
+            sendResponse(login.fd, response);
+            continue;
+        }
+        // Someone may have taken the id or nickname while the check ran.
+        if (!rejectLogin(login.fd, login.sequence, login.clientId, login.nickname)) {
+            completeLogin(login.fd, login.sequence, login.clientId, login.nickname);
+        }
     }
+}
 
-    std::string fileId(offer.fileId, boundedStrnlen(offer.fileId, sizeof(offer.fileId)));
-    std::string fileName(offer.fileName, boundedStrnlen(offer.fileName, sizeof(offer.fileName)));
-    std::string toId(offer.toId, boundedStrnlen(offer.toId, sizeof(offer.toId)));
+bool Server::admitLogin(int clientFd, uint32_t sequence) {
+    if (!loginBucket_.enabled()) {
+        return true;
+    }
+    using namespace std::chrono;
+    auto now = steady_clock::now();
+    if (loginBucket_.tryConsume(1, now)) {
+        return true;
+    }
+    // Everyone told to retry gets a later slot than the one before, so
+    // refused clients come back spread out at the admitted rate instead of
+    // all at once.
+    loginRetrySlot_ = std::max(loginRetrySlot_, now + loginBucket_.delayFor(1, now));
+    auto retryAfter = duration_cast<milliseconds>(loginRetrySlot_ - now);
+    loginRetrySlot_ += microseconds(1000000 / config_.loginRatePerSec);
+    ++deferredLogins_;
+    sendRetryLater(clientFd, sequence, static_cast<uint32_t>(retryAfter.count()));
+    return false;
+}
 
-    if (fileId.empty()) {
-        auto response = ProtocolParser::packFileOfferResponse(
-            header.sequence, "", FILE_OFFER_DECLINE, "Invalid file id");
+void Server::sendRetryLater(int clientFd, uint32_t sequence, uint32_t retryAfterMs) {
+    LoginResponseExt ext;
+    std::memset(&ext, 0, sizeof(ext));
+    ext.retryAfterMs = retryAfterMs;
+    auto response = ProtocolParser::packLoginResponse(
+        sequence, LOGIN_RETRY_LATER, "Server busy, retry later", ext);
+    sendResponse(clientFd, response);
+}
+
+bool Server::rejectLogin(int clientFd, uint32_t sequence, const std::string& clientId,
+                         const std::string& nickname) {
+    if (clientMgr_->isClientIdOnline(clientId, clientFd)) {
+        auto response = ProtocolParser::packLoginResponse(
+            sequence, LOGIN_ALREADY_ONLINE, "Client already online");
         sendResponse(clientFd, response);
-        return;
+        return true;
     }
 
-    if (toId.empty()) {
-        auto response = ProtocolParser::packFileOfferResponse(
-            header.sequence, fileId, FILE_OFFER_DECLINE, "Target required");
+    if (clientMgr_->isNicknameOnline(nickname, clientFd) ||
+        (sessions_ && sessions_->nicknameHeld(nickname, clientId))) {
+        auto response = ProtocolParser::packLoginResponse(
+            sequence, LOGIN_NICKNAME_TAKEN, "Nickname taken");
+        sendResponse(clientFd, response);
+        return true;
+    }
+
+    if (clientMgr_->getOnlineCount() >= kMaxOnlineClients) {
+        auto response = ProtocolParser::packLoginResponse(
+            sequence, LOGIN_SERVER_FULL, "Server full");
+        sendResponse(clientFd, response);
+        return true;
+    }
+    return false;
+}
+
+void Server::completeLogin(int clientFd, uint32_t sequence, const std::string& clientId,
+                           const std::string& nickname) {
+    if (!clientMgr_->setClientIdentity(clientFd, clientId, nickname)) {
+        auto response = ProtocolParser::packLoginResponse(
+            sequence, LOGIN_INVALID_PARAM, "Invalid parameters");
         sendResponse(clientFd, response);
         return;
     }
 
-    int targetFd = -1;
+    leaveUnauthenticated(clientFd);
+    if (recentRing_) {
+        catchUpLimits_[clientFd] = recentRing_->newestSeq();
+    }
+
+    LoginResponseExt ext;
+    std::memset(&ext, 0, sizeof(ext));
+    if (sessions_ && sessions_->issue(clientId, nickname, ext.resumeToken)) {
+        ext.resumeGraceSec = static_cast<uint32_t>(sessions_->graceSec());
+    }
+    auto response = ProtocolParser::packLoginResponse(
+        sequence, LOGIN_SUCCESS, "OK", ext);
+    if (!sendResponse(clientFd, response)) {
+        std::cerr << "send login response failed for fd=" << clientFd << std::endl;
+    }
+
+    std::cout << "[login] fd=" << clientFd
+              << " clientId=" << clientId
+              << " nickname=" << nickname << std::endl;
+    broadcastUserList();
+    reofferDetachedFiles(clientFd, clientId);
+    deliverOfflineMessages(clientFd, clientId);
+}
+
+void Server::resumeLogin(int clientFd, uint32_t sequence, const std::string& clientId,
+                         const std::string& nickname, const uint8_t* token) {
+    int staleFd = clientMgr_->getFdByClientId(clientId);
+    if (staleFd >= 0 && staleFd != clientFd) {
+        // The old connection has not timed out yet. The session moves over
+        // now: its transfers become detached so they are re-offered below,
+        // and it loses the clientId so that is never online on two fds.
+        // The socket itself closes with the other queued disconnects, as a
+        // connection that never logged in, so nobody sees the session leave.
+        cleanupFileSessionsForFd(staleFd, clientId);
+        clientMgr_->clearClientIdentity(staleFd);
+        queueDisconnect(staleFd);
+        ++supersededSessions_;
+    }
+    if (!clientMgr_->setClientIdentity(clientFd, clientId, nickname)) {
+        sessions_->detach(clientId, std::chrono::steady_clock::now());
+        armResumeTimer();
+        auto response = ProtocolParser::packLoginResponse(
+            sequence, LOGIN_INVALID_PARAM, "Invalid parameters");
+        sendResponse(clientFd, response);
+        return;
+    }
+
+    leaveUnauthenticated(clientFd);
+    if (recentRing_) {
+        catchUpLimits_[clientFd] = recentRing_->newestSeq();
+    }
+
+    LoginResponseExt ext;
+    std::memset(&ext, 0, sizeof(ext));
+    std::memcpy(ext.resumeToken, token, sizeof(ext.resumeToken));
+    ext.resumeGraceSec = static_cast<uint32_t>(sessions_->graceSec());
+    ext.resumed = 1;
+    auto response = ProtocolParser::packLoginResponse(sequence, LOGIN_SUCCESS, "Resumed", ext);
+    if (!sendResponse(clientFd, response)) {
+        std::cerr << "send login response failed for fd=" << clientFd << std::endl;
+    }
+
+    std::cout << "[session] resumed fd=" << clientFd
+              << " clientId=" << clientId
+              << " staleFd=" << staleFd << std::endl;
+    // The others never saw the session leave; only this client may have
+    // missed roster changes.
+    sendUserList(clientFd, 0);
+    reofferDetachedFiles(clientFd, clientId);
+    deliverOfflineMessages(clientFd, clientId);
+}
+
+void Server::expireDetachedSessions() {
+    if (!sessions_) {
+        return;
+    }
+    auto expired = sessions_->expire(std::chrono::steady_clock::now());
+    for (const auto& clientId : expired) {
+        std::cout << "[session] expired clientId=" << clientId << std::endl;
+    }
+    if (!expired.empty()) {
+        broadcastUserList();
+    }
+    armResumeTimer();
+}
+
+void Server::armResumeTimer() {
+    using namespace std::chrono;
+    steady_clock::time_point deadline;
+    if (!resumeTimer_ || !sessions_->nextDeadline(deadline)) {
+        return;
+    }
+    resumeTimer_->armOnce(static_cast<int>(
+        duration_cast<milliseconds>(deadline - steady_clock::now()).count()) + 1);
+}
+
+void Server::handleChatMessage(int clientFd, const MessageHeader& header,
+                               const uint8_t* body, size_t bodyLen) {
+    ChatMessage msg;
+    if (!ProtocolParser::parseChatMessage(body, bodyLen, msg)) {
+        std::cerr << "invalid chat message length=" << bodyLen
+                  << " fd=" << clientFd << std::endl;
+        return;
+    }
+
+    ClientInfo sender;
+    if (!clientMgr_ || !clientMgr_->getClientInfo(clientFd, sender) || !sender.isOnline) {
+        std::cerr << "chat from unknown client fd=" << clientFd << std::endl;
+        return;
+    }
+
+    std::string toId(msg.toId, boundedStrnlen(msg.toId, sizeof(msg.toId)));
+    std::string text(msg.message, boundedStrnlen(msg.message, sizeof(msg.message)));
+    uint64_t timestamp = msg.timestamp == 0 ? currentEpochSeconds() : msg.timestamp;
+
+    ChatScope scope = (msg.chatType == CHAT_PRIVATE) ? CHAT_PRIVATE : CHAT_GROUP;
+    if (utf8Sanitize(text) > 0) {
+        std::cerr << "chat message with invalid utf-8 fd=" << clientFd << std::endl;
+    }
+    if (chatFilter_ && scope == CHAT_GROUP) {
+        chatFilter_->apply(text);
+    }
+
+    auto packet = ProtocolParser::packChatMessage(
+        header.sequence,
+        scope,
+        sender.clientId,
+        sender.nickname,
+        toId,
+        text,
+        timestamp);
+
+    if (scope == CHAT_GROUP) {
+        if (recentRing_) {
+            recentRing_->push(packet);
+        }
+        auto targets = clientMgr_->getOnlineClients();
+        for (const auto& target : targets) {
+            if (target.fd == clientFd) {
+                continue;
+            }
+            sendResponse(target.fd, packet);
+        }
+        recordHistory(scope, sender.clientId, toId, packet);
+        return;
+    }
+
+    if (toId.empty()) {
+        std::cerr << "private chat missing target fd=" << clientFd << std::endl;
+        return;
+    }
+
+    int targetFd = clientMgr_->getFdByClientId(toId);
+    if (targetFd < 0) {
+        if (offlineStore_
+            && offlineStore_->append(toId, packet.data(), packet.size(), currentEpochSeconds())) {
+            std::cout << "[offline] queued to=" << toId
+                      << " from=" << sender.clientId << std::endl;
+            recordHistory(scope, sender.clientId, toId, packet);
+            return;
+        }
+        std::cerr << "private chat target offline id=" << toId
+                  << " fd=" << clientFd << std::endl;
+        return;
+    }
+
+    sendResponse(targetFd, packet);
+    recordHistory(scope, sender.clientId, toId, packet);
+}
+
+void Server::handleCatchUpRequest(int clientFd, const MessageHeader& header,
+                                  const uint8_t* body, size_t bodyLen) {
+    ClientInfo info;
+    CatchUpRequest req;
+    if (!clientMgr_ || !clientMgr_->getClientInfo(clientFd, info) || !info.isOnline
+        || !ProtocolParser::parseCatchUpRequest(body, bodyLen, req)) {
+        return;
+    }
+
+    // A client that has not seen this run yet only learns where it starts.
+    std::vector<uint8_t> out;
+    uint32_t count = 0;
+    bool complete = req.runId == 0;
+    uint32_t runId = 0;
+    uint32_t newestSeq = 0;
+    if (recentRing_) {
+        runId = recentRing_->runId();
+        if (req.runId == runId) {
+            // Frames after the login were already routed here live.
+            auto limitIt = catchUpLimits_.find(clientFd);
+            uint32_t untilSeq = limitIt != catchUpLimits_.end() ? limitIt->second : 0;
+            complete = recentRing_->collect(req.lastSeq, untilSeq, info.clientId, out, count);
+        }
+        newestSeq = recentRing_->newestSeq();
+    }
+    if (req.runId != 0) {
+        std::cout << "[recent] catch-up client=" << info.clientId
+                  << " after=" << req.lastSeq
+                  << " replayed=" << count
+                  << " complete=" << complete << std::endl;
+    }
+    auto rsp = ProtocolParser::packCatchUpResponse(header.sequence, runId, newestSeq, count, complete);
+    out.insert(out.end(), rsp.begin(), rsp.end());
+    sendResponse(clientFd, out);
+}
+
+void Server::recordHistory(ChatScope scope, const std::string& fromId, const std::string& toId,
+                           const std::vector<uint8_t>& packet) {
+    if (!historyStore_) {
+        return;
+    }
+    std::string conversation = historyConversation(scope, fromId, toId);
+    const uint8_t* payload = packet.data() + sizeof(MessageHeader);
+    size_t len = packet.size() - sizeof(MessageHeader);
+    uint64_t seq = historyStore_->append(conversation, payload, len, currentEpochSeconds());
+    if (seq > 0) {
+        indexHistoryRecord(conversation, seq, payload, len);
+    }
+}
+
+void Server::indexHistoryRecord(const std::string& conversation, uint64_t seq,
+                                const uint8_t* payload, size_t len) {
+    ChatMessage msg;
+    if (!searchIndex_ || len != sizeof(ChatMessage)) {
+        return;
+    }
+    std::memcpy(&msg, payload, sizeof(msg));
+    searchIndex_->add(seq, conversation, msg.message, boundedStrnlen(msg.message, sizeof(msg.message)));
+}
+
+void Server::handleSearchRequest(int clientFd, const MessageHeader& header,
+                                 const uint8_t* body, size_t bodyLen) {
+    ClientInfo info;
+    if (!clientMgr_ || !clientMgr_->getClientInfo(clientFd, info) || !info.isOnline) {
+        return;
+    }
+
+    SearchRequest req;
+    std::vector<std::string> terms;
+    std::string peerId;
+    if (ProtocolParser::parseSearchRequest(body, bodyLen, req)) {
+        tokenizeForSearch(req.query, boundedStrnlen(req.query, sizeof(req.query)), terms);
+        peerId.assign(req.peerId, boundedStrnlen(req.peerId, sizeof(req.peerId)));
+    }
+    if (terms.empty() || terms.size() > kSearchMaxTerms || req.scope > SEARCH_PRIVATE) {
+        sendResponse(clientFd, ProtocolParser::packSearchResponse(
+            header.sequence, HISTORY_INVALID, std::vector<HistoryEntry>(), false));
+        return;
+    }
+    if (!searchIndex_) {
+        sendResponse(clientFd, ProtocolParser::packSearchResponse(
+            header.sequence, HISTORY_UNAVAILABLE, std::vector<HistoryEntry>(), false));
+        return;
+    }
+
+    // Group chat is visible to everyone; a private conversation only to
+    // its two participants.
+    std::string onlyConversation;
+    if (req.scope == SEARCH_PRIVATE && !peerId.empty()) {
+        onlyConversation = historyConversation(CHAT_PRIVATE, info.clientId, peerId);
+    }
+    uint8_t scope = req.scope;
+    const std::string& clientId = info.clientId;
+    auto visible = [scope, &onlyConversation, &clientId](const std::string& conversation) {
+        if (conversation == historyConversation(CHAT_GROUP, std::string(), std::string())) {
+            return scope != SEARCH_PRIVATE;
+        }
+        if (scope == SEARCH_GROUP) {
+            return false;
+        }
+        if (!onlyConversation.empty()) {
+            return conversation == onlyConversation;
+        }
+        return conversationIncludes(conversation, clientId);
+    };
+
+    size_t limit = req.limit == 0 ? kSearchDefaultPage : std::min(req.limit, kHistoryMaxPage);
+    std::vector<SearchHit> hits;
+    bool more = false;
+    searchIndex_->search(terms, req.beforeSeq, limit, visible, hits, more);
+
+    std::vector<HistoryEntry> entries;
+    entries.reserve(hits.size());
+    for (const auto& hit : hits) {
+        HistoryItem item;
+        if (!historyStore_->fetch(hit.conversation, hit.seq, item)
+            || item.payload.size() != sizeof(ChatMessage)) {
+            continue;
+        }
+        HistoryEntry entry;
+        entry.seq = item.seq;
+        std::memcpy(&entry.message, item.payload.data(), sizeof(ChatMessage));
+        entries.push_back(entry);
+    }
+    sendResponse(clientFd, ProtocolParser::packSearchResponse(
+        header.sequence, HISTORY_OK, entries, more));
+}
+
+void Server::handleHistoryRequest(int clientFd, const MessageHeader& header,
+                                  const uint8_t* body, size_t bodyLen) {
+    ClientInfo info;
+    if (!clientMgr_ || !clientMgr_->getClientInfo(clientFd, info) || !info.isOnline) {
+        return;
+    }
+
+    HistoryRequest req;
+    std::string peerId;
+    bool valid = ProtocolParser::parseHistoryRequest(body, bodyLen, req);
+    if (valid) {
+        peerId.assign(req.peerId, boundedStrnlen(req.peerId, sizeof(req.peerId)));
+        valid = req.chatType != CHAT_PRIVATE || !peerId.empty();
+    }
+    if (!valid) {
+        sendResponse(clientFd, ProtocolParser::packHistoryResponse(
+            header.sequence, HISTORY_INVALID, std::vector<HistoryEntry>(), false));
+        return;
+    }
+    if (!historyStore_) {
+        sendResponse(clientFd, ProtocolParser::packHistoryResponse(
+            header.sequence, HISTORY_UNAVAILABLE, std::vector<HistoryEntry>(), false));
+        return;
+    }
+
+    ChatScope scope = req.chatType == CHAT_PRIVATE ? CHAT_PRIVATE : CHAT_GROUP;
+    HistoryQuery query;
+    query.beforeSeq = req.beforeSeq;
+    query.fromTime = req.fromTime;
+    query.toTime = req.toTime;
+    query.limit = req.limit == 0 ? kHistoryDefaultPage : std::min(req.limit, kHistoryMaxPage);
+
+    std::vector<HistoryItem> items;
+    bool more = false;
+    historyStore_->query(historyConversation(scope, info.clientId, peerId), query, items, more);
+
+    std::vector<HistoryEntry> entries;
+    entries.reserve(items.size());
+    for (const auto& item : items) {
+        if (item.payload.size() != sizeof(ChatMessage)) {
+            continue;
+        }
+        HistoryEntry entry;
+        entry.seq = item.seq;
+        std::memcpy(&entry.message, item.payload.data(), sizeof(ChatMessage));
+        entries.push_back(entry);
+    }
+    sendResponse(clientFd, ProtocolParser::packHistoryResponse(
+        header.sequence, HISTORY_OK, entries, more));
+}
+
+void Server::handleUserListRequest(int clientFd, const MessageHeader& header) {
+    if (!clientMgr_) {
+        return;
+    }
+
+    ClientInfo info;
+    if (!clientMgr_->getClientInfo(clientFd, info) || !info.isOnline) {
+        return;
+    }
+
+    sendUserList(clientFd, header.sequence);
+}
+
+void Server::handleFileOffer(int clientFd, const MessageHeader& header,
+                             const uint8_t* body, size_t bodyLen) {
+    FileOffer offer;
+    FileOfferExt ext;
+    if (!ProtocolParser::parseFileOffer(body, bodyLen, offer, ext)) {
+        std::cerr << "invalid file offer length=" << bodyLen
+                  << " fd=" << clientFd << std::endl;
+        return;
+    }
+
+    ClientInfo sender;
+    if (!clientMgr_ || !clientMgr_->getClientInfo(clientFd, sender) || !sender.isOnline) {
+        std::cerr << "file offer from unknown client fd=" << clientFd << std::endl;
+        return;
+    }
+
+    std::string fileId(offer.fileId, boundedStrnlen(offer.fileId, sizeof(offer.fileId)));
+    std::string fileName(offer.fileName, boundedStrnlen(offer.fileName, sizeof(offer.fileName)));
+    std::string toId(offer.toId, boundedStrnlen(offer.toId, sizeof(offer.toId)));
+
+    FileKey key;
+    if (!parseFileKey(offer.fileId, sizeof(offer.fileId), key)) {
+        auto response = ProtocolParser::packFileOfferResponse(
+            header.sequence, "", FILE_OFFER_DECLINE, "Invalid file id");
+        sendResponse(clientFd, response);
+        return;
+    }
+    if (!ownsFileKey(clientFd, key)) {
+        // Offered fileIds are visible to every recipient; only the sender
+        // may replace its own session.
+        std::cerr << "file offer for foreign fileId=" << fileId << " fd=" << clientFd << std::endl;
+        auto response = ProtocolParser::packFileOfferResponse(
+            header.sequence, fileId, FILE_OFFER_DECLINE, "File id in use");
+        sendResponse(clientFd, response);
+        return;
+    }
+
+    int targetFd = -1;
     if (!toId.empty()) {
         targetFd = clientMgr_->getFdByClientId(toId);
         if (targetFd < 0) {
@@ -674,6 +1965,97 @@ void Server::handleFileOffer(int clientFd, const MessageHeader& header,
         }
     }
 
+    if (ext.streamCount > kMaxFileStreams) {
+        ext.streamCount = kMaxFileStreams;
+    }
+
+    // Group offers are always spooled; extra streams and tunnels are only
+    // supported between two peers and bypass the spool.
+    if (targetFd < 0) {
+        ext.streamCount = 0;
+    }
+    bool tunnel = targetFd >= 0 && (ext.flags & FILE_OFFER_FLAG_TUNNEL) != 0;
+    if (tunnel) {
+        ext.streamCount = 0;
+    } else {
+        ext.flags &= static_cast<uint8_t>(~FILE_OFFER_FLAG_TUNNEL);
+    }
+
+    std::string contentKey;
+    std::shared_ptr<const ContentObject> storeObject;
+    static const uint8_t kNoHash[sizeof(ext.contentHash)] = {0};
+    if (contentStore_ && ext.streamCount == 0 && !tunnel
+        && std::memcmp(ext.contentHash, kNoHash, sizeof(kNoHash)) != 0) {
+        contentKey = Sha256::toHex(ext.contentHash, sizeof(ext.contentHash));
+        storeObject = contentStore_->lookup(contentKey, offer.fileSize);
+    }
+
+    // Knowing the hash is not knowing the content: the sender must return
+    // a digest over a random range before anything is served from the
+    // store. Without a challenge the offer is simply uploaded.
+    uint8_t proofNonce[sizeof(FileProofRequest::nonce)] = {0};
+    uint8_t proofDigest[Sha256::kDigestSize] = {0};
+    uint64_t proofOffset = 0;
+    uint32_t proofLength = 0;
+    if (storeObject) {
+        proofLength = static_cast<uint32_t>(std::min<uint64_t>(offer.fileSize, kStoreProofBytes));
+        if (randomBytes(proofNonce, sizeof(proofNonce))
+            && randomBytes(reinterpret_cast<uint8_t*>(&proofOffset), sizeof(proofOffset))) {
+            proofOffset %= offer.fileSize - proofLength + 1;
+            if (!storeObject->rangeDigest(proofNonce, sizeof(proofNonce), proofOffset,
+                                          proofLength, proofDigest)) {
+                storeObject.reset();
+            }
+        } else {
+            storeObject.reset();
+        }
+    }
+
+    // Only the two peers learn the token their data streams attach with.
+    std::memset(ext.attachToken, 0, sizeof(ext.attachToken));
+    bool direct = (ext.flags & FILE_OFFER_FLAG_DIRECT) != 0 && !storeObject;
+    if (targetFd >= 0 && (tunnel || ext.streamCount > 0 || direct)
+        && !randomBytes(ext.attachToken, sizeof(ext.attachToken))) {
+        auto response = ProtocolParser::packFileOfferResponse(
+            header.sequence, fileId, FILE_OFFER_BUSY, "Server error");
+        sendResponse(clientFd, response);
+        return;
+    }
+
+    std::shared_ptr<FileSpool> spool;
+    if (ext.streamCount == 0 && !storeObject && !tunnel) {
+        bool reserved = false;
+        {
+            std::lock_guard<std::mutex> lock(fileMutex_);
+            if (offer.fileSize <= config_.spoolMaxBytes
+                && spoolReserved_ <= config_.spoolMaxBytes - offer.fileSize) {
+                spoolReserved_ += offer.fileSize;
+                reserved = true;
+            }
+        }
+        if (!reserved) {
+            auto response = ProtocolParser::packFileOfferResponse(
+                header.sequence, fileId, FILE_OFFER_BUSY, "Spool full");
+            sendResponse(clientFd, response);
+            return;
+        }
+        spool = std::make_shared<FileSpool>();
+        if (!spool->create(config_.spoolDir)) {
+            {
+                std::lock_guard<std::mutex> lock(fileMutex_);
+                spoolReserved_ -= offer.fileSize;
+            }
+            auto response = ProtocolParser::packFileOfferResponse(
+                header.sequence, fileId, FILE_OFFER_BUSY, "Spool unavailable");
+            sendResponse(clientFd, response);
+            return;
+        }
+    }
+
+    if (targetFd < 0 || tunnel || ext.streamCount > 0 || storeObject) {
+        ext.flags &= static_cast<uint8_t>(~FILE_OFFER_FLAG_DIRECT);
+    }
+
     auto packet = ProtocolParser::packFileOffer(
         header.sequence,
         fileId,
@@ -681,46 +2063,104 @@ void Server::handleFileOffer(int clientFd, const MessageHeader& header,
         offer.fileSize,
         sender.clientId,
         sender.nickname,
-        toId);
+        toId,
+        ext);
+
+    FileSession session;
+    session.fileId = fileId;
+    session.senderFd = clientFd;
+    session.senderId = sender.clientId;
+    session.receiverId = toId;
+    session.tunnel = tunnel;
+    session.direct = (ext.flags & FILE_OFFER_FLAG_DIRECT) != 0;
+    std::memcpy(session.attachToken, ext.attachToken, sizeof(session.attachToken));
+    session.senderStreams.assign(tunnel ? 1 : ext.streamCount, -1);
+    session.receiverStreams.assign(tunnel ? 1 : ext.streamCount, -1);
+    session.fileSize = offer.fileSize;
+    session.fileName = fileName;
+    session.senderNick = sender.nickname;
+    session.lastActivity = std::chrono::steady_clock::now();
+    session.storeObject = std::move(storeObject);
+    if (session.storeObject) {
+        // The upload is skipped entirely; once the proof is in, receivers
+        // are fed from the store.
+        std::memcpy(session.storeProof, proofDigest, sizeof(session.storeProof));
+        std::cout << "[store] hit fileId=" << fileId << " key=" << contentKey
+                  << " proofOffset=" << proofOffset << " proofLength=" << proofLength << std::endl;
+    } else if (spool && !contentKey.empty()) {
+        session.contentWriter = contentStore_->beginWrite(contentKey);
+    }
+    bool relayed = spool || session.storeObject;
+    std::vector<int> offeredFds;
 
     if (targetFd >= 0) {
         sendResponse(targetFd, packet);
+        offeredFds.push_back(targetFd);
+        if (relayed) {
+            session.pendingIds.insert(toId);
+        } else {
+            session.receiverFd = targetFd;
+        }
     } else {
         auto targets = clientMgr_->getOnlineClients();
-        bool sent = false;
         for (const auto& target : targets) {
             if (target.fd == clientFd) {
                 continue;
             }
             if (sendResponse(target.fd, packet)) {
-                sent = true;
+                session.pendingIds.insert(target.clientId);
+                offeredFds.push_back(target.fd);
             }
         }
-        if (!sent) {
-            auto response = ProtocolParser::packFileOfferResponse(
-                header.sequence, fileId, FILE_OFFER_BUSY, "No recipients online");
-            sendResponse(clientFd, response);
-            return;
-        }
+        session.multicast = true;
+        std::cout << "[relay] multicast offer fileId=" << fileId
+                  << " size=" << offer.fileSize
+                  << " recipients=" << session.pendingIds.size() << std::endl;
     }
+    session.spooled = relayed;
+    session.spool = std::move(spool);
 
-    {
-        std::lock_guard<std::mutex> lock(fileMutex_);
-        fileSessions_[fileId] = FileSession{clientFd, targetFd};
+    std::lock_guard<std::mutex> lock(fileMutex_);
+    if (session.spooled && session.pendingIds.empty()) {
+        if (session.spool) {
+            spoolReserved_ -= session.fileSize;
+        }
+        auto response = ProtocolParser::packFileOfferResponse(
+            header.sequence, fileId, FILE_OFFER_BUSY, "No recipients online");
+        sendResponse(clientFd, response);
+        return;
+    }
+    auto existing = fileSessions_.find(key);
+    if (existing != fileSessions_.end()) {
+        // Checked on entry; the reactor thread is the only one adding
+        // sessions, so it is still this sender's.
+        eraseFileSession(existing);
+    }
+    auto it = fileSessions_.emplace(key, std::move(session)).first;
+    linkSessionFd(it, clientFd);
+    for (int fd : offeredFds) {
+        linkSessionFd(it, fd);
+    }
+    if (it->second.storeObject) {
+        auto request = ProtocolParser::packFileProofRequest(
+            header.sequence, fileId, proofNonce, proofOffset, proofLength);
+        sendResponse(clientFd, request);
     }
 }
 
 void Server::handleFileOfferResponse(int clientFd, const MessageHeader& header,
                                      const uint8_t* body, size_t bodyLen) {
     FileOfferResponse rsp;
-    if (!ProtocolParser::parseFileOfferResponse(body, bodyLen, rsp)) {
+    FileOfferResponseExt ext;
+    if (!ProtocolParser::parseFileOfferResponse(body, bodyLen, rsp, ext)) {
         std::cerr << "invalid file offer response length=" << bodyLen
                   << " fd=" << clientFd << std::endl;
         return;
     }
 
     std::string fileId(rsp.fileId, boundedStrnlen(rsp.fileId, sizeof(rsp.fileId)));
-    if (fileId.empty()) {
+    FileKey key;
+    if (!parseFileKey(rsp.fileId, sizeof(rsp.fileId), key)) {
         std::cerr << "file offer response missing fileId fd=" << clientFd << std::endl;
         return;
     }
@@ -729,11 +2169,15 @@ void Server::handleFileOfferResponse(int clientFd, const MessageHeader& header,
     bool eraseSession = false;
     {
         std::lock_guard<std::mutex> lock(fileMutex_);
-        auto it = fileSessions_.find(fileId);
+        auto it = fileSessions_.find(key);
         if (it == fileSessions_.end()) {
             std::cerr << "file offer response for unknown fileId=" << fileId << std::endl;
             return;
         }
+        if (it->second.spooled) {
+            handleSpooledOfferResponse(clientFd, header, it, rsp, ext);
+            return;
+        }
         session = it->second;
 
         if (session.receiverFd != -1 && session.receiverFd != clientFd) {
@@ -745,6 +2189,11 @@ void Server::handleFileOfferResponse(int clientFd, const MessageHeader& header,
         if (session.receiverFd == -1 && rsp.result == FILE_OFFER_ACCEPT) {
             it->second.receiverFd = clientFd;
             session.receiverFd = clientFd;
+            linkSessionFd(it, clientFd);
+        }
+        if (rsp.result == FILE_OFFER_ACCEPT) {
+            it->second.acceptForwarded = true;
+            it->second.lastActivity = std::chrono::steady_clock::now();
         }
 
         if (rsp.result != FILE_OFFER_ACCEPT) {
@@ -754,7 +2203,7 @@ void Server::handleFileOfferResponse(int clientFd, const MessageHeader& header,
         }
 
         if (eraseSession) {
-            fileSessions_.erase(it);
+            eraseFileSession(it);
         }
     }
 
@@ -762,15 +2211,20 @@ void Server::handleFileOfferResponse(int clientFd, const MessageHeader& header,
         return;
     }
 
+    FileOfferResponseExt senderExt;
+    std::memset(&senderExt, 0, sizeof(senderExt));
+    if (rsp.result == FILE_OFFER_ACCEPT) {
+        std::memcpy(senderExt.attachToken, session.attachToken, sizeof(senderExt.attachToken));
+    }
     auto response = ProtocolParser::packFileOfferResponse(
-        header.sequence, fileId, rsp.result, rsp.message);
+        header.sequence, fileId, rsp.result, rsp.message, senderExt);
     sendResponse(session.senderFd, response);
 }
 
 void Server::handleFileData(int clientFd, const MessageHeader& header,
                             const uint8_t* body, size_t bodyLen) {
-    std::string fileId = extractFileId(body, bodyLen);
-    if (fileId.empty()) {
+    FileKey key;
+    if (!extractFileKey(body, bodyLen, key)) {
         std::cerr << "file data missing fileId fd=" << clientFd << std::endl;
         return;
     }
@@ -778,24 +2232,48 @@ void Server::handleFileData(int clientFd, const MessageHeader& header,
     int targetFd = -1;
     {
         std::lock_guard<std::mutex> lock(fileMutex_);
-        auto it = fileSessions_.find(fileId);
+        auto it = fileSessions_.find(key);
         if (it == fileSessions_.end()) {
-            std::cerr << "file data unknown fileId=" << fileId << std::endl;
+            const char* fileId = reinterpret_cast<const char*>(body);
+            std::cerr << "file data unknown fileId="
+                      << std::string(fileId, boundedStrnlen(fileId, kFileIdSize)) << std::endl;
+            return;
+        }
+        FileSession& session = it->second;
+        if (session.spooled) {
+            if (clientFd == session.senderFd && header.msgType == MSG_FILE_DATA
+                && !session.storeObject) {
+                relaySpooledData(it, header, body, bodyLen);
+            }
             return;
         }
-        if (clientFd == it->second.senderFd) {
-            targetFd = it->second.receiverFd;
-        } else if (clientFd == it->second.receiverFd) {
-            targetFd = it->second.senderFd;
+        if (clientFd == session.senderFd) {
+            targetFd = session.receiverFd;
+        } else if (clientFd == session.receiverFd) {
+            targetFd = session.senderFd;
         } else {
-            std::cerr << "file data fd mismatch fileId=" << fileId << std::endl;
+            auto senderIt = std::find(session.senderStreams.begin(),
+                                      session.senderStreams.end(), clientFd);
+            auto receiverIt = std::find(session.receiverStreams.begin(),
+                                        session.receiverStreams.end(), clientFd);
+            if (senderIt != session.senderStreams.end()) {
+                size_t index = static_cast<size_t>(senderIt - session.senderStreams.begin());
+                int streamFd = session.receiverStreams[index];
+                targetFd = streamFd >= 0 ? streamFd : session.receiverFd;
+            } else if (receiverIt != session.receiverStreams.end()) {
+                size_t index = static_cast<size_t>(receiverIt - session.receiverStreams.begin());
+                int streamFd = session.senderStreams[index];
+                targetFd = streamFd >= 0 ? streamFd : session.senderFd;
+            } else {
+                std::cerr << "file data fd mismatch fileId=" << session.fileId << std::endl;
+                return;
+            }
+        }
+        if (targetFd < 0) {
+            std::cerr << "file data target not ready fileId=" << session.fileId << std::endl;
             return;
         }
-    }
-
-    if (targetFd < 0) {
-        std::cerr << "file data target not ready fileId=" << fileId << std::endl;
-        return;
+        session.lastActivity = std::chrono::steady_clock::now();
     }
 
     auto packet = ProtocolParser::packRawMessage(
@@ -806,29 +2284,289 @@ void Server::handleFileData(int clientFd, const MessageHeader& header,
     sendResponse(targetFd, packet);
 }
 
-void Server::handleClientDisconnect(int clientFd) {
-    if (clientFd < 0) {
+void Server::handleFileStreamAttach(int clientFd, const MessageHeader& header,
+                                    const uint8_t* body, size_t bodyLen) {
+    FileStreamAttach attach;
+    if (!ProtocolParser::parseFileStreamAttach(body, bodyLen, attach)) {
+        std::cerr << "invalid file stream attach length=" << bodyLen
+                  << " fd=" << clientFd << std::endl;
         return;
     }
 
-    if (reactor_) {
-        reactor_->removeHandler(clientFd);
-    }
+    std::string fileId(attach.fileId, boundedStrnlen(attach.fileId, sizeof(attach.fileId)));
+    std::string clientId(attach.clientId, boundedStrnlen(attach.clientId, sizeof(attach.clientId)));
+
+    uint32_t result = FILE_STREAM_ATTACH_REJECTED;
+    bool tunnel = false;
+    bool tunnelReady = false;
+    static const uint8_t kNoToken[sizeof(attach.attachToken)] = {0};
+    FileKey key;
+    ClientInfo info;
+    if (!clientId.empty() && parseFileKey(attach.fileId, sizeof(attach.fileId), key)
+        && clientMgr_ && clientMgr_->getClientInfo(clientFd, info) && !info.isOnline) {
+        std::lock_guard<std::mutex> lock(fileMutex_);
+        auto it = fileSessions_.find(key);
+        if (it != fileSessions_.end() && fileStreams_.find(clientFd) == fileStreams_.end()) {
+            FileSession& session = it->second;
+            std::vector<int>* streams = nullptr;
+            if (attach.role == FILE_STREAM_SENDER && clientId == session.senderId) {
+                streams = &session.senderStreams;
+            } else if (attach.role == FILE_STREAM_RECEIVER && clientId == session.receiverId) {
+                streams = &session.receiverStreams;
+            }
+            if (streams && attach.streamIndex < streams->size()
+                && (*streams)[attach.streamIndex] < 0
+                && std::memcmp(session.attachToken, kNoToken, sizeof(kNoToken)) != 0
+                && constantTimeEqual(attach.attachToken, session.attachToken,
+                                     sizeof(session.attachToken))) {
+                (*streams)[attach.streamIndex] = clientFd;
+                fileStreams_[clientFd] = key;
+                session.lastActivity = std::chrono::steady_clock::now();
+                result = FILE_STREAM_ATTACH_OK;
+                tunnel = session.tunnel;
+                if (tunnel && session.senderStreams[0] >= 0 && session.receiverStreams[0] >= 0) {
+                    auto pipe = std::make_shared<SpliceTunnel>(
+                        session.senderStreams[0], session.receiverStreams[0], session.fileSize);
+                    if (pipe->init()) {
+                        session.tunnelPipe = std::move(pipe);
+                        tunnelReady = true;
+                    } else {
+                        result = FILE_STREAM_ATTACH_REJECTED;
+                        tunnel = false;
+                    }
+                }
+            }
+        }
+    }
+
+    // Only an attached stream leaves the login deadline and the
+    // unauthenticated cap behind; a rejected one is not kept around.
+    bool dropStream = false;
+    if (result == FILE_STREAM_ATTACH_OK) {
+        clientMgr_->markDataChannel(clientFd);
+        leaveUnauthenticated(clientFd);
+    } else {
+        std::cerr << "file stream attach rejected fileId=" << fileId
+                  << " fd=" << clientFd << std::endl;
+        dropStream = unauthenticated_.count(clientFd) > 0;
+    }
+
+    auto response = ProtocolParser::packFileStreamAttachResponse(
+        header.sequence, fileId, result, attach.streamIndex);
+    sendResponse(clientFd, response);
+    if (dropStream) {
+        queueDisconnect(clientFd);
+    }
+
+    if (tunnel) {
+        auto handlerIt = clientHandlers_.find(clientFd);
+        if (handlerIt != clientHandlers_.end()) {
+            handlerIt->second->enterTunnel(attach.role == FILE_STREAM_SENDER);
+        }
+    }
+    if (tunnelReady) {
+        std::cout << "[tunnel] open fileId=" << fileId << std::endl;
+        pumpTunnel(clientFd);
+    }
+}
+
+void Server::handleFileCancel(int clientFd, const uint8_t* body, size_t bodyLen) {
+    FileCancel cancel;
+    if (!ProtocolParser::parseFileCancel(body, bodyLen, cancel)) {
+        std::cerr << "invalid file cancel length=" << bodyLen
+                  << " fd=" << clientFd << std::endl;
+        return;
+    }
+    std::string fileId(cancel.fileId, boundedStrnlen(cancel.fileId, sizeof(cancel.fileId)));
+    FileKey key;
+
+    std::lock_guard<std::mutex> lock(fileMutex_);
+    auto it = parseFileKey(cancel.fileId, sizeof(cancel.fileId), key)
+        ? fileSessions_.find(key) : fileSessions_.end();
+    if (it == fileSessions_.end() || it->second.senderFd != clientFd || !it->second.spooled) {
+        std::cerr << "file cancel rejected fileId=" << fileId << " fd=" << clientFd << std::endl;
+        return;
+    }
+    // Only the sender may withdraw a session, e.g. once the peers have
+    // connected directly and the relay is no longer needed.
+    std::cout << "[file] cancel fileId=" << fileId << " reason=" << cancel.reason << std::endl;
+    eraseFileSession(it);
+}
+
+void Server::handleFileProof(int clientFd, const MessageHeader& header,
+                             const uint8_t* body, size_t bodyLen) {
+    FileProofResponse rsp;
+    if (!ProtocolParser::parseFileProofResponse(body, bodyLen, rsp)) {
+        std::cerr << "invalid file proof length=" << bodyLen
+                  << " fd=" << clientFd << std::endl;
+        return;
+    }
+    std::string fileId(rsp.fileId, boundedStrnlen(rsp.fileId, sizeof(rsp.fileId)));
+    FileKey key;
+
+    std::lock_guard<std::mutex> lock(fileMutex_);
+    auto it = parseFileKey(rsp.fileId, sizeof(rsp.fileId), key)
+        ? fileSessions_.find(key) : fileSessions_.end();
+    if (it == fileSessions_.end() || it->second.senderFd != clientFd
+        || !it->second.storeObject || it->second.storeProven) {
+        std::cerr << "file proof rejected fileId=" << fileId << " fd=" << clientFd << std::endl;
+        return;
+    }
+    FileSession& session = it->second;
+    if (!constantTimeEqual(rsp.digest, session.storeProof, sizeof(session.storeProof))) {
+        std::cerr << "[store] proof failed fileId=" << fileId
+                  << " sender=" << session.senderId << std::endl;
+        auto response = ProtocolParser::packFileOfferResponse(
+            header.sequence, fileId, FILE_OFFER_DECLINE, "Content proof failed");
+        sendResponse(clientFd, response);
+        eraseFileSession(it);
+        return;
+    }
+
+    std::cout << "[store] proven fileId=" << fileId << std::endl;
+    session.storeProven = true;
+    session.bytesRelayed = session.fileSize;
+    session.lastActivity = std::chrono::steady_clock::now();
+    if (!session.receivers.empty() && !session.acceptForwarded) {
+        session.acceptForwarded = true;
+        auto response = ProtocolParser::packFileOfferResponse(
+            header.sequence, fileId, FILE_OFFER_STORED, "Served from server store");
+        sendResponse(clientFd, response);
+    }
+    for (auto& receiver : session.receivers) {
+        pumpSpool(it->first, session, receiver);
+    }
+    finishSpooledIfDone(it);
+}
+
+void Server::pumpTunnel(int clientFd) {
+    std::shared_ptr<SpliceTunnel> tunnel;
+    FileKey key;
+    std::string fileId;
+    {
+        std::lock_guard<std::mutex> lock(fileMutex_);
+        auto streamIt = fileStreams_.find(clientFd);
+        if (streamIt == fileStreams_.end()) {
+            return;
+        }
+        auto it = fileSessions_.find(streamIt->second);
+        if (it == fileSessions_.end() || !it->second.tunnelPipe) {
+            return;
+        }
+        tunnel = it->second.tunnelPipe;
+        key = it->first;
+        fileId = it->second.fileId;
+    }
+
+    // The receiver's attach response must leave before any raw payload.
+    if (pendingBytes(tunnel->outFd()) > 0) {
+        return;
+    }
+
+    SpliceTunnel::State state = tunnel->pump();
+    if (state == SpliceTunnel::State::Open) {
+        return;
+    }
+
+    std::cout << "[tunnel] " << (state == SpliceTunnel::State::Finished ? "complete" : "failed")
+              << " fileId=" << fileId
+              << " bytes=" << tunnel->bytesForwarded() << std::endl;
+    {
+        std::lock_guard<std::mutex> lock(fileMutex_);
+        auto it = fileSessions_.find(key);
+        if (it != fileSessions_.end() && it->second.tunnelPipe == tunnel) {
+            it->second.tunnelPipe.reset();
+        }
+    }
+    queueDisconnect(tunnel->inFd());
+    queueDisconnect(tunnel->outFd());
+}
+
+void Server::handleClientDisconnect(int clientFd) {
+    if (clientFd < 0) {
+        return;
+    }
+
+    // Offline frames the peer never acknowledged are sent again at its
+    // next login.
+    confirmOfflineDelivery(clientFd);
+    offlineDeliveries_.erase(clientFd);
+    if (reactor_) {
+        reactor_->removeHandler(clientFd);
+    }
+    {
+        // A disconnect queued earlier must not hit whoever reuses the fd.
+        std::lock_guard<std::mutex> lock(pendingMutex_);
+        pendingDisconnects_.erase(
+            std::remove(pendingDisconnects_.begin(), pendingDisconnects_.end(), clientFd),
+            pendingDisconnects_.end());
+    }
 
     auto handlerIt = clientHandlers_.find(clientFd);
     if (handlerIt != clientHandlers_.end()) {
         clientHandlers_.erase(handlerIt);
     }
+    bool wasOnline = false;
+    std::string clientId;
     if (clientMgr_) {
+        ClientInfo info;
+        if (clientMgr_->getClientInfo(clientFd, info)) {
+            wasOnline = info.isOnline;
+            if (wasOnline) {
+                clientId = info.clientId;
+            }
+            auto ipIt = connectionsPerIp_.find(info.ip);
+            if (ipIt != connectionsPerIp_.end() && --ipIt->second == 0) {
+                connectionsPerIp_.erase(ipIt);
+            }
+        }
         clientMgr_->removeClient(clientFd);
     }
+    leaveUnauthenticated(clientFd);
+    catchUpLimits_.erase(clientFd);
+    clientLimits_.erase(clientFd);
+    pausedReads_.erase(clientFd);
+    bool rosterChanged = wasOnline;
+    SessionEnd end = SessionEnd::Detach;
+    auto endIt = sessionEnds_.find(clientFd);
+    if (endIt != sessionEnds_.end()) {
+        end = endIt->second;
+        sessionEnds_.erase(endIt);
+    }
+    if (wasOnline && sessions_) {
+        if (end == SessionEnd::Detach && running_ &&
+                   sessions_->detach(clientId, std::chrono::steady_clock::now())) {
+            // Stays on the roster until it is resumed or expires.
+            rosterChanged = false;
+            armResumeTimer();
+        } else {
+            sessions_->forget(clientId);
+        }
+    }
+    auto pendingIt = pendingLoginFds_.find(clientFd);
+    if (pendingIt != pendingLoginFds_.end()) {
+        // The check still runs; its result finds nothing to finish.
+        pendingLogins_.erase(pendingIt->second);
+        pendingLoginFds_.erase(pendingIt);
+    }
+    auto partialIt = partialFrames_.find(clientFd);
+    if (partialIt != partialFrames_.end()) {
+        if (partialIt->second.mode == PartialFrame::Mode::Spool) {
+            std::lock_guard<std::mutex> lock(fileMutex_);
+            auto it = fileSessions_.find(partialIt->second.key);
+            if (it != fileSessions_.end() && it->second.spool) {
+                it->second.spool->discardPartial();
+            }
+        }
+        partialFrames_.erase(partialIt);
+    }
     if (protocol_) {
         protocol_->removeClient(clientFd);
     }
-    cleanupFileSessionsForFd(clientFd);
+    cleanupFileSessionsForFd(clientFd, clientId);
     close(clientFd);
 
-    if (running_) {
+    if (running_ && rosterChanged) {
         broadcastUserList();
     }
 }
@@ -877,23 +2615,24 @@ void Server::sendUserList(int clientFd, uint32_t sequence) {
         return;
     }
 
-    auto clients = clientMgr_->getOnlineClients();
-    std::vector<UserInfo> users;
-    users.reserve(clients.size());
-
-    for (const auto& info : clients) {
-        UserInfo user;
-        std::memset(&user, 0, sizeof(user));
-        std::strncpy(user.clientId, info.clientId.c_str(), sizeof(user.clientId) - 1);
-        std::strncpy(user.nickname, info.nickname.c_str(), sizeof(user.nickname) - 1);
-        users.push_back(user);
-    }
-
-    auto packet = ProtocolParser::packUserListResponse(sequence, users);
+    auto packet = ProtocolParser::packUserListResponse(
+        sequence, buildRoster(clientMgr_->getOnlineClients()));
     sendResponse(clientFd, packet);
 }
 
 void Server::broadcastUserList() {
+    if (rosterTimer_) {
+        if (!rosterDirty_) {
+            rosterDirty_ = true;
+            rosterTimer_->armOnce(config_.rosterFlushMs);
+        }
+        return;
+    }
+    flushUserList();
+}
+
+void Server::flushUserList() {
+    rosterDirty_ = false;
     if (!clientMgr_) {
         return;
     }
@@ -903,21 +2642,34 @@ void Server::broadcastUserList() {
         return;
     }
 
+    ++rosterBroadcasts_;
+    auto packet = ProtocolParser::packUserListResponse(0, buildRoster(clients));
+    for (const auto& info : clients) {
+        sendResponse(info.fd, packet);
+    }
+}
+
+// Online clients plus detached sessions that may still be resumed.
+std::vector<UserInfo> Server::buildRoster(const std::vector<ClientInfo>& clients) const {
     std::vector<UserInfo> users;
     users.reserve(clients.size());
-
-    for (const auto& info : clients) {
+    auto add = [&users](const std::string& clientId, const std::string& nickname) {
         UserInfo user;
         std::memset(&user, 0, sizeof(user));
-        std::strncpy(user.clientId, info.clientId.c_str(), sizeof(user.clientId) - 1);
-        std::strncpy(user.nickname, info.nickname.c_str(), sizeof(user.nickname) - 1);
+        std::strncpy(user.clientId, clientId.c_str(), sizeof(user.clientId) - 1);
+        std::strncpy(user.nickname, nickname.c_str(), sizeof(user.nickname) - 1);
         users.push_back(user);
-    }
+    };
 
-    auto packet = ProtocolParser::packUserListResponse(0, users);
     for (const auto& info : clients) {
-        sendResponse(info.fd, packet);
+        add(info.clientId, info.nickname);
+    }
+    if (sessions_) {
+        for (const auto& entry : sessions_->detached()) {
+            add(entry.first, entry.second);
+        }
     }
+    return users;
 }
 
 bool Server::sendResponse(int clientFd, const std::vector<uint8_t>& data) {
@@ -934,15 +2686,749 @@ bool Server::sendResponse(int clientFd, const std::vector<uint8_t>& data) {
     return true;
 }
 
-void Server::cleanupFileSessionsForFd(int clientFd) {
+bool Server::sendShared(int clientFd, const SharedBuffer& data) {
+    auto it = clientHandlers_.find(clientFd);
+    if (it == clientHandlers_.end()) {
+        return false;
+    }
+
+    if (!it->second->queueShared(data)) {
+        queueDisconnect(clientFd);
+        return false;
+    }
+
+    return true;
+}
+
+bool Server::sendFile(int clientFd, const std::shared_ptr<const void>& owner, int fileFd,
+                      uint64_t offset, size_t len) {
+    auto it = clientHandlers_.find(clientFd);
+    if (it == clientHandlers_.end()) {
+        return false;
+    }
+
+    if (!it->second->queueFile(owner, fileFd, offset, len)) {
+        queueDisconnect(clientFd);
+        return false;
+    }
+
+    return true;
+}
+
+size_t Server::pendingBytes(int clientFd) const {
+    auto it = clientHandlers_.find(clientFd);
+    if (it == clientHandlers_.end()) {
+        return 0;
+    }
+    return it->second->pendingBytes();
+}
+
+void Server::onClientWritable(int clientFd) {
+    if (!offlineDeliveries_.empty()) {
+        confirmOfflineDelivery(clientFd);
+    }
     std::lock_guard<std::mutex> lock(fileMutex_);
-    for (auto it = fileSessions_.begin(); it != fileSessions_.end();) {
-        if (it->second.senderFd == clientFd || it->second.receiverFd == clientFd) {
-            it = fileSessions_.erase(it);
+    auto readerIt = spoolReaders_.find(clientFd);
+    if (readerIt == spoolReaders_.end()) {
+        return;
+    }
+
+    std::vector<FileKey> keys(readerIt->second.begin(), readerIt->second.end());
+    for (const auto& key : keys) {
+        auto it = fileSessions_.find(key);
+        if (it == fileSessions_.end()) {
+            continue;
+        }
+        for (auto& receiver : it->second.receivers) {
+            if (receiver.fd == clientFd) {
+                pumpSpool(key, it->second, receiver);
+                break;
+            }
+        }
+        finishSpooledIfDone(it);
+    }
+}
+
+void Server::handleSpooledOfferResponse(int clientFd, const MessageHeader& header,
+                                        FileSessionMap::iterator it,
+                                        const FileOfferResponse& rsp,
+                                        const FileOfferResponseExt& ext) {
+    // Called with fileMutex_ held.
+    ClientInfo responder;
+    if (!clientMgr_->getClientInfo(clientFd, responder) || !responder.isOnline) {
+        return;
+    }
+
+    const std::string& fileId = it->second.fileId;
+    FileSession& session = it->second;
+    if (session.pendingIds.erase(responder.clientId) == 0) {
+        std::cerr << "file offer response from unexpected fd=" << clientFd
+                  << " fileId=" << fileId << std::endl;
+        return;
+    }
+    session.lastActivity = std::chrono::steady_clock::now();
+    std::string message(rsp.message, boundedStrnlen(rsp.message, sizeof(rsp.message)));
+
+    if (rsp.result == FILE_OFFER_ACCEPT) {
+        FileReceiver receiver;
+        receiver.fd = clientFd;
+        receiver.clientId = responder.clientId;
+        session.receivers.push_back(receiver);
+        linkSessionFd(it, clientFd);
+        // Late joiners and reconnecting receivers replay the spool from the start.
+        pumpSpool(it->first, session, session.receivers.back());
+
+        std::cout << "[relay] accept fileId=" << fileId
+                  << " receiver=" << responder.clientId
+                  << " receivers=" << session.receivers.size() << std::endl;
+
+        // A store hit is only confirmed to the sender once it is proven.
+        if (!session.acceptForwarded && session.senderFd >= 0
+            && (!session.storeObject || session.storeProven)) {
+            session.acceptForwarded = true;
+            FileOfferResponseExt direct;
+            std::memset(&direct, 0, sizeof(direct));
+            if (session.direct && ext.directPort != 0) {
+                direct = ext;
+                in_addr observed;
+                if (direct.directAddress == 0
+                    && inet_pton(AF_INET, responder.ip.c_str(), &observed) == 1) {
+                    direct.directAddress = observed.s_addr;
+                }
+                if (direct.directAddress != 0) {
+                    char addr[INET_ADDRSTRLEN] = {0};
+                    in_addr endpoint;
+                    endpoint.s_addr = direct.directAddress;
+                    inet_ntop(AF_INET, &endpoint, addr, sizeof(addr));
+                    std::cout << "[direct] endpoint fileId=" << fileId
+                              << " receiver=" << responder.clientId
+                              << " addr=" << addr << ":" << direct.directPort << std::endl;
+                } else {
+                    direct.directPort = 0;
+                }
+            }
+            std::memcpy(direct.attachToken, session.attachToken, sizeof(direct.attachToken));
+            auto response = session.storeObject
+                ? ProtocolParser::packFileOfferResponse(
+                      header.sequence, fileId, FILE_OFFER_STORED, "Served from server store")
+                : ProtocolParser::packFileOfferResponse(
+                      header.sequence, fileId, FILE_OFFER_ACCEPT, message, direct);
+            sendResponse(session.senderFd, response);
+        }
+        finishSpooledIfDone(it);
+        return;
+    }
+
+    if (session.pendingIds.empty() && session.receivers.empty()
+        && session.detachedIds.empty()) {
+        if (session.senderFd >= 0 && !session.acceptForwarded) {
+            auto response = session.multicast
+                ? ProtocolParser::packFileOfferResponse(
+                      header.sequence, fileId, FILE_OFFER_DECLINE, "All recipients declined")
+                : ProtocolParser::packFileOfferResponse(
+                      header.sequence, fileId, rsp.result, message);
+            sendResponse(session.senderFd, response);
+        }
+        eraseFileSession(it);
+        return;
+    }
+    finishSpooledIfDone(it);
+}
+
+void Server::relaySpooledData(FileSessionMap::iterator it, const MessageHeader& header,
+                              const uint8_t* body, size_t bodyLen) {
+    // Called with fileMutex_ held.
+    FileSession& session = it->second;
+    const std::string& fileId = session.fileId;
+    if (bodyLen < sizeof(FileDataHeader)) {
+        std::cerr << "file data too short fileId=" << fileId << std::endl;
+        return;
+    }
+
+    SharedBuffer packet = std::make_shared<std::vector<uint8_t>>(
+        ProtocolParser::packRawMessage(static_cast<uint16_t>(header.msgType),
+                                       header.sequence, body, bodyLen));
+    uint64_t payloadLen = bodyLen - sizeof(FileDataHeader);
+    uint64_t frameStart = session.spool->size();
+    if (session.bytesRelayed + payloadLen > session.fileSize) {
+        failSpooledUpload(it, header.sequence, "overflow");
+        return;
+    }
+    if (!session.spool->append(packet->data(), packet->size())) {
+        failSpooledUpload(it, header.sequence, "write failed");
+        return;
+    }
+    session.bytesRelayed += payloadLen;
+    session.lastActivity = std::chrono::steady_clock::now();
+
+    if (session.contentWriter) {
+        FileDataHeader dataHeader;
+        ProtocolParser::parseFileDataHeader(body, bodyLen, dataHeader);
+        if (!session.contentWriter->append(dataHeader.offset,
+                                           body + sizeof(FileDataHeader), payloadLen)) {
+            session.contentWriter.reset();
+        } else if (session.bytesRelayed == session.fileSize) {
+            if (contentStore_->commit(*session.contentWriter)) {
+                std::cout << "[store] insert fileId=" << fileId
+                          << " key=" << session.contentWriter->key()
+                          << " size=" << session.contentWriter->size() << std::endl;
+            }
+            session.contentWriter.reset();
+        }
+    }
+
+    for (auto& receiver : session.receivers) {
+        // Receivers that keep up share the packet; the rest read from the spool.
+        if (receiver.spoolOffset == frameStart
+            && pendingBytes(receiver.fd) < kRelayWindowBytes) {
+            if (sendShared(receiver.fd, packet)) {
+                receiver.spoolOffset = session.spool->size();
+            }
+            continue;
+        }
+        pumpSpool(it->first, session, receiver);
+    }
+    finishSpooledIfDone(it);
+}
+
+void Server::handleFileDataFragment(int clientFd, const MessageHeader& header,
+                                    const uint8_t* prefix, size_t prefixLen,
+                                    const uint8_t* data, size_t len, size_t bodyOffset) {
+    bool last = bodyOffset + len == header.bodyLength;
+    PartialFrame& frame = partialFrames_[clientFd];
+    chargeFileBytes(clientFd, bodyOffset == prefixLen ? prefixLen + len : len);
+    if (bodyOffset == prefixLen) {
+        frame = PartialFrame();
+        std::lock_guard<std::mutex> lock(fileMutex_);
+        if (!beginSpooledFrame(clientFd, header, prefix, prefixLen, frame)
+            && frame.mode == PartialFrame::Mode::Buffer) {
+            frame.body.reserve(header.bodyLength);
+            frame.body.assign(prefix, prefix + prefixLen);
+        }
+    }
+
+    switch (frame.mode) {
+        case PartialFrame::Mode::Spool: {
+            std::lock_guard<std::mutex> lock(fileMutex_);
+            appendSpooledFragment(header, frame, data, len, last);
+            break;
+        }
+        case PartialFrame::Mode::Buffer:
+            frame.body.insert(frame.body.end(), data, data + len);
+            if (last) {
+                handleFileData(clientFd, header, frame.body.data(), frame.body.size());
+            }
+            break;
+        case PartialFrame::Mode::Drop:
+            break;
+    }
+    if (last) {
+        partialFrames_.erase(clientFd);
+    }
+}
+
+bool Server::beginSpooledFrame(int clientFd, const MessageHeader& header,
+                               const uint8_t* prefix, size_t prefixLen, PartialFrame& frame) {
+    // Called with fileMutex_ held. Frames that do not belong to a spooled
+    // upload are left in Buffer mode and handled once complete.
+    FileDataHeader dataHeader;
+    if (!ProtocolParser::parseFileDataHeader(prefix, prefixLen, dataHeader)) {
+        return false;
+    }
+    FileKey key;
+    if (!extractFileKey(prefix, prefixLen, key)) {
+        return false;
+    }
+    auto it = fileSessions_.find(key);
+    if (it == fileSessions_.end() || !it->second.spooled) {
+        return false;
+    }
+    FileSession& session = it->second;
+    if (clientFd != session.senderFd || session.storeObject) {
+        frame.mode = PartialFrame::Mode::Drop;
+        return false;
+    }
+
+    uint64_t payloadLen = header.bodyLength - prefixLen;
+    if (session.bytesRelayed + payloadLen > session.fileSize) {
+        failSpooledUpload(it, header.sequence, "overflow");
+        frame.mode = PartialFrame::Mode::Drop;
+        return false;
+    }
+    auto frameStart = ProtocolParser::packFrameStart(static_cast<uint16_t>(header.msgType),
+                                                     header.sequence, header.bodyLength,
+                                                     prefix, prefixLen);
+    if (!session.spool->append(frameStart.data(), frameStart.size(), false)) {
+        failSpooledUpload(it, header.sequence, "write failed");
+        frame.mode = PartialFrame::Mode::Drop;
+        return false;
+    }
+
+    frame.mode = PartialFrame::Mode::Spool;
+    frame.key = key;
+    frame.dataOffset = dataHeader.offset;
+    return true;
+}
+
+void Server::appendSpooledFragment(const MessageHeader& header, PartialFrame& frame,
+                                   const uint8_t* data, size_t len, bool last) {
+    // Called with fileMutex_ held.
+    auto it = fileSessions_.find(frame.key);
+    if (it == fileSessions_.end()) {
+        frame.mode = PartialFrame::Mode::Drop;
+        return;
+    }
+    FileSession& session = it->second;
+    if (!session.spool->append(data, len, last)) {
+        failSpooledUpload(it, header.sequence, "write failed");
+        frame.mode = PartialFrame::Mode::Drop;
+        return;
+    }
+    session.bytesRelayed += len;
+    session.lastActivity = std::chrono::steady_clock::now();
+
+    if (session.contentWriter) {
+        if (!session.contentWriter->append(frame.dataOffset, data, len)) {
+            session.contentWriter.reset();
+        } else if (session.bytesRelayed == session.fileSize && last) {
+            if (contentStore_->commit(*session.contentWriter)) {
+                std::cout << "[store] insert fileId=" << session.fileId
+                          << " key=" << session.contentWriter->key()
+                          << " size=" << session.contentWriter->size() << std::endl;
+            }
+            session.contentWriter.reset();
+        }
+    }
+    frame.dataOffset += len;
+    if (!last) {
+        return;
+    }
+
+    // Receivers only ever see whole frames, served from the spool.
+    for (auto& receiver : session.receivers) {
+        pumpSpool(frame.key, session, receiver);
+    }
+    finishSpooledIfDone(it);
+}
+
+void Server::failSpooledUpload(FileSessionMap::iterator it, uint32_t sequence, const char* reason) {
+    // Called with fileMutex_ held.
+    FileSession& session = it->second;
+    const std::string& fileId = session.fileId;
+    std::cerr << "[relay] spool " << reason << " fileId=" << fileId << std::endl;
+    if (session.senderFd >= 0) {
+        auto response = ProtocolParser::packFileOfferResponse(
+            sequence, fileId, FILE_OFFER_BUSY, "Spool write failed");
+        sendResponse(session.senderFd, response);
+    }
+    eraseFileSession(it);
+}
+
+void Server::pumpSpool(const FileKey& key, FileSession& session, FileReceiver& receiver) {
+    uint64_t available = deliverableBytes(session);
+    while (receiver.spoolOffset < available
+           && pendingBytes(receiver.fd) < kRelayWindowBytes) {
+        size_t span = 0;
+        if (session.storeObject) {
+            // Stored objects hold raw content, so frame it on the way out.
+            span = static_cast<size_t>(std::min<uint64_t>(kSpoolSendSize,
+                                                          available - receiver.spoolOffset));
+            SharedBuffer frameHeader = std::make_shared<std::vector<uint8_t>>(
+                ProtocolParser::packFileDataHeader(0, session.fileId, receiver.spoolOffset, span));
+            if (!sendShared(receiver.fd, frameHeader)
+                || !sendFile(receiver.fd, session.storeObject, session.storeObject->fd(),
+                             receiver.spoolOffset, span)) {
+                break;
+            }
         } else {
-            ++it;
+            span = session.spool->frameSpan(receiver.spoolOffset, kSpoolSendSize);
+            if (span == 0 || !sendFile(receiver.fd, session.spool, session.spool->fd(),
+                                       receiver.spoolOffset, span)) {
+                break;
+            }
+        }
+        receiver.spoolOffset += span;
+        session.lastActivity = std::chrono::steady_clock::now();
+    }
+    if (session.storeObject && !session.storeHitCounted && session.storeProven
+        && receiver.spoolOffset >= available) {
+        // Counted once the first receiver has the whole object.
+        session.storeHitCounted = true;
+        contentStore_->recordHit(session.fileSize);
+    }
+
+    if (receiver.spoolOffset < available) {
+        spoolReaders_[receiver.fd].insert(key);
+        return;
+    }
+    auto readerIt = spoolReaders_.find(receiver.fd);
+    if (readerIt != spoolReaders_.end()) {
+        readerIt->second.erase(key);
+        if (readerIt->second.empty()) {
+            spoolReaders_.erase(readerIt);
+        }
+    }
+}
+
+void Server::finishSpooledIfDone(FileSessionMap::iterator it) {
+    const FileSession& session = it->second;
+    if (session.bytesRelayed < session.fileSize || !session.pendingIds.empty()
+        || !session.detachedIds.empty()) {
+        return;
+    }
+    for (const auto& receiver : session.receivers) {
+        if (receiver.spoolOffset < deliverableBytes(session)) {
+            return;
         }
     }
+
+    std::cout << "[relay] complete fileId=" << session.fileId
+              << " receivers=" << session.receivers.size()
+              << " bytes=" << session.bytesRelayed << std::endl;
+    eraseFileSession(it);
+}
+
+uint64_t Server::deliverableBytes(const FileSession& session) {
+    if (session.storeObject) {
+        return session.storeProven ? session.storeObject->size() : 0;
+    }
+    return session.spool->committedSize();
+}
+
+bool Server::ownsFileKey(int clientFd, const FileKey& key) {
+    std::lock_guard<std::mutex> lock(fileMutex_);
+    auto it = fileSessions_.find(key);
+    return it == fileSessions_.end() || it->second.senderFd == clientFd;
+}
+
+Server::FileSessionMap::iterator Server::eraseFileSession(FileSessionMap::iterator it) {
+    const FileSession& session = it->second;
+    if (session.spool) {
+        spoolReserved_ -= session.fileSize;
+    }
+    // Data channels serve exactly one session and are exempt from the
+    // heartbeat and login timeouts, so they go with it.
+    for (const auto* streams : {&session.senderStreams, &session.receiverStreams}) {
+        for (int fd : *streams) {
+            if (fd >= 0) {
+                fileStreams_.erase(fd);
+                queueDisconnect(fd);
+            }
+        }
+    }
+    for (int fd : session.indexedFds) {
+        auto indexIt = fdSessions_.find(fd);
+        if (indexIt != fdSessions_.end()) {
+            indexIt->second.erase(it->first);
+            if (indexIt->second.empty()) {
+                fdSessions_.erase(indexIt);
+            }
+        }
+    }
+    for (const auto& clientId : session.detachedIds) {
+        auto detachedIt = detachedSessions_.find(clientId);
+        if (detachedIt != detachedSessions_.end()) {
+            detachedIt->second.erase(it->first);
+            if (detachedIt->second.empty()) {
+                detachedSessions_.erase(detachedIt);
+            }
+        }
+    }
+    for (const auto& receiver : session.receivers) {
+        auto readerIt = spoolReaders_.find(receiver.fd);
+        if (readerIt != spoolReaders_.end()) {
+            readerIt->second.erase(it->first);
+            if (readerIt->second.empty()) {
+                spoolReaders_.erase(readerIt);
+            }
+        }
+    }
+    return fileSessions_.erase(it);
+}
+
+void Server::linkSessionFd(FileSessionMap::iterator it, int fd) {
+    // Called with fileMutex_ held.
+    std::vector<int>& fds = it->second.indexedFds;
+    if (fd < 0 || std::find(fds.begin(), fds.end(), fd) != fds.end()) {
+        return;
+    }
+    fds.push_back(fd);
+    fdSessions_[fd].insert(it->first);
+}
+
+void Server::unlinkSessionFd(FileSession& session, int fd) {
+    // Called with fileMutex_ held; the caller drops fd's own index entry.
+    auto& fds = session.indexedFds;
+    fds.erase(std::remove(fds.begin(), fds.end(), fd), fds.end());
+}
+
+void Server::reofferDetachedFiles(int clientFd, const std::string& clientId) {
+    std::vector<std::vector<uint8_t>> offers;
+    {
+        std::lock_guard<std::mutex> lock(fileMutex_);
+        auto detachedIt = detachedSessions_.find(clientId);
+        if (detachedIt == detachedSessions_.end()) {
+            return;
+        }
+        FileKeySet keys;
+        keys.swap(detachedIt->second);
+        detachedSessions_.erase(detachedIt);
+        for (const auto& key : keys) {
+            auto it = fileSessions_.find(key);
+            if (it == fileSessions_.end()) {
+                continue;
+            }
+            FileSession& session = it->second;
+            if (session.detachedIds.erase(clientId) == 0) {
+                continue;
+            }
+            session.pendingIds.insert(clientId);
+            linkSessionFd(it, clientFd);
+            session.lastActivity = std::chrono::steady_clock::now();
+
+            FileOfferExt ext;
+            std::memset(&ext, 0, sizeof(ext));
+            offers.push_back(ProtocolParser::packFileOffer(
+                0, session.fileId, session.fileName, session.fileSize,
+                session.senderId, session.senderNick, session.receiverId, ext));
+            std::cout << "[relay] reoffer fileId=" << session.fileId
+                      << " receiver=" << clientId << std::endl;
+        }
+    }
+
+    for (const auto& offer : offers) {
+        sendResponse(clientFd, offer);
+    }
+}
+
+void Server::deliverOfflineMessages(int clientFd, const std::string& clientId) {
+    if (!offlineStore_) {
+        return;
+    }
+    size_t batches = 0;
+    uint64_t throughSeq = 0;
+    size_t count = offlineStore_->collect(
+        clientId, kOfflineBatchBytes, [this, clientFd, &batches](const std::vector<uint8_t>& batch) {
+            sendResponse(clientFd, batch);
+            ++batches;
+        }, throughSeq);
+    if (count > 0) {
+        std::cout << "[offline] sent to=" << clientId
+                  << " messages=" << count
+                  << " batches=" << batches << std::endl;
+        offlineDeliveries_[clientFd] = OfflineDelivery{clientId, throughSeq, count};
+        confirmOfflineDelivery(clientFd);
+    }
+}
+
+void Server::confirmOfflineDelivery(int clientFd) {
+    auto it = offlineDeliveries_.find(clientFd);
+    if (it == offlineDeliveries_.end() || pendingBytes(clientFd) > 0) {
+        return;
+    }
+    // Frames still in our buffer or unacknowledged in the kernel's are lost
+    // if the connection drops now, so they stay in the store until then.
+    int unacked = 0;
+    if (ioctl(clientFd, SIOCOUTQ, &unacked) != 0 || unacked > 0) {
+        return;
+    }
+    offlineStore_->markDelivered(it->second.clientId, it->second.throughSeq);
+    std::cout << "[offline] delivered to=" << it->second.clientId
+              << " messages=" << it->second.count << std::endl;
+    offlineDeliveries_.erase(it);
+}
+
+void Server::releaseRetiredZeroCopyBuffers() {
+    // Two generations so every retired buffer survives at least one full
+    // GC interval after its socket was closed.
+    zeroCopyRetiredOld_.clear();
+    zeroCopyRetiredOld_.swap(zeroCopyRetired_);
+}
+
+void Server::collectSpoolGarbage() {
+    auto now = std::chrono::steady_clock::now();
+    auto retention = std::chrono::seconds(config_.spoolRetentionSec);
+    std::vector<std::pair<int, std::vector<uint8_t>>> notices;
+    {
+        std::lock_guard<std::mutex> lock(fileMutex_);
+        for (auto it = fileSessions_.begin(); it != fileSessions_.end();) {
+            const FileSession& session = it->second;
+            if (!session.spooled || now - session.lastActivity < retention) {
+                ++it;
+                continue;
+            }
+            std::cout << "[relay] expire fileId=" << session.fileId
+                      << " spooled=" << deliverableBytes(session)
+                      << " pending=" << session.pendingIds.size()
+                      << " detached=" << session.detachedIds.size() << std::endl;
+            if (session.senderFd >= 0 && !session.acceptForwarded) {
+                notices.emplace_back(session.senderFd,
+                                     ProtocolParser::packFileOfferResponse(
+                                         0, session.fileId, FILE_OFFER_BUSY, "Offer expired"));
+            }
+            it = eraseFileSession(it);
+        }
+    }
+
+    for (const auto& notice : notices) {
+        sendResponse(notice.first, notice.second);
+    }
+}
+
+void Server::expireIdleFileSessions() {
+    if (config_.fileIdleSec <= 0) {
+        return;
+    }
+    auto now = std::chrono::steady_clock::now();
+    auto idleLimit = std::chrono::seconds(config_.fileIdleSec);
+    std::vector<std::pair<int, std::vector<uint8_t>>> notices;
+    {
+        std::lock_guard<std::mutex> lock(fileMutex_);
+        for (auto it = fileSessions_.begin(); it != fileSessions_.end();) {
+            const FileSession& session = it->second;
+            // Spooled sessions follow the spool retention policy, and an open
+            // tunnel moves data without touching lastActivity.
+            if (session.spooled || session.tunnelPipe || now - session.lastActivity < idleLimit) {
+                ++it;
+                continue;
+            }
+            std::cout << "[file] expire fileId=" << session.fileId
+                      << " sender=" << session.senderId
+                      << " accepted=" << (session.acceptForwarded ? 1 : 0) << std::endl;
+            if (session.senderFd >= 0 && !session.acceptForwarded) {
+                notices.emplace_back(session.senderFd,
+                                     ProtocolParser::packFileOfferResponse(
+                                         0, session.fileId, FILE_OFFER_BUSY, "Offer expired"));
+            }
+            it = eraseFileSession(it);
+        }
+    }
+
+    for (const auto& notice : notices) {
+        sendResponse(notice.first, notice.second);
+    }
+}
+
+void Server::removeStaleSpoolFiles() {
+    // Spool files are unlinked when their session ends; anything left over
+    // belongs to a previous run that did not shut down cleanly.
+    DIR* dir = opendir(config_.spoolDir.c_str());
+    if (!dir) {
+        std::cerr << "[relay] cannot open spool dir " << config_.spoolDir
+                  << ": " << std::strerror(errno) << std::endl;
+        return;
+    }
+    size_t removed = 0;
+    while (dirent* entry = readdir(dir)) {
+        if (std::strncmp(entry->d_name, kSpoolFilePrefix, std::strlen(kSpoolFilePrefix)) != 0) {
+            continue;
+        }
+        std::string path = config_.spoolDir + "/" + entry->d_name;
+        if (unlink(path.c_str()) == 0) {
+            ++removed;
+        }
+    }
+    closedir(dir);
+    if (removed > 0) {
+        std::cout << "[relay] removed stale spool files count=" << removed << std::endl;
+    }
+}
+
+void Server::cleanupFileSessionsForFd(int clientFd, const std::string& clientId) {
+    std::vector<std::pair<int, std::vector<uint8_t>>> notices;
+    {
+        std::lock_guard<std::mutex> lock(fileMutex_);
+        spoolReaders_.erase(clientFd);
+
+        auto streamIt = fileStreams_.find(clientFd);
+        if (streamIt != fileStreams_.end()) {
+            auto it = fileSessions_.find(streamIt->second);
+            if (it != fileSessions_.end()) {
+                std::replace(it->second.senderStreams.begin(),
+                             it->second.senderStreams.end(), clientFd, -1);
+                std::replace(it->second.receiverStreams.begin(),
+                             it->second.receiverStreams.end(), clientFd, -1);
+                if (it->second.tunnelPipe) {
+                    // A tunnel cannot resume with one side gone.
+                    std::cout << "[tunnel] failed fileId=" << it->second.fileId
+                              << " bytes=" << it->second.tunnelPipe->bytesForwarded() << std::endl;
+                    it->second.tunnelPipe.reset();
+                    for (int fd : {it->second.senderStreams[0], it->second.receiverStreams[0]}) {
+                        if (fd >= 0) {
+                            queueDisconnect(fd);
+                        }
+                    }
+                }
+            }
+            fileStreams_.erase(streamIt);
+            return;
+        }
+
+        auto indexIt = fdSessions_.find(clientFd);
+        std::vector<FileKey> keys;
+        if (indexIt != fdSessions_.end()) {
+            keys.assign(indexIt->second.begin(), indexIt->second.end());
+            fdSessions_.erase(indexIt);
+        }
+
+        for (const auto& key : keys) {
+            auto it = fileSessions_.find(key);
+            if (it == fileSessions_.end()) {
+                continue;
+            }
+            FileSession& session = it->second;
+            unlinkSessionFd(session, clientFd);
+            if (session.spooled) {
+                // An interrupted upload cannot be completed; otherwise the
+                // spool outlives both ends until the retention period expires.
+                if (session.senderFd == clientFd) {
+                    session.senderFd = -1;
+                    if (session.bytesRelayed < session.fileSize) {
+                        eraseFileSession(it);
+                        continue;
+                    }
+                }
+                auto receiverIt = std::find_if(session.receivers.begin(), session.receivers.end(),
+                                               [clientFd](const FileReceiver& receiver) {
+                                                   return receiver.fd == clientFd;
+                                               });
+                bool wasPending = !clientId.empty() && session.pendingIds.erase(clientId) > 0;
+                if (receiverIt != session.receivers.end() || wasPending) {
+                    bool delivered = false;
+                    if (receiverIt != session.receivers.end()) {
+                        delivered = session.bytesRelayed >= session.fileSize
+                            && receiverIt->spoolOffset >= deliverableBytes(session);
+                        session.receivers.erase(receiverIt);
+                    }
+                    if (!delivered && !clientId.empty() && config_.spoolRetentionSec > 0) {
+                        session.detachedIds.insert(clientId);
+                        detachedSessions_[clientId].insert(it->first);
+                    }
+                    session.lastActivity = std::chrono::steady_clock::now();
+                }
+                if (session.pendingIds.empty() && session.receivers.empty()
+                    && session.detachedIds.empty()) {
+                    if (session.senderFd >= 0 && !session.acceptForwarded) {
+                        notices.emplace_back(session.senderFd,
+                                             ProtocolParser::packFileOfferResponse(
+                                                 0, session.fileId, FILE_OFFER_BUSY,
+                                                 "No recipients online"));
+                    }
+                    eraseFileSession(it);
+                    continue;
+                }
+                finishSpooledIfDone(it);
+                continue;
+            }
+            if (session.senderFd == clientFd || session.receiverFd == clientFd) {
+                eraseFileSession(it);
+            }
+        }
+    }
+
+    for (const auto& notice : notices) {
+        sendResponse(notice.first, notice.second);
+    }
 }
 
 void Server::heartbeatLoop() {
@@ -952,12 +3438,132 @@ void Server::heartbeatLoop() {
             break;
         }
 
-        auto timeoutClients = clientMgr_->checkTimeout(kHeartbeatTimeoutSec);
-        for (int fd : timeoutClients) {
-            std::cout << "[heartbeat timeout] fd=" << fd << std::endl;
-            queueDisconnect(fd);
+        // With keepalive on, dead peers surface as socket errors and a
+        // silent but reachable client is not an error.
+        if (config_.tcpKeepaliveSec == 0) {
+            auto timeoutClients = clientMgr_->checkTimeout(kHeartbeatTimeoutSec);
+            for (int fd : timeoutClients) {
+                std::cout << "[heartbeat timeout] fd=" << fd << std::endl;
+                queueDisconnect(fd);
+            }
+        }
+        if (config_.loginDeadlineSec > 0) {
+            for (int fd : clientMgr_->checkLoginTimeout(config_.loginDeadlineSec)) {
+                std::cout << "[login timeout] fd=" << fd << std::endl;
+                ++loginTimeouts_;
+                queueDisconnect(fd);
+            }
         }
 
         std::cout << "[status] online clients: " << clientMgr_->getOnlineCount() << std::endl;
+        if (contentStore_) {
+            ContentStoreStats stats = contentStore_->stats();
+            double hitRate = stats.lookups > 0
+                ? static_cast<double>(stats.hits) / static_cast<double>(stats.lookups)
+                : 0.0;
+            std::cout << "[store] objects=" << stats.objects
+                      << " bytes=" << stats.bytes
+                      << " lookups=" << stats.lookups
+                      << " hits=" << stats.hits
+                      << " hitRate=" << hitRate
+                      << " bytesSaved=" << stats.bytesSaved
+                      << " inserts=" << stats.inserts
+                      << " evictions=" << stats.evictions << std::endl;
+        }
+        if (config_.zeroCopySend) {
+            std::cout << "[zerocopy] sends=" << zeroCopySends_.load()
+                      << " completions=" << zeroCopyCompletions_.load()
+                      << " copied=" << zeroCopyCopied_.load() << std::endl;
+        }
+        if (chatFilter_) {
+            std::cout << "[filter] terms=" << chatFilter_->termCount()
+                      << " scanned=" << chatFilter_->bytesScanned()
+                      << " matches=" << chatFilter_->matches() << std::endl;
+        }
+        if (offlineStore_) {
+            OfflineStoreStats stats = offlineStore_->stats();
+            std::cout << "[offline] pending=" << stats.pending
+                      << " recipients=" << stats.recipients
+                      << " segments=" << stats.segments
+                      << " appended=" << stats.appended
+                      << " delivered=" << stats.delivered
+                      << " rejected=" << stats.rejected
+                      << " expired=" << stats.expired
+                      << " syncs=" << stats.syncs << std::endl;
+        }
+        if (historyStore_) {
+            HistoryStoreStats stats = historyStore_->stats();
+            std::cout << "[history] conversations=" << stats.conversations
+                      << " segments=" << stats.segments
+                      << " appended=" << stats.appended
+                      << " queries=" << stats.queries
+                      << " recordsRead=" << stats.recordsRead
+                      << " droppedSegments=" << stats.droppedSegments << std::endl;
+        }
+        if (searchIndex_) {
+            SearchIndexStats stats = searchIndex_->stats();
+            std::cout << "[search] documents=" << stats.documents
+                      << " terms=" << stats.terms
+                      << " segments=" << stats.segments
+                      << " postingBytes=" << stats.postingBytes
+                      << " merges=" << stats.merges
+                      << " queries=" << stats.queries << std::endl;
+        }
+        if (authPool_) {
+            AuthPoolStats stats = authPool_->stats();
+            std::cout << "[auth] queued=" << stats.queued
+                      << " submitted=" << stats.submitted
+                      << " rejected=" << stats.rejected
+                      << " completed=" << stats.completed
+                      << " failed=" << stats.failed
+                      << " busyMs=" << stats.busyUs / 1000 << std::endl;
+        }
+        std::cout << "[admission] unauthenticated=" << unauthenticatedCount_.load()
+                  << " deferredLogins=" << deferredLogins_.load()
+                  << " refusedConnections=" << refusedConnections_.load()
+                  << " refusedPerIp=" << refusedPerIp_.load()
+                  << " loginTimeouts=" << loginTimeouts_.load()
+                  << " rosterBroadcasts=" << rosterBroadcasts_.load() << std::endl;
+        if (sessions_) {
+            SessionTableStats stats = sessions_->stats();
+            std::cout << "[session] sessions=" << stats.sessions
+                      << " lingering=" << stats.lingering
+                      << " logins=" << stats.logins
+                      << " resumes=" << stats.resumes
+                      << " resumeRejected=" << stats.resumeRejected
+                      << " superseded=" << supersededSessions_.load()
+                      << " expired=" << stats.expired << std::endl;
+        }
+        if (userDirectory_) {
+            UserDirectoryStats stats = userDirectory_->stats();
+            std::cout << "[users] users=" << stats.users
+                      << " slots=" << stats.slots
+                      << " mappedBytes=" << stats.mappedBytes
+                      << " lookups=" << stats.lookups
+                      << " hits=" << stats.hits
+                      << " probes=" << stats.probes
+                      << " reloads=" << stats.reloads << std::endl;
+        }
+        if (recentRing_) {
+            RecentRingStats stats = recentRing_->stats();
+            std::cout << "[recent] stored=" << stats.stored
+                      << " capacity=" << stats.capacity
+                      << " newestSeq=" << stats.newestSeq
+                      << " memoryBytes=" << stats.memoryBytes
+                      << " catchUps=" << stats.catchUps
+                      << " replayed=" << stats.replayed
+                      << " incomplete=" << stats.incomplete << std::endl;
+        }
+        if (config_.msgRatePerSec > 0 || config_.fileRateBytes > 0) {
+            std::cout << "[throttle] rejected=" << throttledMessages_.load()
+                      << " pauses=" << readPauses_.load()
+                      << " pausedMs=" << readPausedMs_.load() << std::endl;
+        }
+        if (protocol_ && protocol_->resyncCount() > 0) {
+            std::cout << "[protocol] resyncs=" << protocol_->resyncCount()
+                      << " skipped=" << protocol_->resyncSkippedBytes() << std::endl;
+        }
+        std::cout << "[heartbeat] pings=" << heartbeatRequests_.load()
+                  << " keepaliveSec=" << config_.tcpKeepaliveSec << std::endl;
     }
 }
@@ -4,21 +4,40 @@
 #include <string>
 #include <memory>
 #include <atomic>
+#include <chrono>
 #include <thread>
 #include <mutex>
 #include <vector>
 #include <unordered_map>
+#include <unordered_set>
 
 #include "reactor.h"
 #include "client_manager.h"
 #include "protocol.h"
+#include "file_spool.h"
+#include "server_config.h"
+#include "auth_pool.h"
+#include "content_store.h"
+#include "splice_tunnel.h"
+#include "file_key.h"
+#include "content_filter.h"
+#include "token_bucket.h"
+#include "offline_store.h"
+#include "history_store.h"
+#include "recent_ring.h"
+#include "search_index.h"
+#include "user_directory.h"
+#include "session_table.h"
+
+using SharedBuffer = std::shared_ptr<const std::vector<uint8_t>>;
 
 class ListenHandler;
 class ClientHandler;
+class TimerHandler;
 
 class Server {
 public:
-    Server(const std::string& ip, int port);
+    Server(const std::string& ip, int port, const ServerConfig& config = ServerConfig());
     ~Server();
 
     bool start();
@@ -28,54 +47,292 @@ public:
 private:
     friend class ListenHandler;
     friend class ClientHandler;
+    friend class TimerHandler;
 
     bool initListenSocket();
     bool setNonBlocking(int fd);
+    bool setKeepAlive(int fd, int idleSec);
     bool registerClient(int clientFd, const std::string& ip, int port);
     void onClientData(int clientFd, const uint8_t* data, size_t len);
     void handleClientDisconnect(int clientFd);
     void handleMessage(int clientFd, const MessageHeader& header,
                        const uint8_t* body, size_t bodyLen);
+    void handleLoginRequest(int clientFd, const MessageHeader& header,
+                            const uint8_t* body, size_t bodyLen);
+    bool rejectLogin(int clientFd, uint32_t sequence, const std::string& clientId,
+                     const std::string& nickname);
+    void completeLogin(int clientFd, uint32_t sequence, const std::string& clientId,
+                       const std::string& nickname);
+    void finishPendingLogins();
+    bool admitLogin(int clientFd, uint32_t sequence);
+    void leaveUnauthenticated(int clientFd);
+    void sendRetryLater(int clientFd, uint32_t sequence, uint32_t retryAfterMs);
+    void resumeLogin(int clientFd, uint32_t sequence, const std::string& clientId,
+                     const std::string& nickname, const uint8_t* token);
+    void expireDetachedSessions();
+    void armResumeTimer();
     void handleChatMessage(int clientFd, const MessageHeader& header,
                            const uint8_t* body, size_t bodyLen);
     void handleUserListRequest(int clientFd, const MessageHeader& header);
+    void handleHistoryRequest(int clientFd, const MessageHeader& header,
+                              const uint8_t* body, size_t bodyLen);
+    void recordHistory(ChatScope scope, const std::string& fromId, const std::string& toId,
+                       const std::vector<uint8_t>& packet);
+    void indexHistoryRecord(const std::string& conversation, uint64_t seq,
+                            const uint8_t* payload, size_t len);
+    void handleCatchUpRequest(int clientFd, const MessageHeader& header,
+                              const uint8_t* body, size_t bodyLen);
+    void handleSearchRequest(int clientFd, const MessageHeader& header,
+                             const uint8_t* body, size_t bodyLen);
     void handleFileOffer(int clientFd, const MessageHeader& header,
                          const uint8_t* body, size_t bodyLen);
     void handleFileOfferResponse(int clientFd, const MessageHeader& header,
                                  const uint8_t* body, size_t bodyLen);
     void handleFileData(int clientFd, const MessageHeader& header,
                         const uint8_t* body, size_t bodyLen);
+    void handleFileDataFragment(int clientFd, const MessageHeader& header,
+                                const uint8_t* prefix, size_t prefixLen,
+                                const uint8_t* data, size_t len, size_t bodyOffset);
+    void handleFileStreamAttach(int clientFd, const MessageHeader& header,
+                                const uint8_t* body, size_t bodyLen);
+    void handleFileCancel(int clientFd, const uint8_t* body, size_t bodyLen);
+    void handleFileProof(int clientFd, const MessageHeader& header,
+                         const uint8_t* body, size_t bodyLen);
     void broadcastUserList();
+    void flushUserList();
+    std::vector<UserInfo> buildRoster(const std::vector<ClientInfo>& clients) const;
     void sendUserList(int clientFd, uint32_t sequence);
     void heartbeatLoop();
     void queueDisconnect(int clientFd);
     void processPendingDisconnects();
     void cleanupAllClients();
     bool sendResponse(int clientFd, const std::vector<uint8_t>& data);
-    void cleanupFileSessionsForFd(int clientFd);
+    bool sendShared(int clientFd, const SharedBuffer& data);
+    bool sendFile(int clientFd, const std::shared_ptr<const void>& owner, int fileFd,
+                  uint64_t offset, size_t len);
+    size_t pendingBytes(int clientFd) const;
+    void onClientWritable(int clientFd);
+    void pumpTunnel(int clientFd);
+    void cleanupFileSessionsForFd(int clientFd, const std::string& clientId);
+    bool admitMessage(int clientFd, const MessageHeader& header);
+    void chargeFileBytes(int clientFd, size_t bytes);
+    void resumePausedReads();
 
 private:
+    struct FileReceiver {
+        int fd = -1;
+        std::string clientId;
+        // Offset into the spool, or into the stored object for store hits.
+        uint64_t spoolOffset = 0;
+    };
+
     struct FileSession {
+        std::string fileId;
         int senderFd = -1;
         int receiverFd = -1;
+        std::string senderId;
+        std::string receiverId;
+        std::vector<int> senderStreams;
+        std::vector<int> receiverStreams;
+
+        // Spooled sessions store every chunk before forwarding it, so the
+        // sender never waits on receivers. Multicast sessions fan one upload
+        // out to every accepting receiver.
+        bool spooled = false;
+        bool multicast = false;
+        bool acceptForwarded = false;
+        uint64_t fileSize = 0;
+        uint64_t bytesRelayed = 0;
+        std::string fileName;
+        std::string senderNick;
+        std::unordered_set<std::string> pendingIds;
+        std::unordered_set<std::string> detachedIds;
+        std::vector<FileReceiver> receivers;
+        std::shared_ptr<FileSpool> spool;
+        // Offers announcing a content hash are either served from the
+        // content store or recorded into it while they are relayed.
+        std::shared_ptr<const ContentObject> storeObject;
+        std::shared_ptr<ContentWriter> contentWriter;
+        // Nothing is served from the store until the sender has answered
+        // the proof request with this digest.
+        uint8_t storeProof[Sha256::kDigestSize] = {};
+        bool storeProven = false;
+        bool storeHitCounted = false;
+        std::chrono::steady_clock::time_point lastActivity;
+
+        // Tunnel sessions carry the raw payload over one data channel per
+        // side, joined with splice() once both have attached.
+        bool tunnel = false;
+        std::shared_ptr<SpliceTunnel> tunnelPipe;
+        // Direct sessions let the receiver advertise an endpoint so the
+        // peers can connect to each other; the spool remains the fallback.
+        bool direct = false;
+        // Handed to the receiver in the offer and to the sender in the
+        // accept; data streams must present it to attach.
+        uint8_t attachToken[sizeof(FileStreamAttach::attachToken)] = {};
+
+        // Connections listed in fdSessions_ under this session's key.
+        std::vector<int> indexedFds;
+    };
+
+    // Per-connection budgets. Frames over the message budget are rejected
+    // with MSG_RATE_LIMITED; file data over the byte budget is still taken,
+    // but the connection is not read again until the debt is paid off.
+    struct ClientLimits {
+        TokenBucket messages;
+        TokenBucket fileBytes;
+        bool notified = false;
+    };
+
+    // A login waiting for its password check on the auth pool.
+    struct PendingLogin {
+        int fd;
+        uint32_t sequence;
+        std::string clientId;
+        std::string nickname;
     };
 
+    // What closing a logged-in connection does to its session.
+    enum class SessionEnd {
+        Detach,        // dropped: resumable for the grace period
+        Logout         // the client logged out
+    };
+
+    // Offline frames sent to a connection stay stored until its peer has
+    // acknowledged them.
+    struct OfflineDelivery {
+        std::string clientId;
+        uint64_t throughSeq;
+        size_t count;
+    };
+
+    struct PausedRead {
+        std::chrono::steady_clock::time_point since;
+        std::chrono::steady_clock::time_point resumeAt;
+    };
+
+    using FileSessionMap = std::unordered_map<FileKey, FileSession, FileKeyHash>;
+    using FileKeySet = std::unordered_set<FileKey, FileKeyHash>;
+
+    // A large file data frame that is still arriving. Frames for spooled
+    // uploads are written to the spool piece by piece; anything else is
+    // reassembled and handled as a whole frame.
+    struct PartialFrame {
+        enum class Mode { Spool, Buffer, Drop };
+        Mode mode = Mode::Buffer;
+        FileKey key;
+        uint64_t dataOffset = 0;
+        std::vector<uint8_t> body;
+    };
+
+    void handleSpooledOfferResponse(int clientFd, const MessageHeader& header,
+                                    FileSessionMap::iterator it,
+                                    const FileOfferResponse& rsp,
+                                    const FileOfferResponseExt& ext);
+    void relaySpooledData(FileSessionMap::iterator it, const MessageHeader& header,
+                          const uint8_t* body, size_t bodyLen);
+    bool beginSpooledFrame(int clientFd, const MessageHeader& header,
+                           const uint8_t* prefix, size_t prefixLen, PartialFrame& frame);
+    void appendSpooledFragment(const MessageHeader& header, PartialFrame& frame,
+                               const uint8_t* data, size_t len, bool last);
+    void failSpooledUpload(FileSessionMap::iterator it, uint32_t sequence, const char* reason);
+    void pumpSpool(const FileKey& key, FileSession& session, FileReceiver& receiver);
+    void finishSpooledIfDone(FileSessionMap::iterator it);
+    static uint64_t deliverableBytes(const FileSession& session);
+    bool ownsFileKey(int clientFd, const FileKey& key);
+    FileSessionMap::iterator eraseFileSession(FileSessionMap::iterator it);
+    void linkSessionFd(FileSessionMap::iterator it, int fd);
+    void unlinkSessionFd(FileSession& session, int fd);
+    void expireIdleFileSessions();
+    void reofferDetachedFiles(int clientFd, const std::string& clientId);
+    void deliverOfflineMessages(int clientFd, const std::string& clientId);
+    void confirmOfflineDelivery(int clientFd);
+    void collectSpoolGarbage();
+    void removeStaleSpoolFiles();
+    void releaseRetiredZeroCopyBuffers();
+
     std::string ip_;
     int port_;
+    ServerConfig config_;
     int listenFd_;
     std::atomic<bool> running_;
 
     std::unique_ptr<Reactor> reactor_;
     std::unique_ptr<ClientManager> clientMgr_;
     std::unique_ptr<ProtocolParser> protocol_;
+    std::unique_ptr<ContentStore> contentStore_;
+    std::unique_ptr<ContentFilter> chatFilter_;
+    std::unique_ptr<OfflineStore> offlineStore_;
+    // Keyed by fd; reactor thread only.
+    std::unordered_map<int, OfflineDelivery> offlineDeliveries_;
+    std::unique_ptr<HistoryStore> historyStore_;
+    std::unique_ptr<SearchIndex> searchIndex_;
+    std::unique_ptr<RecentRing> recentRing_;
+    std::unique_ptr<UserDirectory> userDirectory_;
     std::unique_ptr<ListenHandler> listenHandler_;
+    std::unique_ptr<TimerHandler> spoolGcTimer_;
+    std::unique_ptr<TimerHandler> throttleTimer_;
+    std::unique_ptr<TimerHandler> offlineSyncTimer_;
+    // Drains the auth pool's eventfd; declared before the pool so the
+    // workers are joined before the fd is closed.
+    std::unique_ptr<TimerHandler> authNotifier_;
+    std::unique_ptr<AuthPool> authPool_;
+    std::unordered_map<uint64_t, PendingLogin> pendingLogins_;
+    std::unordered_map<int, uint64_t> pendingLoginFds_;
+    uint64_t nextAuthId_ = 1;
+    std::unique_ptr<SessionTable> sessions_;
+    std::unique_ptr<TimerHandler> resumeTimer_;
+    std::unordered_map<int, SessionEnd> sessionEnds_;
+    // Admission control: full logins are metered by loginBucket_, and the
+    // logins told to retry are spread over later slots.
+    TokenBucket loginBucket_;
+    std::chrono::steady_clock::time_point loginRetrySlot_;
+    std::unordered_set<int> unauthenticated_;
+    // Newest recent-ring seq when each fd logged in; later group frames
+    // reach it live, so a catch-up stops there.
+    std::unordered_map<int, uint32_t> catchUpLimits_;
+    std::unordered_map<std::string, size_t> connectionsPerIp_;
+    // User list broadcasts are coalesced until this timer fires.
+    std::unique_ptr<TimerHandler> rosterTimer_;
+    bool rosterDirty_ = false;
+    // Buffers that were still pinned by zero-copy sends when their client
+    // handler went away; released on later GC ticks.
+    std::vector<SharedBuffer> zeroCopyRetired_;
+    std::vector<SharedBuffer> zeroCopyRetiredOld_;
     std::unordered_map<int, std::unique_ptr<ClientHandler>> clientHandlers_;
+    std::unordered_map<int, ClientLimits> clientLimits_;
+    std::unordered_map<int, PausedRead> pausedReads_;
 
     std::thread heartbeatThread_;
     std::mutex pendingMutex_;
     std::vector<int> pendingDisconnects_;
     std::mutex fileMutex_;
-    std::unordered_map<std::string, FileSession> fileSessions_;
+    FileSessionMap fileSessions_;
+    std::unordered_map<int, FileKey> fileStreams_;
+    std::unordered_map<int, FileKeySet> spoolReaders_;
+    // Sessions each connection takes part in, so a disconnect only visits
+    // its own sessions.
+    std::unordered_map<int, FileKeySet> fdSessions_;
+    // Sessions waiting for each detached receiver, so a login only visits
+    // the transfers it missed.
+    std::unordered_map<std::string, FileKeySet> detachedSessions_;
+    std::unordered_map<int, PartialFrame> partialFrames_;
+    uint64_t spoolReserved_ = 0;
+
+    std::atomic<uint64_t> zeroCopySends_{0};
+    std::atomic<uint64_t> zeroCopyCompletions_{0};
+    std::atomic<uint64_t> zeroCopyCopied_{0};
+    std::atomic<uint64_t> throttledMessages_{0};
+    std::atomic<uint64_t> readPauses_{0};
+    std::atomic<uint64_t> readPausedMs_{0};
+    std::atomic<uint64_t> supersededSessions_{0};
+    std::atomic<uint64_t> deferredLogins_{0};
+    std::atomic<uint64_t> refusedConnections_{0};
+    std::atomic<uint64_t> refusedPerIp_{0};
+    std::atomic<uint64_t> loginTimeouts_{0};
+    std::atomic<uint64_t> rosterBroadcasts_{0};
+    std::atomic<uint64_t> heartbeatRequests_{0};
+    std::atomic<size_t> unauthenticatedCount_{0};
 };
 
 #endif
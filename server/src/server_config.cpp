@@ -0,0 +1,145 @@
+#include "server_config.h"
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+
+namespace {
+
+std::string trim(const std::string& s) {
+    size_t begin = s.find_first_not_of(" \t\r");
+    if (begin == std::string::npos) {
+        return {};
+    }
+    size_t end = s.find_last_not_of(" \t\r");
+    return s.substr(begin, end - begin + 1);
+}
+
+bool parseInt(const std::string& value, long long& out) {
+    char* end = nullptr;
+    out = std::strtoll(value.c_str(), &end, 10);
+    return end && *end == '\0' && !value.empty() && out >= 0;
+}
+
+}  // namespace
+
+bool ServerConfig::loadFromFile(const std::string& path) {
+    std::ifstream in(path);
+    if (!in) {
+        std::cerr << "[config] cannot open " << path << std::endl;
+        return false;
+    }
+
+    std::string line;
+    int lineNo = 0;
+    while (std::getline(in, line)) {
+        ++lineNo;
+        size_t comment = line.find('#');
+        if (comment != std::string::npos) {
+            line.erase(comment);
+        }
+        line = trim(line);
+        if (line.empty()) {
+            continue;
+        }
+
+        size_t eq = line.find('=');
+        if (eq == std::string::npos) {
+            std::cerr << "[config] " << path << ":" << lineNo << " missing '='" << std::endl;
+            return false;
+        }
+        std::string key = trim(line.substr(0, eq));
+        std::string value = trim(line.substr(eq + 1));
+
+        long long number = 0;
+        if (key == "spool_dir" && !value.empty()) {
+            spoolDir = value;
+        } else if (key == "spool_max_mb" && parseInt(value, number)) {
+            spoolMaxBytes = static_cast<uint64_t>(number) * 1024 * 1024;
+        } else if (key == "spool_retention_sec" && parseInt(value, number)) {
+            spoolRetentionSec = static_cast<int>(number);
+        } else if (key == "spool_gc_interval_sec" && parseInt(value, number) && number > 0) {
+            spoolGcIntervalSec = static_cast<int>(number);
+        } else if (key == "store_dir" && !value.empty()) {
+            storeDir = value;
+        } else if (key == "store_max_mb" && parseInt(value, number)) {
+            storeMaxBytes = static_cast<uint64_t>(number) * 1024 * 1024;
+        } else if (key == "zerocopy_send" && parseInt(value, number) && number <= 1) {
+            zeroCopySend = number == 1;
+        } else if (key == "zerocopy_min_kb" && parseInt(value, number)) {
+            zeroCopyMinBytes = static_cast<size_t>(number) * 1024;
+        } else if (key == "file_idle_sec" && parseInt(value, number)) {
+            fileIdleSec = static_cast<int>(number);
+        } else if (key == "chat_filter_file") {
+            chatFilterFile = value;
+        } else if (key == "msg_rate_per_sec" && parseInt(value, number)) {
+            msgRatePerSec = static_cast<int>(number);
+        } else if (key == "msg_burst" && parseInt(value, number) && number > 0) {
+            msgBurst = static_cast<int>(number);
+        } else if (key == "file_rate_kb" && parseInt(value, number)) {
+            fileRateBytes = static_cast<uint64_t>(number) * 1024;
+        } else if (key == "file_burst_kb" && parseInt(value, number) && number > 0) {
+            fileBurstBytes = static_cast<uint64_t>(number) * 1024;
+        } else if (key == "offline_dir" && !value.empty()) {
+            offlineDir = value;
+        } else if (key == "offline_max_mb" && parseInt(value, number)) {
+            offlineMaxBytes = static_cast<uint64_t>(number) * 1024 * 1024;
+        } else if (key == "offline_segment_mb" && parseInt(value, number)
+                   && number > 0 && number <= 1024) {
+            offlineSegmentBytes = static_cast<uint64_t>(number) * 1024 * 1024;
+        } else if (key == "offline_sync"
+                   && (value == "always" || value == "interval" || value == "os")) {
+            offlineSync = value;
+        } else if (key == "offline_sync_ms" && parseInt(value, number) && number > 0) {
+            offlineSyncMs = static_cast<int>(number);
+        } else if (key == "offline_retention_sec" && parseInt(value, number)) {
+            offlineRetentionSec = static_cast<int>(number);
+        } else if (key == "offline_max_per_user" && parseInt(value, number) && number > 0) {
+            offlineMaxPerUser = static_cast<size_t>(number);
+        } else if (key == "history_dir" && !value.empty()) {
+            historyDir = value;
+        } else if (key == "history_max_mb" && parseInt(value, number)) {
+            historyMaxBytes = static_cast<uint64_t>(number) * 1024 * 1024;
+        } else if (key == "history_segment_mb" && parseInt(value, number)
+                   && number > 0 && number <= 1024) {
+            historySegmentBytes = static_cast<uint64_t>(number) * 1024 * 1024;
+        } else if (key == "history_retention_sec" && parseInt(value, number)) {
+            historyRetentionSec = static_cast<int>(number);
+        } else if (key == "search_index" && parseInt(value, number) && number <= 1) {
+            searchIndex = number == 1;
+        } else if (key == "recent_ring_messages" && parseInt(value, number)) {
+            recentRingMessages = static_cast<size_t>(number);
+        } else if (key == "user_db") {
+            userDb = value;
+        } else if (key == "user_db_required" && parseInt(value, number) && number <= 1) {
+            userDbRequired = number == 1;
+        } else if (key == "auth_threads" && parseInt(value, number) && number >= 1) {
+            authThreads = static_cast<int>(number);
+        } else if (key == "auth_queue_max" && parseInt(value, number) && number >= 1) {
+            authQueueMax = static_cast<size_t>(number);
+        } else if (key == "resume_grace_sec" && parseInt(value, number)) {
+            resumeGraceSec = static_cast<int>(number);
+        } else if (key == "listen_backlog" && parseInt(value, number) && number >= 1) {
+            listenBacklog = static_cast<int>(number);
+        } else if (key == "login_rate_per_sec" && parseInt(value, number)) {
+            loginRatePerSec = static_cast<int>(number);
+        } else if (key == "login_burst" && parseInt(value, number) && number >= 1) {
+            loginBurst = static_cast<int>(number);
+        } else if (key == "login_deadline_sec" && parseInt(value, number)) {
+            loginDeadlineSec = static_cast<int>(number);
+        } else if (key == "max_unauthenticated" && parseInt(value, number)) {
+            maxUnauthenticated = static_cast<size_t>(number);
+        } else if (key == "max_conns_per_ip" && parseInt(value, number)) {
+            maxConnsPerIp = static_cast<size_t>(number);
+        } else if (key == "roster_flush_ms" && parseInt(value, number)) {
+            rosterFlushMs = static_cast<int>(number);
+        } else if (key == "tcp_keepalive_sec" && parseInt(value, number)) {
+            tcpKeepaliveSec = static_cast<int>(number);
+        } else {
+            std::cerr << "[config] " << path << ":" << lineNo
+                      << " invalid setting '" << key << "'" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,115 @@
+#ifndef SERVER_CONFIG_H
+#define SERVER_CONFIG_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Runtime settings, optionally loaded from a "key = value" file.
+//
+//   spool_dir              directory for relay spool files
+//   spool_max_mb           total spool budget across all sessions
+//   spool_retention_sec    idle time before a relay session is dropped
+//   spool_gc_interval_sec  how often idle sessions are collected
+//   store_dir              content-addressed store for deduplicated uploads
+//   store_max_mb           store size limit (LRU eviction); 0 disables it
+//   zerocopy_send          1 to send large relayed frames with MSG_ZEROCOPY
+//   zerocopy_min_kb        smallest batch worth pinning instead of copying
+//   file_idle_sec          idle time before a direct or streamed transfer
+//                          session is dropped; 0 keeps them indefinitely
+//   chat_filter_file       banned-term list applied to group chat; reloaded
+//                          when the file changes; empty disables filtering
+//   msg_rate_per_sec       frames per second a connection may send, apart
+//                          from heartbeats and file data; 0 disables
+//   msg_burst              frames a connection may send back to back
+//   file_rate_kb           file data KB per second per connection; reads
+//                          pause while over budget; 0 disables
+//   file_burst_kb          file data a connection may send back to back
+//   offline_dir            log segments holding private messages for
+//                          offline recipients
+//   offline_max_mb         offline log size limit; 0 disables queueing
+//   offline_segment_mb     size of one log segment
+//   offline_sync           always (msync per message), interval (every
+//                          offline_sync_ms) or os (kernel writeback)
+//   offline_sync_ms        flush period for offline_sync = interval
+//   offline_retention_sec  age at which undelivered messages are dropped
+//   offline_max_per_user   messages queued per recipient
+//   history_dir            log segments holding chat history
+//   history_max_mb         history size limit, oldest segments are dropped
+//                          first; 0 disables history
+//   history_segment_mb     size of one history segment
+//   history_retention_sec  age at which history segments are dropped;
+//                          0 keeps them until the size limit
+//   search_index           1 to keep a full-text index over the history
+//   recent_ring_messages   recent group messages kept in memory for
+//                          reconnect catch-up; 0 disables
+//   user_db                registered-user directory written by
+//                          im_user_import; empty disables it
+//   user_db_required       1 to refuse clientIds missing from user_db
+//   auth_threads           worker threads checking user_db passwords
+//   auth_queue_max         password checks allowed to wait; logins past
+//                          that are refused as busy
+//   resume_grace_sec       how long a dropped session may be resumed with
+//                          its token before the others see it leave;
+//                          0 disables resume tokens
+//   listen_backlog         pending connections the kernel queues before
+//                          accept(); capped by net.core.somaxconn
+//   login_rate_per_sec     full logins admitted per second; the rest are
+//                          told when to retry; 0 disables
+//   login_burst            full logins admitted back to back
+//   login_deadline_sec     time a connection may stay without logging in;
+//                          0 disables
+//   max_unauthenticated    connections allowed before login; more are
+//                          closed on accept; 0 disables
+//   max_conns_per_ip       connections allowed from one address; 0 disables
+//   roster_flush_ms        delay for coalescing user list broadcasts;
+//                          0 sends every change at once
+//   tcp_keepalive_sec      idle time before the kernel probes a connection;
+//                          when set, silent clients are left to keepalive
+//                          instead of the heartbeat timeout; 0 disables
+struct ServerConfig {
+    std::string spoolDir = "/tmp";
+    uint64_t spoolMaxBytes = 4096ULL * 1024 * 1024;
+    int spoolRetentionSec = 600;
+    int spoolGcIntervalSec = 30;
+    std::string storeDir = "/tmp/im_store";
+    uint64_t storeMaxBytes = 1024ULL * 1024 * 1024;
+    bool zeroCopySend = false;
+    size_t zeroCopyMinBytes = 32 * 1024;
+    int fileIdleSec = 300;
+    std::string chatFilterFile;
+    int msgRatePerSec = 20;
+    int msgBurst = 40;
+    uint64_t fileRateBytes = 0;
+    uint64_t fileBurstBytes = 1024 * 1024;
+    std::string offlineDir = "/tmp/im_offline";
+    uint64_t offlineMaxBytes = 256ULL * 1024 * 1024;
+    uint64_t offlineSegmentBytes = 16ULL * 1024 * 1024;
+    std::string offlineSync = "interval";
+    int offlineSyncMs = 200;
+    int offlineRetentionSec = 7 * 24 * 3600;
+    size_t offlineMaxPerUser = 1000;
+    std::string historyDir = "/tmp/im_history";
+    uint64_t historyMaxBytes = 1024ULL * 1024 * 1024;
+    uint64_t historySegmentBytes = 64ULL * 1024 * 1024;
+    int historyRetentionSec = 30 * 24 * 3600;
+    bool searchIndex = true;
+    size_t recentRingMessages = 1024;
+    std::string userDb;
+    bool userDbRequired = false;
+    int authThreads = 2;
+    size_t authQueueMax = 256;
+    int resumeGraceSec = 30;
+    int listenBacklog = 1024;
+    int loginRatePerSec = 1000;
+    int loginBurst = 1000;
+    int loginDeadlineSec = 30;
+    size_t maxUnauthenticated = 1024;
+    size_t maxConnsPerIp = 0;
+    int rosterFlushMs = 100;
+    int tcpKeepaliveSec = 0;
+
+    bool loadFromFile(const std::string& path);
+};
+
+#endif
@@ -0,0 +1,154 @@
+#include "session_table.h"
+
+#include <cstring>
+
+#include "credential.h"
+
+SessionTable::SessionTable(int graceSec)
+    : graceSec_(graceSec) {}
+
+bool SessionTable::newToken(Session& session) {
+    return randomBytes(session.token, sizeof(session.token));
+}
+
+bool SessionTable::issue(const std::string& clientId, const std::string& nickname,
+                         uint8_t token[kResumeTokenSize]) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Session& session = sessions_[clientId];
+    if (!session.attached) {
+        --lingering_;
+    }
+    session.nickname = nickname;
+    session.attached = true;
+    ++stats_.logins;
+    if (!newToken(session)) {
+        sessions_.erase(clientId);
+        std::memset(token, 0, kResumeTokenSize);
+        return false;
+    }
+    std::memcpy(token, session.token, kResumeTokenSize);
+    return true;
+}
+
+bool SessionTable::resume(const std::string& clientId, uint8_t token[kResumeTokenSize],
+                          std::string& nickname) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = sessions_.find(clientId);
+    if (it == sessions_.end() ||
+        !constantTimeEqual(it->second.token, token, kResumeTokenSize)) {
+        ++stats_.resumeRejected;
+        return false;
+    }
+    Session& session = it->second;
+    if (!session.attached) {
+        --lingering_;
+        session.attached = true;
+    }
+    // A token is good for one resume; the next one comes with this login.
+    if (!newToken(session)) {
+        std::memset(session.token, 0, sizeof(session.token));
+    }
+    ++stats_.resumes;
+    nickname = session.nickname;
+    std::memcpy(token, session.token, kResumeTokenSize);
+    return true;
+}
+
+bool SessionTable::detach(const std::string& clientId, Clock::time_point now) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = sessions_.find(clientId);
+    if (it == sessions_.end() || !it->second.attached) {
+        return false;
+    }
+    it->second.attached = false;
+    it->second.deadline = now + std::chrono::seconds(graceSec_);
+    ++lingering_;
+    return true;
+}
+
+void SessionTable::forget(const std::string& clientId) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = sessions_.find(clientId);
+    if (it == sessions_.end()) {
+        return;
+    }
+    if (!it->second.attached) {
+        --lingering_;
+    }
+    sessions_.erase(it);
+}
+
+bool SessionTable::nicknameHeld(const std::string& nickname,
+                                const std::string& clientId) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (lingering_ == 0) {
+        return false;
+    }
+    for (const auto& entry : sessions_) {
+        if (!entry.second.attached && entry.second.nickname == nickname &&
+            entry.first != clientId) {
+            return true;
+        }
+    }
+    return false;
+}
+
+std::vector<std::string> SessionTable::expire(Clock::time_point now) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<std::string> expired;
+    if (lingering_ == 0) {
+        return expired;
+    }
+    for (auto it = sessions_.begin(); it != sessions_.end();) {
+        if (!it->second.attached && it->second.deadline <= now) {
+            expired.push_back(it->first);
+            it = sessions_.erase(it);
+            --lingering_;
+        } else {
+            ++it;
+        }
+    }
+    stats_.expired += expired.size();
+    return expired;
+}
+
+bool SessionTable::nextDeadline(Clock::time_point& deadline) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    bool found = false;
+    if (lingering_ == 0) {
+        return false;
+    }
+    for (const auto& entry : sessions_) {
+        if (entry.second.attached) {
+            continue;
+        }
+        if (!found || entry.second.deadline < deadline) {
+            deadline = entry.second.deadline;
+            found = true;
+        }
+    }
+    return found;
+}
+
+std::vector<std::pair<std::string, std::string>> SessionTable::detached() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<std::pair<std::string, std::string>> out;
+    if (lingering_ == 0) {
+        return out;
+    }
+    out.reserve(lingering_);
+    for (const auto& entry : sessions_) {
+        if (!entry.second.attached) {
+            out.emplace_back(entry.first, entry.second.nickname);
+        }
+    }
+    return out;
+}
+
+SessionTableStats SessionTable::stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    SessionTableStats stats = stats_;
+    stats.sessions = sessions_.size();
+    stats.lingering = lingering_;
+    return stats;
+}
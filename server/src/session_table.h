@@ -0,0 +1,76 @@
+#ifndef SESSION_TABLE_H
+#define SESSION_TABLE_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+constexpr size_t kResumeTokenSize = 16;
+
+struct SessionTableStats {
+    uint64_t sessions = 0;
+    uint64_t lingering = 0;
+    uint64_t logins = 0;
+    uint64_t resumes = 0;
+    uint64_t resumeRejected = 0;
+    uint64_t expired = 0;
+};
+
+// Resume tokens for logged-in clientIds. Losing the connection detaches a
+// session instead of ending it: for graceSec it keeps its nickname and
+// place on the roster, and the token brings it back without a full login.
+// Only the reactor thread changes the table; stats() may be called from
+// any thread.
+class SessionTable {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    explicit SessionTable(int graceSec);
+
+    int graceSec() const { return graceSec_; }
+
+    // Starts a session after a full login, replacing any earlier one for
+    // clientId, and fills token with its new resume token.
+    bool issue(const std::string& clientId, const std::string& nickname,
+               uint8_t token[kResumeTokenSize]);
+    // Checks a presented token. On a match the session is attached again,
+    // nickname is set to the one it had, and token is replaced by a fresh
+    // one.
+    bool resume(const std::string& clientId, uint8_t token[kResumeTokenSize],
+                std::string& nickname);
+    // The session's connection closed; returns false if there was none.
+    bool detach(const std::string& clientId, Clock::time_point now);
+    void forget(const std::string& clientId);
+    // True if a detached session other than clientId's holds nickname.
+    bool nicknameHeld(const std::string& nickname, const std::string& clientId) const;
+    // Drops detached sessions whose grace period is over and returns their
+    // clientIds.
+    std::vector<std::string> expire(Clock::time_point now);
+    bool nextDeadline(Clock::time_point& deadline) const;
+    // (clientId, nickname) of the detached sessions.
+    std::vector<std::pair<std::string, std::string>> detached() const;
+    SessionTableStats stats() const;
+
+private:
+    struct Session {
+        std::string nickname;
+        uint8_t token[kResumeTokenSize];
+        bool attached = true;
+        Clock::time_point deadline;
+    };
+
+    bool newToken(Session& session);
+
+    int graceSec_;
+    std::unordered_map<std::string, Session> sessions_;
+    size_t lingering_ = 0;
+    SessionTableStats stats_;
+    mutable std::mutex mutex_;
+};
+
+#endif
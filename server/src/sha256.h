@@ -0,0 +1,28 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+class Sha256 {
+public:
+    static constexpr size_t kDigestSize = 32;
+
+    Sha256();
+
+    void update(const uint8_t* data, size_t len);
+    void finish(uint8_t digest[kDigestSize]);
+
+    static std::string toHex(const uint8_t* digest, size_t len = kDigestSize);
+
+private:
+    void transform(const uint8_t block[64]);
+
+    uint32_t state_[8];
+    uint64_t bitLength_;
+    uint8_t buffer_[64];
+    size_t bufferLen_;
+};
+
+#endif
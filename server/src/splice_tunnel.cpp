@@ -0,0 +1,91 @@
+#include "splice_tunnel.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+namespace {
+constexpr int kTunnelPipeSize = 1024 * 1024;
+}
+
+SpliceTunnel::SpliceTunnel(int inFd, int outFd, uint64_t length)
+    : inFd_(inFd),
+      outFd_(outFd),
+      pipe_{-1, -1},
+      pipeCapacity_(0),
+      inPipe_(0),
+      length_(length),
+      received_(0),
+      forwarded_(0) {}
+
+SpliceTunnel::~SpliceTunnel() {
+    for (int fd : pipe_) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+}
+
+bool SpliceTunnel::init() {
+    if (pipe2(pipe_, O_NONBLOCK | O_CLOEXEC) < 0) {
+        std::cerr << "[tunnel] pipe failed error=" << std::strerror(errno) << std::endl;
+        return false;
+    }
+    // A larger pipe means fewer splice calls per wakeup; the default
+    // (usually 64 KB) still works if the limit does not allow it.
+    fcntl(pipe_[1], F_SETPIPE_SZ, kTunnelPipeSize);
+    int capacity = fcntl(pipe_[1], F_GETPIPE_SZ);
+    pipeCapacity_ = capacity > 0 ? static_cast<size_t>(capacity) : 64 * 1024;
+    return true;
+}
+
+SpliceTunnel::State SpliceTunnel::pump() {
+    bool progress = true;
+    while (progress) {
+        progress = false;
+
+        if (received_ < length_ && inPipe_ < pipeCapacity_) {
+            size_t want = static_cast<size_t>(
+                std::min<uint64_t>(pipeCapacity_ - inPipe_, length_ - received_));
+            ssize_t n = splice(inFd_, nullptr, pipe_[1], nullptr, want,
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0) {
+                inPipe_ += static_cast<size_t>(n);
+                received_ += static_cast<uint64_t>(n);
+                progress = true;
+            } else if (n == 0) {
+                std::cerr << "[tunnel] sender closed early received=" << received_
+                          << " length=" << length_ << std::endl;
+                return State::Failed;
+            } else if (errno == EINTR) {
+                progress = true;
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                std::cerr << "[tunnel] splice in failed error=" << std::strerror(errno) << std::endl;
+                return State::Failed;
+            }
+        }
+
+        if (inPipe_ > 0) {
+            unsigned int flags = SPLICE_F_MOVE | SPLICE_F_NONBLOCK;
+            if (received_ < length_) {
+                flags |= SPLICE_F_MORE;
+            }
+            ssize_t n = splice(pipe_[0], nullptr, outFd_, nullptr, inPipe_, flags);
+            if (n > 0) {
+                inPipe_ -= static_cast<size_t>(n);
+                forwarded_ += static_cast<uint64_t>(n);
+                progress = true;
+            } else if (n < 0 && errno == EINTR) {
+                progress = true;
+            } else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                std::cerr << "[tunnel] splice out failed error=" << std::strerror(errno) << std::endl;
+                return State::Failed;
+            }
+        }
+    }
+    return forwarded_ >= length_ ? State::Finished : State::Open;
+}
@@ -0,0 +1,54 @@
+#ifndef SPLICE_TUNNEL_H
+#define SPLICE_TUNNEL_H
+
+#include <cstddef>
+#include <cstdint>
+
+// Moves a fixed number of raw bytes from one socket to another through a
+// pipe with splice(), so the payload never enters userspace. Both sockets
+// must be non-blocking; pump() is called whenever either side is ready.
+class SpliceTunnel {
+public:
+    enum class State {
+        Open,
+        Finished,
+        Failed
+    };
+
+    SpliceTunnel(int inFd, int outFd, uint64_t length);
+    ~SpliceTunnel();
+
+    SpliceTunnel(const SpliceTunnel&) = delete;
+    SpliceTunnel& operator=(const SpliceTunnel&) = delete;
+
+    bool init();
+    State pump();
+
+    int inFd() const {
+        return inFd_;
+    }
+
+    int outFd() const {
+        return outFd_;
+    }
+
+    uint64_t bytesForwarded() const {
+        return forwarded_;
+    }
+
+    uint64_t length() const {
+        return length_;
+    }
+
+private:
+    int inFd_;
+    int outFd_;
+    int pipe_[2];
+    size_t pipeCapacity_;
+    size_t inPipe_;
+    uint64_t length_;
+    uint64_t received_;
+    uint64_t forwarded_;
+};
+
+#endif
@@ -0,0 +1,55 @@
+#include "token_bucket.h"
+
+#include <algorithm>
+#include <cmath>
+
+TokenBucket::TokenBucket(double rate, double burst)
+    : rate_(rate), burst_(std::max(burst, 1.0)), tokens_(burst_), last_(Clock::now()) {}
+
+void TokenBucket::refill(Clock::time_point now) {
+    if (now <= last_) {
+        return;
+    }
+    double elapsed = std::chrono::duration<double>(now - last_).count();
+    tokens_ = std::min(burst_, tokens_ + elapsed * rate_);
+    last_ = now;
+}
+
+bool TokenBucket::tryConsume(double cost, Clock::time_point now) {
+    if (!enabled()) {
+        return true;
+    }
+    refill(now);
+    if (tokens_ < cost) {
+        return false;
+    }
+    tokens_ -= cost;
+    return true;
+}
+
+void TokenBucket::consume(double cost, Clock::time_point now) {
+    if (!enabled()) {
+        return;
+    }
+    refill(now);
+    tokens_ -= cost;
+}
+
+void TokenBucket::refund(double cost) {
+    if (!enabled()) {
+        return;
+    }
+    tokens_ = std::min(burst_, tokens_ + cost);
+}
+
+std::chrono::milliseconds TokenBucket::delayFor(double cost, Clock::time_point now) {
+    if (!enabled()) {
+        return std::chrono::milliseconds(0);
+    }
+    refill(now);
+    if (tokens_ >= cost) {
+        return std::chrono::milliseconds(0);
+    }
+    return std::chrono::milliseconds(
+        static_cast<long long>(std::ceil((cost - tokens_) * 1000.0 / rate_)));
+}
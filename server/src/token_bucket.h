@@ -0,0 +1,37 @@
+#ifndef TOKEN_BUCKET_H
+#define TOKEN_BUCKET_H
+
+#include <chrono>
+
+// Classic token bucket: refills at rate tokens per second up to burst.
+// A bucket with a rate of zero is disabled and admits everything.
+class TokenBucket {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    TokenBucket() = default;
+    TokenBucket(double rate, double burst);
+
+    bool enabled() const {
+        return rate_ > 0;
+    }
+
+    // Takes cost tokens if they are all available.
+    bool tryConsume(double cost, Clock::time_point now);
+    // Takes cost tokens even if that leaves the bucket in debt.
+    void consume(double cost, Clock::time_point now);
+    // Gives back cost tokens taken for work that was then not done.
+    void refund(double cost);
+    // Time until cost tokens will be available; zero if they are now.
+    std::chrono::milliseconds delayFor(double cost, Clock::time_point now);
+
+private:
+    void refill(Clock::time_point now);
+
+    double rate_ = 0;
+    double burst_ = 0;
+    double tokens_ = 0;
+    Clock::time_point last_;
+};
+
+#endif
@@ -0,0 +1,338 @@
+#include "user_directory.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+#include "utils.h"
+
+namespace {
+
+constexpr uint32_t kFileMagic = 0x31554d49;  // "IMU1"
+constexpr uint32_t kFileVersion = 1;
+constexpr size_t kHeaderSize = 4096;
+
+// Stored in host byte order; the file is built and read on the same host.
+struct FileHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t userCount;
+    uint64_t slotCount;
+    uint64_t recordsOffset;
+};
+
+// record is the record index plus one; 0 marks an empty slot.
+struct Slot {
+    uint32_t tag;
+    uint32_t record;
+};
+
+uint64_t hashClientId(const char* id, size_t len) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= static_cast<uint8_t>(id[i]);
+        hash *= 1099511628211ULL;
+    }
+    // FNV leaves the low bits of short keys poorly mixed.
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+uint64_t recordsOffsetFor(uint64_t slotCount) {
+    uint64_t end = kHeaderSize + slotCount * sizeof(Slot);
+    return (end + kHeaderSize - 1) / kHeaderSize * kHeaderSize;
+}
+
+bool fileIdentity(const std::string& path, uint64_t& inode, int64_t& mtimeNs) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        return false;
+    }
+    inode = static_cast<uint64_t>(st.st_ino);
+    mtimeNs = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+    return true;
+}
+
+bool sameId(const UserRecord& record, const std::string& clientId) {
+    size_t len = boundedStrnlen(record.clientId, sizeof(record.clientId));
+    return len == clientId.size() && std::memcmp(record.clientId, clientId.data(), len) == 0;
+}
+
+}  // namespace
+
+struct UserDirectory::Mapping {
+    int fd = -1;
+    uint8_t* base = nullptr;
+    size_t size = 0;
+    const Slot* slots = nullptr;
+    uint64_t slotCount = 0;
+    const UserRecord* records = nullptr;
+    uint64_t users = 0;
+
+    ~Mapping() {
+        if (base) {
+            munmap(base, size);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+};
+
+UserDirectory::UserDirectory(const std::string& path)
+    : path_(path) {}
+
+bool UserDirectory::load() {
+    uint64_t inode = 0;
+    int64_t mtimeNs = 0;
+    auto mapping = std::make_shared<Mapping>();
+    mapping->fd = open(path_.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (mapping->fd < 0 || fstat(mapping->fd, &st) != 0) {
+        std::cerr << "[users] cannot open " << path_ << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    inode = static_cast<uint64_t>(st.st_ino);
+    mtimeNs = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+
+    FileHeader header;
+    size_t size = static_cast<size_t>(st.st_size);
+    if (size < kHeaderSize || pread(mapping->fd, &header, sizeof(header), 0) != sizeof(header)
+        || header.magic != kFileMagic || header.version != kFileVersion
+        || header.slotCount == 0 || (header.slotCount & (header.slotCount - 1)) != 0
+        || header.userCount >= header.slotCount || header.userCount > UINT32_MAX
+        || header.recordsOffset != recordsOffsetFor(header.slotCount)
+        || header.recordsOffset + header.userCount * sizeof(UserRecord) > size) {
+        std::cerr << "[users] invalid directory file " << path_ << std::endl;
+        return false;
+    }
+
+    void* base = mmap(nullptr, size, PROT_READ, MAP_SHARED, mapping->fd, 0);
+    if (base == MAP_FAILED) {
+        std::cerr << "[users] mmap failed: " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    // Lookups land on random pages; readahead would only evict useful ones.
+    madvise(base, size, MADV_RANDOM);
+    mapping->base = static_cast<uint8_t*>(base);
+    mapping->size = size;
+    mapping->slots = reinterpret_cast<const Slot*>(mapping->base + kHeaderSize);
+    mapping->slotCount = header.slotCount;
+    mapping->records = reinterpret_cast<const UserRecord*>(mapping->base + header.recordsOffset);
+    mapping->users = header.userCount;
+
+    std::atomic_store(&mapping_, std::shared_ptr<const Mapping>(mapping));
+    inode_ = inode;
+    mtimeNs_ = mtimeNs;
+    std::cout << "[users] loaded path=" << path_
+              << " users=" << header.userCount
+              << " slots=" << header.slotCount
+              << " bytes=" << size << std::endl;
+    return true;
+}
+
+void UserDirectory::reloadIfChanged() {
+    uint64_t inode = 0;
+    int64_t mtimeNs = 0;
+    if (!fileIdentity(path_, inode, mtimeNs) || (inode == inode_ && mtimeNs == mtimeNs_)) {
+        return;
+    }
+    // A failed reload keeps the previous directory in force.
+    if (load()) {
+        ++reloads_;
+    }
+}
+
+bool UserDirectory::lookup(const std::string& clientId, UserRecord& record) const {
+    std::shared_ptr<const Mapping> mapping = std::atomic_load(&mapping_);
+    ++lookups_;
+    if (!mapping) {
+        return false;
+    }
+
+    uint64_t hash = hashClientId(clientId.data(), clientId.size());
+    uint32_t tag = static_cast<uint32_t>(hash >> 32);
+    uint64_t mask = mapping->slotCount - 1;
+    uint64_t probes = 0;
+    bool found = false;
+    for (uint64_t i = hash & mask;; i = (i + 1) & mask) {
+        const Slot& slot = mapping->slots[i];
+        ++probes;
+        if (slot.record == 0 || slot.record > mapping->users || probes > mapping->slotCount) {
+            break;
+        }
+        if (slot.tag == tag && sameId(mapping->records[slot.record - 1], clientId)) {
+            std::memcpy(&record, &mapping->records[slot.record - 1], sizeof(record));
+            found = true;
+            break;
+        }
+    }
+    probes_ += probes;
+    if (found) {
+        ++hits_;
+    }
+    return found;
+}
+
+UserDirectoryStats UserDirectory::stats() const {
+    UserDirectoryStats stats;
+    std::shared_ptr<const Mapping> mapping = std::atomic_load(&mapping_);
+    if (mapping) {
+        stats.users = mapping->users;
+        stats.slots = mapping->slotCount;
+        stats.mappedBytes = mapping->size;
+    }
+    stats.lookups = lookups_.load();
+    stats.hits = hits_.load();
+    stats.probes = probes_.load();
+    stats.reloads = reloads_.load();
+    return stats;
+}
+
+UserDirectoryBuilder::UserDirectoryBuilder(const std::string& path, uint64_t maxNewUsers)
+    : path_(path),
+      tmpPath_(path + ".tmp"),
+      maxNewUsers_(maxNewUsers) {}
+
+UserDirectoryBuilder::~UserDirectoryBuilder() {
+    if (base_) {
+        munmap(base_, size_);
+    }
+    if (fd_ >= 0) {
+        close(fd_);
+        unlink(tmpPath_.c_str());
+    }
+}
+
+bool UserDirectoryBuilder::open() {
+    // Existing users are carried over, so map the current file first.
+    const uint8_t* oldBase = nullptr;
+    size_t oldSize = 0;
+    FileHeader oldHeader;
+    std::memset(&oldHeader, 0, sizeof(oldHeader));
+    int oldFd = ::open(path_.c_str(), O_RDONLY | O_CLOEXEC);
+    if (oldFd >= 0) {
+        struct stat st;
+        if (fstat(oldFd, &st) != 0 || static_cast<size_t>(st.st_size) < kHeaderSize
+            || pread(oldFd, &oldHeader, sizeof(oldHeader), 0) != sizeof(oldHeader)
+            || oldHeader.magic != kFileMagic || oldHeader.version != kFileVersion
+            || oldHeader.recordsOffset + oldHeader.userCount * sizeof(UserRecord)
+                   > static_cast<uint64_t>(st.st_size)) {
+            std::cerr << "[users] refusing to replace invalid file " << path_ << std::endl;
+            close(oldFd);
+            return false;
+        }
+        oldSize = static_cast<size_t>(st.st_size);
+        void* mapped = mmap(nullptr, oldSize, PROT_READ, MAP_SHARED, oldFd, 0);
+        close(oldFd);
+        if (mapped == MAP_FAILED) {
+            std::cerr << "[users] mmap failed: " << std::strerror(errno) << std::endl;
+            return false;
+        }
+        oldBase = static_cast<const uint8_t*>(mapped);
+    }
+
+    // Load factor stays at or below 0.7 even if every import is new.
+    capacity_ = oldHeader.userCount + maxNewUsers_;
+    slotCount_ = 16;
+    while (slotCount_ * 7 < capacity_ * 10 + 10) {
+        slotCount_ <<= 1;
+    }
+    size_ = static_cast<size_t>(recordsOffsetFor(slotCount_) + capacity_ * sizeof(UserRecord));
+
+    // The file holds salts and credential hashes, so only the owner may
+    // read it; a leftover temp file keeps its old mode, hence the fchmod.
+    fd_ = ::open(tmpPath_.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    int rc = fd_ < 0 || fchmod(fd_, 0600) != 0
+        ? errno : posix_fallocate(fd_, 0, static_cast<off_t>(size_));
+    void* mapped = rc == 0 ? mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0)
+                           : MAP_FAILED;
+    if (mapped == MAP_FAILED) {
+        std::cerr << "[users] cannot create " << tmpPath_ << ": "
+                  << std::strerror(rc != 0 ? rc : errno) << std::endl;
+        if (oldBase) {
+            munmap(const_cast<uint8_t*>(oldBase), oldSize);
+        }
+        return false;
+    }
+    base_ = static_cast<uint8_t*>(mapped);
+
+    bool ok = true;
+    if (oldBase) {
+        const UserRecord* records = reinterpret_cast<const UserRecord*>(oldBase + oldHeader.recordsOffset);
+        bool replaced = false;
+        for (uint64_t i = 0; i < oldHeader.userCount && ok; ++i) {
+            ok = put(records[i], replaced);
+        }
+        munmap(const_cast<uint8_t*>(oldBase), oldSize);
+    }
+    return ok;
+}
+
+bool UserDirectoryBuilder::put(const UserRecord& record, bool& replaced) {
+    replaced = false;
+    std::string clientId(record.clientId, boundedStrnlen(record.clientId, sizeof(record.clientId)));
+    if (clientId.empty()) {
+        return false;
+    }
+
+    Slot* slots = reinterpret_cast<Slot*>(base_ + kHeaderSize);
+    UserRecord* records = reinterpret_cast<UserRecord*>(base_ + recordsOffsetFor(slotCount_));
+    uint64_t hash = hashClientId(clientId.data(), clientId.size());
+    uint32_t tag = static_cast<uint32_t>(hash >> 32);
+    uint64_t mask = slotCount_ - 1;
+    uint64_t i = hash & mask;
+    for (; slots[i].record != 0; i = (i + 1) & mask) {
+        if (slots[i].tag == tag && sameId(records[slots[i].record - 1], clientId)) {
+            std::memcpy(&records[slots[i].record - 1], &record, sizeof(record));
+            replaced = true;
+            return true;
+        }
+    }
+    if (count_ == capacity_) {
+        return false;
+    }
+    std::memcpy(&records[count_], &record, sizeof(record));
+    slots[i].tag = tag;
+    slots[i].record = static_cast<uint32_t>(++count_);
+    return true;
+}
+
+bool UserDirectoryBuilder::commit() {
+    FileHeader header;
+    std::memset(&header, 0, sizeof(header));
+    header.magic = kFileMagic;
+    header.version = kFileVersion;
+    header.userCount = count_;
+    header.slotCount = slotCount_;
+    header.recordsOffset = recordsOffsetFor(slotCount_);
+    std::memcpy(base_, &header, sizeof(header));
+
+    munmap(base_, size_);
+    base_ = nullptr;
+    // Room reserved for imports that turned out to be updates goes back.
+    bool ok = ftruncate(fd_, static_cast<off_t>(header.recordsOffset + count_ * sizeof(UserRecord))) == 0
+        && fsync(fd_) == 0;
+    close(fd_);
+    fd_ = -1;
+    if (!ok || rename(tmpPath_.c_str(), path_.c_str()) != 0) {
+        std::cerr << "[users] cannot write " << path_ << ": " << std::strerror(errno) << std::endl;
+        unlink(tmpPath_.c_str());
+        return false;
+    }
+
+    std::string dir = path_.substr(0, path_.find_last_of('/') + 1);
+    int dirFd = ::open(dir.empty() ? "." : dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirFd >= 0) {
+        fsync(dirFd);
+        close(dirFd);
+    }
+    return true;
+}
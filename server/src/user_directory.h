@@ -0,0 +1,101 @@
+#ifndef USER_DIRECTORY_H
+#define USER_DIRECTORY_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "credential.h"
+
+enum UserFlags : uint32_t {
+    USER_DISABLED = 1u << 0
+};
+
+// One registered user as stored in the directory file.
+#pragma pack(push, 1)
+struct UserRecord {
+    char clientId[32];
+    char nickname[64];
+    uint8_t salt[kCredentialSaltSize];
+    uint8_t credential[kCredentialHashSize];
+    uint32_t iterations;     // 0 when no password is set
+    uint32_t flags;          // UserFlags
+    uint64_t created;
+};
+#pragma pack(pop)
+
+static_assert(sizeof(UserRecord) == 160, "UserRecord size mismatch");
+
+struct UserDirectoryStats {
+    uint64_t users = 0;
+    uint64_t slots = 0;
+    uint64_t mappedBytes = 0;
+    uint64_t lookups = 0;
+    uint64_t hits = 0;
+    uint64_t probes = 0;
+    uint64_t reloads = 0;
+};
+
+// Registered users in a single file: a header, an open-addressing hash
+// table of (tag, record) slots keyed by clientId, then the fixed-size
+// records. The server maps the file read-only, so startup does not read
+// it and a lookup touches one slot page and one record page. The import
+// tool writes a new file and renames it into place; reloadIfChanged()
+// then swaps the mapping while lookups in flight keep the old one.
+class UserDirectory {
+public:
+    explicit UserDirectory(const std::string& path);
+
+    bool load();
+    void reloadIfChanged();
+    bool lookup(const std::string& clientId, UserRecord& record) const;
+    UserDirectoryStats stats() const;
+
+private:
+    struct Mapping;
+
+    std::string path_;
+    uint64_t inode_ = 0;
+    int64_t mtimeNs_ = 0;
+    std::shared_ptr<const Mapping> mapping_;
+    mutable std::atomic<uint64_t> lookups_{0};
+    mutable std::atomic<uint64_t> hits_{0};
+    mutable std::atomic<uint64_t> probes_{0};
+    std::atomic<uint64_t> reloads_{0};
+};
+
+// Writes a directory file holding an existing one's users plus imported
+// ones; a record with a known clientId replaces the stored one. Output
+// goes to a temporary file that commit() renames over path.
+class UserDirectoryBuilder {
+public:
+    UserDirectoryBuilder(const std::string& path, uint64_t maxNewUsers);
+    ~UserDirectoryBuilder();
+
+    UserDirectoryBuilder(const UserDirectoryBuilder&) = delete;
+    UserDirectoryBuilder& operator=(const UserDirectoryBuilder&) = delete;
+
+    bool open();
+    // Returns false once the capacity given to the constructor is used up.
+    bool put(const UserRecord& record, bool& replaced);
+    bool commit();
+
+    uint64_t users() const {
+        return count_;
+    }
+
+private:
+    std::string path_;
+    std::string tmpPath_;
+    uint64_t maxNewUsers_;
+    int fd_ = -1;
+    uint8_t* base_ = nullptr;
+    size_t size_ = 0;
+    uint64_t slotCount_ = 0;
+    uint64_t capacity_ = 0;
+    uint64_t count_ = 0;
+};
+
+#endif
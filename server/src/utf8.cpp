@@ -0,0 +1,115 @@
+#include "utf8.h"
+
+#include <cstdint>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+// Skips the run of ASCII bytes starting at pos, 16 at a time where SSE2
+// is available.
+size_t skipAscii(const uint8_t* data, size_t pos, size_t len) {
+#if defined(__SSE2__)
+    while (len - pos >= 16) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + pos));
+        int mask = _mm_movemask_epi8(block);
+        if (mask != 0) {
+            return pos + static_cast<size_t>(__builtin_ctz(static_cast<unsigned>(mask)));
+        }
+        pos += 16;
+    }
+#endif
+    while (pos < len && data[pos] < 0x80) {
+        ++pos;
+    }
+    return pos;
+}
+
+// Length of the well-formed sequence starting at data[pos], or 0.
+size_t sequenceLength(const uint8_t* data, size_t pos, size_t len) {
+    uint8_t lead = data[pos];
+    size_t need = 0;
+    uint8_t lo = 0x80;
+    uint8_t hi = 0xBF;
+    if (lead < 0x80) {
+        return 1;
+    } else if (lead >= 0xC2 && lead <= 0xDF) {
+        need = 1;
+    } else if (lead >= 0xE0 && lead <= 0xEF) {
+        need = 2;
+        if (lead == 0xE0) {
+            lo = 0xA0;
+        } else if (lead == 0xED) {
+            hi = 0x9F;
+        }
+    } else if (lead >= 0xF0 && lead <= 0xF4) {
+        need = 3;
+        if (lead == 0xF0) {
+            lo = 0x90;
+        } else if (lead == 0xF4) {
+            hi = 0x8F;
+        }
+    } else {
+        return 0;
+    }
+
+    if (len - pos <= need) {
+        return 0;
+    }
+    if (data[pos + 1] < lo || data[pos + 1] > hi) {
+        return 0;
+    }
+    for (size_t i = 2; i <= need; ++i) {
+        if ((data[pos + i] & 0xC0) != 0x80) {
+            return 0;
+        }
+    }
+    return need + 1;
+}
+
+}  // namespace
+
+size_t utf8ValidPrefix(const char* text, size_t len) {
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(text);
+    size_t pos = 0;
+    while (pos < len) {
+        pos = skipAscii(data, pos, len);
+        if (pos == len) {
+            break;
+        }
+        size_t n = sequenceLength(data, pos, len);
+        if (n == 0) {
+            break;
+        }
+        pos += n;
+    }
+    return pos;
+}
+
+size_t utf8Sanitize(std::string& text) {
+    size_t replaced = 0;
+    size_t pos = 0;
+    while (pos < text.size()) {
+        pos += utf8ValidPrefix(text.data() + pos, text.size() - pos);
+        if (pos < text.size()) {
+            text[pos++] = '?';
+            ++replaced;
+        }
+    }
+    return replaced;
+}
+
+size_t utf8TruncatedLength(const char* text, size_t len, size_t maxBytes) {
+    if (len <= maxBytes) {
+        return len;
+    }
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(text);
+    // Back off over continuation bytes; a sequence is at most four long.
+    size_t cut = maxBytes;
+    while (cut > 0 && maxBytes - cut < 3 && (data[cut] & 0xC0) == 0x80) {
+        --cut;
+    }
+    return (data[cut] & 0xC0) == 0x80 ? maxBytes : cut;
+}
@@ -0,0 +1,19 @@
+#ifndef UTF8_H
+#define UTF8_H
+
+#include <cstddef>
+#include <string>
+
+// Length of the longest prefix of data that is well-formed UTF-8
+// (no overlong forms, surrogates or code points above U+10FFFF).
+size_t utf8ValidPrefix(const char* data, size_t len);
+
+// Replaces every byte that is not part of a well-formed sequence with '?'
+// and returns how many were replaced. The length never changes.
+size_t utf8Sanitize(std::string& text);
+
+// Largest length not above maxBytes that does not cut a multi-byte
+// sequence of well-formed input in half.
+size_t utf8TruncatedLength(const char* data, size_t len, size_t maxBytes);
+
+#endif
@@ -0,0 +1,161 @@
+// Bulk-loads registered users into the server's user directory file.
+//
+//   im_user_import <users.db> <users.tsv> [--iterations N]
+//
+// Each line of users.tsv is clientId, nickname, and optionally a password
+// and numeric profile flags, separated by tabs. Lines whose first non-blank
+// character is '#' are comments; '#' anywhere else is data. Passwords are
+// limited to the 63 bytes a login request can carry.
+// Users already in users.db are kept, and a line with a known clientId
+// replaces that user. The running server picks up the new file on its
+// next maintenance tick.
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "common/message.h"
+#include "user_directory.h"
+#include "utils.h"
+
+namespace {
+
+constexpr uint32_t kDefaultIterations = 100000;
+// Clients send the password NUL-terminated in LoginRequestExt.
+constexpr size_t kMaxPasswordBytes = sizeof(LoginRequestExt::password) - 1;
+
+void split(const std::string& line, std::vector<std::string>& fields) {
+    fields.clear();
+    size_t start = 0;
+    while (true) {
+        size_t tab = line.find('\t', start);
+        fields.push_back(line.substr(start, tab == std::string::npos ? std::string::npos : tab - start));
+        if (tab == std::string::npos) {
+            break;
+        }
+        start = tab + 1;
+    }
+}
+
+bool parseUser(const std::string& line, uint32_t iterations, uint64_t now, UserRecord& record,
+               std::string& error) {
+    std::vector<std::string> fields;
+    split(line, fields);
+    if (fields.size() < 2 || fields[0].empty()
+        || fields[0].size() >= sizeof(record.clientId)
+        || fields[1].size() >= sizeof(record.nickname)) {
+        error = "malformed";
+        return false;
+    }
+    if (fields.size() > 2 && fields[2].size() > kMaxPasswordBytes) {
+        error = "password longer than " + std::to_string(kMaxPasswordBytes) + " bytes";
+        return false;
+    }
+
+    std::memset(&record, 0, sizeof(record));
+    std::memcpy(record.clientId, fields[0].data(), fields[0].size());
+    std::memcpy(record.nickname, fields[1].data(), fields[1].size());
+    record.created = now;
+    if (fields.size() > 2 && !fields[2].empty()) {
+        if (!randomBytes(record.salt, sizeof(record.salt))) {
+            error = "no random salt";
+            return false;
+        }
+        deriveCredential(fields[2], record.salt, sizeof(record.salt), iterations, record.credential);
+        record.iterations = iterations;
+    }
+    if (fields.size() > 3 && !fields[3].empty()) {
+        char* end = nullptr;
+        unsigned long flags = std::strtoul(fields[3].c_str(), &end, 0);
+        if (*end != '\0' || flags > UINT32_MAX) {
+            error = "bad flags";
+            return false;
+        }
+        record.flags = static_cast<uint32_t>(flags);
+    }
+    return true;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    if (argc != 3 && !(argc == 5 && std::strcmp(argv[3], "--iterations") == 0)) {
+        std::cerr << "usage: " << argv[0] << " <users.db> <users.tsv> [--iterations N]" << std::endl;
+        return 2;
+    }
+    uint32_t iterations = argc == 5 ? static_cast<uint32_t>(std::strtoul(argv[4], nullptr, 10))
+                                    : kDefaultIterations;
+    if (iterations == 0) {
+        std::cerr << "iterations must be positive" << std::endl;
+        return 2;
+    }
+
+    // Every line may be a new user; the builder sizes the file for that.
+    std::ifstream in(argv[2]);
+    if (!in) {
+        std::cerr << "cannot open " << argv[2] << std::endl;
+        return 1;
+    }
+    uint64_t lines = 0;
+    std::string line;
+    while (std::getline(in, line)) {
+        ++lines;
+    }
+    in.clear();
+    in.seekg(0);
+
+    auto started = std::chrono::steady_clock::now();
+    UserDirectoryBuilder builder(argv[1], lines);
+    if (!builder.open()) {
+        return 1;
+    }
+    uint64_t existing = builder.users();
+    uint64_t added = 0;
+    uint64_t updated = 0;
+    uint64_t skipped = 0;
+    uint64_t lineNo = 0;
+    uint64_t now = static_cast<uint64_t>(std::time(nullptr));
+    UserRecord record;
+    while (std::getline(in, line)) {
+        ++lineNo;
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        size_t first = line.find_first_not_of(" \t");
+        if (first == std::string::npos || line[first] == '#') {
+            continue;
+        }
+        bool replaced = false;
+        std::string error;
+        if (!parseUser(line, iterations, now, record, error)) {
+            std::cerr << argv[2] << ":" << lineNo << ": skipped: " << error << std::endl;
+            ++skipped;
+            continue;
+        }
+        if (!builder.put(record, replaced)) {
+            std::cerr << argv[2] << ":" << lineNo << ": skipped: directory full" << std::endl;
+            ++skipped;
+            continue;
+        }
+        ++(replaced ? updated : added);
+    }
+    if (!builder.commit()) {
+        return 1;
+    }
+
+    auto elapsedMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - started).count();
+    std::cout << "[users] imported path=" << argv[1]
+              << " existing=" << existing
+              << " added=" << added
+              << " updated=" << updated
+              << " skipped=" << skipped
+              << " users=" << builder.users()
+              << " ms=" << elapsedMs << std::endl;
+    return 0;
+}